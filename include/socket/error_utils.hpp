@@ -19,12 +19,17 @@ enum class errc
   close_failure,
   connect_failure,
   getaddrinfo_failure,
+  getsockname_failure,
   ipfamily_not_set,
   listen_failure,
   receive_failure,
   receive_from_failure,
+  receive_many_failure,
+  receive_segments_failure,
   send_failure,
   sendto_failure,
+  send_many_failure,
+  send_segments_failure,
   setsockopt_failure,
   shutdown_failure,
 };
@@ -2,6 +2,7 @@
 #define ICETEA_SOCKETS_H
 
 #include <iterator>
+#include <span>
 #include <string_view>
 
 #include "generic_sockets.hpp"
@@ -151,6 +152,35 @@ private:
   bool IsSetIPCalled;
 }; // struct SockaddrWrapper
 
+/* one datagram of `BSocket::receiveMany()` or `BSocket::sendMany()`, in a
+ * buffer the caller owns */
+struct DatagramSlot
+{
+  void* buf;
+  BetterSocket::Size bufsz; // room in `buf`, for receiving
+  BetterSocket::Size len;   // bytes received, or to send
+  SockaddrWrapper addr;     // sender, or destination
+}; // struct DatagramSlot
+
+/* below this many bytes a send is copied anyway: pinning the pages and
+ * reading the completion costs more than the copy */
+inline constexpr BetterSocket::Size ZERO_COPY_MIN = 1 << 14;
+
+/* MSG_ZEROCOPY sends `first` to `last` of a socket, numbered from 0 in the
+ * order they were made, are done with their buffers */
+struct ZeroCopyRange
+{
+  uint32_t first;
+  uint32_t last;
+  bool copied; // the kernel copied them after all, zero copy does not pay
+               // off on this path (loopback, a device without offloads)
+}; // struct ZeroCopyRange
+
+/* Linux only: read a completion off the error queue of `s` without
+ * blocking. False if there is none */
+bool
+readZeroCopyCompletion(BetterSocket::GSocket s, ZeroCopyRange& range);
+
 /* Managed class that wraps over the C API.
  * Not every function is wrapped over, only the handful ones that need
  * be used in avantee. They are as follows:
@@ -166,10 +196,45 @@ private:
  *                                      struct sockaddr*
  *                                      BetterSocket::size*
  *                                      int (default)
+ * BetterSocket::size     receiveMany   std::span<DatagramSlot>, recvmmsg
+ *                                      int (default)
  * BetterSocket::ssize    sendS         std::string_view,      send
  *                                      int (default)
+ * BetterSocket::size     sendMany      std::span<DatagramSlot>, sendmmsg
+ *                                      int (default)
+ * BetterSocket::ssize    sendSegments  const void*,           sendmsg
+ *                                      BetterSocket::size,    (UDP_SEGMENT)
+ *                                      BetterSocket::size,
+ *                                      SockaddrWrapper&,
+ *                                      int (default)
+ * BetterSocket::ssize    sendToZeroCopy
+ *                                      const void*,           sendto
+ *                                      BetterSocket::size,    (MSG_ZEROCOPY)
+ *                                      SockaddrWrapper&,
+ *                                      bool&,
+ *                                      int (default)
+ * BetterSocket::ssize    receiveSegments
+ *                                      void*,                 recvmsg
+ *                                      BetterSocket::size,    (UDP_GRO)
+ *                                      SockaddrWrapper&,
+ *                                      BetterSocket::size&,
+ *                                      int (default)
  * void                   shutdownS     enum TransmissionEnd   shutdown
  * void                   tryNext       [None]                 [None]
+ * in_port_t              localPort     [None]                 getsockname
+ * void                   reusePort     [None]                 setsockopt
+ * void                   steerByCPU    unsigned int           setsockopt
+ * void                   multicastLoop bool                   setsockopt
+ * void                   multicastTtl  int                    setsockopt
+ * void                   multicastInterface
+ *                                      const std::string&     setsockopt
+ * bool                   canSegment    [None]                 getsockopt
+ * bool                   coalesceReceives
+ *                                      bool                   setsockopt
+ * bool                   zeroCopy      bool                   setsockopt
+ * bool                   zeroCopyCompletion
+ *                                      ZeroCopyRange&         recvmsg
+ *                                                             (MSG_ERRQUEUE)
  */
 class BSocket
 {
@@ -197,7 +262,7 @@ public:
 
   ~BSocket();
 
-  BSocket& operator=(const BSocket&& s);
+  BSocket& operator=(BSocket&& s);
   BSocket& operator=(const GSocket& s);
   BSocket& operator=(BSocket& s) = delete;
   BSocket(const BSocket&) = delete;
@@ -214,6 +279,9 @@ public:
   friend bool operator!=(const BSocket& lhs, const BSocket& rhs);
   sockaddr getsockaddr() const;
   SockaddrWrapper getsockaddrInWrapper() const;
+  /* port the socket is bound to in host byte order, also when the kernel
+   * picked it because the service was "0" */
+  in_port_t localPort() const;
   void tryNext();
 
   /* -- socket api -- */
@@ -231,14 +299,83 @@ public:
                                   BetterSocket::Size bufsz,
                                   SockaddrWrapper& senderAddr,
                                   int flags = 0);
+  /* receive up to `slots.size()` datagrams, each into its slot, with as
+   * few system calls as the platform allows (one recvmmsg() on Linux).
+   * Returns how many arrived. With MSG_DONTWAIT 0 means none was waiting,
+   * any other error throws */
+  BetterSocket::Size receiveMany(std::span<DatagramSlot> slots, int flags = 0);
   BetterSocket::SSize send(std::string_view buf, int flags = 0);
   BetterSocket::SSize sendTo(void* ibuf,
                              BetterSocket::Size bufsz,
                              SockaddrWrapper& destAddr,
                              int flags = 0);
+  /* send `len` bytes of every slot to its address, one sendmmsg() on
+   * Linux. Returns how many were sent, fewer than `slots.size()` only with
+   * MSG_DONTWAIT and a full send buffer */
+  BetterSocket::Size sendMany(std::span<DatagramSlot> slots, int flags = 0);
+  /* send `len` bytes of `ibuf` as datagrams of `segment` bytes each, the
+   * last one may be shorter: one system call if the kernel segments them
+   * (UDP_SEGMENT), one per datagram if it cannot. Returns the bytes sent */
+  BetterSocket::SSize sendSegments(const void* ibuf,
+                                   BetterSocket::Size len,
+                                   BetterSocket::Size segment,
+                                   SockaddrWrapper& destAddr,
+                                   int flags = 0);
+  /* send a datagram of at least ZERO_COPY_MIN bytes without copying it,
+   * after zeroCopy(true). `pending` tells whether it was: `ibuf` must then
+   * stay untouched until zeroCopyCompletion() reports the send. Smaller
+   * datagrams, and those the kernel has no room to track, are copied */
+  BetterSocket::SSize sendToZeroCopy(const void* ibuf,
+                                     BetterSocket::Size len,
+                                     SockaddrWrapper& destAddr,
+                                     bool& pending,
+                                     int flags = 0);
+  /* receive a datagram or, after coalesceReceives(), several datagrams of
+   * the same sender back to back. `segment` is set to their size, the last
+   * one may be shorter */
+  BetterSocket::SSize receiveSegments(void* ibuf,
+                                      BetterSocket::Size bufsz,
+                                      SockaddrWrapper& senderAddr,
+                                      BetterSocket::Size& segment,
+                                      int flags = 0);
   void shutdown(enum TransmissionEnd reason);
   void close();
 
+  /* -- socket options -- */
+
+  /* let several sockets bind the same address (SO_REUSEPORT), the kernel
+   * spreads incoming datagrams over them. Must be called before bind(). */
+  void reusePort();
+  /* Linux only: attach a classic BPF program to this socket's reuseport
+   * group that picks the socket by the receiving CPU (cpu % groupSize), so
+   * a flow steered to one CPU always lands on the same socket. */
+  void steerByCPU(unsigned int groupSize);
+  /* deliver multicast sent from this socket to the members of the group on
+   * this host as well (IP_MULTICAST_LOOP, IPV6_MULTICAST_LOOP) */
+  void multicastLoop(bool enable);
+  /* routers multicast sent from this socket may cross, 1 keeps it on the
+   * local network (IP_MULTICAST_TTL, IPV6_MULTICAST_HOPS) */
+  void multicastTtl(int hops);
+  /* IPv4 only: send multicast out of the interface that has address
+   * `ipv4` instead of the one routing picks (IP_MULTICAST_IF) */
+  void multicastInterface(const std::string& ipv4);
+  /* Linux only: true if the kernel can split one send of this UDP socket
+   * into datagrams of equal size (UDP_SEGMENT, generic segmentation
+   * offload, Linux 4.18). False elsewhere */
+  bool canSegment() const;
+  /* Linux only: let the kernel hand datagrams of one sender that arrive
+   * together over as one buffer (UDP_GRO, generic receive offload, Linux
+   * 5.0). False if it cannot, the socket then receives them one by one.
+   * Only receiveSegments() and recvmsg() with a control buffer can tell
+   * them apart */
+  bool coalesceReceives(bool enable);
+  /* Linux only: allow sends with MSG_ZEROCOPY (SO_ZEROCOPY, Linux 4.14 for
+   * TCP, 5.0 for UDP). False if the kernel cannot */
+  bool zeroCopy(bool enable);
+  /* a completion of the sends made with sendToZeroCopy(), see
+   * readZeroCopyCompletion() */
+  bool zeroCopyCompletion(ZeroCopyRange& range);
+
 }; // class BSocket
 
 } // namespace BetterSocket
@@ -44,6 +44,9 @@ make_error_code(errc e) noexcept
         case errc::getaddrinfo_failure:
           return std::string("getaddrinfo() failed: ");
 
+        case errc::getsockname_failure:
+          return std::string("getsockname() failed: ");
+
         case errc::listen_failure:
           return std::string("listen() failed: ");
 
@@ -56,12 +59,24 @@ make_error_code(errc e) noexcept
         case errc::receive_from_failure:
           return std::string("recvfrom() failed: ");
 
+        case errc::receive_many_failure:
+          return std::string("recvmmsg() failed: ");
+
+        case errc::receive_segments_failure:
+          return std::string("recvmsg() failed: ");
+
         case errc::send_failure:
           return std::string("send() failed: ");
 
         case errc::sendto_failure:
           return std::string("sendto() failed: ");
 
+        case errc::send_many_failure:
+          return std::string("sendmmsg() failed: ");
+
+        case errc::send_segments_failure:
+          return std::string("sendmsg() failed: ");
+
         case errc::setsockopt_failure:
           return std::string("setsockopt() failed: ");
 
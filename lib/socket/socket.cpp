@@ -4,6 +4,12 @@
 #include <string>
 #include <sys/socket.h>
 
+#if defined(__linux__)
+#include <linux/errqueue.h>
+#include <linux/filter.h>
+#include <netinet/udp.h>
+#endif
+
 #include "socket/error_utils.hpp"
 #include "socket/generic_sockets.hpp"
 #include "socket/socket.hpp"
@@ -242,7 +248,10 @@ SockaddrWrapper::SockaddrWrapper(sockaddr_in6& s6, socklen_t size)
 
 SockaddrWrapper::SockaddrWrapper(sockaddr_storage& gs, socklen_t size)
   : sockaddrsz(size)
+  , IsEmpty(false)
   , genericSockaddr(gs)
+  , ipv4Sockaddr()
+  , ipv6Sockaddr()
 {
   m_setIP();
 }
@@ -361,14 +370,20 @@ BSocket::BSocket(BetterSocket::GSocket s)
 }
 
 BSocket::BSocket(BSocket&& ms)
-  : bindCalled(ms.bindCalled)
+  : alreadyClosed(ms.alreadyClosed)
+  , bindCalled(ms.bindCalled)
   , empty(ms.empty)
   , IsListener(ms.IsListener)
   , addressinfoList(ms.addressinfoList)
-  , validAddr()
+  , validAddr(ms.validAddr)
   , rawSocket(ms.rawSocket)
 {
   LocalData::default_v = SockaddrWrapper();
+  // the moved-from socket must neither close the descriptor nor free the
+  // addrinfo list that we now own
+  ms.alreadyClosed = true;
+  ms.addressinfoList.infoP = nullptr;
+  ms.rawSocket = BAD_SOCKET;
 }
 
 BSocket::BSocket(const struct SocketHint hint,
@@ -444,15 +459,23 @@ BSocket::operator=(const GSocket& s)
 }
 
 BSocket&
-BSocket::operator=(const BSocket&& s)
+BSocket::operator=(BSocket&& s)
 {
+  if (this == &s)
+    return *this;
+
+  alreadyClosed = s.alreadyClosed;
   bindCalled = s.bindCalled;
   empty = s.empty;
   IsListener = s.IsListener;
   addressinfoList = s.addressinfoList;
   validAddr = s.validAddr;
   rawSocket = s.rawSocket;
-  // s.clearOut();
+
+  // take ownership, see the move constructor
+  s.alreadyClosed = true;
+  s.addressinfoList.infoP = nullptr;
+  s.rawSocket = BAD_SOCKET;
   return *this;
 }
 
@@ -505,6 +528,21 @@ BSocket::getsockaddrInWrapper() const
   return SockaddrWrapper(*validAddr.ai_addr);
 }
 
+in_port_t
+BSocket::localPort() const
+{
+  sockaddr_storage local = {};
+  socklen_t size = sizeof(local);
+  if (getsockname(rawSocket, reinterpret_cast<sockaddr*>(&local), &size) ==
+      SOCK_ERR)
+    throw SockErrors::APIError(SockErrors::errc::getsockname_failure,
+                               std::string(std::strerror(errno)));
+
+  if (local.ss_family == AF_INET6)
+    return ntohs(reinterpret_cast<sockaddr_in6*>(&local)->sin6_port);
+  return ntohs(reinterpret_cast<sockaddr_in*>(&local)->sin_port);
+}
+
 void
 BSocket::tryNext()
 {
@@ -704,6 +742,222 @@ BSocket::sendTo(void* ibuf,
   return r;
 }
 
+#if defined(__linux__)
+// the message headers live on the stack, a longer span takes a few calls
+static constexpr std::size_t MMSG_BATCH = 64;
+
+static void
+fillMessages(std::span<DatagramSlot> slots,
+             struct mmsghdr* msgs,
+             struct iovec* iov,
+             bool receiving)
+{
+  for (std::size_t i = 0; i < slots.size(); i++) {
+    auto& slot = slots[i];
+    iov[i] = { slot.buf, receiving ? slot.bufsz : slot.len };
+    msgs[i] = {};
+    msgs[i].msg_hdr.msg_name = slot.addr.m_getPtrToStorage();
+    msgs[i].msg_hdr.msg_namelen =
+      receiving ? sizeof(sockaddr_storage) : slot.addr.sockaddrsz;
+    msgs[i].msg_hdr.msg_iov = &iov[i];
+    msgs[i].msg_hdr.msg_iovlen = 1;
+  }
+}
+#endif
+
+BetterSocket::Size
+BSocket::receiveMany(std::span<DatagramSlot> slots, int flags)
+{
+  if (slots.empty())
+    return 0;
+#if defined(__linux__)
+  Size got = 0;
+  // block for the first datagram at most, then take what is waiting
+  flags |= MSG_WAITFORONE;
+  while (got < slots.size()) {
+    struct mmsghdr msgs[MMSG_BATCH];
+    struct iovec iov[MMSG_BATCH];
+    auto batch = slots.subspan(got, std::min(slots.size() - got, MMSG_BATCH));
+    fillMessages(batch, msgs, iov, true);
+    int r = recvmmsg(
+      rawSocket, msgs, static_cast<unsigned>(batch.size()), flags, nullptr);
+    if (r == SOCK_ERR) {
+      if (got > 0 || errno == EAGAIN || errno == EWOULDBLOCK)
+        return got;
+      throw SockErrors::APIError(SockErrors::errc::receive_many_failure,
+                                 std::string(std::strerror(errno)));
+    }
+    for (int i = 0; i < r; i++) {
+      batch[i].len = msgs[i].msg_len;
+      batch[i].addr.sockaddrsz = msgs[i].msg_hdr.msg_namelen;
+      batch[i].addr.m_setIP();
+    }
+    got += static_cast<Size>(r);
+    if (static_cast<Size>(r) < batch.size())
+      break;
+    flags |= MSG_DONTWAIT;
+  }
+  return got;
+#else
+  slots[0].len = static_cast<Size>(
+    receiveFrom(slots[0].buf, slots[0].bufsz, slots[0].addr, flags));
+  return 1;
+#endif
+}
+
+BetterSocket::Size
+BSocket::sendMany(std::span<DatagramSlot> slots, int flags)
+{
+#if defined(__linux__)
+  Size sent = 0;
+  while (sent < slots.size()) {
+    struct mmsghdr msgs[MMSG_BATCH];
+    struct iovec iov[MMSG_BATCH];
+    auto batch = slots.subspan(sent, std::min(slots.size() - sent, MMSG_BATCH));
+    fillMessages(batch, msgs, iov, false);
+    // an error past the first datagram shows up on the next call
+    int r =
+      sendmmsg(rawSocket, msgs, static_cast<unsigned>(batch.size()), flags);
+    if (r == SOCK_ERR) {
+      if (errno == EAGAIN || errno == EWOULDBLOCK)
+        return sent;
+      throw SockErrors::APIError(SockErrors::errc::send_many_failure,
+                                 std::string(std::strerror(errno)));
+    }
+    sent += static_cast<Size>(r);
+  }
+  return sent;
+#else
+  for (auto& slot : slots)
+    sendTo(slot.buf, slot.len, slot.addr, flags);
+  return slots.size();
+#endif
+}
+
+BetterSocket::SSize
+BSocket::sendSegments(const void* ibuf,
+                      BetterSocket::Size len,
+                      BetterSocket::Size segment,
+                      SockaddrWrapper& destAddr,
+                      int flags)
+{
+  if (segment == 0 || len <= segment)
+    return sendTo(const_cast<void*>(ibuf), len, destAddr, flags);
+#if defined(UDP_SEGMENT)
+  struct iovec iov = { const_cast<void*>(ibuf), len };
+  union
+  {
+    char buf[CMSG_SPACE(sizeof(uint16_t))];
+    struct cmsghdr align;
+  } control = {};
+  struct msghdr msg = {};
+  msg.msg_name = destAddr.m_getPtrToStorage();
+  msg.msg_namelen = destAddr.sockaddrsz;
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control.buf;
+  msg.msg_controllen = sizeof(control.buf);
+  auto* cmsg = CMSG_FIRSTHDR(&msg);
+  cmsg->cmsg_level = SOL_UDP;
+  cmsg->cmsg_type = UDP_SEGMENT;
+  cmsg->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+  auto size = static_cast<uint16_t>(segment);
+  std::memcpy(CMSG_DATA(cmsg), &size, sizeof(size));
+
+  BetterSocket::SSize r = sendmsg(rawSocket, &msg, flags);
+  if (r != SOCK_ERR)
+    return r;
+  // EIO: the device cannot checksum what the kernel segments, the others:
+  // a kernel or a segment count it does not take. Sent one by one below
+  if (errno != EIO && errno != EINVAL && errno != ENOPROTOOPT &&
+      errno != EOPNOTSUPP)
+    throw SockErrors::APIError(SockErrors::errc::send_segments_failure,
+                               std::string(std::strerror(errno)));
+#endif
+  auto* bytes = static_cast<const char*>(ibuf);
+  BetterSocket::SSize sent = 0;
+  for (Size at = 0; at < len; at += segment)
+    sent += sendTo(const_cast<char*>(bytes + at),
+                   std::min(segment, len - at),
+                   destAddr,
+                   flags);
+  return sent;
+}
+
+BetterSocket::SSize
+BSocket::sendToZeroCopy(const void* ibuf,
+                        BetterSocket::Size len,
+                        SockaddrWrapper& destAddr,
+                        bool& pending,
+                        int flags)
+{
+  pending = false;
+#if defined(MSG_ZEROCOPY)
+  if (len >= ZERO_COPY_MIN) {
+    BetterSocket::SSize r =
+      sendto(rawSocket,
+             ibuf,
+             len,
+             flags | MSG_ZEROCOPY,
+             reinterpret_cast<sockaddr*>(destAddr.m_getPtrToStorage()),
+             destAddr.sockaddrsz);
+    if (r != SOCK_ERR) {
+      pending = true;
+      return r;
+    }
+    // ENOBUFS: too many sends are waiting for completion, copy this one
+    if (errno != ENOBUFS)
+      throw SockErrors::APIError(SockErrors::errc::sendto_failure,
+                                 std::string(std::strerror(errno)));
+  }
+#endif
+  return sendTo(const_cast<void*>(ibuf), len, destAddr, flags);
+}
+
+BetterSocket::SSize
+BSocket::receiveSegments(void* ibuf,
+                         BetterSocket::Size bufsz,
+                         SockaddrWrapper& senderAddr,
+                         BetterSocket::Size& segment,
+                         int flags)
+{
+#if defined(UDP_GRO)
+  struct iovec iov = { ibuf, bufsz };
+  union
+  {
+    char buf[CMSG_SPACE(sizeof(int))];
+    struct cmsghdr align;
+  } control = {};
+  struct msghdr msg = {};
+  msg.msg_name = senderAddr.m_getPtrToStorage();
+  msg.msg_namelen = sizeof(sockaddr_storage);
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control.buf;
+  msg.msg_controllen = sizeof(control.buf);
+  BetterSocket::SSize r = recvmsg(rawSocket, &msg, flags);
+  if (r == SOCK_ERR)
+    throw SockErrors::APIError(SockErrors::errc::receive_segments_failure,
+                               std::string(std::strerror(errno)));
+  senderAddr.sockaddrsz = msg.msg_namelen;
+  senderAddr.m_setIP();
+
+  segment = static_cast<Size>(r);
+  for (auto* cmsg = CMSG_FIRSTHDR(&msg); cmsg != nullptr;
+       cmsg = CMSG_NXTHDR(&msg, cmsg))
+    if (cmsg->cmsg_level == SOL_UDP && cmsg->cmsg_type == UDP_GRO) {
+      int size;
+      std::memcpy(&size, CMSG_DATA(cmsg), sizeof(size));
+      segment = static_cast<Size>(size);
+    }
+  return r;
+#else
+  auto r = receiveFrom(ibuf, bufsz, senderAddr, flags);
+  segment = static_cast<Size>(r);
+  return r;
+#endif
+}
+
 void
 BSocket::shutdown(enum BetterSocket::TransmissionEnd reason)
 {
@@ -721,5 +975,186 @@ BSocket::close()
   }
   alreadyClosed = true;
 }
+
+/* -- socket options -- */
+void
+BSocket::reusePort()
+{
+#if defined(SO_REUSEPORT)
+  int enable = 1;
+  if (setsockopt(rawSocket, SOL_SOCKET, SO_REUSEPORT, &enable, sizeof(enable)) ==
+      SOCK_ERR)
+    throw SockErrors::APIError(SockErrors::errc::setsockopt_failure,
+                               std::string(std::strerror(errno)));
+#else
+  throw SockErrors::APIError(SockErrors::errc::setsockopt_failure,
+                             "SO_REUSEPORT is not supported on this platform");
+#endif
+}
+
+void
+BSocket::steerByCPU(unsigned int groupSize)
+{
+#if defined(SO_ATTACH_REUSEPORT_CBPF)
+  // A = cpu; A %= groupSize; return A
+  struct sock_filter code[] = {
+    { BPF_LD | BPF_W | BPF_ABS,
+      0,
+      0,
+      static_cast<__u32>(SKF_AD_OFF + SKF_AD_CPU) },
+    { BPF_ALU | BPF_MOD | BPF_K, 0, 0, groupSize },
+    { BPF_RET | BPF_A, 0, 0, 0 },
+  };
+  struct sock_fprog prog = { sizeof(code) / sizeof(code[0]), code };
+
+  if (setsockopt(
+        rawSocket, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &prog, sizeof(prog)) ==
+      SOCK_ERR)
+    throw SockErrors::APIError(SockErrors::errc::setsockopt_failure,
+                               std::string(std::strerror(errno)));
+#else
+  (void)groupSize;
+  throw SockErrors::APIError(
+    SockErrors::errc::setsockopt_failure,
+    "SO_ATTACH_REUSEPORT_CBPF is not supported on this platform");
+#endif
+}
+
+// set the IP level option `name4`, or `name6` on an IPv6 socket
+static void
+setIpOption(GSocket s, bool v6, int name4, int name6, int value)
+{
+  if (setsockopt(s,
+                 v6 ? IPPROTO_IPV6 : IPPROTO_IP,
+                 v6 ? name6 : name4,
+#ifdef ICY_ON_WINDOWS
+                 reinterpret_cast<char*>(&value),
+#else
+                 &value,
+#endif
+                 sizeof(value)) == SOCK_ERR)
+    throw SockErrors::APIError(SockErrors::errc::setsockopt_failure,
+                               std::string(std::strerror(errno)));
+}
+
+void
+BSocket::multicastLoop(bool enable)
+{
+  setIpOption(rawSocket,
+              validAddr.ai_family == AF_INET6,
+              IP_MULTICAST_LOOP,
+              IPV6_MULTICAST_LOOP,
+              enable ? 1 : 0);
+}
+
+void
+BSocket::multicastTtl(int hops)
+{
+  setIpOption(rawSocket,
+              validAddr.ai_family == AF_INET6,
+              IP_MULTICAST_TTL,
+              IPV6_MULTICAST_HOPS,
+              hops);
+}
+
+void
+BSocket::multicastInterface(const std::string& ipv4)
+{
+  struct in_addr addr;
+  if (inet_pton(AF_INET, ipv4.c_str(), &addr) != 1)
+    throw SockErrors::APIError(SockErrors::errc::setsockopt_failure,
+                               "not an IPv4 address: " + ipv4);
+  if (setsockopt(rawSocket,
+                 IPPROTO_IP,
+                 IP_MULTICAST_IF,
+#ifdef ICY_ON_WINDOWS
+                 reinterpret_cast<char*>(&addr),
+#else
+                 &addr,
+#endif
+                 sizeof(addr)) == SOCK_ERR)
+    throw SockErrors::APIError(SockErrors::errc::setsockopt_failure,
+                               std::string(std::strerror(errno)));
+}
+
+bool
+BSocket::canSegment() const
+{
+#if defined(UDP_SEGMENT)
+  // 0 unless set, fails on kernels without segmentation offload
+  int size = 0;
+  socklen_t len = sizeof(size);
+  return getsockopt(rawSocket, SOL_UDP, UDP_SEGMENT, &size, &len) == 0;
+#else
+  return false;
+#endif
+}
+
+bool
+BSocket::zeroCopy(bool enable)
+{
+#if defined(SO_ZEROCOPY)
+  int value = enable ? 1 : 0;
+  return setsockopt(
+           rawSocket, SOL_SOCKET, SO_ZEROCOPY, &value, sizeof(value)) == 0;
+#else
+  (void)enable;
+  return false;
+#endif
+}
+
+bool
+BSocket::zeroCopyCompletion(ZeroCopyRange& range)
+{
+  return readZeroCopyCompletion(rawSocket, range);
+}
+
+bool
+BSocket::coalesceReceives(bool enable)
+{
+#if defined(UDP_GRO)
+  int value = enable ? 1 : 0;
+  return setsockopt(rawSocket, SOL_UDP, UDP_GRO, &value, sizeof(value)) == 0;
+#else
+  (void)enable;
+  return false;
+#endif
+}
 // finish BSocket
+
+bool
+readZeroCopyCompletion(BetterSocket::GSocket s, ZeroCopyRange& range)
+{
+#if defined(SO_EE_ORIGIN_ZEROCOPY)
+  union
+  {
+    char buf[CMSG_SPACE(sizeof(sock_extended_err))];
+    struct cmsghdr align;
+  } control;
+  struct msghdr msg = {};
+  msg.msg_control = control.buf;
+  msg.msg_controllen = sizeof(control.buf);
+  // other errors queued (ICMP with IP_RECVERR) are skipped
+  while (recvmsg(s, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) != SOCK_ERR) {
+    for (auto* cmsg = CMSG_FIRSTHDR(&msg); cmsg != nullptr;
+         cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+      if (cmsg->cmsg_len < CMSG_LEN(sizeof(sock_extended_err)))
+        continue;
+      sock_extended_err err;
+      std::memcpy(&err, CMSG_DATA(cmsg), sizeof(err));
+      if (err.ee_origin != SO_EE_ORIGIN_ZEROCOPY || err.ee_errno != 0)
+        continue;
+      range = { err.ee_info, err.ee_data,
+                (err.ee_code & SO_EE_CODE_ZEROCOPY_COPIED) != 0 };
+      return true;
+    }
+    msg.msg_controllen = sizeof(control.buf);
+  }
+  return false;
+#else
+  (void)s;
+  (void)range;
+  return false;
+#endif
+}
 } // namespace BetterSocket
@@ -0,0 +1,251 @@
+#include <algorithm>
+#include <cerrno>
+#include <fstream>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "block_cache.hpp"
+#include "netascii.hpp"
+
+#define SCAST(Type, e) static_cast<Type>(e)
+
+std::size_t
+BlockCache::KeyHash::operator()(const Key& k) const noexcept
+{
+  uint64_t h = k.ino * 0x9e3779b97f4a7c15ULL;
+  h ^= k.dev + (h << 6) + (h >> 2);
+  h ^= SCAST(uint64_t, k.mtime_ns) + (h << 6) + (h >> 2);
+  h ^= (k.size << 17 | k.blksize << 1 | k.netascii) + (h << 6) + (h >> 2);
+  return SCAST(std::size_t, h);
+}
+
+std::span<const std::byte>
+BlockCache::Image::packet(uint64_t block) const
+{
+  const std::size_t stride = HEADER + key.blksize;
+  const std::byte* slot = slots.data() + (block - 1) * stride;
+  std::size_t len = block < blocks ? key.blksize
+                                   : length - (blocks - 1) * key.blksize;
+  return { slot, HEADER + len };
+}
+
+std::size_t
+BlockCache::Image::bytes() const
+{
+  return slots.size() + sizeof(*this);
+}
+
+BlockCache::BlockCache(std::size_t capacity_bytes)
+  : capacity{ capacity_bytes }
+  , lock{}
+  , lru{}
+  , entries{}
+  , loading{}
+  , used{ 0 }
+  , hits{ 0 }
+  , misses{ 0 }
+  , evictions{ 0 }
+{
+}
+
+static bool
+keyOf(int fd, uint32_t blksize, bool netascii, BlockCache::Key& key)
+{
+  struct stat st;
+  if (fstat(fd, &st) == -1)
+    return false;
+  key = { SCAST(uint64_t, st.st_dev),
+          SCAST(uint64_t, st.st_ino),
+          SCAST(int64_t, st.st_mtim.tv_sec) * 1000000000 + st.st_mtim.tv_nsec,
+          SCAST(uint64_t, st.st_size),
+          blksize,
+          netascii };
+  return true;
+}
+
+std::shared_ptr<const BlockCache::Image>
+BlockCache::get(int fd,
+                uint32_t blksize,
+                bool netascii,
+                Key& key,
+                bool& claimed)
+{
+  claimed = false;
+  if (!keyOf(fd, blksize, netascii, key))
+    return nullptr;
+
+  std::lock_guard<std::mutex> guard(lock);
+  auto found = entries.find(key);
+  if (found != entries.end()) {
+    hits++;
+    lru.splice(lru.begin(), lru, found->second);
+    return *found->second;
+  }
+  misses++;
+
+  // a file that does not fit would only flush everything else out. Its
+  // netascii form is longer still, how much is only known once translated
+  uint64_t blocks = key.size / blksize + 1;
+  if (blocks * (HEADER + blksize) <= capacity)
+    claimed = loading.insert(key).second;
+  return nullptr;
+}
+
+std::shared_ptr<const BlockCache::Image>
+BlockCache::load(int fd, const Key& key)
+{
+  // read without holding the lock, the reactors keep going
+  std::shared_ptr<const Image> image =
+    key.netascii ? readNetascii(fd, key) : read(fd, key);
+  if (image != nullptr && image->bytes() > capacity)
+    image = nullptr;
+
+  std::lock_guard<std::mutex> guard(lock);
+  loading.erase(key);
+  return image == nullptr ? nullptr : insert(std::move(image));
+}
+
+// called with `lock` held
+std::shared_ptr<const BlockCache::Image>
+BlockCache::insert(std::shared_ptr<const Image> image)
+{
+  auto found = entries.find(image->key);
+  if (found != entries.end())
+    return *found->second;
+
+  used += image->bytes();
+  while (used > capacity && !lru.empty()) {
+    used -= lru.back()->bytes();
+    entries.erase(lru.back()->key);
+    lru.pop_back();
+    evictions++;
+  }
+
+  lru.push_front(image);
+  entries.emplace(image->key, lru.begin());
+  return image;
+}
+
+// DATA (opcode 3), then the block number as it goes on the wire
+static void
+putHeader(std::byte* slot, uint64_t block)
+{
+  slot[0] = std::byte{ 0 };
+  slot[1] = std::byte{ 3 };
+  slot[2] = SCAST(std::byte, (block >> 8) & 0xff);
+  slot[3] = SCAST(std::byte, block & 0xff);
+}
+
+std::shared_ptr<BlockCache::Image>
+BlockCache::read(int fd, const Key& key)
+{
+  auto image = std::make_shared<Image>();
+  image->key = key;
+  image->length = key.size;
+  image->blocks = key.size / key.blksize + 1;
+  const std::size_t stride = HEADER + key.blksize;
+  image->slots.resize(image->blocks * stride);
+
+  for (uint64_t block = 1; block <= image->blocks; block++) {
+    std::byte* slot = image->slots.data() + (block - 1) * stride;
+    putHeader(slot, block);
+
+    std::size_t want = block < image->blocks
+                         ? key.blksize
+                         : key.size - (image->blocks - 1) * key.blksize;
+    std::size_t done = 0;
+    while (done < want) {
+      auto r = pread(fd,
+                     slot + HEADER + done,
+                     want - done,
+                     SCAST(off_t, (block - 1) * key.blksize + done));
+      if (r == -1 && errno == EINTR)
+        continue;
+      if (r <= 0)
+        return nullptr; // an error, or the file shrunk while being read
+      done += SCAST(std::size_t, r);
+    }
+  }
+  return image;
+}
+
+/* the file translated to netascii, straight into the packet slots. A line
+ * end that straddles two blocks is carried over by the encoder */
+std::shared_ptr<BlockCache::Image>
+BlockCache::readNetascii(int fd, const Key& key)
+{
+  auto image = std::make_shared<Image>();
+  image->key = key;
+  const std::size_t stride = HEADER + key.blksize;
+  image->slots.reserve((key.size + key.size / 16) / key.blksize * stride +
+                       stride);
+  image->slots.resize(stride);
+  putHeader(image->slots.data(), 1);
+
+  Netascii::Encoder encoder;
+  std::vector<std::byte> chunk(1 << 16);
+  uint64_t offset = 0;
+  uint64_t block = 1;
+  std::size_t fill = 0; // bytes in `block` so far
+  for (bool eof = false; !eof;) {
+    auto r = pread(fd, chunk.data(), chunk.size(), SCAST(off_t, offset));
+    if (r == -1 && errno == EINTR)
+      continue;
+    if (r == -1)
+      return nullptr;
+    offset += SCAST(uint64_t, r);
+    eof = r == 0;
+
+    // at the end, once more for a byte the encoder may still hold
+    std::span<const std::byte> in(chunk.data(), SCAST(std::size_t, r));
+    do {
+      std::byte* slot = image->slots.data() + (block - 1) * stride;
+      auto done = encoder.encode(
+        in, { slot + HEADER + fill, key.blksize - fill });
+      in = in.subspan(done.read);
+      fill += done.written;
+      if (fill == key.blksize) {
+        block++;
+        fill = 0;
+        image->slots.resize(block * stride);
+        putHeader(image->slots.data() + (block - 1) * stride, block);
+      }
+    } while (!in.empty() || (eof && encoder.holding));
+  }
+  image->blocks = block;
+  image->length = (block - 1) * key.blksize + fill;
+  return image;
+}
+
+std::size_t
+BlockCache::warm(const std::string& manifest,
+                 const std::string& root,
+                 uint32_t blksize)
+{
+  std::ifstream in(manifest);
+  std::string line;
+  std::size_t loaded = 0;
+  while (std::getline(in, line)) {
+    if (line.empty() || line.front() == '#')
+      continue;
+    int fd = ::open((root + '/' + line).c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd == -1)
+      continue;
+    Key key;
+    bool claimed;
+    if (get(fd, blksize, false, key, claimed) != nullptr ||
+        (claimed && load(fd, key) != nullptr))
+      loaded++;
+    ::close(fd);
+  }
+  return loaded;
+}
+
+BlockCache::Stats
+BlockCache::stats() const
+{
+  std::lock_guard<std::mutex> guard(lock);
+  return { hits.load(), misses.load(), evictions.load(), lru.size(), used };
+}
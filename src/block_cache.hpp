@@ -0,0 +1,121 @@
+#ifndef AVANTEE_BLOCK_CACHE_H
+#define AVANTEE_BLOCK_CACHE_H
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <span>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+/* Whole files kept in memory as ready made DATA packets, shared by every
+ * reactor of the process.
+ *
+ * Boot images are fetched by many clients at once. Each cached block sits
+ * in a slot of `HEADER + blksize` bytes whose DATA header is already
+ * written, so sending it is a single buffer handed to the kernel, no read
+ * and no copy. Entries are keyed by the file's identity and modification
+ * time, a file that changes on disk is simply a new entry. The cache is
+ * bounded in bytes and drops the least recently used files first;
+ * transfers already sending an evicted file keep it alive until they end.
+ *
+ * A file sent in netascii mode is cached translated, as a separate entry:
+ * text fetched over and over is only converted once.
+ *
+ * Reading a whole image takes a while, the reactors do not wait for it. A
+ * miss claims the file: whoever got the claim reads it on an I/O thread
+ * and inserts it, the other misses meanwhile are told it is on its way
+ * and send from the file as if it was not cached.
+ */
+struct BlockCache
+{
+  static constexpr std::size_t HEADER = 4; // opcode and block number
+
+  struct Key
+  {
+    uint64_t dev;
+    uint64_t ino;
+    int64_t mtime_ns;
+    uint64_t size;
+    uint32_t blksize;
+    bool netascii;
+
+    bool operator==(const Key&) const = default;
+  };
+
+  struct KeyHash
+  {
+    std::size_t operator()(const Key& k) const noexcept;
+  };
+
+  struct Image
+  {
+    Key key;
+    uint64_t length; // bytes in the packets, `key.size` unless netascii
+    uint64_t blocks; // including the final short (maybe empty) one
+    std::vector<std::byte> slots;
+
+    /* DATA packet `block` (1 based), header included */
+    std::span<const std::byte> packet(uint64_t block) const;
+    std::size_t bytes() const;
+  };
+
+  struct Stats
+  {
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t evictions;
+    uint64_t entries;
+    uint64_t bytes;
+  };
+
+  explicit BlockCache(std::size_t capacity_bytes);
+  BlockCache(const BlockCache&) = delete;
+  BlockCache& operator=(const BlockCache&) = delete;
+
+  /* the cached image of the open file `fd`, nullptr on a miss. The first
+   * miss of a file that fits is `claimed`: the caller is to `load()` the
+   * image of `key`, nobody else is asked to until then */
+  std::shared_ptr<const Image> get(int fd,
+                                   uint32_t blksize,
+                                   bool netascii,
+                                   Key& key,
+                                   bool& claimed);
+  /* read the file `fd` claimed with `get()` into the cache, or only drop
+   * the claim if it cannot be read or does not fit. Waits for the disk:
+   * for an I/O thread, or before the reactors start */
+  std::shared_ptr<const Image> load(int fd, const Key& key);
+  /* load the files listed in `manifest`, one path per line relative to
+   * `root`, blank lines and lines starting with '#' are skipped. Returns
+   * how many were loaded */
+  std::size_t warm(const std::string& manifest,
+                   const std::string& root,
+                   uint32_t blksize);
+
+  Stats stats() const;
+
+private:
+  using Lru = std::list<std::shared_ptr<const Image>>;
+
+  std::shared_ptr<const Image> insert(std::shared_ptr<const Image> image);
+  static std::shared_ptr<Image> read(int fd, const Key& key);
+  static std::shared_ptr<Image> readNetascii(int fd, const Key& key);
+
+  const std::size_t capacity;
+  mutable std::mutex lock; // guards everything below but the counters
+  Lru lru;                 // most recently used first
+  std::unordered_map<Key, Lru::iterator, KeyHash> entries;
+  std::unordered_set<Key, KeyHash> loading; // claimed, not inserted yet
+  std::size_t used;
+
+  std::atomic<uint64_t> hits;
+  std::atomic<uint64_t> misses;
+  std::atomic<uint64_t> evictions;
+};
+
+#endif
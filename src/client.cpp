@@ -1,24 +1,282 @@
+#if defined(__linux__)
+#include <fcntl.h>
+#include <sys/stat.h>
+#endif
+
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "options.hpp"
+#include "socket/error_utils.hpp"
 #include "socket/socket.hpp"
+#include "tftp.hpp"
+
+#define SCAST(Type, e) static_cast<Type>(e)
+#define TU(enum) std::to_underlying(enum)
 
 namespace BS = BetterSocket;
 
+static BS::SockaddrWrapper
+wrap(const Endpoint& e)
+{
+  sockaddr_storage storage = {};
+  std::memcpy(&storage, e.get(), e.len());
+  return BS::SockaddrWrapper(storage, e.len());
+}
+
+static bool
+sameEndpoint(const Endpoint& a, const Endpoint& b)
+{
+  return a.len() == b.len() && std::memcmp(&a.addr, &b.addr, a.len()) == 0;
+}
+
+/* One RRQ. The server answers from a port of its own (its TID), which is
+ * where everything after the request goes. With an RFC 7440 window only
+ * the last block of each window is acknowledged. */
+struct Download
+{
+  BS::BSocket& sock;
+  BS::SockaddrWrapper server; // the listener until the TID is known
+  Endpoint tid = {};
+  bool haveTid = false;
+  std::vector<std::byte> last = {}; // sent again when nothing comes back
+  std::vector<std::byte> incoming = {};
+  uint16_t blksize = TU(Constants::maxDataLen);
+  uint16_t windowsize = 1;
+  int timeout = TU(Constants::retransmitTimeout); // ms
+  uint16_t sinceAck = 0; // blocks received since the last ACK
+  bool gapAcked = false; // out of order blocks were answered already
+  uint32_t expect = 1;   // next DATA block
+  uint64_t received = 0;
+
+  void send(std::vector<std::byte> packet)
+  {
+    last = std::move(packet);
+    sock.sendTo(last.data(), last.size(), server);
+  }
+
+  void ack(uint16_t block)
+  {
+    sinceAck = 0;
+    std::vector<std::byte> packet(TU(Constants::headerLen));
+    putU16(packet.data(), TU(Opcodes::ack));
+    putU16(packet.data() + 2, block);
+    send(std::move(packet));
+  }
+
+  void error(BS::SockaddrWrapper& to, ErrorCodes code, std::string_view msg)
+  {
+    std::byte packet[64];
+    auto size = buildError(packet, code, msg);
+    sock.sendTo(packet, size, to);
+  }
+};
+
+// make room for a file of `size` bytes up front, so it is not fragmented
+// by being written a block at a time. Only for regular files: stdout may be
+// a pipe
+static void
+preallocate(std::FILE* out, uint64_t size)
+{
+#if defined(__linux__)
+  struct stat st;
+  int fd = fileno(out);
+  if (size > 0 && fstat(fd, &st) == 0 && S_ISREG(st.st_mode))
+    posix_fallocate(fd, 0, SCAST(off_t, size));
+#else
+  (void)out;
+  (void)size;
+#endif
+}
+
+// false and a message on stderr if the transfer failed
+static bool
+fetch(Download& d, const ClientOptions& opts, std::FILE* out)
+{
+  // the first reply is an OACK or DATA, either fits a 512 byte block buffer
+  d.incoming.resize(packetSize(TU(Constants::maxDataLen)));
+
+  unsigned retries = 0;
+  for (;;) {
+    BS::GPollfd pfd = { d.sock.underlyingSocket(), POLLIN, 0 };
+    if (BS::gPoll(&pfd, 1, d.timeout) == 0) {
+      if (++retries > TU(Constants::maxRetransmits)) {
+        std::fprintf(stderr, "avantee-client: timed out\n");
+        return false;
+      }
+      // once data flows, the last block received in order is what the
+      // server needs to hear about
+      if (d.expect > 1)
+        d.ack(SCAST(uint16_t, (d.expect - 1) & 0xffff));
+      else
+        d.sock.sendTo(d.last.data(), d.last.size(), d.server);
+      continue;
+    }
+
+    BS::SockaddrWrapper sender;
+    auto r = d.sock.receiveFrom(d.incoming.data(), d.incoming.size(), sender);
+    auto from = Endpoint::of(sender);
+    if (!d.haveTid) {
+      d.tid = from;
+      d.server = wrap(from);
+      d.haveTid = true;
+    } else if (!sameEndpoint(from, d.tid)) {
+      d.error(sender, ErrorCodes::unknownTid, "unknown transfer ID");
+      continue;
+    }
+    if (r < SCAST(BS::SSize, TU(Constants::headerLen)))
+      continue;
+
+    auto packet =
+      std::span<const std::byte>(d.incoming.data(), SCAST(std::size_t, r));
+    auto opcode = SCAST(Opcodes, getU16(packet.data()));
+    uint16_t block = getU16(packet.data() + 2);
+
+    if (opcode == Opcodes::error) {
+      auto* text = reinterpret_cast<const char*>(packet.data() + 4);
+      std::string_view msg(text, strnlen(text, packet.size() - 4));
+      std::fprintf(stderr,
+                   "avantee-client: server error %u: %.*s\n",
+                   block,
+                   SCAST(int, msg.size()),
+                   msg.data());
+      return false;
+    }
+
+    if (opcode == Opcodes::oack && d.expect == 1) {
+      // RFC 2347: the server may only lower what we proposed. RFC 2349:
+      // the timeout comes back unchanged or not at all
+      TransferOptions acked;
+      if (!parseOptions(packet.subspan(2), acked) ||
+          ((acked.present & TransferOptions::BLKSIZE) &&
+           (opts.blksize == 0 || acked.blksize > opts.blksize)) ||
+          ((acked.present & TransferOptions::WINDOWSIZE) &&
+           (opts.windowsize == 0 || acked.windowsize > opts.windowsize)) ||
+          ((acked.present & TransferOptions::TIMEOUT) &&
+           acked.timeout != opts.timeout)) {
+        d.error(d.server, ErrorCodes::badOption, "unexpected option");
+        std::fprintf(stderr, "avantee-client: bad OACK\n");
+        return false;
+      }
+      d.blksize = acked.blksize;
+      d.windowsize = acked.windowsize;
+      if (acked.present & TransferOptions::TIMEOUT)
+        d.timeout = acked.timeout * 1000;
+      if (acked.present & TransferOptions::TSIZE)
+        preallocate(out, acked.tsize);
+      d.incoming.resize(packetSize(d.blksize));
+      d.ack(0);
+      retries = 0;
+      continue;
+    }
+
+    if (opcode != Opcodes::data)
+      continue;
+    if (block != (d.expect & 0xffff)) {
+      // a block was lost, or our ACK was and the server sent the window
+      // again: tell it once where we are, it restarts from there
+      if (!d.gapAcked && d.expect > 1) {
+        d.ack(SCAST(uint16_t, (d.expect - 1) & 0xffff));
+        d.gapAcked = true;
+      }
+      continue;
+    }
+
+    auto payload = packet.subspan(TU(Constants::headerLen));
+    if (std::fwrite(payload.data(), 1, payload.size(), out) != payload.size()) {
+      d.error(d.server, ErrorCodes::diskFull, "write failed");
+      std::perror("avantee-client: write");
+      return false;
+    }
+    d.received += payload.size();
+    d.expect++;
+    d.gapAcked = false;
+    retries = 0;
+    bool done = payload.size() < d.blksize; // the short block ends the file
+    if (done || ++d.sinceAck >= d.windowsize)
+      d.ack(block);
+    if (done)
+      return true;
+  }
+}
+
 int
 main(int argc, char** argv)
 {
-  if (argc < 2) {
-    printf("./avantee-client IP\n");
+  ClientOptions opts;
+  if (!parseClientOptions(argc, argv, opts))
     return 1;
-  }
+
   BS::init();
   BS::SocketHint hint(BetterSocket::IpVersion::vAny,
                       BetterSocket::SockKind::Datagram,
                       BetterSocket::SockFlags::UseHostIP,
                       BetterSocket::IpProtocol::UDP);
-  BS::BSocket tftp(hint, "69", argv[1]); // tftp port: 69
 
-  const char msg[] = "hi there avantee server, this is clientee :D";
-  BS::SockaddrWrapper to(tftp.getsockaddr());
-  long out = tftp.sendTo((void*)msg, sizeof(msg), to);
+  bool toStdout = opts.output == "-";
+  std::FILE* out = toStdout ? stdout : std::fopen(opts.output.c_str(), "wb");
+  if (out == nullptr) {
+    std::perror(opts.output.c_str());
+    return 1;
+  }
+
+  bool ok = false;
+  try {
+    BS::BSocket tftp(hint, opts.port, opts.host);
+    sockaddr_storage storage = {};
+    std::memcpy(&storage, tftp.validAddr.ai_addr, tftp.validAddr.ai_addrlen);
+
+    Download d{ tftp,
+                BS::SockaddrWrapper(storage, tftp.validAddr.ai_addrlen) };
+    std::byte options[64];
+    // RFC 2349: a tsize of 0 asks the server for the file size
+    TransferOptions proposed;
+    proposed.present = TransferOptions::TSIZE;
+    if (opts.blksize != 0) {
+      proposed.present |= TransferOptions::BLKSIZE;
+      proposed.blksize = SCAST(uint16_t, opts.blksize);
+    }
+    if (opts.windowsize != 0) {
+      proposed.present |= TransferOptions::WINDOWSIZE;
+      proposed.windowsize = SCAST(uint16_t, opts.windowsize);
+    }
+    if (opts.timeout != 0) {
+      proposed.present |= TransferOptions::TIMEOUT;
+      proposed.timeout = SCAST(uint8_t, opts.timeout);
+    }
+    auto optionsSize = buildOptions(options, proposed);
 
-  printf("client.cpp: sent %ld bytes\n", out);
+    std::vector<std::byte> rrq(TU(Constants::maxFilenameLen) + 64);
+    auto size = buildRequest(rrq,
+                             Opcodes::rrq,
+                             opts.file,
+                             "octet",
+                             std::span(options, optionsSize));
+    if (size == 0) {
+      std::fprintf(stderr, "avantee-client: file name too long\n");
+    } else {
+      rrq.resize(size);
+      d.send(std::move(rrq));
+      ok = fetch(d, opts, out);
+      if (ok)
+        std::fprintf(stderr,
+                     "avantee-client: received %llu bytes in %u byte blocks, "
+                     "%u per ACK\n",
+                     SCAST(unsigned long long, d.received),
+                     d.blksize,
+                     d.windowsize);
+    }
+  } catch (const SockErrors::APIError& e) {
+    std::fprintf(stderr, "avantee-client: %s\n", e.what());
+  }
+
+  if (!toStdout) {
+    std::fclose(out);
+    if (!ok)
+      std::remove(opts.output.c_str());
+  }
+  return ok ? 0 : 1;
 }
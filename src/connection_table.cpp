@@ -0,0 +1,175 @@
+#include <algorithm>
+#include <cstring>
+#include <utility>
+
+#include "connection_table.hpp"
+
+#define SCAST(Type, e) static_cast<Type>(e)
+
+namespace BS = BetterSocket;
+
+static constexpr std::size_t MIN_INDEX = 16;
+
+PeerKey
+PeerKey::of(BS::SockaddrWrapper& sender)
+{
+  PeerKey key{};
+  key.family = sender.wrappingOverIP;
+  if (key.family == BS::IpVersion::v4) {
+    const auto* v4 = sender.getPtrToV4();
+    std::memcpy(key.addr.data(), &v4->sin_addr, sizeof(v4->sin_addr));
+    key.port = v4->sin_port;
+  } else {
+    const auto* v6 = sender.getPtrToV6();
+    std::memcpy(key.addr.data(), &v6->sin6_addr, sizeof(v6->sin6_addr));
+    key.port = v6->sin6_port;
+  }
+  return key;
+}
+
+ConnectionTable::ConnectionTable(std::size_t max_connections)
+  : connections{}
+  , keys{}
+  , queued{}
+  , free_handles{}
+  , index(MIN_INDEX, IndexEntry{ NO_CONNECTION, 0 })
+  , indexed{ 0 }
+  , ready{}
+  , ready_scratch{}
+  , cap{ max_connections }
+{
+}
+
+uint32_t
+ConnectionTable::hash_of(const TransferKey& key)
+{
+  uint64_t h = PeerKeyHash{}(key.peer) ^ (uint64_t{ key.local } << 32);
+  h *= 0x9e3779b97f4a7c15ULL;
+  return SCAST(uint32_t, h >> 32);
+}
+
+ConnectionTable::Handle
+ConnectionTable::allocate(const TransferKey& key)
+{
+  Handle h;
+  if (!free_handles.empty()) {
+    h = free_handles.back();
+    free_handles.pop_back();
+  } else if (connections.size() < cap) {
+    if (connections.size() == connections.capacity()) {
+      // double, but never past the cap so a full table holds no slack
+      std::size_t want = std::min(cap, std::max(connections.size() * 2, MIN_INDEX));
+      connections.reserve(want);
+      keys.reserve(want);
+      queued.reserve(want);
+    }
+    h = SCAST(Handle, connections.size());
+    connections.emplace_back();
+    keys.emplace_back();
+    queued.push_back(false);
+  } else {
+    return NO_CONNECTION;
+  }
+
+  keys[h] = key;
+  index_insert(hash_of(key), h);
+  return h;
+}
+
+void
+ConnectionTable::release(Handle h)
+{
+  index_erase(h);
+  free_handles.push_back(h);
+}
+
+ConnectionTable::Handle
+ConnectionTable::find(const TransferKey& key) const
+{
+  const std::size_t mask = index.size() - 1;
+  const uint32_t hash = hash_of(key);
+  for (std::size_t b = hash & mask;; b = (b + 1) & mask) {
+    const auto& e = index[b];
+    if (e.handle == NO_CONNECTION)
+      return NO_CONNECTION;
+    if (e.hash == hash && keys[e.handle] == key)
+      return e.handle;
+  }
+}
+
+void
+ConnectionTable::index_insert(uint32_t hash, Handle h)
+{
+  if ((indexed + 1) * 2 > index.size())
+    grow_index();
+
+  const std::size_t mask = index.size() - 1;
+  std::size_t b = hash & mask;
+  while (index[b].handle != NO_CONNECTION)
+    b = (b + 1) & mask;
+  index[b] = { h, hash };
+  indexed++;
+}
+
+void
+ConnectionTable::index_erase(Handle h)
+{
+  const std::size_t mask = index.size() - 1;
+  std::size_t hole = hash_of(keys[h]) & mask;
+  for (;; hole = (hole + 1) & mask) {
+    if (index[hole].handle == NO_CONNECTION)
+      return; // not indexed
+    if (index[hole].handle == h)
+      break;
+  }
+
+  // shift later members of the cluster back so lookups never hit a gap
+  for (std::size_t next = (hole + 1) & mask;
+       index[next].handle != NO_CONNECTION;
+       next = (next + 1) & mask) {
+    std::size_t home = index[next].hash & mask;
+    // move `next` into the hole unless its home lies cyclically in
+    // (hole, next]
+    bool stays = hole <= next ? (hole < home && home <= next)
+                              : (hole < home || home <= next);
+    if (!stays) {
+      index[hole] = index[next];
+      hole = next;
+    }
+  }
+  index[hole].handle = NO_CONNECTION;
+  indexed--;
+}
+
+void
+ConnectionTable::grow_index()
+{
+  std::vector<IndexEntry> old(index.size() * 2, IndexEntry{ NO_CONNECTION, 0 });
+  old.swap(index);
+  indexed = 0;
+  for (const auto& e : old) {
+    if (e.handle != NO_CONNECTION)
+      index_insert(e.hash, e.handle);
+  }
+}
+
+void
+ConnectionTable::mark_ready(Handle h)
+{
+  if (queued[h])
+    return;
+  queued[h] = true;
+  ready.push_back(h);
+}
+
+std::size_t
+ConnectionTable::active() const
+{
+  return connections.size() - free_handles.size();
+}
+
+std::size_t
+ConnectionTable::capacity() const
+{
+  return cap;
+}
@@ -0,0 +1,136 @@
+#ifndef AVANTEE_CONNECTION_TABLE_H
+#define AVANTEE_CONNECTION_TABLE_H
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "socket/generic_sockets.hpp"
+#include "socket/socket.hpp"
+#include "tftp.hpp"
+#include "timer_wheel.hpp"
+
+/* a peer's address and port */
+struct PeerKey
+{
+  std::array<uint64_t, 2> addr; // IPv4 addresses use the first 4 bytes
+  BetterSocket::in_port_t port;
+  BetterSocket::IpVersion family;
+
+  bool operator==(const PeerKey&) const = default;
+  static PeerKey of(BetterSocket::SockaddrWrapper& sender);
+};
+
+struct PeerKeyHash
+{
+  std::size_t operator()(const PeerKey& k) const noexcept
+  {
+    // splitmix style mixing, the port and the low address bits vary most
+    uint64_t h = k.addr[0] ^ (k.addr[1] * 0x9e3779b97f4a7c15ULL) ^
+                 (uint64_t{ k.port } << 48);
+    h ^= h >> 31;
+    h *= 0xbf58476d1ce4e5b9ULL;
+    h ^= h >> 29;
+    return static_cast<std::size_t>(h);
+  }
+};
+
+/* a transfer is told apart by both ends: the peer's endpoint and the local
+ * TID it talks to (0 when every transfer shares the listener) */
+struct TransferKey
+{
+  PeerKey peer;
+  BetterSocket::in_port_t local;
+
+  bool operator==(const TransferKey&) const = default;
+};
+
+/* The transfers of one reactor.
+ *
+ * Connections live in a vector that grows up to `capacity()` and are
+ * addressed by a stable `Handle`, their index. Free handles are kept on a
+ * stack, so allocating and freeing are O(1). An open addressing index
+ * (linear probing, backward shift deletion) finds a transfer by its
+ * `TransferKey`. Connections that received something are queued on the
+ * ready list, so a loop iteration only visits those.
+ *
+ * Memory: a full table costs at most `BYTES_PER_CONNECTION` per transfer
+ * (the storage never grows past the cap), and the files being served are
+ * shared through `FileTable`. With `--demux socket` every transfer also
+ * holds a TID socket, see `PortPool::BYTES_PER_TID`.
+ */
+struct ConnectionTable
+{
+  using Handle = uint32_t;
+  static constexpr Handle NO_CONNECTION = UINT32_MAX;
+
+  /* the key itself is in `keys`, the hash saves looking at it on most
+   * collisions */
+  struct IndexEntry
+  {
+    Handle handle; // NO_CONNECTION marks an empty bucket
+    uint32_t hash;
+  };
+
+  std::vector<Connection> connections;
+  std::vector<TransferKey> keys; // per handle, what it is indexed under
+  std::vector<bool> queued;      // per handle, already on `ready`
+  std::vector<Handle> free_handles;
+  std::vector<IndexEntry> index; // power of two, between 1/4 and 1/2 full
+  std::size_t indexed;
+  std::vector<Handle> ready;
+  std::vector<Handle> ready_scratch;
+  std::size_t cap;
+
+  /* the connection, its key and flag, its share of an index that is at
+   * least a quarter full, a slot on the free and ready lists and the two
+   * timers it may have armed */
+  static constexpr std::size_t BYTES_PER_CONNECTION =
+    sizeof(Connection) + sizeof(TransferKey) + 1 + 4 * sizeof(IndexEntry) +
+    2 * sizeof(Handle) +
+    2 * (sizeof(TimerWheel::Node) + sizeof(TimerWheel::TimerId));
+  static_assert(BYTES_PER_CONNECTION <= 256);
+
+  explicit ConnectionTable(std::size_t max_connections);
+
+  /* a free connection registered under `key`, NO_CONNECTION at the cap */
+  Handle allocate(const TransferKey& key);
+  /* take `h` out of the index and hand it back to the free list */
+  void release(Handle h);
+  /* NO_CONNECTION if no transfer has this key */
+  Handle find(const TransferKey& key) const;
+
+  Connection& operator[](Handle h) { return connections[h]; }
+
+  /* queue `h` for the next `for_each_ready()`, at most once */
+  void mark_ready(Handle h);
+  /* call `fn(handle)` for every queued connection and empty the queue.
+   * `fn` may queue connections again, they are seen by the next call. */
+  template<typename Fn>
+  void for_each_ready(Fn&& fn);
+
+  /* connections handed out and not released */
+  std::size_t active() const;
+  std::size_t capacity() const;
+
+private:
+  static uint32_t hash_of(const TransferKey& key);
+  void index_insert(uint32_t hash, Handle h);
+  void index_erase(Handle h);
+  void grow_index();
+};
+
+template<typename Fn>
+void
+ConnectionTable::for_each_ready(Fn&& fn)
+{
+  ready_scratch.swap(ready);
+  for (Handle h : ready_scratch) {
+    queued[h] = false;
+    fn(h);
+  }
+  ready_scratch.clear();
+}
+
+#endif
@@ -0,0 +1,610 @@
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <utility>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "file_table.hpp"
+#include "netascii.hpp"
+
+#define SCAST(Type, e) static_cast<Type>(e)
+#define TU(e) std::to_underlying(e)
+
+FileTable::FileTable(bool map, BlockCache* block_cache)
+  : files{}
+  , free_ids{}
+  , by_path{}
+  , map_files{ map }
+  , cache{ block_cache }
+  , epoch{ 0 }
+  , retired{}
+  , have_results{ false }
+  , stopping{ false }
+  , notify{ -1, -1 }
+{
+  if (pipe(notify) == -1) {
+    std::perror("file_table -> pipe()");
+    notify[0] = notify[1] = -1;
+    return; // the jobs are run on the spot instead
+  }
+  fcntl(notify[0], F_SETFL, O_NONBLOCK);
+  fcntl(notify[1], F_SETFL, O_NONBLOCK);
+  io = std::thread([this]() { run(); });
+}
+
+static void
+unmap(FileTable::File& f)
+{
+  if (f.map != nullptr)
+    munmap(const_cast<std::byte*>(f.map), static_cast<std::size_t>(f.size));
+  f.map = nullptr;
+}
+
+FileTable::~FileTable()
+{
+  if (io.joinable()) {
+    {
+      std::lock_guard guard(lock);
+      stopping = true;
+    }
+    wake.notify_one();
+    io.join();
+    ::close(notify[0]);
+    ::close(notify[1]);
+  }
+  for (auto& f : files) {
+    if (f.refs > 0 || f.pending > 0) {
+      unmap(f);
+      ::close(f.fd);
+    }
+  }
+  for (auto& r : retired)
+    if (r.map != nullptr)
+      munmap(const_cast<std::byte*>(r.map), static_cast<std::size_t>(r.size));
+}
+
+FileTable::FileId
+FileTable::open(const std::string& path, bool netascii)
+{
+  auto found = by_path[netascii].find(path);
+  if (found != by_path[netascii].end()) {
+    files[found->second].refs++;
+    return found->second;
+  }
+
+  int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd == -1)
+    return NO_FILE;
+
+  struct stat st;
+  bool ok = fstat(fd, &st) == 0;
+  if (!ok || !S_ISREG(st.st_mode)) {
+    int saved = ok ? EISDIR : errno; // only regular files are served
+    ::close(fd);
+    errno = saved;
+    return NO_FILE;
+  }
+
+  FileId id;
+  if (free_ids.empty()) {
+    id = SCAST(FileId, files.size());
+    files.emplace_back();
+  } else {
+    id = free_ids.back();
+    free_ids.pop_back();
+  }
+  files[id] = { path, fd, SCAST(uint64_t, st.st_size), nullptr, {}, 1,
+                netascii, {}, {}, 0, 0 };
+  if (netascii) {
+    files[id].size = UNKNOWN_SIZE;
+    files[id].marks.push_back({ 0, 0, Netascii::Encoder{} });
+  }
+
+  // an empty file cannot be mapped, and nothing is lost if mapping fails:
+  // read() still works. Netascii is sent from its translation instead
+  if (map_files && st.st_size > 0 && !netascii) {
+    void* m = mmap(
+      nullptr, SCAST(std::size_t, st.st_size), PROT_READ, MAP_SHARED, fd, 0);
+    if (m != MAP_FAILED)
+      files[id].map = SCAST(const std::byte*, m);
+  }
+  by_path[netascii].emplace(path, id);
+  return id;
+}
+
+void
+FileTable::release(FileId id)
+{
+  if (id == NO_FILE || --files[id].refs > 0)
+    return;
+
+  auto& f = files[id];
+  // sends of this iteration are still queued, they get their ticket later
+  retired.push_back({ UNSTAMPED,
+                      epoch,
+                      f.map,
+                      f.size,
+                      std::move(f.chunks),
+                      std::move(f.images) });
+  f.map = nullptr;
+  f.images.clear();
+  f.marks = {};
+  f.chunks = {};
+  by_path[f.netascii].erase(f.path);
+  f.path.clear();
+  // the I/O thread may still read from the descriptor
+  if (f.pending == 0)
+    recycle(id);
+}
+
+// close a released file and let its entry be reused
+void
+FileTable::recycle(FileId id)
+{
+  ::close(files[id].fd); // a mapping outlives its descriptor
+  free_ids.push_back(id);
+}
+
+// the last mark at or before byte `text` of a netascii translation
+static const FileTable::Mark&
+markBefore(const std::vector<FileTable::Mark>& marks, uint64_t text)
+{
+  auto after = std::upper_bound(
+    marks.begin(), marks.end(), text, [](uint64_t t, const auto& m) {
+      return t < m.text;
+    });
+  return *(after - 1); // there is one at 0
+}
+
+/* netascii from `at` on into `out`, once `skip` bytes of it are passed.
+ * `at` is moved to where it stopped, `end`: the text ended there. The
+ * bytes written, -1 if the file could not be read */
+static BetterSocket::SSize
+translate(int fd,
+          FileTable::Mark& at,
+          uint64_t skip,
+          std::span<std::byte> out,
+          bool& end)
+{
+  std::vector<std::byte> chunk(1 << 16);
+  std::size_t len = 0;
+  uint64_t whole = out.size();
+  end = false;
+  while (len < out.size()) {
+    auto r = pread(fd, chunk.data(), chunk.size(), SCAST(off_t, at.source));
+    if (r == -1 && errno == EINTR)
+      continue;
+    if (r == -1)
+      return -1;
+    bool eof = r == 0;
+
+    // at the end, once more for a byte the encoder may still hold. What is
+    // skipped is written over
+    std::span<const std::byte> in(chunk.data(), SCAST(std::size_t, r));
+    do {
+      auto room = skip > 0 ? out.first(SCAST(std::size_t,
+                                             std::min<uint64_t>(skip, whole)))
+                           : out.subspan(len);
+      auto done = at.encoder.encode(in, room);
+      in = in.subspan(done.read);
+      at.source += done.read;
+      at.text += done.written;
+      if (skip > 0)
+        skip -= done.written;
+      else
+        len += done.written;
+    } while (len < out.size() &&
+             (!in.empty() || (eof && at.encoder.holding)));
+    if (eof && !at.encoder.holding) {
+      end = true;
+      break;
+    }
+  }
+  return SCAST(BetterSocket::SSize, len);
+}
+
+BetterSocket::SSize
+FileTable::read(FileId id, uint64_t offset, void* buf, std::size_t len)
+{
+  const auto& f = files[id];
+  if (f.netascii) {
+    auto at = markBefore(f.marks, offset);
+    bool end;
+    return translate(
+      f.fd, at, offset - at.text, { SCAST(std::byte*, buf), len }, end);
+  }
+
+  std::size_t done = 0;
+  while (done < len) {
+    auto r = pread(files[id].fd,
+                   SCAST(char*, buf) + done,
+                   len - done,
+                   SCAST(off_t, offset + done));
+    if (r == -1 && errno == EINTR)
+      continue;
+    if (r == -1)
+      return -1;
+    if (r == 0)
+      break; // end of file
+    done += SCAST(std::size_t, r);
+  }
+  return SCAST(BetterSocket::SSize, done);
+}
+
+std::span<const std::byte>
+FileTable::mapped(FileId id, uint64_t offset, std::size_t len) const
+{
+  const auto& f = files[id];
+  if (f.map == nullptr || offset > f.size)
+    return {};
+  auto n = std::min(SCAST(uint64_t, len), f.size - offset);
+  return { f.map + offset, SCAST(std::size_t, n) };
+}
+
+bool
+FileTable::chunked(FileId id) const
+{
+  return files[id].map == nullptr;
+}
+
+// blocks of a chunk, which does not split them
+static uint64_t
+perChunk(uint32_t blksize)
+{
+  return std::max<uint64_t>(
+    1, TU(FileTable::constants::CHUNK_SIZE) / blksize);
+}
+
+uint32_t
+FileTable::staged(FileId id,
+                  uint64_t block,
+                  uint32_t count,
+                  uint32_t blksize,
+                  uint64_t ahead,
+                  bool& reading)
+{
+  auto& f = files[id];
+  reading = false;
+  if (f.failed != 0)
+    return count; // left to read() to report
+
+  uint64_t per = perChunk(blksize);
+  uint64_t end = block + count; // the first block not asked for
+  uint64_t until =
+    end + std::min(ahead / blksize, per * TU(constants::AHEAD_CHUNKS));
+  uint32_t ready = 0;
+  bool missing = false;
+  for (uint64_t first = (block - 1) / per * per + 1; first < until;
+       first += per) {
+    if ((first - 1) * blksize >= f.size) {
+      if (!missing)
+        ready = count; // nothing to read past the end
+      break;
+    }
+    auto c = std::find_if(f.chunks.begin(), f.chunks.end(), [&](auto& k) {
+      return k.first == first && k.blksize == blksize;
+    });
+    auto i = c != f.chunks.end() ? SCAST(std::size_t, c - f.chunks.begin())
+                                 : fill(id, first, blksize);
+    bool busy = i >= f.chunks.size();
+    if (first < end && !missing && !busy && !f.chunks[i].reading) {
+      f.chunks[i].used = epoch;
+      ready += SCAST(uint32_t, std::min(first + per, end) -
+                                 std::max(first, block));
+    } else if (first < end && !missing) {
+      missing = true;
+      // nor is a netascii file whose end is not known yet, a read on the
+      // spot could not tell a short block from one cut off
+      reading = i != f.chunks.size() || f.size == UNKNOWN_SIZE;
+    }
+    if (busy)
+      break; // every chunk is in use, the rest has to wait as well
+  }
+  return ready;
+}
+
+// a chunk handed to the I/O thread to read blocks `first` on into, its
+// index. The chunk count if every chunk is in use, WAITING if netascii
+// has to be translated up to the chunk first
+static constexpr std::size_t WAITING = SIZE_MAX;
+
+std::size_t
+FileTable::fill(FileId id, uint64_t first, uint32_t blksize)
+{
+  auto& f = files[id];
+  auto start = (first - 1) * blksize;
+  Mark at{ 0, 0, Netascii::Encoder{} };
+  if (f.netascii) {
+    // chunk after chunk, each from where the one before stopped: one being
+    // translated may end right there
+    at = markBefore(f.marks, start);
+    if (at.text != start && f.pending > 0)
+      return WAITING;
+  }
+
+  std::size_t reuse = f.chunks.size();
+  for (std::size_t i = 0; i < f.chunks.size(); i++) {
+    const auto& c = f.chunks[i];
+    // a chunk sent from lately may still be queued in the kernel
+    bool idle = !c.reading && (c.first == 0 || c.used + 2 <= epoch);
+    if (idle && (reuse == f.chunks.size() || c.used < f.chunks[reuse].used))
+      reuse = i;
+  }
+  if (reuse == f.chunks.size()) {
+    if (f.chunks.size() == TU(constants::MAX_CHUNKS))
+      return reuse;
+    f.chunks.emplace_back();
+  }
+
+  auto& c = f.chunks[reuse];
+  auto bytes = std::move(c.bytes);
+  bytes.resize(std::min(perChunk(blksize) * blksize, f.size - start));
+  c = { first, blksize, true, epoch, {} };
+  submit({ f.netascii ? Job::translate : Job::fill,
+           id,
+           f.fd,
+           first,
+           blksize,
+           start,
+           std::move(bytes),
+           0,
+           at,
+           false,
+           {},
+           nullptr });
+  return reuse;
+}
+
+std::span<const std::byte>
+FileTable::buffered(FileId id, uint64_t block, uint32_t blksize)
+{
+  auto& f = files[id];
+  auto offset = (block - 1) * blksize;
+  if (!chunked(id) || offset > f.size)
+    return {};
+
+  uint64_t per = perChunk(blksize);
+  uint64_t first = (block - 1) / per * per + 1;
+  for (auto& c : f.chunks) {
+    if (c.first != first || c.blksize != blksize || c.reading)
+      continue;
+    c.used = epoch;
+    auto at = SCAST(std::size_t, offset - (first - 1) * blksize);
+    auto n = std::min<std::size_t>(blksize, c.bytes.size() - at);
+    return { c.bytes.data() + at, n };
+  }
+  return {};
+}
+
+int
+FileTable::notifier() const
+{
+  return notify[0];
+}
+
+void
+FileTable::completed()
+{
+  if (!have_results.load(std::memory_order_acquire))
+    return;
+  std::vector<Task> done;
+  if (io.joinable()) {
+    char bytes[64];
+    while (::read(notify[0], bytes, sizeof(bytes)) > 0) {
+    }
+  }
+  {
+    std::lock_guard guard(lock);
+    done.swap(results);
+    have_results.store(false, std::memory_order_relaxed);
+  }
+  for (auto& task : done)
+    settle(task);
+}
+
+// put what a job read where it belongs
+void
+FileTable::settle(Task& task)
+{
+  auto& f = files[task.id];
+  if (--f.pending == 0 && f.refs == 0)
+    recycle(task.id);
+  if (f.refs == 0)
+    return; // released meanwhile, the chunks went with it
+
+  if (task.job == Job::load) {
+    // the transfers of this block size send from the cache from now on
+    auto& image = task.image;
+    if (image != nullptr && cached(task.id, 1, image->key.blksize).empty()) {
+      f.size = image->length; // the same, unless translated
+      f.images.push_back(std::move(image));
+    }
+    return;
+  }
+  if (task.job == Job::translate && task.error == 0) {
+    auto& marks = f.marks;
+    auto at = std::lower_bound(
+      marks.begin(), marks.end(), task.mark.text, [](const auto& m, auto t) {
+        return m.text < t;
+      });
+    if (at == marks.end() || at->text != task.mark.text)
+      marks.insert(at, task.mark);
+    if (task.end)
+      f.size = task.mark.text;
+  }
+  for (auto& c : f.chunks) {
+    if (!c.reading || c.first != task.first || c.blksize != task.blksize)
+      continue;
+    c.reading = false;
+    c.used = epoch; // a transfer is waiting for it
+    c.bytes = std::move(task.bytes);
+    if (task.error != 0) {
+      c.first = 0;
+      f.failed = task.error;
+    }
+    break;
+  }
+}
+
+void
+FileTable::submit(Task task)
+{
+  files[task.id].pending++;
+  if (!io.joinable()) {
+    execute(task);
+    results.push_back(std::move(task));
+    have_results.store(true, std::memory_order_release);
+    return;
+  }
+  {
+    std::lock_guard guard(lock);
+    tasks.push_back(std::move(task));
+  }
+  wake.notify_one();
+}
+
+void
+FileTable::run()
+{
+  for (;;) {
+    Task task;
+    {
+      std::unique_lock guard(lock);
+      wake.wait(guard, [this]() { return stopping || !tasks.empty(); });
+      if (stopping)
+        return; // what is left is of no use to anyone
+      task = std::move(tasks.front());
+      tasks.pop_front();
+    }
+
+    execute(task);
+    bool first;
+    {
+      std::lock_guard guard(lock);
+      first = results.empty();
+      results.push_back(std::move(task));
+      have_results.store(true, std::memory_order_release);
+    }
+    // one byte per batch of results is enough to wake the reactor
+    if (first)
+      (void)!write(notify[1], "", 1);
+  }
+}
+
+// runs on the I/O thread: touches nothing but the task, and the cache,
+// which locks
+void
+FileTable::execute(Task& task)
+{
+  if (task.job == Job::load) {
+    task.image = cache->load(task.fd, task.key);
+    return;
+  }
+  if (task.job == Job::translate) {
+    auto skip = task.offset - task.mark.text;
+    auto r = translate(task.fd, task.mark, skip, task.bytes, task.end);
+    if (r == -1)
+      task.error = errno;
+    else
+      task.bytes.resize(SCAST(std::size_t, r));
+    return;
+  }
+  std::size_t done = 0;
+  while (done < task.bytes.size()) {
+    auto r = pread(task.fd,
+                   task.bytes.data() + done,
+                   task.bytes.size() - done,
+                   SCAST(off_t, task.offset + done));
+    if (r == -1 && errno == EINTR)
+      continue;
+    if (r <= 0) {
+      // an error, or the file shrunk while being read
+      task.error = r == 0 ? EIO : errno;
+      return;
+    }
+    done += SCAST(std::size_t, r);
+  }
+}
+
+void
+FileTable::tick()
+{
+  epoch++;
+}
+
+void
+FileTable::reap(uint64_t issued, uint64_t done)
+{
+  for (auto& r : retired)
+    if (r.ticket == UNSTAMPED)
+      r.ticket = issued;
+  // like chunks, buffers stay two iterations, io_uring sends them late
+  while (!retired.empty() && retired.front().ticket <= done &&
+         retired.front().epoch + 2 <= epoch) {
+    auto& r = retired.front();
+    if (r.map != nullptr)
+      munmap(const_cast<std::byte*>(r.map), static_cast<std::size_t>(r.size));
+    retired.pop_front();
+  }
+}
+
+void
+FileTable::prepare(FileId id, uint32_t blksize)
+{
+  auto& f = files[id];
+  auto& images = f.images;
+  bool have = std::any_of(images.begin(), images.end(), [&](const auto& image) {
+    return image->key.blksize == blksize;
+  });
+  if (have || cache == nullptr)
+    return;
+
+  BlockCache::Key key;
+  bool claimed = false;
+  if (auto image = cache->get(f.fd, blksize, f.netascii, key, claimed)) {
+    f.size = image->length; // the same, unless translated
+    images.push_back(std::move(image));
+  } else if (claimed) {
+    submit({ Job::load,
+             id,
+             f.fd,
+             0,
+             blksize,
+             0,
+             {},
+             0,
+             { 0, 0, Netascii::Encoder{} },
+             false,
+             key,
+             nullptr });
+  }
+}
+
+std::span<const std::byte>
+FileTable::cached(FileId id, uint64_t block, uint32_t blksize) const
+{
+  // rarely more than one or two block sizes in use at once
+  for (const auto& image : files[id].images) {
+    if (image->key.blksize == blksize)
+      return block > image->blocks ? std::span<const std::byte>{}
+                                   : image->packet(block);
+  }
+  return {};
+}
+
+uint64_t
+FileTable::size(FileId id) const
+{
+  return files[id].size;
+}
+
+int
+FileTable::descriptor(FileId id) const
+{
+  return files[id].fd;
+}
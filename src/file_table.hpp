@@ -0,0 +1,234 @@
+#ifndef AVANTEE_FILE_TABLE_H
+#define AVANTEE_FILE_TABLE_H
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <span>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include "block_cache.hpp"
+#include "netascii.hpp"
+#include "socket/generic_sockets.hpp"
+
+/* Files being served, shared by every transfer of the same path.
+ *
+ * A transfer only holds a `FileId`, the descriptor and the path live here
+ * once no matter how many clients fetch the file. Blocks that have to be
+ * sent again are read back from the file instead of being kept around.
+ *
+ * Files are memory mapped when possible so DATA packets can be sent
+ * straight out of the page cache. `read()` works for every file, mapped or
+ * not. With a `BlockCache` the whole file may also be available as ready
+ * made packets, see `cached()`.
+ *
+ * Files that are not mapped are read a chunk of blocks at a time into
+ * buffers of the file, shared like the descriptor: a boot storm of clients
+ * fetching the same image at about the same offsets makes one read per
+ * chunk, not one per client and block, and holds one set of buffers. Each
+ * transfer only keeps its own position. A file keeps up to `MAX_CHUNKS`
+ * of them and reuses the least recently sent from first. The chunks are
+ * read by an I/O thread of the table's own, ahead of the transfers, so the
+ * event loop does not wait for the disk: `staged()` asks for them and
+ * tells what can be sent, `completed()` takes in what was read.
+ *
+ * A file opened for netascii is an entry of its own whose contents are the
+ * translated text: its size, `read()` and chunks are those of the text.
+ * It is never mapped, the I/O thread translates a chunk at a time as the
+ * transfers get to it, unless the block cache has the whole text already.
+ * Where each chunk ended in the file, and what the encoder held back
+ * there, is kept as a mark the next chunk starts from. The size of the
+ * text is only known once its end was translated.
+ *
+ * Cached packets may be sent without a copy: the kernel reads them after
+ * the send returned, until it reports completion, and batched sends are
+ * only made on the next poll. A released file's mapping, chunks and
+ * images are therefore retired rather than dropped, `reap()` lets go of
+ * them once the sends made from them are done.
+ */
+struct FileTable
+{
+  using FileId = uint32_t;
+  static constexpr FileId NO_FILE = UINT32_MAX;
+  static constexpr uint64_t UNKNOWN_SIZE = UINT64_MAX; // netascii, for now
+
+  enum class constants : std::size_t
+  {
+    CHUNK_SIZE = 1 << 16, // bytes read at once, rounded down to blocks
+    MAX_CHUNKS = 16,      // per file
+    AHEAD_CHUNKS = 4,     // read ahead of one transfer, at most
+  };
+
+  /* blocks `first` on of the transfers using `blksize`, read in one go */
+  struct Chunk
+  {
+    uint64_t first; // 0: the buffer is unused
+    uint32_t blksize;
+    bool reading;  // the I/O thread has `bytes`, nothing to send yet
+    uint64_t used; // `epoch` it was last sent from
+    std::vector<std::byte> bytes;
+  };
+
+  /* netascii: byte `text` of the translation comes from byte `source` of
+   * the file, through `encoder` as it was there */
+  struct Mark
+  {
+    uint64_t text;
+    uint64_t source;
+    Netascii::Encoder encoder;
+  };
+
+  /* what the I/O thread does */
+  enum class Job : uint8_t
+  {
+    fill,      // read a chunk
+    translate, // read and translate a chunk of netascii
+    load,      // read the file into the block cache
+  };
+
+  /* a job, handed back as it was once done, with `error` set */
+  struct Task
+  {
+    Job job;
+    FileId id;
+    int fd;
+    uint64_t first; // fill: the chunk's first block
+    uint32_t blksize;
+    uint64_t offset; // where the chunk starts in the file or the text
+    std::vector<std::byte> bytes; // as long as what is to be read at most
+    int error;                    // errno, 0 on success
+    Mark mark; // translate: where to start from, then where it stopped
+    bool end;  // translate: the text ended in the chunk
+    BlockCache::Key key;          // load: as claimed from the cache
+    std::shared_ptr<const BlockCache::Image> image; // load: nullptr if not
+  };
+
+  /* buffers of released files, kept for the sends made before */
+  struct Retired
+  {
+    uint64_t ticket; // zero copy sends to wait for, UNSTAMPED: not known
+    uint64_t epoch;  // `epoch` it was released in
+    const std::byte* map; // to unmap, nullptr if none
+    uint64_t size;
+    std::vector<Chunk> chunks;
+    std::vector<std::shared_ptr<const BlockCache::Image>> images;
+  };
+  static constexpr uint64_t UNSTAMPED = UINT64_MAX;
+
+  struct File
+  {
+    std::string path;
+    int fd;
+    uint64_t size; // UNKNOWN_SIZE until a netascii text was translated
+    const std::byte* map; // whole file, nullptr if it could not be mapped
+    // from the block cache, one per block size the file is sent with
+    std::vector<std::shared_ptr<const BlockCache::Image>> images;
+    uint32_t refs; // 0: the entry is free
+    bool netascii;
+    std::vector<Mark> marks;   // netascii: by `text`, from 0 on
+    std::vector<Chunk> chunks; // files that are not mapped
+    uint32_t pending; // jobs not completed, the entry is reused after them
+    int failed;       // errno of a chunk that could not be read
+  };
+
+  std::vector<File> files;
+  std::vector<FileId> free_ids;
+  std::unordered_map<std::string, FileId> by_path[2]; // octet, netascii
+  bool map_files;
+  BlockCache* cache; // shared with the other reactors, may be nullptr
+  uint64_t epoch;    // loop iterations, see `tick()`
+  std::deque<Retired> retired;
+
+  // shared with the I/O thread
+  std::mutex lock;
+  std::condition_variable wake;
+  std::deque<Task> tasks;
+  std::vector<Task> results;
+  std::atomic<bool> have_results;
+  bool stopping;
+  int notify[2]; // pipe, readable while there are results
+  std::thread io;
+
+  explicit FileTable(bool map = true, BlockCache* block_cache = nullptr);
+  ~FileTable();
+  FileTable(const FileTable&) = delete;
+  FileTable& operator=(const FileTable&) = delete;
+
+  /* open `path` for reading, or take another reference to it.
+   * NO_FILE if it cannot be opened, errno tells why */
+  FileId open(const std::string& path, bool netascii = false);
+  /* drop a reference, the file is closed with the last one */
+  void release(FileId id);
+
+  /* read up to `len` bytes at `offset`, short only at the end of the file.
+   * Netascii is translated on the spot, from the mark before `offset` */
+  BetterSocket::SSize read(FileId id,
+                           uint64_t offset,
+                           void* buf,
+                           std::size_t len);
+  /* `len` bytes at `offset` inside the mapping, empty if the file is not
+   * mapped. Valid until the file's last reference is released */
+  std::span<const std::byte> mapped(FileId id,
+                                    uint64_t offset,
+                                    std::size_t len) const;
+  /* whether `id` is sent from chunks rather than from a mapping, which a
+   * netascii file always is */
+  bool chunked(FileId id) const;
+  /* how many of the `count` blocks from `block` on of a `blksize` transfer
+   * are in the file's chunks already. The chunks missing are handed to the
+   * I/O thread, and so are those of the `ahead` bytes after the blocks.
+   * `reading`: the first block missing is being read */
+  uint32_t staged(FileId id,
+                  uint64_t block,
+                  uint32_t count,
+                  uint32_t blksize,
+                  uint64_t ahead,
+                  bool& reading);
+  /* payload of DATA block `block` of a `blksize` transfer, from the
+   * file's shared chunks. Empty if the file is mapped, or the chunk was
+   * not read (yet): `read()` it then. Valid until two `tick()`s
+   * later, long enough to send it even with io_uring */
+  std::span<const std::byte> buffered(FileId id,
+                                      uint64_t block,
+                                      uint32_t blksize);
+  /* readable when the I/O thread has results, -1 without a thread */
+  int notifier() const;
+  /* take in the chunks read since the last call */
+  void completed();
+  /* the reactor went through one more loop iteration */
+  void tick();
+  /* the sends queued so far were made, `issued` zero copy sends of which
+   * the first `done` completed, see Multiplexer::zerocopy_ticket(). Drops
+   * the retired buffers no send can read anymore */
+  void reap(uint64_t issued, uint64_t done);
+  /* look the file up in the block cache for transfers using `blksize`.
+   * On a miss the I/O thread loads it there, the transfers are sent from
+   * the file until it is in */
+  void prepare(FileId id, uint32_t blksize);
+  /* DATA packet `block` of a `blksize` transfer, header included, from the
+   * block cache. Empty if the file is not cached at that block size */
+  std::span<const std::byte> cached(FileId id,
+                                    uint64_t block,
+                                    uint32_t blksize) const;
+  /* bytes the transfers send, UNKNOWN_SIZE for a netascii text whose end
+   * was not translated yet */
+  uint64_t size(FileId id) const;
+  int descriptor(FileId id) const;
+
+private:
+  std::size_t fill(FileId id, uint64_t first, uint32_t blksize);
+  void recycle(FileId id);
+  void submit(Task task);
+  void settle(Task& task);
+  void run();
+  void execute(Task& task);
+};
+
+#endif
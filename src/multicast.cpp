@@ -0,0 +1,128 @@
+#include <algorithm>
+#include <cstring>
+
+#include "multicast.hpp"
+
+namespace BS = BetterSocket;
+
+void
+Multicast::fill(uint32_t first, std::size_t count, BS::in_port_t port)
+{
+  groups.reserve(groups.size() + count);
+  for (std::size_t i = 0; i < count; i++) {
+    Endpoint e{};
+    e.addr.v4.sin_family = AF_INET;
+    e.addr.v4.sin_port = htons(port);
+    e.addr.v4.sin_addr.s_addr = htonl(first + static_cast<uint32_t>(i));
+    groups.push_back(e);
+    sessions.push_back(
+      { ConnectionTable::NO_CONNECTION, 0, FileTable::NO_FILE, 0, 0, {} });
+  }
+}
+
+// sessions are few, a reactor holds one per group at most: a scan is as
+// fast as an index and needs no upkeep
+Multicast::SessionId
+Multicast::find(FileTable::FileId file, uint16_t blksize) const
+{
+  for (SessionId s = 0; s < sessions.size(); s++)
+    if (sessions[s].data != ConnectionTable::NO_CONNECTION &&
+        sessions[s].file == file && sessions[s].blksize == blksize)
+      return s;
+  return NO_SESSION;
+}
+
+Multicast::SessionId
+Multicast::vacant() const
+{
+  for (SessionId s = 0; s < sessions.size(); s++)
+    if (sessions[s].data == ConnectionTable::NO_CONNECTION)
+      return s;
+  return NO_SESSION;
+}
+
+void
+Multicast::open(SessionId s,
+                Handle data,
+                BS::in_port_t local,
+                FileTable::FileId file,
+                uint16_t blksize,
+                const Member& master)
+{
+  auto& session = sessions[s];
+  session.data = data;
+  session.local = local;
+  session.file = file;
+  session.blksize = blksize;
+  session.sent = 0;
+  session.members.assign(1, master);
+}
+
+void
+Multicast::close(SessionId s)
+{
+  auto& session = sessions[s];
+  session.data = ConnectionTable::NO_CONNECTION;
+  session.file = FileTable::NO_FILE;
+  session.members.clear();
+}
+
+Multicast::SessionId
+Multicast::of(Handle data) const
+{
+  for (SessionId s = 0; s < sessions.size(); s++)
+    if (sessions[s].data == data)
+      return s;
+  return NO_SESSION;
+}
+
+Multicast::SessionId
+Multicast::at(BS::in_port_t local) const
+{
+  for (SessionId s = 0; s < sessions.size(); s++)
+    if (sessions[s].data != ConnectionTable::NO_CONNECTION &&
+        sessions[s].local == local)
+      return s;
+  return NO_SESSION;
+}
+
+TransferKey
+Multicast::key(SessionId s, BS::in_port_t local) const
+{
+  PeerKey peer{};
+  peer.family = BS::IpVersion::v4;
+  std::memcpy(
+    peer.addr.data(), &groups[s].addr.v4.sin_addr, sizeof(in_addr));
+  peer.port = groups[s].addr.v4.sin_port;
+  return { peer, local };
+}
+
+Multicast::Member*
+Multicast::member(SessionId s, const PeerKey& key)
+{
+  auto& members = sessions[s].members;
+  auto it = std::find_if(members.begin(), members.end(), [&](const Member& m) {
+    return m.key == key;
+  });
+  return it == members.end() ? nullptr : &*it;
+}
+
+void
+Multicast::remove(SessionId s, const PeerKey& key)
+{
+  std::erase_if(sessions[s].members,
+                [&](const Member& m) { return m.key == key; });
+}
+
+std::size_t
+Multicast::size() const
+{
+  return groups.size();
+}
+
+bool
+Multicast::isGroup(const Endpoint& e)
+{
+  return e.addr.v4.sin_family == AF_INET &&
+         IN_MULTICAST(ntohl(e.addr.v4.sin_addr.s_addr));
+}
@@ -0,0 +1,92 @@
+#ifndef AVANTEE_MULTICAST_H
+#define AVANTEE_MULTICAST_H
+
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <vector>
+
+#include "connection_table.hpp"
+#include "file_table.hpp"
+#include "socket/socket.hpp"
+#include "tftp.hpp"
+
+/* The multicast transfers (RFC 2090) of one reactor.
+ *
+ * A session sends a file to a group address once, however many clients
+ * read it. It is a transfer of its own, `data`, whose peer is the group.
+ * Clients asking for the same file with the same block size join it as
+ * members. Only the first member, the master client, acknowledges; the
+ * others listen and wait for their turn. Once the master has the whole
+ * file, or stops answering, the next member becomes the master and starts
+ * from the first block it is missing, so a member that joined late gets
+ * the blocks sent before it joined. The session ends with its last member.
+ *
+ * Every session has a group address of its own, taken from the reactor's
+ * share of the configured range, all on the same port: a client only
+ * receives the file it joined for. This is bookkeeping only, the reactor
+ * does the sending.
+ */
+struct Multicast
+{
+  using Handle = ConnectionTable::Handle;
+  using SessionId = uint32_t;
+  static constexpr SessionId NO_SESSION = UINT32_MAX;
+
+  struct Member
+  {
+    Endpoint peer;   // where its OACK is sent
+    PeerKey key;     // where its ACKs come from
+    uint8_t options; // `TransferOptions::present` bits acknowledged to it
+  };
+
+  struct Session
+  {
+    Handle data; // the transfer sending to the group, NO_CONNECTION: free
+    BetterSocket::in_port_t local; // its TID port, members send there
+    FileTable::FileId file;
+    uint16_t blksize;
+    uint32_t sent;              // highest block sent to the group so far
+    std::deque<Member> members; // the master first
+  };
+
+  std::vector<Endpoint> groups; // per session
+  std::vector<Session> sessions;
+
+  /* `count` groups from address `first` on (host byte order), all on
+   * `port` */
+  void fill(uint32_t first, std::size_t count, BetterSocket::in_port_t port);
+
+  /* the session sending `file` in blocks of `blksize`, NO_SESSION if none
+   * is */
+  SessionId find(FileTable::FileId file, uint16_t blksize) const;
+  /* a free session, NO_SESSION if all groups are in use. It stays free
+   * until `open()` */
+  SessionId vacant() const;
+  void open(SessionId s,
+            Handle data,
+            BetterSocket::in_port_t local,
+            FileTable::FileId file,
+            uint16_t blksize,
+            const Member& master);
+  void close(SessionId s);
+
+  /* the session whose transfer is `data`, NO_SESSION if it is a unicast
+   * transfer */
+  SessionId of(Handle data) const;
+  /* the session served from TID port `local`, NO_SESSION if none is */
+  SessionId at(BetterSocket::in_port_t local) const;
+  /* what the transfer of session `s` is registered under: no client has
+   * a multicast address */
+  TransferKey key(SessionId s, BetterSocket::in_port_t local) const;
+
+  /* the member of `s` sending from `key`, nullptr if there is none */
+  Member* member(SessionId s, const PeerKey& key);
+  void remove(SessionId s, const PeerKey& key);
+
+  /* groups configured, 0 without multicast */
+  std::size_t size() const;
+  static bool isGroup(const Endpoint& e);
+};
+
+#endif
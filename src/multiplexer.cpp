@@ -1,4 +1,7 @@
+#include <algorithm>
+#include <cerrno>
 #include <cstdio>
+#include <cstring>
 #include <exception>
 #include <utility>
 
@@ -6,58 +9,1003 @@
 #include "socket/generic_sockets.hpp"
 
 #define SCAST(Type, e) static_cast<Type>(e)
+#define RCAST(Type, e) reinterpret_cast<Type>(e)
 #define TU(e) std::to_underlying(e)
 
-Multiplexer::Multiplexer()
-  : fdcount{ 0 }
+#if defined(AVANTEE_HAVE_IO_URING)
+/* user_data layout: kind in the top byte, then a 24 bit generation so stale
+ * completions of an unwatched (and maybe reused) fd can be told apart, and
+ * the fd or send slot in the low 32 bits */
+enum class UringKind : uint64_t
+{
+  poll = 1,
+  recv = 2,
+  send = 3,
+  cancel = 4,
+};
+
+static uint64_t
+uring_data(UringKind k, uint32_t generation, uint32_t low)
+{
+  return (TU(k) << 56) | ((SCAST(uint64_t, generation) & 0xffffff) << 32) |
+         low;
+}
+#endif
+
+Multiplexer::Multiplexer(Backend preferred, BetterSocket::Size datagram_size)
+  : backend{ preferred }
+  , fdcount{ 0 }
   , poll_over{}
+  , watch_index{}
+  , readycount{ 0 }
+  , ready_over{}
+  , datagram_capacity{ datagram_size }
+  , datagram_over{}
+  , datagram_arena{}
+  , arena_used{ 0 }
+  , batch_io{ true }
+#if defined(AVANTEE_HAVE_MMSG)
+  , send_queue{}
+  , send_arena{}
+  , send_msgs{}
+  , send_iov{}
+  , recv_msgs{}
+  , recv_iov{}
+  , recv_names{}
+  , segment_offload{ false }
+  , gso_refused{ SIZE_MAX }
+  , send_first{}
+  , send_control{}
+  , send_zerocopy{}
+  , zerocopy_pending{}
+  , zerocopy_first{ 0 }
+  , recv_control{}
+#endif
+#if defined(AVANTEE_HAVE_EPOLL)
+  , epoll_fd{ -1 }
+  , epoll_over{}
+#endif
+#if defined(AVANTEE_HAVE_IO_URING)
+  , ring{}
+  , uring_generation{ 0 }
+  , uring_recv_msg{}
+  , uring_watches{}
+  , uring_rearm{}
+  , uring_consumed{}
+  , uring_sends{}
+  , uring_free_sends{}
+#endif
+{
+#if defined(AVANTEE_HAVE_IO_URING)
+  if (backend == Backend::uring && !uring_init()) {
+    std::perror("multiplexer: io_uring setup, falling back to epoll()");
+    backend = Backend::epoll;
+  }
+#else
+  if (backend == Backend::uring)
+    backend = default_backend();
+#endif
+
+#if defined(AVANTEE_HAVE_EPOLL)
+  if (backend == Backend::epoll) {
+    epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (epoll_fd == -1) {
+      std::perror("multiplexer: epoll_create1(), falling back to poll()");
+      backend = Backend::poll;
+    }
+  }
+#else
+  backend = Backend::poll;
+#endif
+
+  if (backend != Backend::uring) {
+    datagram_arena.resize(TU(constants::DATAGRAM_BATCH) * datagram_capacity);
+#if defined(AVANTEE_HAVE_MMSG)
+    recv_msgs.resize(TU(constants::DATAGRAM_BATCH));
+    recv_iov.resize(TU(constants::DATAGRAM_BATCH));
+    recv_names.resize(TU(constants::DATAGRAM_BATCH));
+    recv_control.resize(TU(constants::DATAGRAM_BATCH));
+#endif
+  }
+}
+
+Multiplexer::~Multiplexer()
+{
+#if defined(AVANTEE_HAVE_EPOLL)
+  if (epoll_fd != -1)
+    close(epoll_fd);
+#endif
+}
+
+#if defined(AVANTEE_HAVE_EPOLL)
+static void
+epoll_control(int epfd, int op, BetterSocket::GSocket socket, uint32_t events)
+{
+  struct epoll_event ev = {};
+  ev.events = events;
+  ev.data.fd = socket;
+  if (epoll_ctl(epfd, op, socket, &ev) == -1) {
+    std::perror("mutiplexer -> epoll_ctl()");
+    std::terminate();
+  }
+}
+#endif
+
+Multiplexer::WatchSlot&
+Multiplexer::index_of(BetterSocket::GSocket socket)
 {
-  poll_over.fill(BetterSocket::GPollfd(-1, 0, 0));
+  // descriptors are small integers handed out lowest-first, so a flat
+  // table indexed by them stays dense
+  auto i = SCAST(BetterSocket::Size, socket);
+  if (i >= watch_index.size())
+    watch_index.resize(i + 1 > 2 * watch_index.size() ? i + 1
+                                                     : 2 * watch_index.size(),
+                       { NO_SLOT, false, false, false, 0 });
+  return watch_index[i];
+}
+
+bool
+Multiplexer::is_datagram_socket(BetterSocket::GSocket socket) const
+{
+  auto i = SCAST(BetterSocket::Size, socket);
+  return i < watch_index.size() && watch_index[i].datagram;
+}
+
+bool
+Multiplexer::is_zerocopy_socket(BetterSocket::GSocket socket) const
+{
+  auto i = SCAST(BetterSocket::Size, socket);
+  return i < watch_index.size() && watch_index[i].zerocopy;
 }
 
 void
 Multiplexer::watch(BetterSocket::GSocket socket, Events ev)
 {
-  poll_over[fdcount].fd = socket;
-  poll_over[fdcount++].events = std::to_underlying(ev);
+  ready_over.resize(fdcount + 1);
+
+#if defined(AVANTEE_HAVE_IO_URING)
+  if (backend == Backend::uring) {
+    UringWatch w{ uring_generation++, SCAST(uint32_t, TU(ev)), false };
+    uring_watches[socket] = w;
+    uring_arm(socket, w);
+    fdcount++;
+    return;
+  }
+#endif
+
+#if defined(AVANTEE_HAVE_EPOLL)
+  if (backend == Backend::epoll) {
+    epoll_control(epoll_fd, EPOLL_CTL_ADD, socket, SCAST(uint32_t, TU(ev)));
+    fdcount++;
+    epoll_over.resize(fdcount);
+    return;
+  }
+#endif
+  index_of(socket).slot = SCAST(uint32_t, poll_over.size());
+  poll_over.push_back(BetterSocket::GPollfd(socket, TU(ev), 0));
+  fdcount++;
+}
+
+void
+Multiplexer::receive_datagrams(BetterSocket::GSocket socket, bool coalesced)
+{
+#if defined(AVANTEE_HAVE_IO_URING)
+  if (backend == Backend::uring) {
+    UringWatch w{ uring_generation++, 0, true };
+    uring_watches[socket] = w;
+    uring_arm(socket, w);
+    fdcount++;
+    return;
+  }
+#endif
+  auto& index = index_of(socket);
+  index.datagram = true;
+  index.coalesced = coalesced;
+  watch(socket, Events::input);
+}
+
+void
+Multiplexer::zerocopy_sends(BetterSocket::GSocket socket)
+{
+#if defined(AVANTEE_HAVE_MMSG)
+  if (backend != Backend::uring)
+    index_of(socket).zerocopy = true;
+#else
+  (void)socket;
+#endif
+}
+
+uint64_t
+Multiplexer::zerocopy_ticket() const
+{
+#if defined(AVANTEE_HAVE_MMSG)
+  return zerocopy_first + zerocopy_pending.size();
+#else
+  return 0;
+#endif
+}
+
+uint64_t
+Multiplexer::zerocopy_done() const
+{
+#if defined(AVANTEE_HAVE_MMSG)
+  return zerocopy_first;
+#else
+  return 0;
+#endif
 }
 
 void
 Multiplexer::unwatch(BetterSocket::GSocket socket)
 {
-  for (BetterSocket::Size i = 0; i < fdcount; i++) {
-    if (poll_over[i].fd == socket) {
-      // if only watching over one socket, then ignore.
-      // otherwise copy over it
-      if (i == 0)
-        poll_over[i].fd = -1; // poll ignores -1 fds
+  // a socket closed after this call may show up in the ready set of the
+  // current iteration, drop it so the caller does not act on a stale fd.
+  // This is bounded by what one poll_io() returned, not by the watch count.
+  for (BetterSocket::Size i = 0; i < readycount; i++) {
+    if (ready_over[i].fd == socket)
+      ready_over[i].revents = 0;
+  }
+  for (auto& dgram : datagram_over) {
+    if (dgram.socket == socket)
+      dgram.socket = BAD_SOCKET;
+  }
 
-      poll_over[i] = poll_over[fdcount - 1];
-      fdcount--;
-    }
+#if defined(AVANTEE_HAVE_IO_URING)
+  if (backend == Backend::uring) {
+    auto found = uring_watches.find(socket);
+    if (found == uring_watches.end())
+      return;
+    uring_cancel(socket, found->second);
+    uring_watches.erase(found);
+    fdcount--;
+    return;
+  }
+#endif
+
+  auto& index = index_of(socket);
+  index.datagram = false;
+  index.coalesced = false;
+  index.zerocopy = false;
+
+#if defined(AVANTEE_HAVE_EPOLL)
+  if (backend == Backend::epoll) {
+    epoll_control(epoll_fd, EPOLL_CTL_DEL, socket, 0);
+    fdcount--;
+    return;
   }
+#endif
+  if (index.slot == NO_SLOT)
+    return;
+
+  // move the last entry into the hole and shrink
+  uint32_t hole = index.slot;
+  index.slot = NO_SLOT;
+  if (hole != poll_over.size() - 1) {
+    poll_over[hole] = poll_over.back();
+    index_of(poll_over[hole].fd).slot = hole;
+  }
+  poll_over.pop_back();
+  fdcount--;
 }
 
 void
 Multiplexer::update_fd_event(BetterSocket::GSocket socket, Events ev)
 {
-  for (BetterSocket::Size i = 0; i < fdcount; i++) {
-    if (poll_over[i].fd == socket)
-      poll_over[i].events = std::to_underlying(ev);
+#if defined(AVANTEE_HAVE_IO_URING)
+  if (backend == Backend::uring) {
+    auto found = uring_watches.find(socket);
+    if (found == uring_watches.end() || found->second.datagram)
+      return;
+    // replace the armed poll with one for the new events
+    uring_cancel(socket, found->second);
+    found->second.generation = uring_generation++;
+    found->second.events = SCAST(uint32_t, TU(ev));
+    uring_arm(socket, found->second);
+    return;
+  }
+#endif
+#if defined(AVANTEE_HAVE_EPOLL)
+  if (backend == Backend::epoll) {
+    epoll_control(epoll_fd, EPOLL_CTL_MOD, socket, SCAST(uint32_t, TU(ev)));
+    return;
+  }
+#endif
+  auto& index = index_of(socket);
+  if (index.slot != NO_SLOT)
+    poll_over[index.slot].events = std::to_underlying(ev);
+}
+
+void
+Multiplexer::send_to(BetterSocket::GSocket socket,
+                     const void* buf,
+                     BetterSocket::Size len,
+                     BetterSocket::SockaddrWrapper& dest)
+{
+  send_to(socket,
+          buf,
+          len,
+          RCAST(const sockaddr*, dest.m_getPtrToStorage()),
+          dest.sockaddrsz);
+}
+
+void
+Multiplexer::send_to(BetterSocket::GSocket socket,
+                     const void* buf,
+                     BetterSocket::Size len,
+                     const sockaddr* dest,
+                     socklen_t dest_len)
+{
+#if defined(AVANTEE_HAVE_IO_URING)
+  if (backend == Backend::uring) {
+    // the caller may reuse `buf` right away, the kernel reads it later
+    uring_send(socket, { SCAST(const std::byte*, buf), len }, {}, dest, dest_len);
+    return;
+  }
+#endif
+#if defined(AVANTEE_HAVE_MMSG)
+  if (batch_io) {
+    queue_send(
+      socket, { SCAST(const std::byte*, buf), len }, {}, dest, dest_len);
+    return;
+  }
+#endif
+
+  BetterSocket::SSize r =
+    sendto(socket,
+#ifdef ICY_ON_WINDOWS
+           reinterpret_cast<const char*>(buf),
+#else
+           buf,
+#endif
+           len,
+           0,
+           dest,
+           dest_len);
+  stats.calls.fetch_add(1, std::memory_order_relaxed);
+  // datagrams may be dropped anyway, the peer retransmits
+  if (r == SOCK_ERR)
+    std::perror("mutiplexer::send_to -> sendto()");
+  else
+    stats.sent.fetch_add(1, std::memory_order_relaxed);
+}
+
+#if !defined(ICY_ON_WINDOWS)
+void
+Multiplexer::send_parts(BetterSocket::GSocket socket,
+                        std::span<const std::byte> header,
+                        std::span<const std::byte> body,
+                        const sockaddr* dest,
+                        socklen_t dest_len,
+                        bool kept)
+{
+#if defined(AVANTEE_HAVE_IO_URING)
+  if (backend == Backend::uring) {
+    uring_send(socket, header, body, dest, dest_len);
+    return;
+  }
+#endif
+#if defined(AVANTEE_HAVE_MMSG)
+  if (batch_io) {
+    queue_send(socket, header, body, dest, dest_len, kept);
+    return;
+  }
+#else
+  (void)kept;
+#endif
+
+  struct iovec iov[2] = {
+    { const_cast<std::byte*>(header.data()), header.size() },
+    { const_cast<std::byte*>(body.data()), body.size() },
+  };
+  struct msghdr msg = {};
+  msg.msg_name = const_cast<sockaddr*>(dest);
+  msg.msg_namelen = dest_len;
+  msg.msg_iov = iov;
+  msg.msg_iovlen = body.empty() ? 1 : 2;
+
+  stats.calls.fetch_add(1, std::memory_order_relaxed);
+  // datagrams may be dropped anyway, the peer retransmits
+  if (sendmsg(socket, &msg, 0) == SOCK_ERR)
+    std::perror("mutiplexer::send_parts -> sendmsg()");
+  else
+    stats.sent.fetch_add(1, std::memory_order_relaxed);
+}
+#endif
+
+#if defined(AVANTEE_HAVE_MMSG)
+// `copied` is copied now, `referenced` is read when the queue is flushed
+void
+Multiplexer::queue_send(BetterSocket::GSocket socket,
+                        std::span<const std::byte> copied,
+                        std::span<const std::byte> referenced,
+                        const sockaddr* dest,
+                        socklen_t dest_len,
+                        bool kept)
+{
+  QueuedSend q;
+  q.socket = socket;
+  q.copied = send_arena.size();
+  q.copied_len = copied.size();
+  q.referenced = referenced;
+  std::memcpy(&q.dest, dest, dest_len);
+  q.dest_len = dest_len;
+  q.kept = kept;
+  send_arena.insert(send_arena.end(), copied.begin(), copied.end());
+  send_queue.push_back(q);
+}
+
+static std::size_t
+queued_size(const Multiplexer::QueuedSend& q)
+{
+  return q.copied_len + q.referenced.size();
+}
+
+static bool
+same_peer(const Multiplexer::QueuedSend& a, const Multiplexer::QueuedSend& b)
+{
+  return a.socket == b.socket && a.dest_len == b.dest_len &&
+         std::memcmp(&a.dest, &b.dest, a.dest_len) == 0;
+}
+
+/* send everything queued since the last flush, in order, with one
+ * sendmmsg() per run of datagrams on the same socket: a window of DATA, or
+ * every transfer's packets when they share the listener. With
+ * `segment_offload` a run of equal datagrams to one peer is one message of
+ * that sendmmsg(), the kernel splits it */
+void
+Multiplexer::flush_sends()
+{
+  const auto n = send_queue.size();
+  if (n == 0)
+    return;
+  // the arena is done growing, its offsets can become pointers now. Each
+  // datagram takes two iovecs, a merged message spans theirs
+  send_iov.resize(2 * n);
+  for (std::size_t i = 0; i < n; i++) {
+    auto& q = send_queue[i];
+    send_iov[2 * i] = { send_arena.data() + q.copied, q.copied_len };
+    send_iov[2 * i + 1] = { const_cast<std::byte*>(q.referenced.data()),
+                            q.referenced.size() };
+  }
+
+  send_msgs.clear();
+  send_first.clear();
+  send_zerocopy.clear();
+  send_control.resize(n);
+  for (std::size_t i = 0; i < n;) {
+    auto& q = send_queue[i];
+    const auto size = queued_size(q);
+    std::size_t count = 1;
+#if defined(AVANTEE_HAVE_UDP_OFFLOAD)
+    // only the last datagram of a message may be shorter
+    if (segment_offload && size < gso_refused) {
+      auto bytes = size;
+      while (i + count < n && count < TU(constants::GSO_SEGMENTS) &&
+             queued_size(send_queue[i + count - 1]) == size) {
+        auto& next = send_queue[i + count];
+        auto len = queued_size(next);
+        if (len > size || bytes + len > TU(constants::GSO_BYTES) ||
+            !same_peer(q, next))
+          break;
+        bytes += len;
+        count++;
+      }
+    }
+#endif
+
+    struct mmsghdr m = {};
+    m.msg_hdr.msg_name = &q.dest;
+    m.msg_hdr.msg_namelen = q.dest_len;
+    m.msg_hdr.msg_iov = &send_iov[2 * i];
+    m.msg_hdr.msg_iovlen =
+      count == 1 && q.referenced.empty() ? 1 : 2 * count;
+#if defined(AVANTEE_HAVE_UDP_OFFLOAD)
+    if (count > 1) {
+      auto& control = send_control[send_msgs.size()];
+      m.msg_hdr.msg_control = control.buf;
+      m.msg_hdr.msg_controllen = CMSG_SPACE(sizeof(uint16_t));
+      auto* cmsg = CMSG_FIRSTHDR(&m.msg_hdr);
+      cmsg->cmsg_level = SOL_UDP;
+      cmsg->cmsg_type = UDP_SEGMENT;
+      cmsg->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+      auto segment = SCAST(uint16_t, size);
+      std::memcpy(CMSG_DATA(cmsg), &segment, sizeof(segment));
+    }
+#endif
+    // without a copy only if all of it outlives the send and the pages
+    // pinned are worth it
+    bool zerocopy = is_zerocopy_socket(q.socket);
+    std::size_t bytes = 0;
+    for (auto d = i; d < i + count; d++) {
+      auto& part = send_queue[d];
+      zerocopy = zerocopy && part.kept && part.copied_len == 0;
+      bytes += queued_size(part);
+    }
+    send_msgs.push_back(m);
+    send_first.push_back(i);
+    send_zerocopy.push_back(zerocopy && bytes >= BetterSocket::ZERO_COPY_MIN);
+    i += count;
+  }
+  send_first.push_back(n);
+
+  const auto messages = send_msgs.size();
+  for (std::size_t i = 0; i < messages;) {
+    auto socket = send_queue[send_first[i]].socket;
+    auto zerocopy = send_zerocopy[i];
+    std::size_t end = i;
+    while (end < messages && send_queue[send_first[end]].socket == socket &&
+           send_zerocopy[end] == zerocopy)
+      end++;
+    while (i < end) {
+      int r = sendmmsg(socket,
+                       &send_msgs[i],
+                       SCAST(unsigned, end - i),
+                       zerocopy ? MSG_ZEROCOPY : 0);
+      stats.calls.fetch_add(1, std::memory_order_relaxed);
+      if (r == SOCK_ERR && zerocopy && errno == ENOBUFS) {
+        // too many sends wait for completion already, copy these
+        zerocopy = false;
+        continue;
+      }
+      if (r == SOCK_ERR) {
+        auto count = send_first[i + 1] - send_first[i];
+        // the device cannot checksum what the kernel splits, or the
+        // segments exceed its MTU: this size goes out one by one from now
+        if (count > 1 && (errno == EIO || errno == EINVAL)) {
+          gso_refused =
+            std::min(gso_refused, queued_size(send_queue[send_first[i]]));
+          send_each(send_first[i], count);
+        } else {
+          // dropped like a datagram on the way, the peer retransmits
+          std::perror("mutiplexer::poll_io -> sendmmsg()");
+        }
+        i++;
+        continue;
+      }
+      auto done = i + SCAST(std::size_t, r);
+      stats.sent.fetch_add(send_first[done] - send_first[i],
+                           std::memory_order_relaxed);
+      for (auto m = i; m < done; m++)
+        if (send_first[m + 1] - send_first[m] > 1)
+          stats.segmented.fetch_add(send_first[m + 1] - send_first[m],
+                                    std::memory_order_relaxed);
+      if (zerocopy) {
+        // the kernel numbers them per socket, in the order they were sent
+        auto& index = index_of(socket);
+        for (auto m = i; m < done; m++)
+          zerocopy_pending.push_back({ socket, index.zerocopy_next++, false });
+        stats.zerocopy.fetch_add(done - i, std::memory_order_relaxed);
+      }
+      i += SCAST(std::size_t, r);
+    }
+  }
+  send_queue.clear();
+  send_arena.clear();
+}
+
+/* mark the zero copy sends `socket` reports as completed, and retire the
+ * oldest while they are. True if it had reports */
+bool
+Multiplexer::reap_zerocopy(BetterSocket::GSocket socket)
+{
+  if (zerocopy_pending.empty())
+    return false;
+  BetterSocket::ZeroCopyRange range;
+  bool reaped = false;
+  while (BetterSocket::readZeroCopyCompletion(socket, range)) {
+    reaped = true;
+    uint32_t count = range.last - range.first + 1;
+    for (auto& z : zerocopy_pending)
+      if (z.socket == socket && z.id - range.first < count)
+        z.done = true;
+    if (range.copied) {
+      // pinning pages the kernel copies anyway only costs
+      stats.zerocopy_copied.fetch_add(count, std::memory_order_relaxed);
+      index_of(socket).zerocopy = false;
+    }
+  }
+  while (!zerocopy_pending.empty() && zerocopy_pending.front().done) {
+    zerocopy_pending.pop_front();
+    zerocopy_first++;
+  }
+  return reaped;
+}
+
+// queued datagrams a merged message could not send, one sendmsg() each
+void
+Multiplexer::send_each(std::size_t first, std::size_t count)
+{
+  for (auto i = first; i < first + count; i++) {
+    auto& q = send_queue[i];
+    struct msghdr msg = {};
+    msg.msg_name = &q.dest;
+    msg.msg_namelen = q.dest_len;
+    msg.msg_iov = &send_iov[2 * i];
+    msg.msg_iovlen = 2;
+    stats.calls.fetch_add(1, std::memory_order_relaxed);
+    if (sendmsg(q.socket, &msg, 0) == SOCK_ERR)
+      std::perror("mutiplexer::poll_io -> sendmsg()");
+    else
+      stats.sent.fetch_add(1, std::memory_order_relaxed);
   }
 }
 
+// as many datagrams as there are free arena slots, in one system call
 void
-Multiplexer::poll_io()
+Multiplexer::read_batch(BetterSocket::GSocket socket)
 {
-  int polled = BetterSocket::gPoll(
-    poll_over.data(), fdcount, SCAST(int, constants::POLL_FOR));
+  const auto first = arena_used;
+  const auto room = TU(constants::DATAGRAM_BATCH) - first;
+  if (room == 0)
+    return; // out of buffers, the rest is read on the next iteration
+
+  const bool coalesced = watch_index[SCAST(std::size_t, socket)].coalesced;
+  for (std::size_t i = 0; i < room; i++) {
+    recv_iov[i] = { datagram_arena.data() + (first + i) * datagram_capacity,
+                    datagram_capacity };
+    recv_msgs[i] = {};
+    recv_msgs[i].msg_hdr.msg_name = &recv_names[i];
+    recv_msgs[i].msg_hdr.msg_namelen = sizeof(sockaddr_storage);
+    recv_msgs[i].msg_hdr.msg_iov = &recv_iov[i];
+    recv_msgs[i].msg_hdr.msg_iovlen = 1;
+    if (coalesced) {
+      recv_msgs[i].msg_hdr.msg_control = recv_control[i].buf;
+      recv_msgs[i].msg_hdr.msg_controllen = sizeof(recv_control[i].buf);
+    }
+  }
+  int r = recvmmsg(
+    socket, recv_msgs.data(), SCAST(unsigned, room), MSG_DONTWAIT, nullptr);
+  stats.calls.fetch_add(1, std::memory_order_relaxed);
+  if (r == SOCK_ERR) {
+    if (errno != EAGAIN && errno != EWOULDBLOCK)
+      std::perror("mutiplexer::poll_io -> recvmmsg()");
+    return;
+  }
+
+  arena_used += SCAST(BetterSocket::Size, r);
+  for (int i = 0; i < r; i++) {
+    auto& hdr = recv_msgs[i].msg_hdr;
+    auto* buf = SCAST(std::byte*, recv_iov[i].iov_base);
+    std::size_t len = recv_msgs[i].msg_len;
+    std::size_t segment = len;
+#if defined(AVANTEE_HAVE_UDP_OFFLOAD)
+    // a coalesced buffer cut short would lose datagrams in the middle
+    if (coalesced && (hdr.msg_flags & MSG_TRUNC))
+      continue;
+    if (coalesced)
+      for (auto* cmsg = CMSG_FIRSTHDR(&hdr); cmsg != nullptr;
+           cmsg = CMSG_NXTHDR(&hdr, cmsg))
+        if (cmsg->cmsg_level == SOL_UDP && cmsg->cmsg_type == UDP_GRO) {
+          int size;
+          std::memcpy(&size, CMSG_DATA(cmsg), sizeof(size));
+          segment = size > 0 ? SCAST(std::size_t, size) : len;
+        }
+#endif
+    BetterSocket::SockaddrWrapper sender(recv_names[i], hdr.msg_namelen);
+    std::size_t at = 0;
+    do {
+      auto part = std::min(segment, len - at);
+      datagram_over.push_back({ socket, { buf + at, part }, sender });
+      stats.received.fetch_add(1, std::memory_order_relaxed);
+      at += part;
+    } while (at < len);
+    if (segment < len)
+      stats.coalesced.fetch_add((len + segment - 1) / segment,
+                                std::memory_order_relaxed);
+  }
+}
+#endif
+
+void
+Multiplexer::read_datagrams(BetterSocket::GSocket socket)
+{
+#if defined(AVANTEE_HAVE_MMSG)
+  // only a batch reads the sizes of coalesced datagrams
+  if (batch_io || watch_index[SCAST(std::size_t, socket)].coalesced) {
+    read_batch(socket);
+    return;
+  }
+#endif
+  for (unsigned long i = 0; i < TU(constants::DATAGRAM_BATCH); i++) {
+    BetterSocket::Size slot = arena_used;
+    if (slot == TU(constants::DATAGRAM_BATCH))
+      return; // out of buffers, the rest is read on the next iteration
+
+    std::byte* buf = datagram_arena.data() + slot * datagram_capacity;
+    sockaddr_storage sender;
+    socklen_t senderSz = sizeof(sender);
+    BetterSocket::SSize r = recvfrom(socket,
+#ifdef ICY_ON_WINDOWS
+                                     reinterpret_cast<char*>(buf),
+#else
+                                     buf,
+#endif
+                                     datagram_capacity,
+                                     MSG_DONTWAIT,
+                                     RCAST(sockaddr*, &sender),
+                                     &senderSz);
+    stats.calls.fetch_add(1, std::memory_order_relaxed);
+    if (r == SOCK_ERR) {
+      if (errno != EAGAIN && errno != EWOULDBLOCK)
+        std::perror("mutiplexer::poll_io -> recvfrom()");
+      return;
+    }
+    stats.received.fetch_add(1, std::memory_order_relaxed);
+    arena_used++;
+
+    datagram_over.push_back(
+      { socket,
+        { buf, SCAST(BetterSocket::Size, r) },
+        BetterSocket::SockaddrWrapper(sender, senderSz) });
+  }
+}
+
+void
+Multiplexer::poll_io(int timeout)
+{
+  readycount = 0;
+  datagram_over.clear();
+  arena_used = 0;
+
+#if defined(AVANTEE_HAVE_IO_URING)
+  if (backend == Backend::uring) {
+    uring_poll_io(timeout);
+    return;
+  }
+#endif
+#if defined(AVANTEE_HAVE_MMSG)
+  // what the last iteration sent goes out before we wait
+  flush_sends();
+#endif
+
+  // datagram sockets are drained here and kept out of the ready set, so
+  // are the completions of zero copy sends on their error queue
+  auto collect = [&](const BetterSocket::GPollfd& p) {
+#if defined(AVANTEE_HAVE_MMSG)
+    if ((p.revents & POLLERR) && reap_zerocopy(p.fd) && !(p.revents & POLLIN))
+      return;
+#endif
+    if (is_datagram_socket(p.fd) && (p.revents & POLLIN))
+      read_datagrams(p.fd);
+    else
+      ready_over[readycount++] = p;
+  };
+
+#if defined(AVANTEE_HAVE_EPOLL)
+  if (backend == Backend::epoll) {
+    int polled = epoll_wait(epoll_fd,
+                            epoll_over.data(),
+                            SCAST(int, std::max<BetterSocket::Size>(
+                                         epoll_over.size(), 1)),
+                            timeout);
+    if (polled == -1) {
+      if (errno == EINTR)
+        return;
+      std::perror("mutiplexer::poll_io -> epoll_wait()");
+      std::terminate();
+    }
+
+    // the kernel already handed us only the ready sockets
+    for (int i = 0; i < polled; i++) {
+      collect(BetterSocket::GPollfd(epoll_over[i].data.fd,
+                                    0,
+                                    SCAST(short, epoll_over[i].events)));
+    }
+    return;
+  }
+#endif
+
+  int polled = BetterSocket::gPoll(poll_over.data(), fdcount, timeout);
 
   if (polled == SOCK_ERR) {
+    if (errno == EINTR)
+      return;
     std::perror("mutiplexer::poll_io -> poll()");
     std::terminate();
   }
+
+  // stop as soon as every ready socket has been collected
+  int seen = 0;
+  for (BetterSocket::Size i = 0; i < fdcount && seen < polled; i++) {
+    if (poll_over[i].revents) {
+      seen++;
+      collect(poll_over[i]);
+    }
+  }
+}
+
+std::span<const BetterSocket::GPollfd>
+Multiplexer::ready() const
+{
+  return { ready_over.data(), readycount };
+}
+
+std::span<Multiplexer::Datagram>
+Multiplexer::datagrams()
+{
+  return datagram_over;
+}
+
+#if defined(AVANTEE_HAVE_IO_URING)
+bool
+Multiplexer::uring_init()
+{
+  if (!ring.setup(TU(constants::URING_ENTRIES)))
+    return false;
+  if (!ring.setup_buffers(TU(constants::URING_BUFFERS),
+                          SCAST(unsigned,
+                                datagram_capacity +
+                                  sizeof(struct io_uring_recvmsg_out) +
+                                  sizeof(sockaddr_storage)),
+                          TU(constants::URING_BUFFER_GROUP)))
+    return false;
+
+  uring_recv_msg.msg_namelen = sizeof(sockaddr_storage);
+  uring_recv_msg.msg_controllen = 0;
+  return true;
+}
+
+void
+Multiplexer::uring_arm(BetterSocket::GSocket socket, const UringWatch& w)
+{
+  struct io_uring_sqe* sqe = ring.get_sqe();
+  sqe->fd = socket;
+  if (w.datagram) {
+    // one submission keeps delivering datagrams into provided buffers
+    sqe->opcode = IORING_OP_RECVMSG;
+    sqe->addr = RCAST(uint64_t, &uring_recv_msg);
+    sqe->len = 1;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = TU(constants::URING_BUFFER_GROUP);
+    sqe->user_data =
+      uring_data(UringKind::recv, w.generation, SCAST(uint32_t, socket));
+  } else {
+    // one-shot poll re-armed after each completion keeps poll()'s level
+    // triggered behaviour
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->poll32_events = w.events;
+    sqe->user_data =
+      uring_data(UringKind::poll, w.generation, SCAST(uint32_t, socket));
+  }
+}
+
+void
+Multiplexer::uring_cancel(BetterSocket::GSocket socket, const UringWatch& w)
+{
+  struct io_uring_sqe* sqe = ring.get_sqe();
+  sqe->opcode = IORING_OP_ASYNC_CANCEL;
+  sqe->fd = -1;
+  sqe->addr = uring_data(w.datagram ? UringKind::recv : UringKind::poll,
+                         w.generation,
+                         SCAST(uint32_t, socket));
+  sqe->user_data = uring_data(UringKind::cancel, 0, 0);
+}
+
+// queue a sendmsg(): `copied` is copied into the slot, `referenced` is
+// handed to the kernel as it is
+void
+Multiplexer::uring_send(BetterSocket::GSocket socket,
+                        std::span<const std::byte> copied,
+                        std::span<const std::byte> referenced,
+                        const sockaddr* dest,
+                        socklen_t dest_len)
+{
+  uint32_t slot;
+  if (uring_free_sends.empty()) {
+    slot = SCAST(uint32_t, uring_sends.size());
+    uring_sends.emplace_back();
+  } else {
+    slot = uring_free_sends.back();
+    uring_free_sends.pop_back();
+  }
+
+  UringSend& s = uring_sends[slot];
+  s.payload.assign(copied.begin(), copied.end());
+  std::memcpy(&s.dest, dest, dest_len);
+  s.iov[0].iov_base = s.payload.data();
+  s.iov[0].iov_len = s.payload.size();
+  s.iov[1].iov_base = const_cast<std::byte*>(referenced.data());
+  s.iov[1].iov_len = referenced.size();
+  s.msg = {};
+  s.msg.msg_name = &s.dest;
+  s.msg.msg_namelen = dest_len;
+  s.msg.msg_iov = s.iov;
+  s.msg.msg_iovlen = referenced.empty() ? 1 : 2;
+
+  struct io_uring_sqe* sqe = ring.get_sqe();
+  sqe->opcode = IORING_OP_SENDMSG;
+  sqe->fd = socket;
+  sqe->addr = RCAST(uint64_t, &s.msg);
+  sqe->len = 1;
+  sqe->user_data = uring_data(UringKind::send, 0, slot);
+}
+
+void
+Multiplexer::uring_poll_io(int timeout)
+{
+  // hand back the buffers of the previous iteration's datagrams
+  for (auto bid : uring_consumed)
+    ring.recycle_buffer(bid);
+  if (!uring_consumed.empty())
+    ring.publish_buffers();
+  uring_consumed.clear();
+
+  for (auto socket : uring_rearm) {
+    auto found = uring_watches.find(socket);
+    if (found != uring_watches.end())
+      uring_arm(socket, found->second);
+  }
+  uring_rearm.clear();
+
+  // queued sends, re-arms and cancels all go to the kernel in this one call
+  if (ring.submit_and_wait(timeout) < 0) {
+    std::perror("mutiplexer::poll_io -> io_uring_enter()");
+    std::terminate();
+  }
+
+  ring.for_each_cqe([&](const struct io_uring_cqe& cqe) {
+    auto kind = SCAST(UringKind, cqe.user_data >> 56);
+    auto generation = SCAST(uint32_t, (cqe.user_data >> 32) & 0xffffff);
+    auto low = SCAST(uint32_t, cqe.user_data & 0xffffffff);
+
+    if (kind == UringKind::send) {
+      if (cqe.res < 0)
+        std::fprintf(stderr,
+                     "mutiplexer::poll_io -> sendmsg(): %s\n",
+                     std::strerror(-cqe.res));
+      uring_free_sends.push_back(low);
+      return;
+    }
+    if (kind != UringKind::poll && kind != UringKind::recv)
+      return;
+
+    auto socket = SCAST(BetterSocket::GSocket, low);
+    auto found = uring_watches.find(socket);
+    bool current = found != uring_watches.end() &&
+                   (found->second.generation & 0xffffff) == generation;
+
+    if (kind == UringKind::recv && (cqe.flags & IORING_CQE_F_BUFFER)) {
+      auto bid = SCAST(unsigned short, cqe.flags >> IORING_CQE_BUFFER_SHIFT);
+      uring_consumed.push_back(bid);
+
+      if (current && cqe.res >= 0) {
+        std::byte* buf = ring.buffer(bid);
+        auto* out = RCAST(struct io_uring_recvmsg_out*, buf);
+        std::byte* name = buf + sizeof(*out);
+        std::byte* payload = name + uring_recv_msg.msg_namelen;
+        BetterSocket::Size avail =
+          SCAST(BetterSocket::Size, cqe.res) - (payload - buf);
+        BetterSocket::Size len = out->payloadlen < avail ? out->payloadlen
+                                                         : avail;
+
+        sockaddr_storage sender = {};
+        std::memcpy(&sender,
+                    name,
+                    out->namelen < sizeof(sender) ? out->namelen
+                                                  : sizeof(sender));
+        datagram_over.push_back(
+          { socket,
+            { payload, len },
+            BetterSocket::SockaddrWrapper(sender, out->namelen) });
+      }
+    }
+
+    if (!current)
+      return; // completion of a cancelled or replaced watch
+
+    if (kind == UringKind::poll && cqe.res > 0 &&
+        readycount < ready_over.size()) {
+      ready_over[readycount++] = BetterSocket::GPollfd(
+        socket, SCAST(short, found->second.events), SCAST(short, cqe.res));
+    }
+
+    // the kernel dropped the request (one-shot poll, or out of buffers)
+    if (!(cqe.flags & IORING_CQE_F_MORE))
+      uring_rearm.push_back(socket);
+  });
 }
+#endif
 
 // overload definition
 unsigned long
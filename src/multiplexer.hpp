@@ -2,34 +2,208 @@
 #define AVANTEE_MULTIPLEXER_H
 
 #include <array>
+#include <atomic>
+#include <cstdint>
+#include <deque>
+#include <span>
+#include <unordered_map>
 #include <utility>
+#include <vector>
 
 #include "socket/generic_sockets.hpp"
+#include "socket/socket.hpp"
+#include "uring.hpp"
+
+#if defined(__linux__)
+#define AVANTEE_HAVE_EPOLL
+#include <sys/epoll.h>
+#define AVANTEE_HAVE_MMSG
+#include <netinet/udp.h>
+#if defined(UDP_SEGMENT) && defined(UDP_GRO)
+#define AVANTEE_HAVE_UDP_OFFLOAD
+#endif
+#endif
 
 #define TYPEOF(Value) __decltype(Value)
 
+/* datagrams moved by the poll and epoll backends of every multiplexer, and
+ * the system calls it took */
+struct IoStats
+{
+  std::atomic<uint64_t> calls{ 0 };
+  std::atomic<uint64_t> received{ 0 };
+  std::atomic<uint64_t> sent{ 0 };
+  std::atomic<uint64_t> segmented{ 0 }; // sent, in buffers the kernel split
+  std::atomic<uint64_t> coalesced{ 0 }; // received, in coalesced buffers
+  std::atomic<uint64_t> zerocopy{ 0 };  // messages sent with MSG_ZEROCOPY
+  std::atomic<uint64_t> zerocopy_copied{ 0 }; // of them, copied after all
+};
+
 struct Multiplexer
 {
+  inline static IoStats stats;
 
   enum class constants : unsigned long
   {
-    MAX_SERVER_CONNECTIONS = 64,
-    POLL_FOR = 0,
+    DATAGRAM_SIZE = 2048,  // default receive buffer size per datagram
+    DATAGRAM_BATCH = 32,   // datagrams read per ready socket with poll/epoll
+    GSO_SEGMENTS = 64,     // datagrams the kernel splits one send into
+    GSO_BYTES = 65507,     // at most, and their bytes: one IPv4 datagram
+    URING_ENTRIES = 256,   // submission queue depth
+    URING_BUFFERS = 256,   // provided receive buffers, power of two
+    URING_BUFFER_GROUP = 0,
+  };
+
+  /* which kernel interface is used to wait for I/O.
+   * `poll` is available everywhere and is used as the fallback when the
+   * preferred backend cannot be initialised. */
+  enum class Backend
+  {
+    poll,
+    epoll,
+    uring,
   };
 
+  /* a datagram received on a socket registered with `receive_datagrams()`.
+   * `payload` is only valid until the next `poll_io()` */
+  struct Datagram
+  {
+    BetterSocket::GSocket socket;
+    std::span<const std::byte> payload;
+    BetterSocket::SockaddrWrapper sender;
+  };
+
+  /* where a watched socket lives, indexed by the socket itself */
+  struct WatchSlot
+  {
+    uint32_t slot;  // position in `poll_over`, NO_SLOT if not watched
+    bool datagram;  // registered with `receive_datagrams()`
+    bool coalesced; // the kernel may hand over several datagrams at once
+    bool zerocopy;  // large messages are sent with MSG_ZEROCOPY
+    uint32_t zerocopy_next; // number the kernel gives the next one
+  };
+  static constexpr uint32_t NO_SLOT = UINT32_MAX;
+
+  Backend backend;
   BetterSocket::Size fdcount;
-  std::array<BetterSocket::GPollfd,
-             std::to_underlying(constants::MAX_SERVER_CONNECTIONS)>
-    poll_over;
+  /* dense array handed to poll(), grows as sockets are watched. Removal
+   * moves the last entry into the hole, `watch_index` finds it in O(1) */
+  std::vector<BetterSocket::GPollfd> poll_over;
+  std::vector<WatchSlot> watch_index;
+
+  /* sockets that had events during the last `poll_io()`, `revents` is set */
+  BetterSocket::Size readycount;
+  std::vector<BetterSocket::GPollfd> ready_over;
+
+  /* datagrams received during the last `poll_io()` */
+  BetterSocket::Size datagram_capacity;
+  std::vector<Datagram> datagram_over;
+  std::vector<std::byte> datagram_arena; // receive buffers for poll/epoll
+  BetterSocket::Size arena_used;         // of them, by the last `poll_io()`
+
+  /* poll and epoll: datagrams are read with one recvmmsg() per ready
+   * socket, and sends wait for the next `poll_io()` to go out with one
+   * sendmmsg() per socket, like io_uring batches them. False: a system
+   * call per datagram */
+  bool batch_io;
+#if defined(AVANTEE_HAVE_MMSG)
+  struct QueuedSend
+  {
+    BetterSocket::GSocket socket;
+    std::size_t copied; // offset of the copied bytes in `send_arena`
+    std::size_t copied_len;
+    std::span<const std::byte> referenced;
+    sockaddr_storage dest;
+    socklen_t dest_len;
+    bool kept; // `referenced` outlives the send, see `send_parts()`
+  };
+
+  /* a MSG_ZEROCOPY message the kernel may still read from */
+  struct ZeroCopySend
+  {
+    BetterSocket::GSocket socket;
+    uint32_t id; // its number on `socket`
+    bool done;
+  };
+
+  std::vector<QueuedSend> send_queue;
+  std::vector<std::byte> send_arena;
+  std::vector<struct mmsghdr> send_msgs; // built from the queue
+  std::vector<struct iovec> send_iov;
+  std::vector<struct mmsghdr> recv_msgs; // one per arena slot
+  std::vector<struct iovec> recv_iov;
+  std::vector<sockaddr_storage> recv_names;
+
+  /* with `batch_io`: datagrams queued back to back for the same peer with
+   * the same size, a window of DATA, leave as one buffer the kernel splits
+   * (UDP_SEGMENT). Sizes from `gso_refused` on were refused by the kernel
+   * or the device and are sent one by one */
+  bool segment_offload;
+  BetterSocket::Size gso_refused;
+  union Control
+  {
+    char buf[CMSG_SPACE(sizeof(int))];
+    struct cmsghdr align;
+  };
+  std::vector<std::size_t> send_first; // queued datagram starting a message
+  std::vector<Control> send_control;
+  std::vector<uint8_t> send_zerocopy; // per message
 
-  enum class Events : TYPEOF(TYPEOF(poll_over)::value_type::events){
+  /* zero copy sends in the order they were made, numbered across sockets
+   * from `zerocopy_first` on: the tickets of `zerocopy_ticket()` */
+  std::deque<ZeroCopySend> zerocopy_pending;
+  uint64_t zerocopy_first;
+  std::vector<Control> recv_control; // sockets receiving coalesced
+#endif
+
+#if defined(AVANTEE_HAVE_EPOLL)
+  int epoll_fd;
+  std::vector<struct epoll_event> epoll_over;
+#endif
+
+#if defined(AVANTEE_HAVE_IO_URING)
+  struct UringWatch
+  {
+    uint32_t generation;
+    uint32_t events;
+    bool datagram;
+  };
+
+  /* sendmsg() in flight, the kernel reads from it until completion */
+  struct UringSend
+  {
+    struct msghdr msg;
+    struct iovec iov[2]; // the copied bytes, then what is only referenced
+    sockaddr_storage dest;
+    std::vector<std::byte> payload;
+  };
+
+  Uring ring;
+  uint32_t uring_generation;
+  struct msghdr uring_recv_msg; // template for multishot recvmsg
+  std::unordered_map<BetterSocket::GSocket, UringWatch> uring_watches;
+  std::vector<BetterSocket::GSocket> uring_rearm;
+  std::vector<unsigned short> uring_consumed; // buffers to hand back
+  std::deque<UringSend> uring_sends;
+  std::vector<uint32_t> uring_free_sends;
+#endif
+
+  enum class Events : TYPEOF(BetterSocket::GPollfd::events){
     input = POLLIN,
     output = POLLOUT,
     error = POLLERR,
     invalid = POLLNVAL,
   };
 
-  Multiplexer();
+  Multiplexer(Backend preferred = default_backend(),
+              BetterSocket::Size datagram_size =
+                std::to_underlying(constants::DATAGRAM_SIZE));
+  ~Multiplexer();
+  Multiplexer(const Multiplexer&) = delete;
+  Multiplexer& operator=(const Multiplexer&) = delete;
+
+  /* best backend for this platform */
+  static constexpr Backend default_backend();
 
   /* add socket to be polled over */
   void watch(BetterSocket::GSocket socket, Events ev);
@@ -38,21 +212,117 @@ struct Multiplexer
   /* update the event for socket to be polled over */
   void update_fd_event(BetterSocket::GSocket socket, Events ev);
 
-  /* poll for I/O on `poll_over` */
-  void poll_io();
+  /* receive datagrams on `socket` inside `poll_io()` instead of reporting it
+   * as ready. With io_uring this is a multishot receive into the registered
+   * buffers, so no system call is made per datagram. `coalesced`: the
+   * socket was asked to coalesce receives (UDP_GRO) and each buffer is
+   * split back into its datagrams, poll and epoll with `batch_io` only;
+   * the datagram size must fit what the kernel coalesces */
+  void receive_datagrams(BetterSocket::GSocket socket,
+                         bool coalesced = false);
+
+  /* `socket` has SO_ZEROCOPY set (BSocket::zeroCopy()). With `batch_io`,
+   * its messages of at least BetterSocket::ZERO_COPY_MIN bytes made of
+   * `kept` bodies only are sent without a copy. The kernel reports how
+   * they went: if it copied them anyway, the socket stops asking. Call
+   * after `receive_datagrams()` */
+  void zerocopy_sends(BetterSocket::GSocket socket);
+  /* zero copy sends made so far. A `kept` body that was queued before
+   * this was read, and flushed, may be freed once `zerocopy_done()`
+   * reaches it */
+  uint64_t zerocopy_ticket() const;
+  /* zero copy sends that completed, oldest first */
+  uint64_t zerocopy_done() const;
+
+  /* send a datagram. It is queued and sent in one batch by the next
+   * `poll_io()`, with io_uring or `batch_io`, otherwise right away. */
+  void send_to(BetterSocket::GSocket socket,
+               const void* buf,
+               BetterSocket::Size len,
+               BetterSocket::SockaddrWrapper& dest);
+  void send_to(BetterSocket::GSocket socket,
+               const void* buf,
+               BetterSocket::Size len,
+               const sockaddr* dest,
+               socklen_t dest_len);
+
+#if !defined(ICY_ON_WINDOWS)
+  /* send `header` followed by `body` as one datagram with sendmsg(), without
+   * copying them together first. `header` may be reused right away, `body`
+   * must stay valid until the send completed (when batched: until a later
+   * `poll_io()` reaped it), such as a slice of a mapped file. `kept`: the
+   * caller keeps `body` until `zerocopy_done()` says so and never
+   * changes it, the kernel may then read it after the send returned, see
+   * `zerocopy_sends()` */
+  void send_parts(BetterSocket::GSocket socket,
+                  std::span<const std::byte> header,
+                  std::span<const std::byte> body,
+                  const sockaddr* dest,
+                  socklen_t dest_len,
+                  bool kept = false);
+#endif
+
+  /* poll for I/O on the watched sockets and fill the ready set.
+   * `timeout` is in milliseconds like poll(): -1 blocks until there is I/O,
+   * 0 returns immediately. */
+  void poll_io(int timeout = -1);
+
+  /* only the sockets that became ready in the last `poll_io()` */
+  std::span<const BetterSocket::GPollfd> ready() const;
+  /* datagrams that arrived in the last `poll_io()` */
+  std::span<Datagram> datagrams();
 
   /* check if a socket is available for some event or not */
   template<Multiplexer::Events Event>
   bool socket_available_for(BetterSocket::GSocket sock);
+
+private:
+  WatchSlot& index_of(BetterSocket::GSocket socket);
+  bool is_datagram_socket(BetterSocket::GSocket socket) const;
+  bool is_zerocopy_socket(BetterSocket::GSocket socket) const;
+  void read_datagrams(BetterSocket::GSocket socket);
+#if defined(AVANTEE_HAVE_MMSG)
+  void read_batch(BetterSocket::GSocket socket);
+  void queue_send(BetterSocket::GSocket socket,
+                  std::span<const std::byte> copied,
+                  std::span<const std::byte> referenced,
+                  const sockaddr* dest,
+                  socklen_t dest_len,
+                  bool kept = false);
+  void flush_sends();
+  bool reap_zerocopy(BetterSocket::GSocket socket);
+  void send_each(std::size_t first, std::size_t count);
+#endif
+#if defined(AVANTEE_HAVE_IO_URING)
+  bool uring_init();
+  void uring_arm(BetterSocket::GSocket socket, const UringWatch& w);
+  void uring_cancel(BetterSocket::GSocket socket, const UringWatch& w);
+  void uring_send(BetterSocket::GSocket socket,
+                  std::span<const std::byte> copied,
+                  std::span<const std::byte> referenced,
+                  const sockaddr* dest,
+                  socklen_t dest_len);
+  void uring_poll_io(int timeout);
+#endif
 };
 
+constexpr Multiplexer::Backend
+Multiplexer::default_backend()
+{
+#if defined(AVANTEE_HAVE_EPOLL)
+  return Backend::epoll;
+#else
+  return Backend::poll;
+#endif
+}
+
 template<Multiplexer::Events Event>
 bool
 Multiplexer::socket_available_for(BetterSocket::GSocket sock)
 {
-  for (BetterSocket::Size i = 0; i < fdcount; i++) {
-    if ((poll_over[i].fd == sock) &&
-        (poll_over[i].revents & std::to_underlying(Event)))
+  for (BetterSocket::Size i = 0; i < readycount; i++) {
+    if ((ready_over[i].fd == sock) &&
+        (ready_over[i].revents & std::to_underlying(Event)))
       return true;
   }
   return false;
@@ -0,0 +1,265 @@
+#include <algorithm>
+#include <cstring>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define NETASCII_X86 1
+#endif
+
+#include "netascii.hpp"
+
+#define SCAST(Type, e) static_cast<Type>(e)
+
+static constexpr std::byte CR{ '\r' };
+static constexpr std::byte LF{ '\n' };
+static constexpr std::byte NUL{ 0 };
+
+// the next byte to translate, `end` if there is none. `withLf`: a LF as
+// well as a CR, the encoder wants both and the decoder only CR
+template<bool withLf>
+static const std::byte*
+scanScalar(const std::byte* p, const std::byte* end)
+{
+  for (; p < end; p++)
+    if (*p == CR || (withLf && *p == LF))
+      return p;
+  return end;
+}
+
+/* The bulk of the work, while input and output both have room for a whole
+ * vector and a line end. Every vector is stored as it is, then the
+ * position only moves up to its first CR or LF, which is translated: runs
+ * of plain text cost one load and one store per 16 or 32 bytes, a line end
+ * one more of each. `r` and `w` are where the input and output are */
+#if defined(NETASCII_X86)
+__attribute__((target("sse2"))) static void
+encodeSse2(std::span<const std::byte> in,
+           std::span<std::byte> out,
+           std::size_t& r,
+           std::size_t& w)
+{
+  const __m128i cr = _mm_set1_epi8('\r');
+  const __m128i lf = _mm_set1_epi8('\n');
+  while (in.size() - r >= 16 && out.size() - w > 16) {
+    __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(&in[r]));
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(&out[w]), v);
+    auto hits = SCAST(unsigned, _mm_movemask_epi8(
+                                  _mm_or_si128(_mm_cmpeq_epi8(v, cr),
+                                               _mm_cmpeq_epi8(v, lf))));
+    if (hits == 0) {
+      r += 16;
+      w += 16;
+      continue;
+    }
+    auto k = SCAST(std::size_t, __builtin_ctz(hits));
+    r += k;
+    w += k;
+    out[w + 1] = in[r] == CR ? NUL : LF;
+    out[w] = CR;
+    r += 1;
+    w += 2;
+  }
+}
+
+__attribute__((target("avx2"))) static void
+encodeAvx2(std::span<const std::byte> in,
+           std::span<std::byte> out,
+           std::size_t& r,
+           std::size_t& w)
+{
+  const __m256i cr = _mm256_set1_epi8('\r');
+  const __m256i lf = _mm256_set1_epi8('\n');
+  while (in.size() - r >= 32 && out.size() - w > 32) {
+    __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(&in[r]));
+    _mm256_storeu_si256(reinterpret_cast<__m256i*>(&out[w]), v);
+    auto hits = SCAST(unsigned, _mm256_movemask_epi8(
+                                  _mm256_or_si256(_mm256_cmpeq_epi8(v, cr),
+                                                  _mm256_cmpeq_epi8(v, lf))));
+    if (hits == 0) {
+      r += 32;
+      w += 32;
+      continue;
+    }
+    auto k = SCAST(std::size_t, __builtin_ctz(hits));
+    r += k;
+    w += k;
+    out[w + 1] = in[r] == CR ? NUL : LF;
+    out[w] = CR;
+    r += 1;
+    w += 2;
+  }
+}
+
+// what follows a CR at `in[r]`, which is not the last byte of `in`
+static void
+decodeCr(std::span<const std::byte> in,
+         std::span<std::byte> out,
+         std::size_t& r,
+         std::size_t& w)
+{
+  std::byte next = in[r + 1];
+  out[w++] = next == LF ? LF : CR;
+  r += next == LF || next == NUL ? 2 : 1;
+}
+
+__attribute__((target("sse2"))) static void
+decodeSse2(std::span<const std::byte> in,
+           std::span<std::byte> out,
+           std::size_t& r,
+           std::size_t& w)
+{
+  const __m128i cr = _mm_set1_epi8('\r');
+  while (in.size() - r > 16 && out.size() - w >= 16) {
+    __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(&in[r]));
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(&out[w]), v);
+    auto hits = SCAST(unsigned, _mm_movemask_epi8(_mm_cmpeq_epi8(v, cr)));
+    if (hits == 0) {
+      r += 16;
+      w += 16;
+      continue;
+    }
+    auto k = SCAST(std::size_t, __builtin_ctz(hits));
+    r += k;
+    w += k;
+    decodeCr(in, out, r, w);
+  }
+}
+
+__attribute__((target("avx2"))) static void
+decodeAvx2(std::span<const std::byte> in,
+           std::span<std::byte> out,
+           std::size_t& r,
+           std::size_t& w)
+{
+  const __m256i cr = _mm256_set1_epi8('\r');
+  while (in.size() - r > 32 && out.size() - w >= 32) {
+    __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(&in[r]));
+    _mm256_storeu_si256(reinterpret_cast<__m256i*>(&out[w]), v);
+    auto hits =
+      SCAST(unsigned, _mm256_movemask_epi8(_mm256_cmpeq_epi8(v, cr)));
+    if (hits == 0) {
+      r += 32;
+      w += 32;
+      continue;
+    }
+    auto k = SCAST(std::size_t, __builtin_ctz(hits));
+    r += k;
+    w += k;
+    decodeCr(in, out, r, w);
+  }
+}
+#endif
+
+Netascii::Simd
+Netascii::best()
+{
+#if defined(NETASCII_X86)
+  static const Simd simd = __builtin_cpu_supports("avx2")   ? Simd::avx2
+                           : __builtin_cpu_supports("sse2") ? Simd::sse2
+                                                            : Simd::scalar;
+  return simd;
+#else
+  return Simd::scalar;
+#endif
+}
+
+Netascii::Encoder::Encoder(Simd isa)
+  : simd{ isa }
+  , holding{ false }
+  , held{}
+{
+}
+
+Netascii::Progress
+Netascii::Encoder::encode(std::span<const std::byte> in,
+                          std::span<std::byte> out)
+{
+  std::size_t r = 0, w = 0;
+  if (holding) {
+    if (out.empty())
+      return { 0, 0 };
+    out[w++] = held;
+    holding = false;
+  }
+
+#if defined(NETASCII_X86)
+  if (simd == Simd::avx2)
+    encodeAvx2(in, out, r, w);
+  else if (simd == Simd::sse2)
+    encodeSse2(in, out, r, w);
+#endif
+
+  // what is left, too little for a vector, or all of it without SIMD
+  while (r < in.size() && w < out.size()) {
+    // only as far as the output has room: a run that does not fit would
+    // be scanned again by the next call
+    const std::byte* start = in.data() + r;
+    const std::byte* end = start + std::min(in.size() - r, out.size() - w);
+    const std::byte* hit = scanScalar<true>(start, end);
+    auto run = SCAST(std::size_t, hit - start);
+    std::memcpy(out.data() + w, start, run);
+    r += run;
+    w += run;
+    if (hit == end)
+      break;
+
+    std::byte second = *hit == CR ? NUL : LF;
+    r++;
+    out[w++] = CR;
+    if (w == out.size()) {
+      held = second;
+      holding = true;
+      break;
+    }
+    out[w++] = second;
+  }
+  return { r, w };
+}
+
+Netascii::Decoder::Decoder(Simd isa)
+  : simd{ isa }
+  , cr{ false }
+{
+}
+
+Netascii::Progress
+Netascii::Decoder::decode(std::span<const std::byte> in,
+                          std::span<std::byte> out)
+{
+  std::size_t r = 0, w = 0;
+  while (r < in.size() && w < out.size()) {
+    if (cr) {
+      // CR LF is a line end, CR NUL a lone CR
+      cr = false;
+      if (in[r] == LF) {
+        out[w++] = LF;
+        r++;
+        continue;
+      }
+      out[w++] = CR;
+      if (in[r] == NUL)
+        r++;
+      continue;
+    }
+
+#if defined(NETASCII_X86)
+    if (simd == Simd::avx2)
+      decodeAvx2(in, out, r, w);
+    else if (simd == Simd::sse2)
+      decodeSse2(in, out, r, w);
+#endif
+    // what is left, too little for a vector, or all of it without SIMD
+    const std::byte* start = in.data() + r;
+    const std::byte* end = start + std::min(in.size() - r, out.size() - w);
+    const std::byte* hit = scanScalar<false>(start, end);
+    auto run = SCAST(std::size_t, hit - start);
+    std::memcpy(out.data() + w, start, run);
+    r += run;
+    w += run;
+    if (hit == end)
+      break;
+    r++; // what the CR means depends on the byte after it
+    cr = true;
+  }
+  return { r, w };
+}
@@ -0,0 +1,69 @@
+#ifndef AVANTEE_NETASCII_H
+#define AVANTEE_NETASCII_H
+
+#include <cstddef>
+#include <cstdint>
+#include <span>
+
+/* TFTP's netascii mode (RFC 1350, after the Telnet NVT of RFC 764): every
+ * line ends in CR LF, and a CR that is not part of a line end is sent as
+ * CR NUL.
+ *
+ * Text is mostly runs of plain bytes between line ends. The transcoders
+ * look for the next CR or LF 16 or 32 bytes at a time with SSE2 or AVX2,
+ * copy the run in one piece and only step through the line end itself.
+ * Both work on a stream: input and output come in pieces of any size, a
+ * line end cut in two by the end of either is carried over to the next
+ * call. The translated text is longer (encoding) or shorter (decoding)
+ * than its source, so a block of one never lines up with a block of the
+ * other.
+ */
+struct Netascii
+{
+  enum class Simd : uint8_t
+  {
+    scalar,
+    sse2,
+    avx2,
+  };
+
+  /* the widest this CPU runs, checked once */
+  static Simd best();
+
+  struct Progress
+  {
+    std::size_t read;    // input bytes consumed
+    std::size_t written; // output bytes produced
+  };
+
+  /* the host's text to netascii: LF becomes CR LF, CR becomes CR NUL */
+  struct Encoder
+  {
+    Simd simd;
+    bool holding; // the second byte of a line end did not fit
+    std::byte held;
+
+    explicit Encoder(Simd isa = best());
+
+    /* translate as much of `in` as fits in `out`. A byte held back from
+     * the last call comes first, even if `in` is empty: encoding an empty
+     * input flushes the stream */
+    Progress encode(std::span<const std::byte> in, std::span<std::byte> out);
+  };
+
+  /* netascii to the host's text: CR LF becomes LF, CR NUL becomes CR. A CR
+   * followed by anything else is kept as it is */
+  struct Decoder
+  {
+    Simd simd;
+    bool cr; // the last input ended in a CR
+
+    explicit Decoder(Simd isa = best());
+
+    /* translate as much of `in` as fits in `out`, which never needs more
+     * than `in.size() + 1` bytes */
+    Progress decode(std::span<const std::byte> in, std::span<std::byte> out);
+  };
+};
+
+#endif
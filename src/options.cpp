@@ -0,0 +1,509 @@
+#include <charconv>
+#include <cstdio>
+#include <string_view>
+#include <vector>
+
+#include <arpa/inet.h>
+
+#include "options.hpp"
+#include "tftp.hpp"
+
+#define TU(enum) std::to_underlying(enum)
+
+static void
+usage(const char* prog)
+{
+  std::fprintf(stderr,
+               "usage: %s [options]\n"
+               "  --backend poll|epoll|uring   I/O backend (default: best "
+               "available)\n"
+               "  --port PORT                  listening port (default: 69)\n"
+               "  --reactors N                 event loops sharing the port, 0 "
+               "is one per core (default: 1)\n"
+               "  --steering hash|cpu          spread requests over reactors by "
+               "flow hash or receiving CPU (default: hash)\n"
+               "  --demux socket|peer          one socket per transfer, or "
+               "serve every transfer from the\n"
+               "                               listener keyed by peer address "
+               "(default: socket)\n"
+               "  --max-transfers N            transfers a reactor serves at "
+               "once (default: 64)\n"
+               "  --max-window N               largest windowsize granted "
+               "to a client, 1-65535 (default: 64)\n"
+               "  --congestion none|aimd       send a window at once, or pace "
+               "it by a window that\n"
+               "                               grows on clean ACKs and halves "
+               "on loss (default: none)\n"
+               "  --file-io mmap|read          send file data from a mapping "
+               "or read() it (default: mmap)\n"
+               "  --root DIR                   serve files below DIR "
+               "(default: .)\n"
+               "  --tid-ports LOW-HIGH         ports bound at startup for "
+               "transfers (default: picked by\n"
+               "                               the kernel)\n"
+               "  --cache-mb N                 keep up to N MiB of files in "
+               "memory as ready DATA packets\n"
+               "                               (default: 0, no cache)\n"
+               "  --cache-manifest FILE        load the files listed in FILE, "
+               "relative to the root, into\n"
+               "                               the cache at startup\n"
+               "  --cache-blksize N            load the manifest for transfers "
+               "using N byte blocks, may\n"
+               "                               be given more than once "
+               "(default: 512)\n"
+               "  --upload-root DIR            accept write requests, the "
+               "files go below DIR\n"
+               "                               (default: none, writing is "
+               "refused)\n"
+               "  --upload-blksize N           largest blksize granted to "
+               "a write request, 8-65464\n"
+               "                               (default: 1468)\n"
+               "  --fsync none|close|batch     sync uploads never, once "
+               "complete, or after every\n"
+               "                               buffer written (default: "
+               "close)\n"
+               "  --upload-io thread|inline    write uploads from a thread "
+               "of each reactor, or from\n"
+               "                               the reactor itself "
+               "(default: thread)\n"
+               "  --multicast ADDR[:PORT]      offer RFC 2090 multicast, "
+               "sending to groups from ADDR on\n"
+               "                               (default: none, port 1758)\n"
+               "  --multicast-groups N         groups, and so files sent at "
+               "once, shared by the\n"
+               "                               reactors (default: 16)\n"
+               "  --multicast-if ADDR          send multicast out of the "
+               "interface with this address\n"
+               "                               (default: the routing "
+               "table's)\n"
+               "  --multicast-ttl N            routers multicast may cross, "
+               "0-255 (default: 1)\n"
+               "  --admit-rate N               transfers started per second, "
+               "others are refused\n"
+               "                               (default: 0, no limit)\n"
+               "  --rate BYTES                 DATA bytes sent per second "
+               "(default: 0, no limit)\n"
+               "  --client-rate BYTES          DATA bytes sent per second to "
+               "each client address\n"
+               "                               (default: 0, no limit)\n"
+               "  --scheduling arrival|drr     send as ACKs are handled, or "
+               "share the loop between\n"
+               "                               transfers by deficit round "
+               "robin (default: arrival)\n"
+               "  --quantum BYTES              DATA a transfer sends per "
+               "round with drr (default: 8192)\n"
+               "  --small-file BYTES           files up to this size get "
+               "four quanta a round\n"
+               "                               (default: 1048576)\n"
+               "  --read-ahead BYTES           have the disk read this far "
+               "ahead of each transfer\n"
+               "                               (default: 1048576, 0: "
+               "none)\n"
+               "  --gso on|off                 let the kernel split windows "
+               "of DATA into datagrams\n"
+               "                               (default: off)\n"
+               "  --gro on|off                 let the kernel coalesce "
+               "uploaded DATA (default: off)\n"
+               "  --zerocopy on|off            send large windows or blocks "
+               "of the block cache\n"
+               "                               without a copy (default: "
+               "off)\n",
+               prog);
+}
+
+static bool
+parseBackend(std::string_view v, Multiplexer::Backend& out)
+{
+  if (v == "poll")
+    out = Multiplexer::Backend::poll;
+  else if (v == "epoll")
+    out = Multiplexer::Backend::epoll;
+  else if (v == "uring")
+    out = Multiplexer::Backend::uring;
+  else
+    return false;
+  return true;
+}
+
+static bool
+parseUnsigned(std::string_view v, unsigned& out)
+{
+  auto [end, ec] = std::from_chars(v.data(), v.data() + v.size(), out);
+  return ec == std::errc() && end == v.data() + v.size();
+}
+
+static bool
+parseSize(std::string_view v, uint64_t& out)
+{
+  auto [end, ec] = std::from_chars(v.data(), v.data() + v.size(), out);
+  return ec == std::errc() && end == v.data() + v.size();
+}
+
+static bool
+parsePort(std::string_view v, std::string& out)
+{
+  unsigned port;
+  if (!parseUnsigned(v, port) || port > 65535)
+    return false;
+  out = v;
+  return true;
+}
+
+static bool
+parseWindow(std::string_view v, uint16_t& out)
+{
+  unsigned n;
+  if (!parseUnsigned(v, n) || n < 1 || n > TU(Constants::maxWindowsize))
+    return false;
+  out = static_cast<uint16_t>(n);
+  return true;
+}
+
+static bool
+parseBlksize(std::string_view v, uint16_t& out)
+{
+  unsigned n;
+  if (!parseUnsigned(v, n) || n < TU(Constants::minBlksize) ||
+      n > TU(Constants::maxBlksize))
+    return false;
+  out = static_cast<uint16_t>(n);
+  return true;
+}
+
+static bool
+parsePortRange(std::string_view v,
+               BetterSocket::in_port_t& lower,
+               BetterSocket::in_port_t& upper)
+{
+  auto dash = v.find('-');
+  unsigned lo, hi;
+  if (dash == std::string_view::npos ||
+      !parseUnsigned(v.substr(0, dash), lo) ||
+      !parseUnsigned(v.substr(dash + 1), hi) || lo == 0 || lo > hi ||
+      hi > 65535)
+    return false;
+  lower = static_cast<BetterSocket::in_port_t>(lo);
+  upper = static_cast<BetterSocket::in_port_t>(hi);
+  return true;
+}
+
+static bool
+parseFileIO(std::string_view v, FileIO& out)
+{
+  if (v == "mmap")
+    out = FileIO::mmap;
+  else if (v == "read")
+    out = FileIO::read;
+  else
+    return false;
+  return true;
+}
+
+static bool
+parseSteering(std::string_view v, Steering& out)
+{
+  if (v == "hash")
+    out = Steering::hash;
+  else if (v == "cpu")
+    out = Steering::cpu;
+  else
+    return false;
+  return true;
+}
+
+static bool
+parseSync(std::string_view v, WriteBehind::Sync& out)
+{
+  if (v == "none")
+    out = WriteBehind::Sync::none;
+  else if (v == "close")
+    out = WriteBehind::Sync::close;
+  else if (v == "batch")
+    out = WriteBehind::Sync::batch;
+  else
+    return false;
+  return true;
+}
+
+static bool
+parseUploadIO(std::string_view v, bool& threaded)
+{
+  if (v == "thread")
+    threaded = true;
+  else if (v == "inline")
+    threaded = false;
+  else
+    return false;
+  return true;
+}
+
+static bool
+parseSwitch(std::string_view v, bool& on)
+{
+  if (v == "on")
+    on = true;
+  else if (v == "off")
+    on = false;
+  else
+    return false;
+  return true;
+}
+
+static bool
+isIPv4(std::string_view v)
+{
+  in_addr a;
+  return inet_pton(AF_INET, std::string(v).c_str(), &a) == 1;
+}
+
+// a multicast IPv4 address, optionally followed by a port
+static bool
+parseGroup(std::string_view v,
+           uint32_t& group,
+           BetterSocket::in_port_t& port)
+{
+  auto colon = v.find(':');
+  std::string addr(v.substr(0, colon));
+  in_addr a;
+  if (inet_pton(AF_INET, addr.c_str(), &a) != 1 ||
+      !IN_MULTICAST(ntohl(a.s_addr)))
+    return false;
+  unsigned p = port;
+  if (colon != std::string_view::npos &&
+      (!parseUnsigned(v.substr(colon + 1), p) || p == 0 || p > 65535))
+    return false;
+  group = ntohl(a.s_addr);
+  port = static_cast<BetterSocket::in_port_t>(p);
+  return true;
+}
+
+static bool
+parseScheduling(std::string_view v, Scheduling& out)
+{
+  if (v == "arrival")
+    out = Scheduling::arrival;
+  else if (v == "drr")
+    out = Scheduling::drr;
+  else
+    return false;
+  return true;
+}
+
+static bool
+parseCongestion(std::string_view v, Congestion& out)
+{
+  if (v == "none")
+    out = Congestion::none;
+  else if (v == "aimd")
+    out = Congestion::aimd;
+  else
+    return false;
+  return true;
+}
+
+static bool
+parseDemux(std::string_view v, Demux& out)
+{
+  if (v == "socket")
+    out = Demux::socket;
+  else if (v == "peer")
+    out = Demux::peer;
+  else
+    return false;
+  return true;
+}
+
+bool
+parseServerOptions(int argc, char** argv, ServerOptions& opts)
+{
+  for (int i = 1; i < argc; i++) {
+    std::string_view arg = argv[i];
+    // every option takes exactly one value
+    if (i + 1 >= argc) {
+      usage(argv[0]);
+      return false;
+    }
+    std::string_view value = argv[++i];
+
+    bool ok = false;
+    if (arg == "--backend")
+      ok = parseBackend(value, opts.backend);
+    else if (arg == "--port")
+      ok = parsePort(value, opts.port);
+    else if (arg == "--reactors")
+      ok = parseUnsigned(value, opts.reactors);
+    else if (arg == "--steering")
+      ok = parseSteering(value, opts.steering);
+    else if (arg == "--demux")
+      ok = parseDemux(value, opts.demux);
+    else if (arg == "--max-transfers")
+      ok = parseUnsigned(value, opts.maxTransfers) && opts.maxTransfers > 0;
+    else if (arg == "--max-window")
+      ok = parseWindow(value, opts.maxWindow);
+    else if (arg == "--congestion")
+      ok = parseCongestion(value, opts.congestion);
+    else if (arg == "--file-io")
+      ok = parseFileIO(value, opts.fileIO);
+    else if (arg == "--root")
+      ok = !(opts.root = value).empty();
+    else if (arg == "--tid-ports")
+      ok = parsePortRange(value, opts.tidLower, opts.tidUpper);
+    else if (arg == "--cache-mb")
+      ok = parseUnsigned(value, opts.cacheMiB);
+    else if (arg == "--cache-manifest")
+      ok = !(opts.cacheManifest = value).empty();
+    else if (arg == "--cache-blksize")
+      ok = parseBlksize(value, opts.cacheBlksizes.emplace_back());
+    else if (arg == "--upload-root")
+      ok = !(opts.uploadRoot = value).empty();
+    else if (arg == "--upload-blksize")
+      ok = parseBlksize(value, opts.maxUploadBlksize);
+    else if (arg == "--fsync")
+      ok = parseSync(value, opts.fsync);
+    else if (arg == "--upload-io")
+      ok = parseUploadIO(value, opts.uploadThread);
+    else if (arg == "--multicast")
+      ok = parseGroup(value, opts.multicastGroup, opts.multicastPort);
+    else if (arg == "--multicast-groups")
+      ok = parseUnsigned(value, opts.multicastGroups) &&
+           opts.multicastGroups > 0;
+    else if (arg == "--multicast-if")
+      ok = isIPv4(value) && !(opts.multicastInterface = value).empty();
+    else if (arg == "--multicast-ttl")
+      ok = parseUnsigned(value, opts.multicastTtl) && opts.multicastTtl <= 255;
+    else if (arg == "--admit-rate")
+      ok = parseUnsigned(value, opts.admitRate);
+    else if (arg == "--rate")
+      ok = parseUnsigned(value, opts.byteRate);
+    else if (arg == "--client-rate")
+      ok = parseUnsigned(value, opts.clientByteRate);
+    else if (arg == "--scheduling")
+      ok = parseScheduling(value, opts.scheduling);
+    else if (arg == "--quantum")
+      ok = parseUnsigned(value, opts.quantum) && opts.quantum > 0;
+    else if (arg == "--small-file")
+      ok = parseSize(value, opts.smallFile);
+    else if (arg == "--read-ahead")
+      ok = parseSize(value, opts.readAhead);
+    else if (arg == "--gso")
+      ok = parseSwitch(value, opts.gso);
+    else if (arg == "--gro")
+      ok = parseSwitch(value, opts.gro);
+    else if (arg == "--zerocopy")
+      ok = parseSwitch(value, opts.zeroCopy);
+
+    if (!ok) {
+      std::fprintf(stderr,
+                   "avantee-server: bad option: %s %s\n",
+                   arg.data(),
+                   value.data());
+      usage(argv[0]);
+      return false;
+    }
+  }
+
+  // a peer's packets must keep reaching the reactor that owns its transfer,
+  // which only the flow hash guarantees
+  if (opts.demux == Demux::peer && opts.steering == Steering::cpu &&
+      opts.reactors != 1) {
+    std::fprintf(stderr,
+                 "avantee-server: --demux peer needs --steering hash with "
+                 "more than one reactor\n");
+    return false;
+  }
+  if (!opts.cacheManifest.empty() && opts.cacheMiB == 0) {
+    std::fprintf(stderr,
+                 "avantee-server: --cache-manifest needs --cache-mb\n");
+    return false;
+  }
+  if (!opts.cacheBlksizes.empty() && opts.cacheManifest.empty()) {
+    std::fprintf(stderr,
+                 "avantee-server: --cache-blksize needs --cache-manifest\n");
+    return false;
+  }
+  // a session sends from a TID of its own, its members' ACKs come there
+  if (opts.multicastGroup != 0 && opts.demux != Demux::socket) {
+    std::fprintf(stderr,
+                 "avantee-server: --multicast needs --demux socket\n");
+    return false;
+  }
+  if (opts.multicastGroup != 0 &&
+      !IN_MULTICAST(opts.multicastGroup + (opts.multicastGroups - 1ull))) {
+    std::fprintf(stderr,
+                 "avantee-server: --multicast-groups runs past the "
+                 "multicast range\n");
+    return false;
+  }
+  return true;
+}
+
+static void
+clientUsage(const char* prog)
+{
+  std::fprintf(stderr,
+               "usage: %s [options] HOST FILE\n"
+               "  --port PORT                  server port (default: 69)\n"
+               "  --blksize N                  ask for N byte DATA blocks, "
+               "8-65464 (RFC 2348)\n"
+               "  --windowsize N               ask for N blocks per ACK, "
+               "1-65535 (RFC 7440)\n"
+               "  --timeout N                  ask for a fixed N second "
+               "timeout, 1-255 (RFC 2349)\n"
+               "  --output PATH                write the file to PATH, - is "
+               "stdout (default: FILE)\n",
+               prog);
+}
+
+bool
+parseClientOptions(int argc, char** argv, ClientOptions& opts)
+{
+  std::vector<std::string_view> positional;
+  for (int i = 1; i < argc; i++) {
+    std::string_view arg = argv[i];
+    if (!arg.starts_with("--")) {
+      positional.push_back(arg);
+      continue;
+    }
+    if (i + 1 >= argc) {
+      clientUsage(argv[0]);
+      return false;
+    }
+    std::string_view value = argv[++i];
+
+    bool ok = false;
+    if (arg == "--port")
+      ok = parsePort(value, opts.port);
+    else if (arg == "--blksize")
+      ok = parseUnsigned(value, opts.blksize) &&
+           opts.blksize >= TU(Constants::minBlksize) &&
+           opts.blksize <= TU(Constants::maxBlksize);
+    else if (arg == "--windowsize")
+      ok = parseUnsigned(value, opts.windowsize) && opts.windowsize >= 1 &&
+           opts.windowsize <= TU(Constants::maxWindowsize);
+    else if (arg == "--timeout")
+      ok = parseUnsigned(value, opts.timeout) &&
+           opts.timeout >= TU(Constants::minTimeoutOption) &&
+           opts.timeout <= TU(Constants::maxTimeoutOption);
+    else if (arg == "--output")
+      ok = !(opts.output = value).empty();
+
+    if (!ok) {
+      std::fprintf(stderr,
+                   "avantee-client: bad option: %s %s\n",
+                   arg.data(),
+                   value.data());
+      clientUsage(argv[0]);
+      return false;
+    }
+  }
+
+  if (positional.size() != 2) {
+    clientUsage(argv[0]);
+    return false;
+  }
+  opts.host = positional[0];
+  opts.file = positional[1];
+  if (opts.output.empty())
+    opts.output = opts.file;
+  return true;
+}
@@ -0,0 +1,116 @@
+#ifndef AVANTEE_OPTIONS_H
+#define AVANTEE_OPTIONS_H
+
+#include <string>
+#include <vector>
+
+#include "multiplexer.hpp"
+#include "write_behind.hpp"
+
+/* how datagrams for port 69 are spread over the reactors' listeners */
+enum class Steering
+{
+  hash, // kernel default: hash of the address/port 4-tuple
+  cpu,  // classic BPF program: the CPU that received the packet
+};
+
+/* which socket a transfer is served from */
+enum class Demux
+{
+  socket, // RFC 1350: a fresh socket, and so a fresh TID, per transfer
+  peer,   // the reactor's listener, transfers told apart by peer address
+};
+
+/* how DATA payloads get from the file into the socket */
+enum class FileIO
+{
+  mmap, // sendmsg() straight from the mapped file, read() if it cannot be
+  read, // read() into a buffer, then send it
+};
+
+/* how fast an RFC 7440 window is sent */
+enum class Congestion
+{
+  none, // all of it at once
+  aimd, // paced by a congestion window, grown on clean ACKs, cut on loss
+};
+
+/* in which order transfers with DATA to send get to send it */
+enum class Scheduling
+{
+  arrival, // as their ACKs are handled
+  drr,     // deficit round robin, a quantum per transfer and loop iteration
+};
+
+/* runtime configuration of avantee-server, filled from the command line */
+struct ServerOptions
+{
+  Multiplexer::Backend backend = Multiplexer::default_backend();
+  std::string port = "69";
+  unsigned reactors = 1; // 0: one per core
+  Steering steering = Steering::hash;
+  Demux demux = Demux::socket;
+  unsigned maxTransfers = 64; // per reactor
+  uint16_t maxWindow = 64;    // largest RFC 7440 window granted a client
+  Congestion congestion = Congestion::none;
+  FileIO fileIO = FileIO::mmap;
+  std::string root = "."; // directory the served files are looked up in
+  // ports handed out as transfer TIDs, split between the reactors.
+  // 0-0 lets the kernel pick them
+  BetterSocket::in_port_t tidLower = 0;
+  BetterSocket::in_port_t tidUpper = 0;
+  unsigned cacheMiB = 0;     // block cache shared by the reactors, 0: none
+  std::string cacheManifest; // files loaded into the cache at startup
+  // block sizes the manifest is loaded for, empty: 512 only
+  std::vector<uint16_t> cacheBlksizes;
+  std::string uploadRoot; // WRQ files are written below it, empty: refused
+  uint16_t maxUploadBlksize = 1468; // also sizes the receive buffers
+  WriteBehind::Sync fsync = WriteBehind::Sync::close;
+  bool uploadThread = true; // disk writes on a thread of each reactor
+  // RFC 2090 groups, consecutive addresses from `multicastGroup` on, split
+  // between the reactors. A group address of 0: multicast is not offered
+  uint32_t multicastGroup = 0; // host byte order
+  BetterSocket::in_port_t multicastPort = 1758; // tftp-mcast
+  unsigned multicastGroups = 16;
+  std::string multicastInterface; // address of the interface sent out of
+  unsigned multicastTtl = 1;
+  // limits for the whole server, 0: none. Each reactor enforces its share
+  unsigned admitRate = 0; // transfers started per second
+  unsigned byteRate = 0;  // DATA bytes sent per second
+  // DATA bytes sent to one address per second, by each reactor
+  unsigned clientByteRate = 0;
+  Scheduling scheduling = Scheduling::arrival;
+  unsigned quantum = 8192;      // DRR bytes per turn
+  uint64_t smallFile = 1 << 20; // up to this size a file gets more turns
+  uint64_t readAhead = 1 << 20; // bytes read ahead of a transfer, 0: none
+  // UDP offloads, Linux with the poll and epoll backends only: a window of
+  // DATA handed to the kernel as one buffer it splits into datagrams (GSO),
+  // DATA of an upload received the same way (GRO)
+  bool gso = false;
+  bool gro = false;
+  // packets of the block cache sent with MSG_ZEROCOPY when a send is large
+  // enough to pay off: a --gso window or a big block. Linux, poll and epoll
+  bool zeroCopy = false;
+};
+
+/* parse `argv` into `opts`. Prints the usage and returns false on bad input */
+bool
+parseServerOptions(int argc, char** argv, ServerOptions& opts);
+
+/* runtime configuration of avantee-client */
+struct ClientOptions
+{
+  std::string host;
+  std::string file;   // name asked from the server
+  std::string output; // where it is written, "-" for stdout. Default: `file`
+  std::string port = "69";
+  unsigned blksize = 0;    // proposed to the server, 0: RFC 1350's 512
+  unsigned windowsize = 0; // proposed to the server, 0: lock step
+  unsigned timeout = 0;    // seconds, proposed to the server, 0: its own
+};
+
+/* like `parseServerOptions()`, for `[options] HOST FILE` */
+bool
+parseClientOptions(int argc, char** argv, ClientOptions& opts);
+
+#endif
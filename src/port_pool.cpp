@@ -0,0 +1,85 @@
+#include <string>
+#include <utility>
+
+#include "port_pool.hpp"
+#include "socket/error_utils.hpp"
+
+namespace BS = BetterSocket;
+
+void
+PortPool::fill(const BS::SocketHint& hint,
+               std::size_t count,
+               BS::in_port_t lower,
+               BS::in_port_t upper)
+{
+  sockets.reserve(sockets.size() + count);
+  unsigned next = lower;
+
+  while (count > 0) {
+    if (lower != 0 && next > upper)
+      break; // range used up
+
+    std::string service = lower == 0 ? "0" : std::to_string(next++);
+    BS::BSocket s(hint, service);
+    try {
+      // no SO_REUSEADDR: a port somebody else holds must fail to bind
+      s.bind(false);
+    } catch (const SockErrors::APIError&) {
+      if (lower == 0)
+        throw;
+      continue;
+    }
+
+    auto tid = static_cast<Tid>(sockets.size());
+    auto fd = static_cast<std::size_t>(s.underlyingSocket());
+    if (fd >= by_socket.size())
+      by_socket.resize(fd + 1, NO_TID);
+    by_socket[fd] = tid;
+
+    ports.push_back(s.localPort());
+    sockets.push_back(std::move(s));
+    free_tids.push_back(tid);
+    count--;
+  }
+}
+
+PortPool::Tid
+PortPool::acquire()
+{
+  if (free_tids.empty())
+    return NO_TID;
+  Tid tid = free_tids.front();
+  free_tids.pop_front();
+  return tid;
+}
+
+void
+PortPool::release(Tid tid)
+{
+  free_tids.push_back(tid);
+}
+
+PortPool::Tid
+PortPool::find(BS::GSocket socket) const
+{
+  auto fd = static_cast<std::size_t>(socket);
+  return fd < by_socket.size() ? by_socket[fd] : NO_TID;
+}
+
+BS::GSocket
+PortPool::socket(Tid tid) const
+{
+  return sockets[tid].underlyingSocket();
+}
+
+BS::in_port_t
+PortPool::port(Tid tid) const
+{
+  return ports[tid];
+}
+
+std::size_t
+PortPool::size() const
+{
+  return sockets.size();
+}
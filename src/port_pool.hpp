@@ -0,0 +1,56 @@
+#ifndef AVANTEE_PORT_POOL_H
+#define AVANTEE_PORT_POOL_H
+
+#include <cstdint>
+#include <deque>
+#include <vector>
+
+#include "socket/generic_sockets.hpp"
+#include "socket/socket.hpp"
+
+/* Sockets bound ahead of time for transfers' server-side TIDs.
+ *
+ * Everything that is slow or can fail about giving a transfer its own port
+ * (getaddrinfo, socket, bind, a port already in use) happens once, when the
+ * pool is filled. Handing a socket out and taking it back is a push or pop
+ * on a free list.
+ */
+struct PortPool
+{
+  using Tid = uint32_t;
+  static constexpr Tid NO_TID = UINT32_MAX;
+
+  std::vector<BetterSocket::BSocket> sockets;
+  std::vector<BetterSocket::in_port_t> ports; // host byte order
+  // oldest released first: a port is not reused while its previous peer
+  // may still be retransmitting to it
+  std::deque<Tid> free_tids;
+  std::vector<Tid> by_socket; // indexed by the socket
+
+  /* user space cost of one TID on top of the kernel's socket */
+  static constexpr std::size_t BYTES_PER_TID =
+    sizeof(BetterSocket::BSocket) + sizeof(BetterSocket::in_port_t) +
+    2 * sizeof(Tid);
+
+  PortPool() = default;
+
+  /* bind `count` sockets. With `lower` 0 the kernel picks each port,
+   * otherwise ports are taken from [lower, upper] and ports that are already
+   * in use are skipped, so the pool may come out smaller than `count`. */
+  void fill(const BetterSocket::SocketHint& hint,
+            std::size_t count,
+            BetterSocket::in_port_t lower = 0,
+            BetterSocket::in_port_t upper = 0);
+
+  /* a free socket, NO_TID when all of them are in use */
+  Tid acquire();
+  void release(Tid tid);
+
+  /* the TID owning `socket`, NO_TID if it is not one of ours */
+  Tid find(BetterSocket::GSocket socket) const;
+  BetterSocket::GSocket socket(Tid tid) const;
+  BetterSocket::in_port_t port(Tid tid) const;
+  std::size_t size() const;
+};
+
+#endif
@@ -0,0 +1,163 @@
+#include <algorithm>
+#include <utility>
+
+#include "rate_limit.hpp"
+
+#define SCAST(Type, e) static_cast<Type>(e)
+
+TokenBucket::TokenBucket(uint64_t per_second, uint64_t capacity)
+  : rate{ per_second }
+  , burst{ SCAST(int64_t, capacity * 1000) }
+  , tokens{ SCAST(int64_t, capacity * 1000) }
+  , stamp{ 0 }
+{
+}
+
+void
+TokenBucket::refill(uint64_t now)
+{
+  if (now <= stamp)
+    return;
+  // rate per second is rate thousandths per millisecond
+  auto gained = SCAST(int64_t, std::min<uint64_t>(now - stamp, 1000) * rate);
+  tokens = std::min(tokens + gained, burst);
+  stamp = now;
+}
+
+bool
+TokenBucket::take(uint64_t n, uint64_t now)
+{
+  if (rate == 0)
+    return true;
+  refill(now);
+  auto cost = SCAST(int64_t, n * 1000);
+  if (tokens < cost)
+    return false;
+  tokens -= cost;
+  return true;
+}
+
+void
+TokenBucket::charge(uint64_t n, uint64_t now)
+{
+  if (rate == 0)
+    return;
+  refill(now);
+  tokens -= SCAST(int64_t, n * 1000);
+}
+
+void
+TokenBucket::refund(uint64_t n)
+{
+  if (rate != 0)
+    tokens = std::min(tokens + SCAST(int64_t, n * 1000), burst);
+}
+
+uint64_t
+TokenBucket::wait(uint64_t n) const
+{
+  if (rate == 0)
+    return 1;
+  auto missing = SCAST(int64_t, n * 1000) - tokens;
+  if (missing <= 0)
+    return 1;
+  return std::max<uint64_t>(1, (SCAST(uint64_t, missing) + rate - 1) / rate);
+}
+
+// a byte bucket holds a tenth of a second at the rate, and at least a
+// whole DATA packet
+static uint64_t
+burstOf(uint64_t rate)
+{
+  return std::max<uint64_t>(rate / 10, UINT16_MAX);
+}
+
+RateLimits::RateLimits(uint64_t admit_rate,
+                       uint64_t byte_rate,
+                       uint64_t client_byte_rate,
+                       std::size_t max_connections)
+  : admissions{ admit_rate, std::max<uint64_t>(admit_rate, 1) }
+  , total{ byte_rate, burstOf(byte_rate) }
+  , clientRate{ client_byte_rate }
+  , clients{}
+  , free_ids{}
+  , by_addr{}
+  , by_handle(max_connections, NO_CLIENT)
+{
+}
+
+bool
+RateLimits::admit(uint64_t now)
+{
+  return admissions.take(1, now);
+}
+
+void
+RateLimits::attach(Handle h, const PeerKey& peer)
+{
+  if (clientRate == 0)
+    return;
+  PeerKey addr = peer;
+  addr.port = 0;
+  auto [it, added] = by_addr.try_emplace(addr, NO_CLIENT);
+  if (added) {
+    if (free_ids.empty()) {
+      it->second = SCAST(ClientId, clients.size());
+      clients.emplace_back();
+    } else {
+      it->second = free_ids.back();
+      free_ids.pop_back();
+    }
+    // a client that comes back starts with a full bucket
+    clients[it->second] = {
+      TokenBucket{ clientRate, burstOf(clientRate) }, 0, addr
+    };
+  }
+  clients[it->second].transfers++;
+  by_handle[h] = it->second;
+}
+
+void
+RateLimits::detach(Handle h)
+{
+  auto id = std::exchange(by_handle[h], NO_CLIENT);
+  if (id == NO_CLIENT)
+    return;
+  auto& c = clients[id];
+  if (--c.transfers > 0)
+    return;
+  by_addr.erase(c.addr);
+  free_ids.push_back(id);
+}
+
+uint64_t
+RateLimits::take(Handle h, uint64_t bytes, uint64_t now)
+{
+  auto id = by_handle[h];
+  auto* client = id == NO_CLIENT ? nullptr : &clients[id].bucket;
+  // both or neither: a packet the client may have and the server may not
+  // send must not use up the client's tokens
+  if (client != nullptr && !client->take(bytes, now))
+    return client->wait(bytes);
+  if (!total.take(bytes, now)) {
+    if (client != nullptr)
+      client->refund(bytes);
+    return total.wait(bytes);
+  }
+  return 0;
+}
+
+void
+RateLimits::charge(Handle h, uint64_t bytes, uint64_t now)
+{
+  auto id = by_handle[h];
+  if (id != NO_CLIENT)
+    clients[id].bucket.charge(bytes, now);
+  total.charge(bytes, now);
+}
+
+bool
+RateLimits::pacing() const
+{
+  return total.rate != 0 || clientRate != 0;
+}
@@ -0,0 +1,94 @@
+#ifndef AVANTEE_RATE_LIMIT_H
+#define AVANTEE_RATE_LIMIT_H
+
+#include <cstddef>
+#include <cstdint>
+#include <unordered_map>
+#include <vector>
+
+#include "connection_table.hpp"
+
+/* Tokens that come back at `rate` per second, up to `burst` of them. A
+ * rate of 0 is no limit. The count is kept in thousandths, so a slow rate
+ * refilled every millisecond does not round down to nothing */
+struct TokenBucket
+{
+  uint64_t rate;
+  int64_t burst;  // thousandths
+  int64_t tokens; // thousandths, below 0 after a charge it could not cover
+  uint64_t stamp; // ms of the last refill
+
+  TokenBucket(uint64_t per_second = 0, uint64_t capacity = 0);
+
+  /* take `n` tokens if there are that many */
+  bool take(uint64_t n, uint64_t now);
+  /* take `n` tokens even if it leaves the bucket in debt */
+  void charge(uint64_t n, uint64_t now);
+  /* give back `n` tokens taken but not used */
+  void refund(uint64_t n);
+  /* ms until `n` tokens are there, at least 1 */
+  uint64_t wait(uint64_t n) const;
+
+private:
+  void refill(uint64_t now);
+};
+
+/* Admission and bandwidth limits of one reactor.
+ *
+ * New transfers are admitted at a bounded rate, and the DATA a reactor
+ * sends is paced by two buckets: its share of the server wide limit and
+ * one per client address, shared by all of that client's transfers on
+ * this reactor. Limits for the whole server are split evenly between the
+ * reactors like the TID ports are, so every check is local to the event
+ * loop and takes no lock. A client whose transfers land on several
+ * reactors gets the per client rate from each of them.
+ *
+ * A client's bucket lives while it has transfers. They find it through a
+ * slot per connection handle, the address is only looked up when a
+ * transfer starts.
+ */
+struct RateLimits
+{
+  using Handle = ConnectionTable::Handle;
+  using ClientId = uint32_t;
+  static constexpr ClientId NO_CLIENT = UINT32_MAX;
+
+  struct Client
+  {
+    TokenBucket bucket;
+    uint32_t transfers; // 0: the slot is free
+    PeerKey addr;       // the port is 0
+  };
+
+  TokenBucket admissions;
+  TokenBucket total;
+  uint64_t clientRate; // bytes per second, 0: no per client limit
+  std::vector<Client> clients;
+  std::vector<ClientId> free_ids;
+  std::unordered_map<PeerKey, ClientId, PeerKeyHash> by_addr;
+  std::vector<ClientId> by_handle; // per connection, NO_CLIENT if unlimited
+
+  /* `admit_rate` transfers a second, `byte_rate` bytes a second in all and
+   * `client_byte_rate` to each client, 0 for no limit */
+  RateLimits(uint64_t admit_rate,
+             uint64_t byte_rate,
+             uint64_t client_byte_rate,
+             std::size_t max_connections);
+
+  /* false if a transfer may not start now */
+  bool admit(uint64_t now);
+  /* transfer `h` sends to `peer` from now on */
+  void attach(Handle h, const PeerKey& peer);
+  /* transfer `h` ended */
+  void detach(Handle h);
+
+  /* 0 if `bytes` may be sent for `h` now, and were taken. Otherwise the
+   * ms until they may */
+  uint64_t take(Handle h, uint64_t bytes, uint64_t now);
+  /* `bytes` that were sent regardless, retransmits */
+  void charge(Handle h, uint64_t bytes, uint64_t now);
+  /* true if DATA is paced at all */
+  bool pacing() const;
+};
+
+#endif
@@ -0,0 +1,1125 @@
+#include <algorithm>
+#include <cctype>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+
+#include "reactor.hpp"
+#include "socket/error_utils.hpp"
+
+#define SCAST(Type, e) static_cast<Type>(e)
+#define RCAST(Type, e) reinterpret_cast<Type>(e)
+#define TU(enum) std::to_underlying(enum)
+
+namespace BS = BetterSocket;
+
+// TFTP modes are case insensitive
+static bool
+isMode(std::string_view mode, std::string_view name)
+{
+  return mode.size() == name.size() &&
+         std::equal(mode.begin(), mode.end(), name.begin(), [](char a, char b) {
+           return std::tolower(static_cast<unsigned char>(a)) == b;
+         });
+}
+
+// the UDP offloads are done by the kernel for poll and epoll only
+static bool
+offloads(const ServerOptions& opts)
+{
+  return (opts.gso || opts.gro) &&
+         opts.backend != Multiplexer::Backend::uring;
+}
+
+// DATA is only received by uploads, everything else fits the default. What
+// the kernel coalesces is up to 64 KiB
+static BS::Size
+receiveSize(const ServerOptions& opts)
+{
+  BS::Size size = TU(Multiplexer::constants::DATAGRAM_SIZE);
+  if (opts.uploadRoot.empty())
+    return size;
+  if (opts.gro && offloads(opts))
+    return 1 << 16;
+  return std::max(size, packetSize(opts.maxUploadBlksize));
+}
+
+// RFC 2090: what a member of a multicast session is acknowledged. Timeout
+// and windowsize are the session's, not any one member's
+static uint8_t
+groupOptions(uint8_t proposed, uint16_t blksize)
+{
+  uint8_t acked =
+    TransferOptions::MULTICAST | (proposed & TransferOptions::TSIZE);
+  if (blksize != TU(Constants::maxDataLen))
+    acked |= TransferOptions::BLKSIZE;
+  return acked;
+}
+
+// what to tell a client whose upload could not be stored
+static ErrorCodes
+diskError(int err)
+{
+  switch (err) {
+    case ENOSPC:
+    case EDQUOT:
+    case EFBIG:
+      return ErrorCodes::diskFull;
+    case EACCES:
+    case EPERM:
+    case EROFS:
+    case EISDIR:
+      return ErrorCodes::accessViolation;
+    case ENOENT:
+      return ErrorCodes::fileNotFound;
+    default:
+      return ErrorCodes::undefined;
+  }
+}
+
+Reactor::Reactor(const ServerOptions& opts,
+                 const BS::SocketHint& h,
+                 BS::BSocket&& tftp_listener,
+                 PortPool&& tid_pool,
+                 BlockCache* cache,
+                 Multicast&& group_pool)
+  : options{ opts }
+  , hint{ h }
+  , listener{ std::move(tftp_listener) }
+  , tids{ std::move(tid_pool) }
+  , multiplexer{ opts.backend, receiveSize(opts) }
+  , timers{}
+  , connections{ opts.maxTransfers }
+  , files{ opts.fileIO == FileIO::mmap, cache }
+  , uploads{ opts.fsync,
+             opts.uploadThread && !opts.uploadRoot.empty(),
+             opts.uploadRoot.empty() ? 0 : opts.maxTransfers,
+             2 * std::size_t{ opts.maxTransfers } }
+  , multicast{ std::move(group_pool) }
+  , limits{ opts.admitRate,
+            opts.byteRate,
+            opts.clientByteRate,
+            opts.maxTransfers }
+  , scheduler{ opts.maxTransfers,
+               opts.scheduling == Scheduling::drr ? opts.quantum : 0 }
+  , readAhead{ opts.maxTransfers, opts.readAhead }
+  , outgoing(packetSize(TU(Constants::maxBlksize)))
+{
+  // each socket that cannot offload falls back on its own
+  bool gro = false;
+#if defined(AVANTEE_HAVE_MMSG)
+  if (offloads(opts)) {
+    multiplexer.segment_offload = opts.gso && listener.canSegment();
+    gro = opts.gro && !opts.uploadRoot.empty();
+  }
+#endif
+  multiplexer.receive_datagrams(listener.underlyingSocket(),
+                                gro && listener.coalesceReceives(true));
+  if (uploads.notifier() != -1)
+    multiplexer.watch(uploads.notifier(), Multiplexer::Events::input);
+  if (files.notifier() != -1)
+    multiplexer.watch(files.notifier(), Multiplexer::Events::input);
+  // the TID sockets stay registered for their whole life, a transfer that
+  // starts or ends does not touch the multiplexer
+  for (PortPool::Tid tid = 0; tid < tids.size(); tid++)
+    multiplexer.receive_datagrams(
+      tids.socket(tid), gro && tids.sockets[tid].coalesceReceives(true));
+  // only the block cache keeps what it sent until the kernel is done
+  if (opts.zeroCopy && cache != nullptr &&
+      opts.backend != Multiplexer::Backend::uring) {
+    if (listener.zeroCopy(true))
+      multiplexer.zerocopy_sends(listener.underlyingSocket());
+    for (auto& s : tids.sockets)
+      if (s.zeroCopy(true))
+        multiplexer.zerocopy_sends(s.underlyingSocket());
+  }
+
+  // sessions send to their group from a TID socket, which has to be IPv4.
+  // Members on this host hear the group too, over loopback for a test
+  if (multicast.size() == 0)
+    return;
+  try {
+    for (auto& s : tids.sockets) {
+      if (s.validAddr.ai_family != AF_INET)
+        throw SockErrors::APIError(SockErrors::errc::setsockopt_failure,
+                                   "the TID sockets are not IPv4");
+      s.multicastLoop(true);
+      s.multicastTtl(SCAST(int, opts.multicastTtl));
+      if (!opts.multicastInterface.empty())
+        s.multicastInterface(opts.multicastInterface);
+    }
+  } catch (const SockErrors::APIError& e) {
+    std::fprintf(stderr, "avantee-server: no multicast: %s\n", e.what());
+    multicast = {};
+  }
+}
+
+/* milliseconds to wait for an ACK after `backoff` timeouts in a row. RFC
+ * 2349: a timeout the client asked for is used as is. RFC 6298 otherwise,
+ * doubled on every timeout */
+uint64_t
+Reactor::retransmitTimeout(const Connection& con, uint8_t backoff)
+{
+  if (con.timeout != 0)
+    return con.timeout * 1000u;
+  const uint64_t ceiling = TU(Constants::maxRetransmitTimeout);
+  uint64_t rto = TU(Constants::retransmitTimeout);
+  if (con.rttvar != Connection::NO_RTT)
+    rto = std::clamp<uint64_t>(con.srtt / 8 + con.rttvar,
+                               TU(Constants::minRetransmitTimeout),
+                               ceiling);
+  return backoff >= 8 ? ceiling : std::min(rto << backoff, ceiling);
+}
+
+/* an ACK made progress: time it against the send it answers, which is
+ * when the retransmit timer was armed. Karn: an ACK after a retransmit
+ * could answer either send and is not a sample */
+void
+Reactor::sampleRoundTrip(Handle h)
+{
+  auto& con = connections[h];
+  if (con.retransmitTimer == TimerWheel::NO_TIMER)
+    return;
+  auto rto = retransmitTimeout(con, con.retransmits);
+  auto sent = timers.deadline(con.retransmitTimer) - rto;
+  auto now = timers.now();
+  uint64_t elapsed = now > sent ? now - sent : 0;
+
+  if (con.retransmits > 0) {
+    // back well before a round trip: the first send was answered, it was
+    // only slower than the timeout
+    if (con.rttvar != Connection::NO_RTT && elapsed * 16 < con.srtt)
+      stats.spurious.fetch_add(1, std::memory_order_relaxed);
+    return;
+  }
+
+  auto m = SCAST(int32_t,
+                 std::min<uint64_t>(elapsed, TU(Constants::maxRetransmitTimeout)));
+  if (con.rttvar == Connection::NO_RTT) {
+    con.srtt = SCAST(uint16_t, m * 8);
+    con.rttvar = SCAST(uint16_t, m * 2);
+    return;
+  }
+  // RFC 6298 with alpha 1/8 and beta 1/4, in fixed point
+  int32_t err = m - con.srtt / 8;
+  con.srtt = SCAST(uint16_t, con.srtt + err);
+  con.rttvar = SCAST(uint16_t, con.rttvar + std::abs(err) - con.rttvar / 4);
+}
+
+// part of the window is still to be sent: the timer paces it out
+bool
+Reactor::windowOpen(Connection& con)
+{
+  const auto& un = con.unacked;
+  return un.opcode == Opcodes::data && un.count < con.windowsize &&
+         un.block + un.count <= finalBlock(con);
+}
+
+/* the whole window was acknowledged without a retransmit. Slow start
+ * doubles `cwnd`, after that it grows by a block for every round trip the
+ * window took */
+void
+Reactor::growWindow(Connection& con)
+{
+  uint32_t cwnd = con.cwnd;
+  if (con.slowStart)
+    cwnd *= 2;
+  else
+    cwnd += (con.unacked.count + cwnd - 1) / cwnd;
+  con.cwnd = SCAST(uint16_t, std::min<uint32_t>(cwnd, con.windowsize));
+}
+
+// a loss: halve `cwnd`, at most once per window
+void
+Reactor::cutWindow(Connection& con)
+{
+  if (con.reduced)
+    return;
+  con.cwnd = std::max<uint16_t>(con.cwnd / 2, 1);
+  con.slowStart = 0;
+  con.reduced = 1;
+}
+
+void
+Reactor::armRetransmit(Handle h)
+{
+  auto& con = connections[h];
+  con.retransmitTimer =
+    timers.reschedule(con.retransmitTimer,
+                      retransmitTimeout(con, con.retransmits),
+                      SCAST(uint64_t, h));
+}
+
+BS::GSocket
+Reactor::socketOf(Connection& con)
+{
+  if (con.tid == PortPool::NO_TID)
+    return listener.underlyingSocket();
+  return tids.socket(con.tid);
+}
+
+// both ends of the datagram: who sent it and which of our ports got it
+TransferKey
+Reactor::keyOf(Multiplexer::Datagram& dgram)
+{
+  TransferKey key{ PeerKey::of(dgram.sender), 0 };
+  if (dgram.socket != listener.underlyingSocket()) {
+    auto tid = tids.find(dgram.socket);
+    key.local = tid == PortPool::NO_TID ? 0 : tids.port(tid);
+  }
+  return key;
+}
+
+void
+Reactor::closeConnection(Handle h)
+{
+  auto& con = connections[h];
+  timers.cancel(con.retransmitTimer);
+  con.retransmitTimer = TimerWheel::NO_TIMER;
+
+  if (con.tid != PortPool::NO_TID)
+    tids.release(con.tid);
+  if (Multicast::isGroup(con.peer))
+    multicast.close(multicast.of(h));
+  limits.detach(h);
+  scheduler.remove(h);
+  readAhead.stop(h);
+  // an upload that did not complete is removed
+  if (con.receiving) {
+    if (con.file != WriteBehind::NO_UPLOAD)
+      uploads.abort(con.file);
+  } else {
+    files.release(con.file);
+  }
+  con.tid = PortPool::NO_TID;
+  con.file = FileTable::NO_FILE;
+  con.IsActive = false;
+  connections.release(h);
+}
+
+// send DATA block `block` from the cache, the mapping, the file's shared
+// chunks or, if its chunk was not read, through read().
+// False if the file shrunk under us
+bool
+Reactor::sendBlock(Handle h, uint32_t block)
+{
+  auto& con = connections[h];
+  std::byte header[TU(Constants::headerLen)];
+  putU16(header, TU(Opcodes::data));
+  putU16(header + 2, SCAST(uint16_t, block & 0xffff));
+
+  auto packet = files.cached(con.file, block, con.blksize);
+  if (!packet.empty()) {
+    // the cache holds the whole packet, header included, and the file
+    // table keeps it for sends without a copy
+    multiplexer.send_parts(
+      socketOf(con), {}, packet, con.peer.get(), con.peer.len(), true);
+    return true;
+  }
+
+  auto length = blockLength(con, block);
+  auto offset = SCAST(uint64_t, block - 1) * con.blksize;
+  auto slice = files.mapped(con.file, offset, length);
+  if (slice.size() != length)
+    slice = files.buffered(con.file, block, con.blksize);
+  if (slice.size() == length) {
+    // zero copy: the header and a slice of the mapped file, or of the
+    // chunk read for every transfer of the file
+    multiplexer.send_parts(
+      socketOf(con), header, slice, con.peer.get(), con.peer.len());
+    return true;
+  }
+
+  auto* body = outgoing.data() + sizeof(header);
+  if (files.read(con.file, offset, body, length) != length)
+    return false;
+  std::memcpy(outgoing.data(), header, sizeof(header));
+  multiplexer.send_to(socketOf(con),
+                      outgoing.data(),
+                      sizeof(header) + length,
+                      con.peer.get(),
+                      con.peer.len());
+  return true;
+}
+
+/* acknowledge the `present` options to `to`, the transfer's peer or a
+ * member of its multicast session */
+void
+Reactor::sendOack(Handle h, const Endpoint& to, uint8_t present, bool master)
+{
+  auto& con = connections[h];
+  TransferOptions acked;
+  acked.present = present;
+  acked.blksize = con.blksize;
+  acked.windowsize = con.windowsize;
+  acked.timeout = con.timeout;
+  acked.tsize = con.receiving ? uploads.tsize(con.file) : files.size(con.file);
+  if (present & TransferOptions::MULTICAST) {
+    // a session's peer is its group
+    acked.group = ntohl(con.peer.addr.v4.sin_addr.s_addr);
+    acked.groupPort = ntohs(con.peer.addr.v4.sin_port);
+    acked.master = master;
+  }
+  auto size = buildOptions(std::span(outgoing).subspan(2), acked);
+  putU16(outgoing.data(), TU(Opcodes::oack));
+  multiplexer.send_to(
+    socketOf(con), outgoing.data(), 2 + size, to.get(), to.len());
+}
+
+// send the OACK, or every packet of the window again after a timeout
+void
+Reactor::sendUnacked(Handle h)
+{
+  auto& con = connections[h];
+  const auto& un = con.unacked;
+
+  if (un.opcode == Opcodes::oack && Multicast::isGroup(con.peer)) {
+    // the group does not answer, a session's OACK is for its master
+    const auto& master =
+      multicast.sessions[multicast.of(h)].members.front();
+    sendOack(h, master.peer, master.options, true);
+  } else if (un.opcode == Opcodes::oack) {
+    sendOack(h, con.peer, SCAST(uint8_t, un.block), false);
+  } else if (un.opcode == Opcodes::data) {
+    stats.retransmits.fetch_add(un.count, std::memory_order_relaxed);
+    for (uint32_t i = 0; i < un.count; i++) {
+      // not held back, but counted against the limits
+      if (limits.pacing())
+        limits.charge(h,
+                      packetSize(blockLength(con, un.block + i)),
+                      timers.now());
+      if (!sendBlock(h, un.block + i)) {
+        closeConnection(h);
+        return;
+      }
+    }
+  } else {
+    std::byte header[TU(Constants::headerLen)];
+    putU16(header, TU(un.opcode));
+    putU16(header + 2, SCAST(uint16_t, un.block & 0xffff));
+    multiplexer.send_to(
+      socketOf(con), header, sizeof(header), con.peer.get(), con.peer.len());
+  }
+
+  armRetransmit(h);
+}
+
+/* send new DATA blocks until the window is full or the file is all out.
+ * At most `cwnd` of them at once, the rest a round trip later, or as soon
+ * as the rate limits let them go. With DRR they wait for the transfer's
+ * turn, see `run()` */
+void
+Reactor::fillWindow(Handle h)
+{
+  auto& con = connections[h];
+  if (scheduler.enabled()) {
+    bool small = files.size(con.file) <= options.smallFile;
+    scheduler.queue(
+      h, con.cwnd, small ? TU(Scheduler::constants::SMALL_WEIGHT) : 1);
+    return;
+  }
+  uint16_t burst = con.cwnd;
+  uint64_t budget = UINT64_MAX;
+  sendWindow(h, burst, budget);
+}
+
+/* keep the disk reading ahead of `h`, and tell how many of the next
+ * `burst` blocks it sends are in memory. Those that are not are sent a
+ * tick later, rather than wait for the disk in a page fault or read() */
+uint32_t
+Reactor::staged(Handle h, uint16_t burst)
+{
+  auto& con = connections[h];
+  auto next = con.unacked.block + con.unacked.count;
+  auto offset = SCAST(uint64_t, next - 1) * con.blksize;
+  if (!files.cached(con.file, next, con.blksize).empty())
+    return burst;
+  if (readAhead.active(h))
+    readAhead.advance(
+      h, files.descriptor(con.file), offset, files.size(con.file));
+
+  if (files.chunked(con.file)) {
+    // a chunk being read is waited for. One that cannot be, all of the
+    // file's chunks being in use, only so long: it is read on the spot
+    bool reading = false;
+    auto ready = files.staged(
+      con.file, next, burst, con.blksize, readAhead.depth, reading);
+    if (ready == 0 && reading)
+      return 0;
+    if (readAhead.hold(h, ready != 0))
+      return 0;
+    return ready != 0 ? ready : burst;
+  }
+  if (!readAhead.active(h))
+    return burst;
+  auto slice =
+    files.mapped(con.file, offset, std::size_t{ burst } * con.blksize);
+  auto ready = readAhead.resident(h, slice, con.blksize);
+  if (ready == slice.size())
+    return burst; // all of it, or held back long enough
+  return SCAST(uint32_t, ready / con.blksize);
+}
+
+/* send up to `burst` blocks of the window, as long as `budget` bytes
+ * cover them, and count both down. False if the budget ran out first */
+bool
+Reactor::sendWindow(Handle h, uint16_t& burst, uint64_t& budget)
+{
+  auto& con = connections[h];
+  auto& un = con.unacked;
+  const auto last = finalBlock(con);
+  uint64_t paced = 0;
+  uint32_t ready = staged(h, burst);
+  for (; burst > 0 && un.count < con.windowsize && un.block + un.count <= last;
+       burst--) {
+    auto size = packetSize(blockLength(con, un.block + un.count));
+    if (size > budget)
+      return false;
+    if (ready == 0) {
+      paced = 1; // the rest is still being read, see `staged()`
+      break;
+    }
+    if (limits.pacing()) {
+      paced = limits.take(h, size, timers.now());
+      if (paced != 0)
+        break;
+    }
+    if (!sendBlock(h, un.block + un.count)) {
+      closeConnection(h);
+      return true;
+    }
+    un.count++;
+    ready--;
+    budget -= size;
+  }
+
+  if (paced != 0)
+    con.retransmitTimer =
+      timers.reschedule(con.retransmitTimer, paced, SCAST(uint64_t, h));
+  else if (windowOpen(con))
+    con.retransmitTimer = timers.reschedule(
+      con.retransmitTimer, std::max(con.srtt / 8, 1), SCAST(uint64_t, h));
+  else
+    armRetransmit(h);
+  return true;
+}
+
+// errors are not acknowledged nor retransmitted
+void
+Reactor::sendError(BS::GSocket sock,
+                   const Endpoint& to,
+                   ErrorCodes code,
+                   std::string_view msg)
+{
+  auto size = buildError(outgoing, code, msg);
+  multiplexer.send_to(sock, outgoing.data(), size, to.get(), to.len());
+}
+
+// the last DATA block, shorter than the others and possibly empty
+uint32_t
+Reactor::finalBlock(Connection& con)
+{
+  auto size = files.size(con.file);
+  if (size == FileTable::UNKNOWN_SIZE)
+    return UINT32_MAX; // netascii, until its end is translated
+  return SCAST(uint32_t, size / con.blksize + 1);
+}
+
+// payload bytes of DATA block `block`, the last one is shorter than a block
+uint16_t
+Reactor::blockLength(Connection& con, uint32_t block)
+{
+  uint64_t blksize = con.blksize;
+  uint64_t offset = SCAST(uint64_t, block - 1) * blksize;
+  uint64_t size = files.size(con.file);
+  return SCAST(uint16_t, offset >= size ? 0 : std::min(blksize, size - offset));
+}
+
+// the file a request names, below the served root. Requests that try to
+// leave it are refused
+bool
+Reactor::resolvePath(const std::string& root,
+                     std::string_view filename,
+                     std::string& path)
+{
+  while (!filename.empty() && filename.front() == '/')
+    filename.remove_prefix(1);
+
+  for (std::string_view rest = filename; !rest.empty();) {
+    auto slash = rest.find('/');
+    auto part = rest.substr(0, slash);
+    if (part == "..")
+      return false;
+    rest = slash == std::string_view::npos ? "" : rest.substr(slash + 1);
+  }
+
+  path = root;
+  path += '/';
+  path += filename;
+  return !filename.empty();
+}
+
+void
+Reactor::onTimer(uint64_t token)
+{
+  auto h = SCAST(Handle, token);
+  auto& con = connections[h];
+  if (!con.IsActive)
+    return;
+  con.retransmitTimer = TimerWheel::NO_TIMER;
+  if (windowOpen(con)) {
+    fillWindow(h); // the next burst is due
+    return;
+  }
+  if (con.receiving && con.unacked.count == 0) {
+    closeConnection(h); // done dallying, the upload is stored
+    return;
+  }
+
+  // a peer is given up on after enough retries and enough time: short
+  // timeouts alone would drop a client that is only slow for a moment
+  uint64_t waited = 0;
+  for (uint8_t i = 0; i <= con.retransmits; i++)
+    waited += retransmitTimeout(con, i);
+  if (con.retransmits >= TU(Constants::maxRetransmits) &&
+      waited >= TU(Constants::idleTimeout)) {
+    // a session only gives up on its master
+    if (Multicast::isGroup(con.peer))
+      nextMaster(h);
+    else
+      closeConnection(h);
+    return;
+  }
+
+  stats.timeouts.fetch_add(1, std::memory_order_relaxed);
+  con.retransmits++;
+  // the window is sent again as it was: the peer may hold any part of it
+  // and acknowledge up to its end. The windows after it are paced slower
+  if (options.congestion == Congestion::aimd)
+    cutWindow(con);
+  sendUnacked(h);
+}
+
+void
+Reactor::registerClient(const TransferKey& key,
+                        Multiplexer::Datagram& dgram,
+                        const Request& request)
+{
+  auto peer = Endpoint::of(dgram.sender);
+  auto sock = listener.underlyingSocket();
+  bool upload = request.opcode == Opcodes::wrq;
+
+  if (upload && options.uploadRoot.empty()) {
+    sendError(sock, peer, ErrorCodes::illegalOperation, "writing is not supported");
+    return;
+  }
+  bool netascii = isMode(request.mode, "netascii");
+  if (!netascii && !isMode(request.mode, "octet")) {
+    sendError(sock, peer, ErrorCodes::undefined, "mail mode is not supported");
+    return;
+  }
+
+  // a burst of requests is turned away at once, rather than left to time
+  // out or fill the table
+  if (!limits.admit(timers.now())) {
+    sendError(sock, peer, ErrorCodes::undefined, "server busy, try later");
+    return;
+  }
+
+  std::string path;
+  if (!resolvePath(upload ? options.uploadRoot : options.root,
+                   request.filename,
+                   path)) {
+    sendError(sock, peer, ErrorCodes::accessViolation, "access violation");
+    return;
+  }
+  // an upload's file is opened by WriteBehind once it has a transfer
+  auto file = upload ? FileTable::NO_FILE : files.open(path, netascii);
+  if (!upload && file == FileTable::NO_FILE) {
+    if (errno == ENOENT)
+      sendError(sock, peer, ErrorCodes::fileNotFound, "file not found");
+    else if (errno == EACCES || errno == EISDIR)
+      sendError(sock, peer, ErrorCodes::accessViolation, std::strerror(errno));
+    else
+      sendError(sock, peer, ErrorCodes::undefined, std::strerror(errno));
+    return;
+  }
+
+  // RFC 2348: the client proposes a block size, we take it as is, or up
+  // to our receive buffers for an upload. RFC 7440: its window is capped by
+  // ours, an upload is acknowledged block by block. RFC 2349: its timeout
+  // replaces ours, and tsize is answered with the file size when it is
+  // known or, for an upload, preallocated. A malformed option list gets a
+  // plain RFC 1350 transfer
+  TransferOptions proposed;
+  if (!parseOptions(request.options, proposed))
+    proposed = {};
+  uint16_t blksize = proposed.present & TransferOptions::BLKSIZE
+                       ? proposed.blksize
+                       : TU(Constants::maxDataLen);
+  if (upload)
+    blksize = std::min(blksize, options.maxUploadBlksize);
+  else
+    files.prepare(file, blksize);
+  // the size of netascii is only known once translated, unless cached
+  if (!upload && files.size(file) == FileTable::UNKNOWN_SIZE)
+    proposed.present &= SCAST(uint8_t, ~TransferOptions::TSIZE);
+
+  // RFC 2090: a client asking for multicast joins the session sending its
+  // file, or starts one. Without a free group it is served on its own
+  auto session = Multicast::NO_SESSION;
+  if (proposed.present & TransferOptions::MULTICAST && !upload) {
+    if (joinSession(key.peer, peer, file, blksize, proposed.present))
+      return;
+    session = multicast.vacant();
+  }
+  bool group = session != Multicast::NO_SESSION;
+
+  uint8_t acked = proposed.present & (TransferOptions::TIMEOUT |
+                                      TransferOptions::TSIZE);
+  uint16_t windowsize =
+    proposed.present & TransferOptions::WINDOWSIZE && !upload && !group
+      ? std::min<uint16_t>(proposed.windowsize, options.maxWindow)
+      : 1;
+  if (blksize != TU(Constants::maxDataLen))
+    acked |= TransferOptions::BLKSIZE;
+  if (windowsize != 1)
+    acked |= TransferOptions::WINDOWSIZE;
+  if (group)
+    acked = groupOptions(proposed.present, blksize);
+
+  PortPool::Tid tid = PortPool::NO_TID;
+  TransferKey transfer = key;
+  auto h = ConnectionTable::NO_CONNECTION;
+  if (options.demux == Demux::socket) {
+    tid = tids.acquire();
+    if (tid != PortPool::NO_TID) {
+      transfer.local = tids.port(tid);
+      // a session is registered under its group, its members are not
+      // looked up in the table
+      if (group)
+        transfer = multicast.key(session, transfer.local);
+      h = connections.allocate(transfer);
+    }
+  } else {
+    h = connections.allocate(transfer);
+  }
+
+  if (h != ConnectionTable::NO_CONNECTION && upload) {
+    file = uploads.open(path, proposed.tsize, netascii, h);
+    if (file == WriteBehind::NO_UPLOAD) {
+      connections.release(h); // the last ones are still being written
+      h = ConnectionTable::NO_CONNECTION;
+    }
+  }
+  if (h == ConnectionTable::NO_CONNECTION) {
+    if (tid != PortPool::NO_TID)
+      tids.release(tid);
+    if (!upload)
+      files.release(file);
+    sendError(sock, peer, ErrorCodes::undefined, "too many transfers");
+    return;
+  }
+
+  auto& connection = connections[h];
+  connection.peer = group ? multicast.groups[session] : peer;
+  connection.tid = tid; // NO_TID: replies go out of the listener
+  connection.file = file;
+  connection.unacked = {};
+  connection.lastOpcode = request.opcode;
+  connection.lastBlock = 0;
+  connection.retransmits = 0;
+  connection.retransmitTimer = TimerWheel::NO_TIMER;
+  connection.IsActive = true;
+  connection.blksize = blksize;
+  connection.windowsize = windowsize;
+  connection.srtt = 0;
+  connection.rttvar = Connection::NO_RTT;
+  connection.timeout = acked & TransferOptions::TIMEOUT ? proposed.timeout : 0;
+  connection.cwnd = options.congestion == Congestion::aimd
+                      ? std::min<uint16_t>(windowsize,
+                                           TU(Constants::initialCwnd))
+                      : windowsize;
+  connection.slowStart = 1;
+  connection.reduced = 0;
+  connection.receiving = upload;
+  limits.attach(h, transfer.peer);
+
+  // the first ACK or OACK of an upload waits for its file, see
+  // onUploadDone()
+  if (upload) {
+    connection.unacked = { acked, 0, Opcodes::wrq };
+    return;
+  }
+
+  // files in the block cache are in memory, netascii is read as translated
+  if (!netascii && files.cached(file, 1, blksize).empty())
+    readAhead.start(h, files.descriptor(file), files.size(file));
+
+  if (group)
+    multicast.open(
+      session, h, transfer.local, file, blksize, { peer, key.peer, acked });
+
+  // with options the client first acknowledges our OACK as block 0
+  if (acked != 0) {
+    connection.unacked = { acked, 1, Opcodes::oack };
+    sendUnacked(h);
+  } else {
+    connection.unacked = { 1, 0, Opcodes::data };
+    fillWindow(h);
+  }
+}
+
+void
+Reactor::runConnection(Handle h)
+{
+  auto& con = connections[h];
+  if (!con.IsActive)
+    return; // closed after it was queued
+
+  if (con.lastOpcode == Opcodes::error) {
+    closeConnection(h); // the peer gave up
+    return;
+  }
+
+  // an upload's DATA was taken by onData() already
+  if (con.lastOpcode != Opcodes::ack || con.receiving)
+    return;
+
+  auto& un = con.unacked;
+  uint32_t acked = 0;
+  bool group = Multicast::isGroup(con.peer);
+  if (group) {
+    // RFC 2090: the master acknowledges the last block it has in order. A
+    // new master may be behind the group, even at 0 if it joined late, and
+    // the session goes back for it. Lock step, the window is 1
+    if (!groupAck(h, multicast.sessions[multicast.of(h)], acked))
+      return;
+    if (un.opcode == Opcodes::data && acked < un.block)
+      return; // a duplicate, see below
+  } else if (un.opcode == Opcodes::oack) {
+    if (con.lastBlock != 0)
+      return;
+  } else {
+    // how far into the window the ACK reaches. One for the block before
+    // it is a duplicate and is ignored: answering those would double every
+    // packet from then on (Sorcerer's Apprentice)
+    uint16_t reach = SCAST(uint16_t, con.lastBlock - (un.block - 1));
+    if (reach == 0 && options.congestion == Congestion::aimd)
+      cutWindow(con); // the window's first block is missing
+    if (reach == 0 || reach > un.count)
+      return;
+    acked = un.block - 1 + reach;
+
+    // a partial ACK means the blocks after it were lost
+    if (options.congestion == Congestion::aimd) {
+      if (reach < un.count)
+        cutWindow(con);
+      else if (con.retransmits == 0 && !windowOpen(con))
+        growWindow(con);
+    }
+  }
+
+  // while the window is paced out the timer is no measure of the send time
+  if (!windowOpen(con))
+    sampleRoundTrip(h);
+  con.retransmits = 0;
+
+  if (group && acked == finalBlock(con)) {
+    nextMaster(h); // this master has the whole file
+    return;
+  }
+  if (un.opcode == Opcodes::data && acked == finalBlock(con)) {
+    closeConnection(h); // the short block made it, the file is sent
+    return;
+  }
+
+  // RFC 7440: an ACK short of the window's end means the blocks after it
+  // were lost, the next window starts right after it either way
+  if (un.opcode == Opcodes::data && un.block + un.count - 1 > acked)
+    stats.retransmits.fetch_add(un.block + un.count - 1 - acked,
+                                std::memory_order_relaxed);
+  un = { acked + 1, 0, Opcodes::data };
+  con.reduced = 0;
+  fillWindow(h);
+}
+
+/* DATA of an upload. The next block is copied to the write-behind buffers
+ * and acknowledged, the final one only once the file is complete on disk */
+void
+Reactor::onData(Handle h, std::span<const std::byte> packet)
+{
+  auto& con = connections[h];
+  auto& un = con.unacked;
+  if (un.opcode == Opcodes::wrq)
+    return; // the file is being opened or completed
+
+  uint16_t block = getU16(packet.data() + 2);
+  uint32_t last = un.opcode == Opcodes::oack ? 0 : un.block;
+  if (un.opcode == Opcodes::ack && block == (last & 0xffff)) {
+    // the peer sent its block again, our ACK was lost
+    if (un.count == 0)
+      sendFinalAck(h);
+    else
+      sendUnacked(h);
+    return;
+  }
+  if (un.count == 0 || block != ((last + 1) & 0xffff))
+    return;
+
+  auto payload = packet.subspan(TU(Constants::headerLen));
+  if (payload.size() > con.blksize) {
+    sendError(socketOf(con),
+              con.peer,
+              ErrorCodes::illegalOperation,
+              "block larger than negotiated");
+    closeConnection(h);
+    return;
+  }
+  // out of buffers: the disk is behind, the peer will send the block again
+  if (!uploads.append(con.file, payload))
+    return;
+
+  sampleRoundTrip(h);
+  con.retransmits = 0;
+  if (payload.size() < con.blksize) {
+    // the short block ends the file
+    timers.cancel(con.retransmitTimer);
+    con.retransmitTimer = TimerWheel::NO_TIMER;
+    un = { last + 1, 0, Opcodes::wrq };
+    uploads.finish(con.file);
+    return;
+  }
+  un = { last + 1, 1, Opcodes::ack };
+  sendUnacked(h);
+}
+
+/* WriteBehind opened or completed an upload's file, or failed to */
+void
+Reactor::onUploadDone(const WriteBehind::Result& result)
+{
+  auto h = SCAST(Handle, result.owner);
+  auto& con = connections[h];
+  auto& un = con.unacked;
+
+  if (result.error != 0) {
+    sendError(socketOf(con),
+              con.peer,
+              diskError(result.error),
+              std::strerror(result.error));
+    closeConnection(h);
+    return;
+  }
+
+  if (result.job == WriteBehind::Job::open) {
+    // RFC 2347: the OACK stands for ACK 0
+    if (un.block != 0)
+      un = { un.block, 1, Opcodes::oack };
+    else
+      un = { 0, 1, Opcodes::ack };
+    sendUnacked(h);
+  } else if (result.job == WriteBehind::Job::finish) {
+    // the file is stored and its upload id free for the next WRQ, the
+    // dally that follows must not abort that one
+    con.file = WriteBehind::NO_UPLOAD;
+    un = { un.block, 0, Opcodes::ack };
+    sendFinalAck(h);
+  }
+}
+
+/* acknowledge the final block of an upload, then wait in case the ACK is
+ * lost and the block comes again (RFC 1350 dallying) */
+void
+Reactor::sendFinalAck(Handle h)
+{
+  sendUnacked(h);
+  auto& con = connections[h];
+  con.retransmitTimer = timers.reschedule(con.retransmitTimer,
+                                          TU(Constants::dallyTimeout),
+                                          SCAST(uint64_t, h));
+}
+
+/* RFC 2090: add a client to the session that is sending `file` already,
+ * or send a member its OACK again. False if no session is sending it */
+bool
+Reactor::joinSession(const PeerKey& who,
+                     const Endpoint& peer,
+                     FileTable::FileId file,
+                     uint16_t blksize,
+                     uint8_t proposed)
+{
+  auto s = multicast.find(file, blksize);
+  if (s == Multicast::NO_SESSION)
+    return false;
+  files.release(file); // the session holds it already
+
+  auto& session = multicast.sessions[s];
+  auto* member = multicast.member(s, who);
+  if (member == nullptr) {
+    session.members.push_back({ peer, who, groupOptions(proposed, blksize) });
+    member = &session.members.back();
+  }
+  // a member listens until it is made master, the OACK tells it which one
+  // it is. Only the master's is retransmitted, the others ask again
+  sendOack(session.data,
+           member->peer,
+           member->options,
+           member == &session.members.front());
+  return true;
+}
+
+/* the block a session's master acknowledged, widened from the 16 bits on
+ * the wire to the latest block sent to the group that ends in them. False
+ * if no such block was sent */
+bool
+Reactor::groupAck(Handle h, const Multicast::Session& session, uint32_t& acked)
+{
+  auto& con = connections[h];
+  const auto& un = con.unacked;
+  uint32_t sent = session.sent;
+  if (un.opcode == Opcodes::data)
+    sent = std::max(sent, un.block + un.count - 1);
+  // ACK 0 of an OACK is a master that has nothing yet
+  if (un.opcode == Opcodes::oack && con.lastBlock == 0) {
+    acked = 0;
+    return true;
+  }
+  acked = (sent & ~uint32_t{ 0xffff }) | con.lastBlock;
+  if (acked > sent) {
+    if (acked < 0x10000)
+      return false;
+    acked -= 0x10000;
+  }
+  return true;
+}
+
+/* RFC 2090: the master has the whole file or stopped answering. The next
+ * member takes over, starting from the first block it is missing. The
+ * session ends with its last member */
+void
+Reactor::nextMaster(Handle h)
+{
+  auto& con = connections[h];
+  auto& un = con.unacked;
+  auto& session = multicast.sessions[multicast.of(h)];
+  if (un.opcode == Opcodes::data)
+    session.sent = std::max(session.sent, un.block + un.count - 1);
+  session.members.pop_front();
+  if (session.members.empty()) {
+    closeConnection(h);
+    return;
+  }
+  con.retransmits = 0;
+  un = { session.members.front().options, 1, Opcodes::oack };
+  sendUnacked(h);
+}
+
+/* a packet from a member of session `s`. Only the master's ACKs move the
+ * session on, any member may leave with an ERROR */
+void
+Reactor::onMemberPacket(Multicast::SessionId s,
+                        const PeerKey& who,
+                        std::span<const std::byte> packet)
+{
+  auto& session = multicast.sessions[s];
+  if (packet.size() < TU(Constants::headerLen) ||
+      multicast.member(s, who) == nullptr)
+    return;
+  auto h = session.data;
+  auto opcode = SCAST(Opcodes, getU16(packet.data()));
+  if (opcode == Opcodes::error) {
+    if (session.members.front().key == who)
+      nextMaster(h);
+    else
+      multicast.remove(s, who);
+    return;
+  }
+  if (opcode != Opcodes::ack)
+    return;
+
+  // a second ACK in the same batch: handle the first one now, it may have
+  // made another member master or ended the session
+  if (connections.queued[h])
+    runConnection(h);
+  if (session.data != h || session.members.empty() ||
+      !(session.members.front().key == who))
+    return;
+  connections[h].lastOpcode = opcode;
+  connections[h].lastBlock = getU16(packet.data() + 2);
+  connections.mark_ready(h);
+}
+
+void
+Reactor::onDatagram(Multiplexer::Datagram& dgram)
+{
+  auto key = keyOf(dgram);
+  auto h = connections.find(key);
+  if (h != ConnectionTable::NO_CONNECTION) {
+    if (dgram.payload.size() < TU(Constants::headerLen))
+      return;
+    // DATA is stored right away, its payload is gone after this batch
+    if (connections[h].receiving &&
+        getU16(dgram.payload.data()) == TU(Opcodes::data)) {
+      onData(h, dgram.payload);
+      return;
+    }
+    // a second datagram in the same batch: handle the first one now
+    if (connections.queued[h])
+      runConnection(h);
+    connections[h].lastOpcode = SCAST(Opcodes, getU16(dgram.payload.data()));
+    connections[h].lastBlock = getU16(dgram.payload.data() + 2);
+    connections.mark_ready(h);
+    return;
+  }
+
+  // members of a multicast session answer from their own address
+  if (key.local != 0) {
+    auto s = multicast.at(key.local);
+    if (s != Multicast::NO_SESSION)
+      onMemberPacket(s, key.peer, dgram.payload);
+    return;
+  }
+
+  // only the well known port takes new requests, anything else on a TID
+  // port is for a transfer that is gone or was never ours
+  Request request;
+  if (dgram.socket == listener.underlyingSocket() &&
+      parseRequest(dgram.payload, request))
+    registerClient(key, dgram, request);
+}
+
+void
+Reactor::run()
+{
+  for (;;) {
+    // sleep until there is I/O or the nearest retransmit deadline, only
+    // look for I/O while transfers are waiting for their turn
+    multiplexer.poll_io(scheduler.empty() ? timers.next_timeout() : 0);
+    files.tick();
+    files.reap(multiplexer.zerocopy_ticket(), multiplexer.zerocopy_done());
+    // chunks the I/O thread read, the transfers waiting for them send
+    // them once their timer is due
+    files.completed();
+
+    // only the datagrams that arrived, already read by the multiplexer
+    for (auto& dgram : multiplexer.datagrams())
+      onDatagram(dgram);
+
+    // uploads whose file was opened, completed, or could not be written
+    uploads.completed(
+      [&](const WriteBehind::Result& r) { onUploadDone(r); });
+
+    // only the transfers that heard from their peer
+    connections.for_each_ready([&](Handle h) { runConnection(h); });
+
+    timers.advance([&](uint64_t token) { onTimer(token); });
+
+    // DRR: a turn for every transfer with DATA to send
+    scheduler.round([&](Handle h, Scheduler::Slot& slot) {
+      uint64_t budget = slot.deficit;
+      bool done = sendWindow(h, slot.burst, budget);
+      slot.deficit = SCAST(uint32_t, budget);
+      return !done;
+    });
+  }
+}
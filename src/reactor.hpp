@@ -0,0 +1,120 @@
+#ifndef AVANTEE_REACTOR_H
+#define AVANTEE_REACTOR_H
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+#include "block_cache.hpp"
+#include "connection_table.hpp"
+#include "file_table.hpp"
+#include "multicast.hpp"
+#include "multiplexer.hpp"
+#include "options.hpp"
+#include "port_pool.hpp"
+#include "rate_limit.hpp"
+#include "read_ahead.hpp"
+#include "scheduler.hpp"
+#include "socket/socket.hpp"
+#include "tftp.hpp"
+#include "timer_wheel.hpp"
+#include "write_behind.hpp"
+
+/* Retransmission counters of all reactors, for the operator: a high share
+ * of spurious retransmits means the timeouts are too short for the path */
+struct TransferStats
+{
+  std::atomic<uint64_t> timeouts{ 0 };    // retransmit timers that fired
+  std::atomic<uint64_t> retransmits{ 0 }; // packets sent again, by timeout
+                                          // or after a partial window ACK
+  std::atomic<uint64_t> spurious{ 0 };    // timeouts the original answered
+};
+
+/* One event loop: a listener socket, its multiplexer, timers and the
+ * transfers it accepted. Nothing is shared between reactors, so several of
+ * them can run on their own threads without locking. The block cache, if
+ * any, is the exception: it is shared and locks internally. Uploads are
+ * written to disk by an I/O thread of the reactor's own. Multicast sessions
+ * are transfers too, sending to a group instead of a client. */
+struct Reactor
+{
+  using Handle = ConnectionTable::Handle;
+
+  inline static TransferStats stats;
+
+  const ServerOptions& options;
+  BetterSocket::SocketHint hint;
+  BetterSocket::BSocket listener;
+  PortPool tids;
+  Multiplexer multiplexer;
+  TimerWheel timers;
+  ConnectionTable connections;
+  FileTable files;
+  WriteBehind uploads;
+  Multicast multicast;
+  RateLimits limits;
+  Scheduler scheduler;
+  ReadAhead readAhead;
+  std::vector<std::byte> outgoing; // packets built right before sending
+
+  Reactor(const ServerOptions& opts,
+          const BetterSocket::SocketHint& h,
+          BetterSocket::BSocket&& tftp_listener,
+          PortPool&& tid_pool,
+          BlockCache* cache = nullptr,
+          Multicast&& group_pool = {});
+
+  /* serve forever */
+  void run();
+
+private:
+  uint64_t retransmitTimeout(const Connection& con, uint8_t backoff);
+  void sampleRoundTrip(Handle h);
+  void armRetransmit(Handle h);
+  bool windowOpen(Connection& con);
+  void growWindow(Connection& con);
+  void cutWindow(Connection& con);
+  BetterSocket::GSocket socketOf(Connection& con);
+  TransferKey keyOf(Multiplexer::Datagram& dgram);
+  void onDatagram(Multiplexer::Datagram& dgram);
+  bool resolvePath(const std::string& root,
+                   std::string_view filename,
+                   std::string& path);
+  void sendError(BetterSocket::GSocket sock,
+                 const Endpoint& to,
+                 ErrorCodes code,
+                 std::string_view msg);
+  void registerClient(const TransferKey& key,
+                      Multiplexer::Datagram& dgram,
+                      const Request& request);
+  uint32_t finalBlock(Connection& con);
+  uint16_t blockLength(Connection& con, uint32_t block);
+  void runConnection(Handle h);
+  bool sendBlock(Handle h, uint32_t block);
+  void sendOack(Handle h, const Endpoint& to, uint8_t present, bool master);
+  void sendUnacked(Handle h);
+  void fillWindow(Handle h);
+  uint32_t staged(Handle h, uint16_t burst);
+  bool sendWindow(Handle h, uint16_t& burst, uint64_t& budget);
+  void onData(Handle h, std::span<const std::byte> packet);
+  void onUploadDone(const WriteBehind::Result& result);
+  void sendFinalAck(Handle h);
+  bool joinSession(const PeerKey& who,
+                   const Endpoint& peer,
+                   FileTable::FileId file,
+                   uint16_t blksize,
+                   uint8_t proposed);
+  bool groupAck(Handle h, const Multicast::Session& session, uint32_t& acked);
+  void nextMaster(Handle h);
+  void onMemberPacket(Multicast::SessionId s,
+                      const PeerKey& who,
+                      std::span<const std::byte> packet);
+  void closeConnection(Handle h);
+  void onTimer(uint64_t token);
+};
+
+#endif
@@ -0,0 +1,91 @@
+#include <algorithm>
+#include <utility>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "read_ahead.hpp"
+
+#define SCAST(Type, e) static_cast<Type>(e)
+#define TU(e) std::to_underlying(e)
+
+ReadAhead::ReadAhead(std::size_t max_connections, uint64_t depth_bytes)
+  : stages(max_connections, Stage{ OFF, 0 })
+  , depth{ depth_bytes }
+  , pages{}
+{
+}
+
+void
+ReadAhead::start(Handle h, int fd, uint64_t size)
+{
+  if (!enabled())
+    return;
+  // doubles the kernel's own read-ahead on faults and reads of the file
+  posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+  stages[h] = { 0, 0 };
+  advance(h, fd, 0, size);
+}
+
+void
+ReadAhead::stop(Handle h)
+{
+  stages[h] = { OFF, 0 };
+}
+
+void
+ReadAhead::advance(Handle h, int fd, uint64_t offset, uint64_t size)
+{
+  auto& stage = stages[h];
+  if (stage.hinted == OFF)
+    return;
+  uint64_t target = std::min(size, offset + depth);
+  if (stage.hinted >= target || stage.hinted >= offset + depth / 2)
+    return;
+  uint64_t from = std::max(stage.hinted, offset);
+  // starts the reads and returns, a hint that fails costs nothing
+  posix_fadvise(
+    fd, SCAST(off_t, from), SCAST(off_t, target - from), POSIX_FADV_WILLNEED);
+  stage.hinted = target;
+}
+
+std::size_t
+ReadAhead::resident(Handle h,
+                    std::span<const std::byte> slice,
+                    std::size_t block)
+{
+  static const auto page = SCAST(uintptr_t, sysconf(_SC_PAGESIZE));
+  auto& stage = stages[h];
+  if (slice.empty() || stage.hinted == OFF)
+    return slice.size();
+
+  auto start = reinterpret_cast<uintptr_t>(slice.data());
+  auto base = start & ~(page - 1);
+  auto length = start + slice.size() - base;
+  pages.resize((length + page - 1) / page);
+  if (mincore(reinterpret_cast<void*>(base), length, pages.data()) == -1)
+    return slice.size();
+
+  std::size_t in = 0;
+  while (in < pages.size() && pages[in] & 1)
+    in++;
+  auto ready = in * page > start - base ? in * page - (start - base) : 0;
+  ready = std::min(ready, slice.size());
+  // part of a block sends nothing, it waits like none at all
+  bool staged = ready >= std::min(block, slice.size());
+  if (hold(h, staged))
+    return 0;
+  return staged ? ready : slice.size();
+}
+
+bool
+ReadAhead::hold(Handle h, bool staged)
+{
+  auto& stage = stages[h];
+  if (staged || ++stage.waits >= TU(constants::MAX_WAITS)) {
+    stage.waits = 0;
+    return false;
+  }
+  return true;
+}
@@ -0,0 +1,72 @@
+#ifndef AVANTEE_READ_AHEAD_H
+#define AVANTEE_READ_AHEAD_H
+
+#include <cstddef>
+#include <cstdint>
+#include <span>
+#include <vector>
+
+#include "connection_table.hpp"
+
+/* Blocks of the files being sent, read from disk ahead of the ACKs.
+ *
+ * A block that is not in the page cache stalls the whole event loop while
+ * the page fault or read() waits for the disk, and with it every other
+ * transfer of the reactor. So each transfer keeps the kernel reading the
+ * next `depth` bytes of its file: POSIX_FADV_WILLNEED starts the reads and
+ * returns, and it is issued again once half of them were sent. Before a
+ * burst is sent from the mapping, mincore() tells how much of it is in
+ * memory yet, and the transfer only sends that much; the rest follows when
+ * it has arrived, another transfer can use the loop meanwhile.
+ *
+ * Files read with read() instead of mapped are hinted the same way, and
+ * read into the file's chunks by the FileTable's I/O thread: the next
+ * `depth` bytes of them, as far as a file's chunks go. A burst only sends
+ * from chunks that were read, see FileTable::staged().
+ */
+struct ReadAhead
+{
+  using Handle = ConnectionTable::Handle;
+  static constexpr uint64_t OFF = UINT64_MAX;
+
+  enum class constants : uint8_t
+  {
+    // a burst held back this many times is sent anyway: the kernel may
+    // have dropped the pages again, or be slower than our patience
+    MAX_WAITS = 16,
+  };
+
+  struct Stage
+  {
+    uint64_t hinted; // bytes from the start the kernel was told about,
+                     // OFF: the transfer is not read ahead
+    uint8_t waits;   // bursts held back in a row
+  };
+
+  std::vector<Stage> stages; // per connection handle
+  uint64_t depth;            // bytes read ahead, 0: no read-ahead at all
+  std::vector<unsigned char> pages; // mincore() results
+
+  ReadAhead(std::size_t max_connections, uint64_t depth_bytes);
+
+  bool enabled() const { return depth != 0; }
+  bool active(Handle h) const { return stages[h].hinted != OFF; }
+
+  /* read `fd` ahead for transfer `h`, from its start */
+  void start(Handle h, int fd, uint64_t size);
+  /* `h` ended, or no longer needs the disk */
+  void stop(Handle h);
+  /* `h` sends from `offset` on: tell the kernel about the next `depth`
+   * bytes once less than half of them are hinted */
+  void advance(Handle h, int fd, uint64_t offset, uint64_t size);
+  /* whether `h` holds back a burst none of which is `staged` yet. Only so
+   * many times in a row: then it is sent anyway */
+  bool hold(Handle h, bool staged);
+  /* how many bytes at the start of `slice`, part of a file mapping, may be
+   * sent now. Less than one `block` of them counts as a wait of `h` */
+  std::size_t resident(Handle h,
+                       std::span<const std::byte> slice,
+                       std::size_t block);
+};
+
+#endif
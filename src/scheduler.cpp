@@ -0,0 +1,67 @@
+#include "scheduler.hpp"
+
+static constexpr auto NONE = ConnectionTable::NO_CONNECTION;
+
+Scheduler::Scheduler(std::size_t max_connections, uint32_t quantum_bytes)
+  : slots(max_connections, Slot{ NONE, NONE, 0, 0, 0 })
+  , head{ NONE }
+  , tail{ NONE }
+  , quantum{ quantum_bytes }
+{
+}
+
+void
+Scheduler::queue(Handle h, uint16_t blocks, uint8_t weight)
+{
+  auto& slot = slots[h];
+  slot.burst = blocks;
+  if (slot.weight != 0)
+    return; // queued already, or taking its turn
+  slot.weight = weight;
+  slot.deficit = 0;
+  link(h);
+}
+
+void
+Scheduler::remove(Handle h)
+{
+  if (linked(h))
+    unlink(h);
+  slots[h].weight = 0;
+  slots[h].deficit = 0;
+}
+
+void
+Scheduler::link(Handle h)
+{
+  auto& slot = slots[h];
+  slot.prev = tail;
+  slot.next = NONE;
+  if (tail == NONE)
+    head = h;
+  else
+    slots[tail].next = h;
+  tail = h;
+}
+
+void
+Scheduler::unlink(Handle h)
+{
+  auto& slot = slots[h];
+  if (slot.prev == NONE)
+    head = slot.next;
+  else
+    slots[slot.prev].next = slot.next;
+  if (slot.next == NONE)
+    tail = slot.prev;
+  else
+    slots[slot.next].prev = slot.prev;
+  slot.prev = slot.next = NONE;
+}
+
+// a transfer taking its turn is scheduled but out of the list
+bool
+Scheduler::linked(Handle h) const
+{
+  return slots[h].prev != NONE || head == h;
+}
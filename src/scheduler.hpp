@@ -0,0 +1,93 @@
+#ifndef AVANTEE_SCHEDULER_H
+#define AVANTEE_SCHEDULER_H
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "connection_table.hpp"
+
+/* Deficit round robin (Shreedhar and Varghese) over the transfers that
+ * have DATA to send.
+ *
+ * Without it a transfer sends its whole burst as soon as its ACK is
+ * handled, and the order of the ready list decides who gets the socket
+ * buffers first. With it the transfer is queued instead, and every loop
+ * iteration is a round that gives each queued transfer one turn: its
+ * deficit grows by its quantum and it sends blocks as long as the deficit
+ * covers them. A transfer that sent everything it may leaves the queue
+ * and forgets its deficit. Transfers of small files get `SMALL_WEIGHT`
+ * quanta a turn, so a configuration file is not stuck behind the windows
+ * of disk images.
+ *
+ * The queue is a doubly linked list threaded through a slot per
+ * connection handle: queueing and leaving are O(1), a round is O(queued).
+ */
+struct Scheduler
+{
+  using Handle = ConnectionTable::Handle;
+
+  enum class constants : uint8_t
+  {
+    SMALL_WEIGHT = 4,
+  };
+
+  struct Slot
+  {
+    Handle prev, next; // NO_CONNECTION at either end of the queue
+    uint32_t deficit;  // bytes the transfer may send on its turn
+    uint16_t burst;    // blocks it may still send, see `queue()`
+    uint8_t weight;    // quanta per turn, 0 while not scheduled
+  };
+
+  std::vector<Slot> slots; // per connection handle
+  Handle head;
+  Handle tail;
+  uint32_t quantum; // bytes per turn and weight, 0: not scheduling
+
+  Scheduler(std::size_t max_connections, uint32_t quantum_bytes);
+
+  bool enabled() const { return quantum != 0; }
+  bool empty() const { return head == ConnectionTable::NO_CONNECTION; }
+
+  /* `h` may send `blocks` more, at `weight` quanta a turn. Queued at the
+   * back if it was not queued yet */
+  void queue(Handle h, uint16_t blocks, uint8_t weight);
+  /* take `h` out of the schedule, it was closed */
+  void remove(Handle h);
+
+  /* one round: each transfer queued when it starts has a turn. `turn(h,
+   * slot)` sends what `slot` allows and returns true if there is more to
+   * send, the transfer then goes to the back of the queue */
+  template<typename Fn>
+  void round(Fn&& turn);
+
+private:
+  void link(Handle h);
+  void unlink(Handle h);
+  bool linked(Handle h) const;
+};
+
+template<typename Fn>
+void
+Scheduler::round(Fn&& turn)
+{
+  // the ones queued during the round wait for the next
+  Handle last = tail;
+  for (bool more = !empty(); more;) {
+    Handle h = head;
+    more = h != last;
+    unlink(h);
+    auto& slot = slots[h];
+    slot.deficit += quantum * slot.weight;
+    if (turn(h, slot) && slot.weight != 0) {
+      link(h);
+      continue;
+    }
+    // done, or closed during its turn
+    slot.weight = 0;
+    slot.deficit = 0;
+  }
+}
+
+#endif
@@ -1,114 +1,214 @@
+#include <algorithm>
 #include <cstdio>
-#include <string>
-#include <variant>
-
-#include "multiplexer.hpp"
+#include <memory>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#if defined(__linux__)
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#endif
+
+#include "block_cache.hpp"
+#include "multicast.hpp"
+#include "options.hpp"
+#include "reactor.hpp"
+#include "socket/error_utils.hpp"
 #include "socket/socket.hpp"
-#include "tftp.hpp"
-
-#define SCAST(Type, e) static_cast<Type>(e)
-#define RCAST(Type, e) reinterpret_cast<Type>(e)
-#define TU(enum) std::to_underlying(enum)
 
 namespace BS = BetterSocket;
 
-// unreadable mess only once
-using ConnectionsType =
-  std::array<Connection,
-             TU(Multiplexer::constants::MAX_SERVER_CONNECTIONS) + 1>;
-
-Connection&
-findInactive(ConnectionsType& c)
-{
-  for (auto& con : c) {
-    if (con.IsActive == false && con.IsBad == false)
-      return con;
-  }
-
-  return c[TU(Multiplexer::constants::MAX_SERVER_CONNECTIONS)];
-}
-
-void
-registerClient(ConnectionsType& connections,
-               GenericPacket& packet,
-               const auto& hint)
+// keep reactor `i` on CPU `i`, so CPU based steering also keeps the
+// reactor's data in that CPU's caches
+static void
+pinToCPU(unsigned cpu)
 {
-  int port = randomPort(); // for this connection's server-side TID
-
-  auto& connection = findInactive(connections);
-  connection.peer = BS::BSocket(hint, std::to_string(port));
-  connection.peerLocalPort = port;
-
-  connection.curPacket = [&]() -> PacketVariant {
-    auto opcode = packet.opcode;
-    switch (opcode) {
-      case Opcodes::ack:
-        return *RCAST(AckPacket*, &packet);
-      case Opcodes::data:
-        return *RCAST(DataPacket*, &packet);
-      case Opcodes::error:
-        return *RCAST(ErrorPacket*, &packet);
-      case Opcodes::rrq:
-      case Opcodes::wrq:
-        return *RCAST(RequestPacket*, &packet);
-    }
-  }();
-
-  connection.IsActive = true;
+#if defined(__linux__)
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  CPU_SET(cpu % std::max(1u, std::thread::hardware_concurrency()), &set);
+  if (pthread_setaffinity_np(pthread_self(), sizeof(set), &set) != 0)
+    std::fprintf(stderr, "avantee-server: could not pin reactor to CPU %u\n", cpu);
+#else
+  (void)cpu;
+#endif
 }
 
-void
-runConnections(ConnectionsType& connections, const auto& hint)
+// print the retransmission and cache counters on SIGUSR1. The signal is
+// blocked in every thread and picked up here with sigwait(), so no handler
+// runs on a reactor
+static void
+reportStats(BlockCache* cache)
 {
-  // parse the packet and then perform operations
-  for (auto& con : connections) {
-    if (std::holds_alternative<AckPacket>(con.curPacket)) {
-      auto& actualPacket = std::get<AckPacket>(con.curPacket);
+#if defined(__linux__)
+  sigset_t set;
+  sigemptyset(&set);
+  sigaddset(&set, SIGUSR1);
+  pthread_sigmask(SIG_BLOCK, &set, nullptr);
+
+  std::thread([cache, set]() {
+    for (int sig; sigwait(&set, &sig) == 0;) {
+      auto& t = Reactor::stats;
+      std::fprintf(stderr,
+                   "avantee-server: timeouts %llu retransmits %llu "
+                   "spurious %llu\n",
+                   static_cast<unsigned long long>(t.timeouts.load()),
+                   static_cast<unsigned long long>(t.retransmits.load()),
+                   static_cast<unsigned long long>(t.spurious.load()));
+      auto& io = Multiplexer::stats;
+      std::fprintf(stderr,
+                   "avantee-server: datagrams in %llu out %llu system calls "
+                   "%llu, split by the kernel %llu coalesced %llu, zero "
+                   "copy messages %llu copied anyway %llu\n",
+                   static_cast<unsigned long long>(io.received.load()),
+                   static_cast<unsigned long long>(io.sent.load()),
+                   static_cast<unsigned long long>(io.calls.load()),
+                   static_cast<unsigned long long>(io.segmented.load()),
+                   static_cast<unsigned long long>(io.coalesced.load()),
+                   static_cast<unsigned long long>(io.zerocopy.load()),
+                   static_cast<unsigned long long>(io.zerocopy_copied.load()));
+      if (cache == nullptr)
+        continue;
+      auto s = cache->stats();
+      std::fprintf(stderr,
+                   "avantee-server: cache hits %llu misses %llu evictions %llu "
+                   "entries %llu bytes %llu\n",
+                   static_cast<unsigned long long>(s.hits),
+                   static_cast<unsigned long long>(s.misses),
+                   static_cast<unsigned long long>(s.evictions),
+                   static_cast<unsigned long long>(s.entries),
+                   static_cast<unsigned long long>(s.bytes));
     }
-  }
+  }).detach();
+#else
+  (void)cache;
+#endif
 }
 
 int
-main()
+main(int argc, char** argv)
 {
+  ServerOptions options;
+  if (!parseServerOptions(argc, argv, options))
+    return 1;
+
   BS::init();
   BS::SocketHint hint(BS::IpVersion::vAny,
                       BS::SockKind::Datagram,
                       BS::SockFlags::UseHostIP,
                       BS::IpProtocol::UDP);
 
-  BS::BSocket tftp_listener(hint, "69"); // tftp port: 69
-  tftp_listener.bind();
-
-  Multiplexer multiplexer;
-  multiplexer.watch(tftp_listener.underlyingSocket(),
-                    Multiplexer::Events::input);
-
-  GenericPacket packet;
-
-  ConnectionsType connections;
-  BS::zero(connections.data(),
-           Multiplexer::constants::MAX_SERVER_CONNECTIONS * sizeof(Connection));
-
-  connections[TU(Constants::maxConnections)].IsBad =
-    true; // mark the last connection as bad. This is done for error checking
-          // when maximum connections are reached.
+  unsigned reactors = options.reactors;
+  if (reactors == 0)
+    reactors = std::max(1u, std::thread::hardware_concurrency());
+  // every reactor enforces its share of the server's limits on its own. A
+  // client's limit is not split, its transfers are mostly on one reactor
+  for (auto* rate : { &options.admitRate, &options.byteRate })
+    *rate = *rate == 0 ? 0 : std::max(1u, *rate / reactors);
+
+  // bind the listeners here, in order: the reuseport group numbers its
+  // sockets in bind order, which is what the steering program returns
+  std::vector<BS::BSocket> listeners;
+  std::vector<PortPool> pools(reactors);
+  std::vector<Multicast> groups(reactors);
+  listeners.reserve(reactors);
+  try {
+    for (unsigned i = 0; i < reactors; i++) {
+      BS::BSocket tftp_listener(hint, options.port); // tftp port: 69
+      if (reactors > 1)
+        tftp_listener.reusePort();
+      tftp_listener.bind();
+      listeners.push_back(std::move(tftp_listener));
+    }
+    if (reactors > 1 && options.steering == Steering::cpu)
+      listeners.front().steerByCPU(reactors);
+
+    // every reactor gets its own TID sockets, from its own slice of the range
+    unsigned span = options.tidUpper - options.tidLower + 1u;
+    for (unsigned i = 0; options.demux == Demux::socket && i < reactors; i++) {
+      auto count = options.maxTransfers;
+      if (options.tidLower == 0) {
+        pools[i].fill(hint, count);
+        continue;
+      }
+      auto lower = options.tidLower + span * i / reactors;
+      auto upper = options.tidLower + span * (i + 1) / reactors - 1;
+      pools[i].fill(hint,
+                    count,
+                    static_cast<BS::in_port_t>(lower),
+                    static_cast<BS::in_port_t>(upper));
+      if (pools[i].size() == 0) {
+        std::fprintf(stderr,
+                     "avantee-server: no free port in %u-%u for reactor %u\n",
+                     lower,
+                     upper,
+                     i);
+        return 1;
+      }
+    }
+  } catch (const SockErrors::APIError& e) {
+    std::fprintf(stderr, "avantee-server: listener setup: %s\n", e.what());
+    return 1;
+  }
 
-  for (;;) {
-    multiplexer.poll_io();
+  // every reactor has its own multicast groups as well
+  for (unsigned i = 0; options.multicastGroup != 0 && i < reactors; i++) {
+    auto first = options.multicastGroups * i / reactors;
+    auto last = options.multicastGroups * (i + 1) / reactors;
+    groups[i].fill(options.multicastGroup + first,
+                   last - first,
+                   options.multicastPort);
+  }
 
-    if (multiplexer.socket_available_for<Multiplexer::Events::input>(
-          tftp_listener.underlyingSocket())) {
-      // new connection
-      auto senderInfo = BS::SockaddrWrapper();
-      if (tftp_listener.receiveFrom(packet.data(), packet.size(), senderInfo) !=
-          1) {
-        registerClient(connections, packet, hint);
-      } // new connection created
+  // one cache for the whole process: every reactor serves the same files
+  std::unique_ptr<BlockCache> cache;
+  if (options.cacheMiB > 0) {
+    cache = std::make_unique<BlockCache>(std::size_t{ options.cacheMiB } << 20);
+    if (!options.cacheManifest.empty()) {
+      // packets are cached per block size, for the sizes clients ask for
+      auto blksizes = options.cacheBlksizes;
+      if (blksizes.empty())
+        blksizes.push_back(512);
+      for (auto blksize : blksizes) {
+        auto loaded =
+          cache->warm(options.cacheManifest, options.root, blksize);
+        std::fprintf(stderr,
+                     "avantee-server: cached %zu files in %u byte blocks\n",
+                     loaded,
+                     unsigned{ blksize });
+      }
     }
+  }
+  // before any thread is started, so they all inherit the blocked signal
+  reportStats(cache.get());
+
+  if (reactors == 1) {
+    auto reactor = std::make_unique<Reactor>(options,
+                                             hint,
+                                             std::move(listeners.front()),
+                                             std::move(pools.front()),
+                                             cache.get(),
+                                             std::move(groups.front()));
+    reactor->run();
+  }
 
-    runConnections(connections, hint);
-
-    // go through each connection and we try and work on what they do
+  std::vector<std::thread> threads;
+  for (unsigned i = 0; i < reactors; i++) {
+    threads.emplace_back([&, i]() {
+      if (options.steering == Steering::cpu)
+        pinToCPU(i);
+      auto reactor = std::make_unique<Reactor>(options,
+                                               hint,
+                                               std::move(listeners[i]),
+                                               std::move(pools[i]),
+                                               cache.get(),
+                                               std::move(groups[i]));
+      reactor->run();
+    });
   }
+
+  for (auto& t : threads)
+    t.join();
 }
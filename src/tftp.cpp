@@ -1,5 +1,9 @@
 #include "tftp.hpp"
 #include "socket/generic_sockets.hpp"
+#include <algorithm>
+#include <cctype>
+#include <charconv>
+#include <cstring>
 #include <random>
 #include <utility>
 
@@ -26,7 +30,7 @@ DataPacket::data()
 BetterSocket::Size
 DataPacket::size()
 {
-  return sizeof(TU(opcode)) + sizeof(block) + sizeof(content);
+  return sizeof(TU(opcode)) + sizeof(block);
 }
 
 void*
@@ -53,23 +57,246 @@ ErrorPacket::size()
   return sizeof(TU(opcode)) + sizeof(error_code) + sizeof(error_msg);
 }
 
-void*
-GenericPacket::data()
+// next NUL terminated string in `rest`, which is advanced past it
+static bool
+takeString(std::span<const std::byte>& rest, std::string_view& out)
 {
-  return &this->opcode;
+  auto nul = std::find(rest.begin(), rest.end(), std::byte{ 0 });
+  if (nul == rest.end())
+    return false;
+  auto len = static_cast<std::size_t>(nul - rest.begin());
+  out = std::string_view(reinterpret_cast<const char*>(rest.data()), len);
+  rest = rest.subspan(len + 1);
+  return true;
+}
+
+bool
+parseRequest(std::span<const std::byte> payload, Request& out)
+{
+  if (payload.size() < 2)
+    return false;
+  out.opcode = static_cast<Opcodes>(getU16(payload.data()));
+  if (out.opcode != Opcodes::rrq && out.opcode != Opcodes::wrq)
+    return false;
+
+  auto rest = payload.subspan(2);
+  if (!takeString(rest, out.filename) || !takeString(rest, out.mode) ||
+      out.filename.empty())
+    return false;
+  out.options = rest;
+  return true;
+}
+
+// append `s` and its NUL terminator at `at`, false if it does not fit
+static bool
+putString(std::span<std::byte> out, std::size_t& at, std::string_view s)
+{
+  if (out.size() < at || out.size() - at < s.size() + 1)
+    return false;
+  std::memcpy(out.data() + at, s.data(), s.size());
+  out[at + s.size()] = std::byte{ 0 };
+  at += s.size() + 1;
+  return true;
+}
+
+BetterSocket::Size
+buildRequest(std::span<std::byte> out,
+             Opcodes opcode,
+             std::string_view filename,
+             std::string_view mode,
+             std::span<const std::byte> options)
+{
+  std::size_t at = 2;
+  if (out.size() < at || !putString(out, at, filename) ||
+      !putString(out, at, mode) || out.size() - at < options.size())
+    return 0;
+  putU16(out.data(), static_cast<uint16_t>(TU(opcode)));
+  std::memcpy(out.data() + at, options.data(), options.size());
+  return at + options.size();
+}
+
+// option names are case insensitive (RFC 2347)
+static bool
+sameName(std::string_view a, std::string_view b)
+{
+  return a.size() == b.size() &&
+         std::equal(a.begin(), a.end(), b.begin(), [](char x, char y) {
+           return std::tolower(static_cast<unsigned char>(x)) ==
+                  std::tolower(static_cast<unsigned char>(y));
+         });
+}
+
+static bool
+parseNumber(std::string_view v, unsigned long& out)
+{
+  auto [end, ec] = std::from_chars(v.data(), v.data() + v.size(), out);
+  return ec == std::errc() && end == v.data() + v.size() && !v.empty();
+}
+
+// RFC 2090's "addr,port,mc", a dotted IPv4 address, a port and 0 or 1
+static bool
+parseGroup(std::string_view value, TransferOptions& out)
+{
+  uint32_t addr = 0;
+  for (int i = 0; i < 4; i++) {
+    auto dot = value.find(i < 3 ? '.' : ',');
+    unsigned long octet;
+    if (dot == std::string_view::npos ||
+        !parseNumber(value.substr(0, dot), octet) || octet > 255)
+      return false;
+    addr = addr << 8 | static_cast<uint32_t>(octet);
+    value.remove_prefix(dot + 1);
+  }
+  auto comma = value.find(',');
+  unsigned long port, mc;
+  if (comma == std::string_view::npos ||
+      !parseNumber(value.substr(0, comma), port) || port > 65535 ||
+      !parseNumber(value.substr(comma + 1), mc) || mc > 1)
+    return false;
+  out.group = addr;
+  out.groupPort = static_cast<uint16_t>(port);
+  out.master = mc == 1;
+  return true;
+}
+
+bool
+parseOptions(std::span<const std::byte> raw, TransferOptions& out)
+{
+  while (!raw.empty()) {
+    std::string_view name, value;
+    if (!takeString(raw, name) || !takeString(raw, value))
+      return false;
+
+    unsigned long n;
+    if (sameName(name, "blksize")) {
+      if (!parseNumber(value, n) || n < TU(Constants::minBlksize))
+        continue;
+      out.blksize = static_cast<uint16_t>(
+        std::min(n, static_cast<unsigned long>(TU(Constants::maxBlksize))));
+      out.present |= TransferOptions::BLKSIZE;
+    } else if (sameName(name, "windowsize")) {
+      if (!parseNumber(value, n) || n < 1)
+        continue;
+      out.windowsize = static_cast<uint16_t>(
+        std::min(n, static_cast<unsigned long>(TU(Constants::maxWindowsize))));
+      out.present |= TransferOptions::WINDOWSIZE;
+    } else if (sameName(name, "timeout")) {
+      // RFC 2349 gives no way to answer another value: out of range, the
+      // option is not acknowledged
+      if (!parseNumber(value, n) || n < TU(Constants::minTimeoutOption) ||
+          n > TU(Constants::maxTimeoutOption))
+        continue;
+      out.timeout = static_cast<uint8_t>(n);
+      out.present |= TransferOptions::TIMEOUT;
+    } else if (sameName(name, "tsize")) {
+      unsigned long long size;
+      auto [end, ec] =
+        std::from_chars(value.data(), value.data() + value.size(), size);
+      if (ec != std::errc() || end != value.data() + value.size() ||
+          value.empty())
+        continue;
+      out.tsize = size;
+      out.present |= TransferOptions::TSIZE;
+    } else if (sameName(name, "multicast")) {
+      // "addr,port,mc" in an OACK, nothing in a request
+      if (!value.empty() && !parseGroup(value, out))
+        continue;
+      out.present |= TransferOptions::MULTICAST;
+    }
+  }
+  return true;
+}
+
+// one name/value pair, the value in decimal
+static bool
+putOption(std::span<std::byte> out,
+          std::size_t& at,
+          std::string_view name,
+          unsigned long long value)
+{
+  char digits[24];
+  auto [end, ec] = std::to_chars(digits, digits + sizeof(digits), value);
+  return putString(out, at, name) &&
+         putString(out, at, std::string_view(digits, end));
+}
+
+// RFC 2090's "addr,port,mc"
+static bool
+putGroup(std::span<std::byte> out, std::size_t& at, const TransferOptions& opts)
+{
+  char value[32];
+  char* end = value;
+  for (int shift = 24; shift >= 0; shift -= 8) {
+    end = std::to_chars(end, value + sizeof(value), (opts.group >> shift) & 0xff)
+            .ptr;
+    *end++ = shift > 0 ? '.' : ',';
+  }
+  end = std::to_chars(end, value + sizeof(value), opts.groupPort).ptr;
+  *end++ = ',';
+  *end++ = opts.master ? '1' : '0';
+  return putString(out, at, "multicast") &&
+         putString(out, at, std::string_view(value, end));
 }
 
 BetterSocket::Size
-GenericPacket::size()
+buildOptions(std::span<std::byte> out, const TransferOptions& opts)
+{
+  std::size_t at = 0;
+  if (((opts.present & TransferOptions::BLKSIZE) &&
+       !putOption(out, at, "blksize", opts.blksize)) ||
+      ((opts.present & TransferOptions::WINDOWSIZE) &&
+       !putOption(out, at, "windowsize", opts.windowsize)) ||
+      ((opts.present & TransferOptions::TIMEOUT) &&
+       !putOption(out, at, "timeout", opts.timeout)) ||
+      ((opts.present & TransferOptions::TSIZE) &&
+       !putOption(out, at, "tsize", opts.tsize)) ||
+      ((opts.present & TransferOptions::MULTICAST) &&
+       !putGroup(out, at, opts)))
+    return 0;
+  return at;
+}
+
+BetterSocket::Size
+buildError(std::span<std::byte> out, ErrorCodes code, std::string_view msg)
+{
+  putU16(out.data(), TU(Opcodes::error));
+  putU16(out.data() + 2, TU(code));
+  auto len = std::min(msg.size(), out.size() - 5);
+  std::memcpy(out.data() + 4, msg.data(), len);
+  out[4 + len] = std::byte{ 0 };
+  return 4 + len + 1;
+}
+
+Endpoint
+Endpoint::of(BetterSocket::SockaddrWrapper& sender)
+{
+  Endpoint e{};
+  auto* storage = sender.m_getPtrToStorage();
+  if (storage->ss_family == AF_INET6) {
+    std::memcpy(&e.addr.v6, storage, sizeof(e.addr.v6));
+  } else {
+    std::memcpy(&e.addr.v4, storage, sizeof(e.addr.v4));
+  }
+  return e;
+}
+
+const sockaddr*
+Endpoint::get() const
+{
+  return reinterpret_cast<const sockaddr*>(&addr);
+}
+
+socklen_t
+Endpoint::len() const
 {
-  return sizeof(TU(opcode)) + sizeof(rawData);
+  return addr.v4.sin_family == AF_INET6 ? sizeof(addr.v6) : sizeof(addr.v4);
 }
 
 BetterSocket::in_port_t
 randomPort()
 {
-  std::random_device dv;
-  std::default_random_engine engine(dv());
+  // seeded once per thread, random_device may be a system call per use
+  thread_local std::default_random_engine engine(std::random_device{}());
   std::uniform_int_distribution<BetterSocket::in_port_t> distribution{
     std::to_underlying(Constants::unprivPortsLower),
     std::to_underlying(Constants::unprivPortsUpper)
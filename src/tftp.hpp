@@ -2,35 +2,67 @@
 #define AVANTEE_TFTP_H
 
 #include <algorithm>
-#include <array>
 #include <cstddef>
 #include <cstdint>
+#include <span>
+#include <string_view>
 #include <utility>
 #include <variant>
 
+#include "file_table.hpp"
+#include "port_pool.hpp"
 #include "socket/socket.hpp"
+#include "timer_wheel.hpp"
 
 #define TU(enum) std::to_underlying(enum)
 
 
+// values as on the wire (RFC 1350, OACK from RFC 2347)
 enum class Opcodes : int16_t
 {
-  ack,
+  rrq = 1, // read-request
+  wrq,     // write-request
   data,
+  ack,
   error,
-  rrq, // read-request
-  wrq, // write-request
+  oack, // option acknowledgement
+};
+
+enum class ErrorCodes : uint16_t
+{
+  undefined,
+  fileNotFound,
+  accessViolation,
+  diskFull,
+  illegalOperation,
+  unknownTid,
+  fileExists,
+  noSuchUser,
+  badOption, // RFC 2347: the options were refused, the transfer ends
 };
 
 enum class Constants : unsigned long
 {
-  maxDataLen = 512,
+  maxDataLen = 512,  // block size unless another one is negotiated
+  minBlksize = 8,    // RFC 2348 range of the blksize option
+  maxBlksize = 65464,
+  maxWindowsize = 65535, // RFC 7440 range of the windowsize option
+  initialCwnd = 4, // blocks per round trip at first, with congestion control
+  headerLen = 4, // opcode and block number of DATA and ACK
   maxFilenameLen = 255,
   maxModeStringLen = sizeof("netascii"),
   maxErrorMsgLen = 255,
-  maxConnections = 64,
+  maxConnections = 64, // default cap on transfers per reactor
   unprivPortsLower = 1025,
   unprivPortsUpper = 65535,
+  retransmitTimeout = 1000, // ms, until the round trip time is measured
+  minRetransmitTimeout = 20,
+  maxRetransmitTimeout = 8000, // also caps the exponential backoff
+  maxRetransmits = 5,  // at least this many before giving up on a peer,
+  idleTimeout = 10000, // and at least this many ms
+  dallyTimeout = 3000, // ms a finished upload waits for its last DATA again
+  minTimeoutOption = 1, // RFC 2349 range of the timeout option, seconds
+  maxTimeoutOption = 255,
 };
 
 struct AckPacket
@@ -41,11 +73,12 @@ struct AckPacket
   BetterSocket::Size size();
 } __attribute((packed));
 
+/* the payload follows on the wire, up to the transfer's block size. Its
+ * length is only known once blksize is negotiated, see `packetSize()` */
 struct DataPacket
 {
   Opcodes opcode;
   int16_t block;
-  std::array<std::byte, TU(Constants::maxDataLen)> content;
   void* data();
   BetterSocket::Size size();
 } __attribute((packed));
@@ -71,40 +104,158 @@ struct RequestPacket
 
 using PacketVariant=std::variant<AckPacket,DataPacket,ErrorPacket,RequestPacket>;
 
-consteval BetterSocket::Size
-largestPacketSize()
+/* bytes needed to receive any packet of a transfer using `blksize`: a
+ * DATA packet is the largest one */
+constexpr BetterSocket::Size
+packetSize(uint16_t blksize)
+{
+  return TU(Constants::headerLen) + blksize;
+}
+
+/* TFTP fields are big endian on the wire, packets are read and written
+ * through these rather than by casting them to the structs above */
+inline uint16_t
+getU16(const std::byte* p)
 {
+  return static_cast<uint16_t>((std::to_integer<unsigned>(p[0]) << 8) |
+                               std::to_integer<unsigned>(p[1]));
+}
 
-  return std::max(
-    {
-      sizeof(RequestPacket),
-      sizeof(DataPacket),
-      sizeof(AckPacket),
-      sizeof(ErrorPacket),
-    },
-    [](const BetterSocket::Size e1, const BetterSocket::Size e2) {
-      return e1 < e2;
-    });
+inline void
+putU16(std::byte* p, uint16_t v)
+{
+  p[0] = static_cast<std::byte>(v >> 8);
+  p[1] = static_cast<std::byte>(v & 0xff);
 }
 
-struct GenericPacket
+/* an RRQ or WRQ. The views point into the datagram it was parsed from */
+struct Request
 {
   Opcodes opcode;
-  std::byte rawData[largestPacketSize() - sizeof(opcode)];
-  void* data();
-  BetterSocket::Size size();
-} __attribute((packed));
+  std::string_view filename;
+  std::string_view mode;
+  std::span<const std::byte> options; // what follows the mode, if anything
+};
+
+/* false if `payload` is not a well formed request */
+bool
+parseRequest(std::span<const std::byte> payload, Request& out);
+
+/* write an RRQ or WRQ into `out` followed by `options` (already encoded,
+ * see `buildOptions()`), returns its size. 0 if it does not fit */
+BetterSocket::Size
+buildRequest(std::span<std::byte> out,
+             Opcodes opcode,
+             std::string_view filename,
+             std::string_view mode,
+             std::span<const std::byte> options = {});
 
+/* RFC 2347 options this implementation knows. `present` has a bit per
+ * option that was sent; the values of the others are the defaults */
+struct TransferOptions
+{
+  static constexpr uint8_t BLKSIZE = 1 << 0; // bits of `present`
+  static constexpr uint8_t WINDOWSIZE = 1 << 1;
+  static constexpr uint8_t TIMEOUT = 1 << 2;
+  static constexpr uint8_t TSIZE = 1 << 3;
+  static constexpr uint8_t MULTICAST = 1 << 4;
+
+  uint8_t present = 0;
+  uint16_t blksize = TU(Constants::maxDataLen);
+  uint16_t windowsize = 1; // RFC 7440, 1 is lock step
+  uint8_t timeout = 0;     // RFC 2349, seconds
+  uint64_t tsize = 0;      // RFC 2349, 0 in a read request
+  // RFC 2090, empty in a request: the group the DATA is sent to, and
+  // whether this client is the master client, the one that acknowledges it
+  uint32_t group = 0; // IPv4 address, host byte order
+  uint16_t groupPort = 0;
+  bool master = false;
+};
+
+/* read the name/value pairs of a request or an OACK. Names are case
+ * insensitive and unknown ones are skipped. A value past an option's
+ * maximum is lowered to it, one below its minimum is ignored. False if the
+ * pairs are malformed */
+bool
+parseOptions(std::span<const std::byte> raw, TransferOptions& out);
+
+/* write the options present in `opts` as name/value pairs, returns their
+ * size. 0 if they do not fit */
+BetterSocket::Size
+buildOptions(std::span<std::byte> out, const TransferOptions& opts);
+
+/* write an ERROR packet into `out`, returns its size. The message is cut
+ * to fit `out` */
+BetterSocket::Size
+buildError(std::span<std::byte> out, ErrorCodes code, std::string_view msg);
+
+/* a peer's address, just big enough for IPv6. The length follows from
+ * the family, so it is not stored */
+struct Endpoint
+{
+  union
+  {
+    sockaddr_in v4;
+    sockaddr_in6 v6;
+  } addr;
+
+  static Endpoint of(BetterSocket::SockaddrWrapper& sender);
+  const sockaddr* get() const;
+  socklen_t len() const;
+};
+
+/* the packets waiting for their acknowledgement: `count` of them from
+ * `block` on, more than one with an RFC 7440 window. Only headers are
+ * kept, DATA payloads are read back from the transfer's file when they are
+ * resent.
+ *
+ * A file being received has its last ACK here, or `wrq` with nothing sent
+ * while the upload's file is opened or completed. An ACK with a `count` of
+ * 0 acknowledged the final block, it is only sent again if that block
+ * comes again */
+struct Retransmit
+{
+  // counted from the start, the wire has the low 16 bits. For an OACK, and
+  // a `wrq` waiting for its file to open, the `TransferOptions::present`
+  // bits of what is acknowledged
+  uint32_t block;
+  uint16_t count; // sent and not acknowledged yet, up to the window size
+  Opcodes opcode; // data or oack, ack or wrq while receiving a file
+};
+
+/* Per transfer state, kept small since a server may hold tens of thousands
+ * of them: no packet buffers, no strings, no sockets. See
+ * `ConnectionTable::BYTES_PER_CONNECTION` for what a transfer costs in
+ * total. */
 struct Connection
 {
-  BetterSocket::BSocket peer;
-  PacketVariant prevPacket;
-  PacketVariant curPacket;
-  std::string associatedFile;
-  int peerLocalPort;
-  bool IsActive;
-  bool IsBad;
+  // `rttvar` before the first round trip was measured
+  static constexpr uint16_t NO_RTT = UINT16_MAX;
+
+  Endpoint peer;
+  // armed while `unacked` is valid. Paces the window out while it is not
+  // all sent, waits for its ACK after that
+  TimerWheel::TimerId retransmitTimer;
+  PortPool::Tid tid; // server-side socket, NO_TID when sharing the listener
+  FileTable::FileId file; // or the upload being received
+  Retransmit unacked;
+  Opcodes lastOpcode; // the peer's last packet, for runConnection()
+  uint16_t lastBlock;
+  uint16_t blksize;    // negotiated DATA payload size
+  uint16_t windowsize; // DATA blocks sent before waiting for an ACK
+  uint16_t srtt;       // smoothed round trip time, 1/8 ms (RFC 6298)
+  uint16_t rttvar;     // its mean deviation, 1/4 ms
+  uint16_t cwnd;       // blocks sent per round trip, up to `windowsize`
+  uint8_t timeout;     // seconds asked for by the client, 0: adaptive
+  // timeouts since the peer last made progress. Bounded by the give up
+  // rule in `Reactor::onTimer()`, 10 at most
+  uint8_t retransmits : 4;
+  uint8_t slowStart : 1; // `cwnd` doubles until the first loss
+  uint8_t reduced : 1;   // `cwnd` was cut for this window already
+  uint8_t receiving : 1; // a WRQ, `file` is a `WriteBehind::UploadId`
+  bool IsActive : 1;
 };
+static_assert(sizeof(Connection) <= 64, "keep Connection in a cache line");
 
 // returns a random port between 1025 and 65,535 (the unprivleged ports)
 BetterSocket::in_port_t
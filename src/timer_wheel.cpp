@@ -0,0 +1,186 @@
+#include <algorithm>
+#include <bit>
+#include <climits>
+
+#include "timer_wheel.hpp"
+
+#define SCAST(Type, e) static_cast<Type>(e)
+#define TU(e) std::to_underlying(e)
+
+static constexpr uint64_t SLOTS = TU(TimerWheel::constants::SLOTS);
+static constexpr uint64_t BITS = TU(TimerWheel::constants::SLOT_BITS);
+static constexpr unsigned LEVELS = TU(TimerWheel::constants::LEVELS);
+
+TimerWheel::TimerWheel()
+  : origin{ Clock::now() }
+  , now_tick{ 0 }
+  , nodes{}
+  , free_nodes{}
+  , heads{}
+  , occupied{}
+{
+  heads.fill(NO_TIMER);
+}
+
+uint64_t
+TimerWheel::now() const
+{
+  return SCAST(uint64_t,
+               std::chrono::duration_cast<std::chrono::milliseconds>(
+                 Clock::now() - origin)
+                 .count());
+}
+
+TimerWheel::TimerId
+TimerWheel::schedule(uint64_t delay_ms, uint64_t token)
+{
+  TimerId id;
+  if (free_nodes.empty()) {
+    id = SCAST(TimerId, nodes.size());
+    nodes.emplace_back();
+  } else {
+    id = free_nodes.back();
+    free_nodes.pop_back();
+  }
+
+  // the wheel may lag behind the clock, never fire earlier than asked
+  uint64_t deadline = now() + delay_ms;
+  if (deadline <= now_tick)
+    deadline = now_tick + 1;
+
+  nodes[id] = { deadline, token, NO_TIMER, NO_TIMER, 0, false };
+  insert(id);
+  return id;
+}
+
+void
+TimerWheel::cancel(TimerId id)
+{
+  if (id == NO_TIMER || id >= nodes.size() || !nodes[id].armed)
+    return;
+  unlink(id);
+  free_nodes.push_back(id);
+}
+
+TimerWheel::TimerId
+TimerWheel::reschedule(TimerId id, uint64_t delay_ms, uint64_t token)
+{
+  cancel(id);
+  return schedule(delay_ms, token);
+}
+
+uint64_t
+TimerWheel::deadline(TimerId id) const
+{
+  return nodes[id].deadline;
+}
+
+int
+TimerWheel::next_timeout() const
+{
+  const uint64_t real_now = now();
+  uint64_t first = UINT64_MAX;
+
+  // a coarse slot may be cascaded before the finer levels are due, look at
+  // every level
+  for (unsigned level = 0; level < LEVELS; level++) {
+    if (occupied[level] == 0)
+      continue;
+
+    // rotate so that bit 0 is the slot the wheel is at on this level
+    unsigned current =
+      SCAST(unsigned, (now_tick >> (BITS * level)) & (SLOTS - 1));
+    uint64_t rotated = std::rotr(occupied[level], SCAST(int, current));
+    // a coarse level was cascaded on entering its current slot, timers
+    // there wait for the next rotation
+    if (level > 0)
+      rotated &= ~uint64_t{ 1 };
+    auto distance =
+      rotated == 0 ? SLOTS : SCAST(uint64_t, std::countr_zero(rotated));
+
+    // for coarse levels this is the time the slot gets cascaded, which is
+    // never after the deadlines it holds
+    uint64_t when = ((now_tick >> (BITS * level)) + distance) << (BITS * level);
+    first = std::min(first, when);
+  }
+  if (first == UINT64_MAX)
+    return -1;
+  if (first <= real_now)
+    return 0;
+  uint64_t wait = first - real_now;
+  return wait > INT_MAX ? INT_MAX : SCAST(int, wait);
+}
+
+void
+TimerWheel::insert(TimerId id)
+{
+  Node& n = nodes[id];
+  if (n.deadline < now_tick)
+    n.deadline = now_tick; // cascaded late, expire on this tick
+
+  uint64_t delta = n.deadline - now_tick;
+  unsigned level = 0;
+  while (level + 1 < LEVELS && delta >= (uint64_t{ 1 } << (BITS * (level + 1))))
+    level++;
+
+  // beyond the range of the top level: park it in the furthest slot, it is
+  // re-inserted when that slot is cascaded
+  uint64_t limit = uint64_t{ 1 } << (BITS * LEVELS);
+  uint64_t at = delta >= limit ? now_tick + limit - 1 : n.deadline;
+
+  unsigned index = SCAST(unsigned, (at >> (BITS * level)) & (SLOTS - 1));
+  unsigned slot = level * SCAST(unsigned, SLOTS) + index;
+
+  n.slot = SCAST(uint16_t, slot);
+  n.prev = NO_TIMER;
+  n.next = heads[slot];
+  if (n.next != NO_TIMER)
+    nodes[n.next].prev = id;
+  heads[slot] = id;
+  occupied[level] |= uint64_t{ 1 } << index;
+  n.armed = true;
+}
+
+void
+TimerWheel::unlink(TimerId id)
+{
+  Node& n = nodes[id];
+  if (n.prev != NO_TIMER)
+    nodes[n.prev].next = n.next;
+  else
+    heads[n.slot] = n.next;
+  if (n.next != NO_TIMER)
+    nodes[n.next].prev = n.prev;
+
+  if (heads[n.slot] == NO_TIMER)
+    occupied[n.slot / SLOTS] &= ~(uint64_t{ 1 } << (n.slot % SLOTS));
+  n.armed = false;
+}
+
+TimerWheel::TimerId
+TimerWheel::pop(unsigned slot)
+{
+  TimerId id = heads[slot];
+  if (id != NO_TIMER)
+    unlink(id);
+  return id;
+}
+
+void
+TimerWheel::cascade(unsigned level)
+{
+  unsigned index = SCAST(unsigned, (now_tick >> (BITS * level)) & (SLOTS - 1));
+  unsigned slot = level * SCAST(unsigned, SLOTS) + index;
+
+  // detach the whole list first, re-inserting may land in this very slot
+  TimerId id = heads[slot];
+  heads[slot] = NO_TIMER;
+  occupied[level] &= ~(uint64_t{ 1 } << index);
+
+  while (id != NO_TIMER) {
+    TimerId next = nodes[id].next;
+    nodes[id].armed = false;
+    insert(id);
+    id = next;
+  }
+}
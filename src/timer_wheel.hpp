@@ -0,0 +1,132 @@
+#ifndef AVANTEE_TIMER_WHEEL_H
+#define AVANTEE_TIMER_WHEEL_H
+
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+/* Hierarchical timer wheel with millisecond ticks.
+ *
+ * Level 0 has one slot per millisecond for the next 64 ms, every further
+ * level covers 64 times the span of the one below it. Timers far in the
+ * future sit in a coarse slot and are cascaded down as time reaches them.
+ * Scheduling and cancelling are O(1): timers are nodes of intrusive lists
+ * kept in a slab and addressed by `TimerId`.
+ *
+ * The wheel does not own callbacks, it hands the `token` given to
+ * `schedule()` back to the caller of `advance()` when a timer expires.
+ */
+struct TimerWheel
+{
+  using Clock = std::chrono::steady_clock;
+  using TimerId = uint32_t;
+  static constexpr TimerId NO_TIMER = UINT32_MAX;
+
+  enum class constants : unsigned
+  {
+    LEVELS = 4,
+    SLOT_BITS = 6,
+    SLOTS = 1 << SLOT_BITS,
+  };
+
+  struct Node
+  {
+    uint64_t deadline; // in ticks since `origin`
+    uint64_t token;
+    TimerId prev;
+    TimerId next;
+    uint16_t slot; // level * SLOTS + index, valid while armed
+    bool armed;
+  };
+
+  Clock::time_point origin;
+  uint64_t now_tick;
+  std::vector<Node> nodes;
+  std::vector<TimerId> free_nodes;
+  std::array<TimerId,
+             std::to_underlying(constants::LEVELS) *
+               std::to_underlying(constants::SLOTS)>
+    heads;
+  /* one bit per non-empty slot, to find the next deadline without a scan */
+  std::array<uint64_t, std::to_underlying(constants::LEVELS)> occupied;
+
+  TimerWheel();
+
+  /* milliseconds elapsed since the wheel was created */
+  uint64_t now() const;
+
+  /* arm a timer firing `delay_ms` from now, `token` is handed back on expiry */
+  TimerId schedule(uint64_t delay_ms, uint64_t token);
+  /* disarm a timer, ignores `NO_TIMER` and already expired timers */
+  void cancel(TimerId id);
+  /* cancel `id` (if armed) and arm a new timer, returns the new id */
+  TimerId reschedule(TimerId id, uint64_t delay_ms, uint64_t token);
+
+  /* when the armed timer `id` fires, in milliseconds like `now()` */
+  uint64_t deadline(TimerId id) const;
+
+  /* milliseconds until the next timer needs attention, -1 if none is armed.
+   * Never later than the real deadline, so it can be used as a poll()
+   * timeout directly. */
+  int next_timeout() const;
+
+  /* move the wheel to the current time and call `expired(token)` for every
+   * timer that is due. `expired` may schedule or cancel timers. */
+  template<typename Fn>
+  void advance(Fn&& expired);
+
+private:
+  void insert(TimerId id);
+  void unlink(TimerId id);
+  TimerId pop(unsigned slot);
+  void cascade(unsigned level);
+};
+
+template<typename Fn>
+void
+TimerWheel::advance(Fn&& expired)
+{
+  constexpr uint64_t slots = std::to_underlying(constants::SLOTS);
+  constexpr uint64_t bits = std::to_underlying(constants::SLOT_BITS);
+  const uint64_t target = now();
+
+  while (now_tick < target) {
+    bool empty = true;
+    for (auto o : occupied)
+      empty = empty && o == 0;
+    if (empty) {
+      now_tick = target; // nothing armed, jump straight there
+      break;
+    }
+
+    if (occupied[0] == 0) {
+      // no fine grained timer: skip to the next level 0 rollover at once
+      uint64_t rollover = (now_tick | (slots - 1)) + 1;
+      if (rollover > target) {
+        now_tick = target;
+        break;
+      }
+      now_tick = rollover - 1;
+    }
+
+    now_tick++;
+    // coarse slots are cascaded when the finer level wraps around
+    for (unsigned level = 1; level < std::to_underlying(constants::LEVELS);
+         level++) {
+      if ((now_tick & ((uint64_t{ 1 } << (bits * level)) - 1)) != 0)
+        break;
+      cascade(level);
+    }
+
+    unsigned slot = static_cast<unsigned>(now_tick & (slots - 1));
+    for (TimerId id = pop(slot); id != NO_TIMER; id = pop(slot)) {
+      uint64_t token = nodes[id].token;
+      free_nodes.push_back(id);
+      expired(token);
+    }
+  }
+}
+
+#endif
@@ -0,0 +1,273 @@
+#include "uring.hpp"
+
+#if defined(AVANTEE_HAVE_IO_URING)
+
+#include <cerrno>
+#include <cstring>
+#include <ctime>
+
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#define SCAST(Type, e) static_cast<Type>(e)
+#define RCAST(Type, e) reinterpret_cast<Type>(e)
+
+static int
+sys_io_uring_setup(unsigned entries, struct io_uring_params* p)
+{
+  return SCAST(int, syscall(__NR_io_uring_setup, entries, p));
+}
+
+static int
+sys_io_uring_enter(int fd,
+                   unsigned to_submit,
+                   unsigned min_complete,
+                   unsigned flags,
+                   void* arg,
+                   std::size_t argsz)
+{
+  return SCAST(
+    int,
+    syscall(
+      __NR_io_uring_enter, fd, to_submit, min_complete, flags, arg, argsz));
+}
+
+static int
+sys_io_uring_register(int fd, unsigned opcode, void* arg, unsigned nr_args)
+{
+  return SCAST(int, syscall(__NR_io_uring_register, fd, opcode, arg, nr_args));
+}
+
+Uring::Uring()
+  : ring_fd{ -1 }
+  , sq_head{ nullptr }
+  , sq_tail{ nullptr }
+  , sq_mask{ nullptr }
+  , sq_array{ nullptr }
+  , sqes{ nullptr }
+  , sq_local_tail{ 0 }
+  , cq_head{ nullptr }
+  , cq_tail{ nullptr }
+  , cq_mask{ nullptr }
+  , cqes{ nullptr }
+  , buf_ring{ nullptr }
+  , buf_entries{ 0 }
+  , buf_size{ 0 }
+  , buf_local_tail{ 0 }
+  , buf_arena{}
+  , sq_ring_ptr{ MAP_FAILED }
+  , sq_ring_size{ 0 }
+  , cq_ring_ptr{ MAP_FAILED }
+  , cq_ring_size{ 0 }
+  , sqes_size{ 0 }
+  , buf_ring_size{ 0 }
+{
+}
+
+Uring::~Uring()
+{
+  if (buf_ring != nullptr)
+    munmap(buf_ring, buf_ring_size);
+  if (sqes != nullptr)
+    munmap(sqes, sqes_size);
+  if (cq_ring_ptr != MAP_FAILED && cq_ring_ptr != sq_ring_ptr)
+    munmap(cq_ring_ptr, cq_ring_size);
+  if (sq_ring_ptr != MAP_FAILED)
+    munmap(sq_ring_ptr, sq_ring_size);
+  if (ring_fd != -1)
+    close(ring_fd);
+}
+
+bool
+Uring::setup(unsigned entries)
+{
+  struct io_uring_params params;
+  std::memset(&params, 0, sizeof(params));
+  // multishot receives can post many completions per submission
+  params.flags = IORING_SETUP_CQSIZE;
+  params.cq_entries = entries * 4;
+
+  ring_fd = sys_io_uring_setup(entries, &params);
+  if (ring_fd < 0) {
+    ring_fd = -1;
+    return false;
+  }
+
+  if (!(params.features & IORING_FEAT_EXT_ARG)) {
+    errno = ENOSYS; // we need timeouts on io_uring_enter()
+    return false;
+  }
+
+  sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+  cq_ring_size =
+    params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+  if (params.features & IORING_FEAT_SINGLE_MMAP) {
+    if (cq_ring_size > sq_ring_size)
+      sq_ring_size = cq_ring_size;
+    cq_ring_size = sq_ring_size;
+  }
+
+  sq_ring_ptr = mmap(nullptr,
+                     sq_ring_size,
+                     PROT_READ | PROT_WRITE,
+                     MAP_SHARED | MAP_POPULATE,
+                     ring_fd,
+                     IORING_OFF_SQ_RING);
+  if (sq_ring_ptr == MAP_FAILED)
+    return false;
+
+  if (params.features & IORING_FEAT_SINGLE_MMAP) {
+    cq_ring_ptr = sq_ring_ptr;
+  } else {
+    cq_ring_ptr = mmap(nullptr,
+                       cq_ring_size,
+                       PROT_READ | PROT_WRITE,
+                       MAP_SHARED | MAP_POPULATE,
+                       ring_fd,
+                       IORING_OFF_CQ_RING);
+    if (cq_ring_ptr == MAP_FAILED)
+      return false;
+  }
+
+  sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+  void* sqes_ptr = mmap(nullptr,
+                        sqes_size,
+                        PROT_READ | PROT_WRITE,
+                        MAP_SHARED | MAP_POPULATE,
+                        ring_fd,
+                        IORING_OFF_SQES);
+  if (sqes_ptr == MAP_FAILED)
+    return false;
+  sqes = SCAST(struct io_uring_sqe*, sqes_ptr);
+
+  auto* sq = SCAST(char*, sq_ring_ptr);
+  sq_head = RCAST(unsigned*, sq + params.sq_off.head);
+  sq_tail = RCAST(unsigned*, sq + params.sq_off.tail);
+  sq_mask = RCAST(unsigned*, sq + params.sq_off.ring_mask);
+  sq_array = RCAST(unsigned*, sq + params.sq_off.array);
+  sq_local_tail = *sq_tail;
+
+  auto* cq = SCAST(char*, cq_ring_ptr);
+  cq_head = RCAST(unsigned*, cq + params.cq_off.head);
+  cq_tail = RCAST(unsigned*, cq + params.cq_off.tail);
+  cq_mask = RCAST(unsigned*, cq + params.cq_off.ring_mask);
+  cqes = RCAST(struct io_uring_cqe*, cq + params.cq_off.cqes);
+
+  return true;
+}
+
+bool
+Uring::setup_buffers(unsigned count, unsigned size, unsigned short group)
+{
+  buf_entries = count; // must be a power of two
+  buf_size = size;
+  buf_ring_size = count * sizeof(struct io_uring_buf);
+
+  void* ring = mmap(nullptr,
+                    buf_ring_size,
+                    PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS,
+                    -1,
+                    0);
+  if (ring == MAP_FAILED)
+    return false;
+  buf_ring = SCAST(struct io_uring_buf_ring*, ring);
+
+  struct io_uring_buf_reg reg;
+  std::memset(&reg, 0, sizeof(reg));
+  reg.ring_addr = RCAST(__u64, buf_ring);
+  reg.ring_entries = count;
+  reg.bgid = group;
+  if (sys_io_uring_register(ring_fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0)
+    return false;
+
+  buf_arena.resize(SCAST(std::size_t, count) * size);
+  for (unsigned i = 0; i < count; i++)
+    recycle_buffer(SCAST(unsigned short, i));
+  publish_buffers();
+
+  return true;
+}
+
+struct io_uring_sqe*
+Uring::get_sqe()
+{
+  unsigned head = __atomic_load_n(sq_head, __ATOMIC_ACQUIRE);
+  if (sq_local_tail - head > *sq_mask) {
+    // queue is full: hand what we have to the kernel first
+    submit_and_wait(0);
+    head = __atomic_load_n(sq_head, __ATOMIC_ACQUIRE);
+  }
+
+  unsigned index = sq_local_tail & *sq_mask;
+  struct io_uring_sqe* sqe = &sqes[index];
+  std::memset(sqe, 0, sizeof(*sqe));
+  sq_array[index] = index;
+  sq_local_tail++;
+  return sqe;
+}
+
+int
+Uring::submit_and_wait(int timeout_ms)
+{
+  unsigned to_submit = sq_local_tail - *sq_tail;
+  __atomic_store_n(sq_tail, sq_local_tail, __ATOMIC_RELEASE);
+
+  unsigned flags = 0;
+  unsigned min_complete = 0;
+  struct __kernel_timespec ts = {};
+  struct io_uring_getevents_arg arg = {};
+  void* argp = nullptr;
+  std::size_t argsz = 0;
+
+  if (timeout_ms != 0) {
+    flags |= IORING_ENTER_GETEVENTS;
+    min_complete = 1;
+  }
+  if (timeout_ms > 0) {
+    ts.tv_sec = timeout_ms / 1000;
+    ts.tv_nsec = (timeout_ms % 1000) * 1000000L;
+    arg.ts = RCAST(__u64, &ts);
+    flags |= IORING_ENTER_EXT_ARG;
+    argp = &arg;
+    argsz = sizeof(arg);
+  }
+
+  if (to_submit == 0 && min_complete == 0)
+    return 0;
+
+  int r = sys_io_uring_enter(
+    ring_fd, to_submit, min_complete, flags, argp, argsz);
+  // a timeout or a signal is not an error for the caller
+  if (r < 0 && (errno == ETIME || errno == EINTR))
+    return 0;
+  return r;
+}
+
+std::byte*
+Uring::buffer(unsigned short bid)
+{
+  return buf_arena.data() + SCAST(std::size_t, bid) * buf_size;
+}
+
+void
+Uring::recycle_buffer(unsigned short bid)
+{
+  // index by hand: in C++ the empty member in front of the kernel header's
+  // flexible `bufs` array shifts it by 8 bytes
+  struct io_uring_buf* buf = RCAST(struct io_uring_buf*, buf_ring) +
+                             (buf_local_tail & (buf_entries - 1));
+  buf->addr = RCAST(__u64, buffer(bid));
+  buf->len = buf_size;
+  buf->bid = bid;
+  buf_local_tail++;
+}
+
+void
+Uring::publish_buffers()
+{
+  __atomic_store_n(&buf_ring->tail, buf_local_tail, __ATOMIC_RELEASE);
+}
+
+#endif // AVANTEE_HAVE_IO_URING
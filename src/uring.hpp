@@ -0,0 +1,96 @@
+#ifndef AVANTEE_URING_H
+#define AVANTEE_URING_H
+
+/* Minimal io_uring ring driven through the raw system calls.
+ * Only what the multiplexer needs is wrapped:
+ * - a submission/completion queue pair
+ * - one provided buffer ring ("registered" receive buffers) that the kernel
+ *   picks from for multishot receives
+ */
+
+#if defined(__linux__) && __has_include(<linux/io_uring.h>)
+#define AVANTEE_HAVE_IO_URING
+#endif
+
+#if defined(AVANTEE_HAVE_IO_URING)
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include <linux/io_uring.h>
+
+struct Uring
+{
+  int ring_fd;
+
+  /* submission queue, shared with the kernel */
+  unsigned* sq_head;
+  unsigned* sq_tail;
+  unsigned* sq_mask;
+  unsigned* sq_array;
+  struct io_uring_sqe* sqes;
+  unsigned sq_local_tail; // sqes handed out but not yet published
+
+  /* completion queue, shared with the kernel */
+  unsigned* cq_head;
+  unsigned* cq_tail;
+  unsigned* cq_mask;
+  struct io_uring_cqe* cqes;
+
+  /* provided buffer ring for receives */
+  struct io_uring_buf_ring* buf_ring;
+  unsigned buf_entries;
+  unsigned buf_size;
+  unsigned short buf_local_tail;
+  std::vector<std::byte> buf_arena;
+
+  Uring();
+  ~Uring();
+  Uring(const Uring&) = delete;
+  Uring& operator=(const Uring&) = delete;
+
+  /* returns false (with errno set) if the kernel refuses io_uring */
+  bool setup(unsigned entries);
+  /* register `count` receive buffers of `size` bytes under `group` */
+  bool setup_buffers(unsigned count, unsigned size, unsigned short group);
+
+  /* next free sqe, flushing the queue to the kernel when it is full */
+  struct io_uring_sqe* get_sqe();
+  /* publish queued sqes and optionally wait for completions.
+   * `timeout_ms` follows poll(): -1 blocks, 0 only submits */
+  int submit_and_wait(int timeout_ms);
+
+  /* visit all available completions then mark them as consumed */
+  template<typename Fn>
+  void for_each_cqe(Fn&& fn);
+
+  std::byte* buffer(unsigned short bid);
+  /* hand a consumed receive buffer back to the kernel */
+  void recycle_buffer(unsigned short bid);
+  /* make recycled buffers visible to the kernel */
+  void publish_buffers();
+
+private:
+  void* sq_ring_ptr;
+  std::size_t sq_ring_size;
+  void* cq_ring_ptr;
+  std::size_t cq_ring_size;
+  std::size_t sqes_size;
+  std::size_t buf_ring_size;
+};
+
+template<typename Fn>
+void
+Uring::for_each_cqe(Fn&& fn)
+{
+  unsigned head = *cq_head;
+  unsigned tail = __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE);
+  for (; head != tail; head++)
+    fn(cqes[head & *cq_mask]);
+  __atomic_store_n(cq_head, head, __ATOMIC_RELEASE);
+}
+
+#endif // AVANTEE_HAVE_IO_URING
+
+#endif
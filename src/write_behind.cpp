@@ -0,0 +1,369 @@
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <utility>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "write_behind.hpp"
+
+#define SCAST(Type, e) static_cast<Type>(e)
+#define TU(enum) std::to_underlying(enum)
+
+static constexpr std::size_t BUFFER_SIZE =
+  TU(WriteBehind::constants::BUFFER_SIZE);
+
+WriteBehind::WriteBehind(Sync sync_policy,
+                         bool threaded,
+                         std::size_t capacity,
+                         std::size_t buffer_count)
+  : sync{ sync_policy }
+  , uploads(capacity)
+  , free_ids{}
+  , free_buffers{}
+  , decoded{}
+  , buffers{ 0 }
+  , max_buffers{ buffer_count }
+  , have_results{ false }
+  , stopping{ false }
+  , notify{ -1, -1 }
+{
+  for (auto& u : uploads) {
+    u.used = false;
+    u.fd = -1;
+  }
+  free_ids.reserve(capacity);
+  for (std::size_t i = capacity; i > 0; i--)
+    free_ids.push_back(SCAST(UploadId, i - 1));
+
+  if (!threaded)
+    return;
+  if (pipe(notify) == -1) {
+    std::perror("write_behind -> pipe()");
+    notify[0] = notify[1] = -1;
+    return; // the jobs are run on the spot instead
+  }
+  fcntl(notify[0], F_SETFL, O_NONBLOCK);
+  fcntl(notify[1], F_SETFL, O_NONBLOCK);
+  io = std::thread([this]() { run(); });
+}
+
+WriteBehind::~WriteBehind()
+{
+  if (io.joinable()) {
+    {
+      std::lock_guard guard(lock);
+      stopping = true;
+    }
+    wake.notify_one();
+    io.join();
+    close(notify[0]);
+    close(notify[1]);
+  }
+  for (auto& u : uploads)
+    if (u.used && u.buffer != nullptr)
+      free_buffers.push_back(u.buffer);
+  for (auto* b : free_buffers)
+    std::free(b);
+}
+
+WriteBehind::UploadId
+WriteBehind::open(const std::string& path,
+                  uint64_t tsize,
+                  bool netascii,
+                  uint32_t owner)
+{
+  if (free_ids.empty())
+    return NO_UPLOAD;
+  auto id = free_ids.back();
+  free_ids.pop_back();
+
+  auto& u = uploads[id];
+  u.path = path;
+  u.tsize = tsize;
+  u.owner = owner;
+  u.offset = 0;
+  u.buffer = nullptr;
+  u.fill = 0;
+  u.pending = 0;
+  u.closed = false;
+  u.used = true;
+  u.netascii = netascii;
+  u.decoder = Netascii::Decoder{};
+  u.temp.clear();
+  u.fd = -1;
+  u.failed = 0;
+  submit({ Job::open, id, nullptr, 0, 0 });
+  return id;
+}
+
+// a free buffer, allocated if the pool is not at its limit yet
+std::byte*
+WriteBehind::takeBuffer()
+{
+  if (free_buffers.empty()) {
+    if (buffers == max_buffers)
+      return nullptr;
+    auto* b = static_cast<std::byte*>(
+      std::aligned_alloc(TU(constants::BUFFER_ALIGN), BUFFER_SIZE));
+    if (b == nullptr)
+      return nullptr;
+    buffers++;
+    return b;
+  }
+  auto* b = free_buffers.back();
+  free_buffers.pop_back();
+  return b;
+}
+
+bool
+WriteBehind::append(UploadId id, std::span<const std::byte> payload)
+{
+  auto& u = uploads[id];
+  if (u.closed)
+    return false;
+
+  // the payload may run over the end of the buffer, a second one has to
+  // be at hand before any of it is taken. Translated it is one byte
+  // longer at most, a CR held back from the last one
+  std::byte* next = nullptr;
+  if (u.buffer == nullptr || u.fill + payload.size() + 1 > BUFFER_SIZE) {
+    next = takeBuffer();
+    if (next == nullptr)
+      return false;
+  }
+  if (u.buffer == nullptr) {
+    u.buffer = std::exchange(next, nullptr);
+    u.fill = 0;
+  }
+  if (u.netascii) {
+    decoded.resize(payload.size() + 1);
+    auto done = u.decoder.decode(payload, decoded);
+    payload = std::span(decoded).first(done.written);
+  }
+
+  auto head = std::min(payload.size(), BUFFER_SIZE - u.fill);
+  std::memcpy(u.buffer + u.fill, payload.data(), head);
+  u.fill += head;
+  if (u.fill == BUFFER_SIZE) {
+    submit({ Job::write, id, u.buffer, u.fill, u.offset });
+    u.offset += u.fill;
+    u.buffer = next;
+    u.fill = 0;
+    next = nullptr;
+    if (head < payload.size()) {
+      std::memcpy(u.buffer, payload.data() + head, payload.size() - head);
+      u.fill = payload.size() - head;
+    }
+  }
+  if (next != nullptr)
+    free_buffers.push_back(next);
+  return true;
+}
+
+void
+WriteBehind::finish(UploadId id)
+{
+  auto& u = uploads[id];
+  if (u.closed)
+    return;
+  if (u.buffer != nullptr && u.fill > 0) {
+    submit({ Job::write, id, u.buffer, u.fill, u.offset });
+    u.offset += u.fill;
+  } else if (u.buffer != nullptr) {
+    free_buffers.push_back(u.buffer);
+  }
+  // a CR the decoder may still hold was the last byte, without the LF or
+  // NUL netascii requires after it: it is dropped
+  u.buffer = nullptr;
+  u.closed = true;
+  submit({ Job::finish, id, nullptr, 0, u.offset });
+}
+
+void
+WriteBehind::abort(UploadId id)
+{
+  auto& u = uploads[id];
+  u.owner = NO_OWNER;
+  if (u.closed)
+    return;
+  if (u.buffer != nullptr)
+    free_buffers.push_back(u.buffer);
+  u.buffer = nullptr;
+  u.closed = true;
+  submit({ Job::abort, id, nullptr, 0, 0 });
+}
+
+uint64_t
+WriteBehind::tsize(UploadId id) const
+{
+  return uploads[id].tsize;
+}
+
+int
+WriteBehind::notifier() const
+{
+  return notify[0];
+}
+
+void
+WriteBehind::submit(Task task)
+{
+  uploads[task.id].pending++;
+  if (!io.joinable()) {
+    auto r = execute(task);
+    results.push_back(r);
+    have_results.store(true, std::memory_order_release);
+    return;
+  }
+  {
+    std::lock_guard guard(lock);
+    tasks.push_back(task);
+  }
+  wake.notify_one();
+}
+
+void
+WriteBehind::drain(std::vector<Result>& out)
+{
+  if (io.joinable()) {
+    char bytes[64];
+    while (read(notify[0], bytes, sizeof(bytes)) > 0) {
+    }
+  }
+  std::lock_guard guard(lock);
+  out.swap(results);
+  have_results.store(false, std::memory_order_relaxed);
+}
+
+// bookkeeping for a completed job, returns who to tell about it
+uint32_t
+WriteBehind::settle(const Result& r)
+{
+  auto& u = uploads[r.id];
+  u.pending--;
+  if (r.buffer != nullptr)
+    free_buffers.push_back(r.buffer);
+  auto owner = u.owner;
+  if (u.closed && u.pending == 0) {
+    u.used = false;
+    free_ids.push_back(r.id);
+  }
+  // a successful write is no news, only failures are
+  if (r.job == Job::write && r.error == 0)
+    return NO_OWNER;
+  return owner;
+}
+
+void
+WriteBehind::run()
+{
+  for (;;) {
+    Task task;
+    {
+      std::unique_lock guard(lock);
+      wake.wait(guard, [this]() { return stopping || !tasks.empty(); });
+      if (tasks.empty())
+        return;
+      task = tasks.front();
+      tasks.pop_front();
+    }
+
+    auto r = execute(task);
+    bool first;
+    {
+      std::lock_guard guard(lock);
+      first = results.empty();
+      results.push_back(r);
+      have_results.store(true, std::memory_order_release);
+    }
+    // one byte per batch of results is enough to wake the reactor
+    if (first)
+      (void)!write(notify[1], "", 1);
+  }
+}
+
+WriteBehind::Result
+WriteBehind::execute(const Task& task)
+{
+  auto& u = uploads[task.id];
+  Result r{ task.job, task.id, 0, 0, task.buffer };
+
+  switch (task.job) {
+    case Job::open: {
+      u.temp = u.path + ".XXXXXX";
+      u.fd = mkstemp(u.temp.data());
+      if (u.fd == -1) {
+        r.error = errno;
+        u.temp.clear();
+        break;
+      }
+      fchmod(u.fd, 0644);
+#if defined(__linux__)
+      // the file's blocks in one piece, and ENOSPC now rather than halfway
+      if (u.tsize > 0) {
+        r.error = posix_fallocate(u.fd, 0, SCAST(off_t, u.tsize));
+        if (r.error == EOPNOTSUPP || r.error == EINVAL)
+          r.error = 0; // the file system cannot, it is only slower
+      }
+#endif
+      break;
+    }
+
+    case Job::write: {
+      if (u.fd == -1)
+        r.error = EBADF;
+      for (std::size_t done = 0; done < task.len && r.error == 0;) {
+        auto n = pwrite(u.fd,
+                        task.buffer + done,
+                        task.len - done,
+                        SCAST(off_t, task.offset + done));
+        if (n == -1 && errno == EINTR)
+          continue;
+        if (n <= 0) {
+          r.error = n == 0 ? ENOSPC : errno;
+          break;
+        }
+        done += SCAST(std::size_t, n);
+      }
+      if (r.error == 0 && sync == Sync::batch && fdatasync(u.fd) == -1)
+        r.error = errno;
+      if (u.failed == 0)
+        u.failed = r.error;
+      break;
+    }
+
+    case Job::finish:
+      if (u.fd == -1) {
+        r.error = EBADF;
+        break;
+      }
+      r.error = u.failed;
+      // preallocated for a tsize the client did not keep to
+      if (r.error == 0 && u.tsize > task.offset &&
+          ftruncate(u.fd, SCAST(off_t, task.offset)) == -1)
+        r.error = errno;
+      if (r.error == 0 && sync != Sync::none && fsync(u.fd) == -1)
+        r.error = errno;
+      if (close(u.fd) == -1 && r.error == 0)
+        r.error = errno;
+      u.fd = -1;
+      if (r.error == 0 && rename(u.temp.c_str(), u.path.c_str()) == -1)
+        r.error = errno;
+      if (r.error != 0)
+        unlink(u.temp.c_str());
+      break;
+
+    case Job::abort:
+      if (u.fd != -1)
+        close(u.fd);
+      u.fd = -1;
+      if (!u.temp.empty())
+        unlink(u.temp.c_str());
+      break;
+  }
+  return r;
+}
@@ -0,0 +1,170 @@
+#ifndef AVANTEE_WRITE_BEHIND_H
+#define AVANTEE_WRITE_BEHIND_H
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <span>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "netascii.hpp"
+
+/* Files being received (WRQ), written behind the reactor's back.
+ *
+ * DATA payloads are copied into page aligned buffers of `BUFFER_SIZE`
+ * bytes, one being filled per upload, and every full buffer is written
+ * with a single pwrite(). Opening, preallocating, writing, syncing and
+ * closing are jobs run in order by an I/O thread of the reactor's own, so
+ * the event loop never waits for the disk. Without the thread they are run
+ * on the spot instead. Either way their outcome is picked up with
+ * `completed()`.
+ *
+ * A file is written under a temporary name next to its target and renamed
+ * over it once it is complete: a transfer that fails leaves nothing behind
+ * and a reader never sees half a file. Netascii uploads are translated back
+ * to the host's line ends as they are appended.
+ */
+struct WriteBehind
+{
+  using UploadId = uint32_t;
+  static constexpr UploadId NO_UPLOAD = UINT32_MAX;
+  static constexpr uint32_t NO_OWNER = UINT32_MAX;
+
+  enum class constants : std::size_t
+  {
+    BUFFER_SIZE = 1 << 18,
+    BUFFER_ALIGN = 4096,
+  };
+
+  /* when the data is forced to disk */
+  enum class Sync
+  {
+    none,  // whenever the kernel gets to it
+    close, // before the file is renamed into place
+    batch, // after every buffer written
+  };
+
+  enum class Job : uint8_t
+  {
+    open,   // create the temporary file, preallocate `tsize` bytes
+    write,  // one buffer at its offset
+    finish, // trim, sync, close and rename into place
+    abort,  // close and remove the temporary file
+  };
+
+  struct Task
+  {
+    Job job;
+    UploadId id;
+    std::byte* buffer; // write: handed back to the pool once written
+    std::size_t len;
+    uint64_t offset; // write: where `buffer` goes, finish: the file size
+  };
+
+  struct Result
+  {
+    Job job;
+    UploadId id;
+    uint32_t owner; // as given to `open()`, NO_OWNER after `abort()`
+    int error;      // errno, 0 on success
+    std::byte* buffer; // write: back to the pool
+  };
+
+  struct Upload
+  {
+    // set by the reactor while no job is queued
+    std::string path;
+    uint64_t tsize;    // preallocated, 0 if unknown
+    uint32_t owner;    // the reactor's transfer
+    uint64_t offset;   // bytes handed out in write jobs so far
+    std::byte* buffer; // being filled, nullptr until there is a payload
+    std::size_t fill;
+    uint32_t pending; // jobs not completed yet
+    bool closed;      // finish or abort was queued, no job follows
+    bool used;
+    bool netascii;
+    Netascii::Decoder decoder;
+    // only touched by the jobs
+    std::string temp;
+    int fd;
+    int failed; // errno of a write, the file is not renamed into place
+  };
+
+  Sync sync;
+  std::vector<Upload> uploads; // never resized: the I/O thread uses them
+  std::vector<UploadId> free_ids;
+  std::vector<std::byte*> free_buffers;
+  std::vector<std::byte> decoded; // a netascii payload, translated
+  std::size_t buffers;            // allocated so far
+  std::size_t max_buffers;
+
+  // shared with the I/O thread
+  std::mutex lock;
+  std::condition_variable wake;
+  std::deque<Task> tasks;
+  std::vector<Result> results;
+  std::atomic<bool> have_results;
+  bool stopping;
+  int notify[2]; // pipe, readable while there are results
+  std::thread io;
+
+  /* up to `capacity` uploads at once, sharing at most `buffer_count`
+   * buffers. `threaded`: run the jobs on an I/O thread */
+  WriteBehind(Sync sync_policy,
+              bool threaded,
+              std::size_t capacity,
+              std::size_t buffer_count);
+  ~WriteBehind();
+  WriteBehind(const WriteBehind&) = delete;
+  WriteBehind& operator=(const WriteBehind&) = delete;
+
+  /* start receiving `path`, `tsize` bytes long if not 0. `owner` comes
+   * back with the results. NO_UPLOAD if all slots are taken */
+  UploadId open(const std::string& path,
+                uint64_t tsize,
+                bool netascii,
+                uint32_t owner);
+  /* add a payload at the end of the file. False if no buffer is free right
+   * now: the payload was not taken and the peer should send it again */
+  bool append(UploadId id, std::span<const std::byte> payload);
+  /* everything was appended, complete the file */
+  void finish(UploadId id);
+  /* give up on the file. No result is reported for it anymore */
+  void abort(UploadId id);
+
+  /* the size given to `open()` */
+  uint64_t tsize(UploadId id) const;
+
+  /* readable when results are waiting, -1 without an I/O thread */
+  int notifier() const;
+  /* hand every result since the last call to `f(const Result&)`. Uploads
+   * whose last job completed are released here */
+  template<typename F>
+  void completed(F&& f)
+  {
+    std::vector<Result> done;
+    if (!have_results.load(std::memory_order_acquire))
+      return;
+    drain(done);
+    for (auto& r : done) {
+      r.owner = settle(r);
+      if (r.owner != NO_OWNER)
+        f(r);
+    }
+  }
+
+private:
+  void submit(Task task);
+  void drain(std::vector<Result>& out);
+  uint32_t settle(const Result& r);
+  std::byte* takeBuffer();
+  void run();
+  Result execute(const Task& task);
+};
+
+#endif
@@ -0,0 +1,248 @@
+/* System calls per datagram with and without batched UDP I/O.
+ *
+ * Four reactors run on their own threads: one system call per datagram
+ * (`batch_io` off) or recvmmsg()/sendmmsg() batches, each with a TID
+ * socket per transfer and with every transfer on the listener (`--demux
+ * peer`), where one sendmmsg() carries the packets of several transfers.
+ * For each of them `clients` threads fetch the file at once with a big
+ * window, draining each window with BSocket::receiveMany(). The reactor's
+ * system calls, datagrams and CPU time are printed.
+ *
+ * usage: ./bench-batch [clients] [file-MiB]
+ */
+
+#include "reactor.hpp"
+
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+#define SCAST(Type, e) static_cast<Type>(e)
+#define TU(e) std::to_underlying(e)
+
+namespace BS = BetterSocket;
+using Clock = std::chrono::steady_clock;
+
+constexpr uint16_t BLKSIZE = 1428;
+constexpr uint16_t WINDOW = 64;
+
+static BS::SocketHint
+udpHint()
+{
+  return BS::SocketHint(BS::IpVersion::vAny,
+                        BS::SockKind::Datagram,
+                        BS::SockFlags::UseHostIP,
+                        BS::IpProtocol::UDP);
+}
+
+static void
+sendAck(BS::BSocket& sock, BS::SockaddrWrapper& to, uint32_t block)
+{
+  std::byte ack[4];
+  putU16(ack, TU(Opcodes::ack));
+  putU16(ack + 2, SCAST(uint16_t, block & 0xffff));
+  sock.sendTo(ack, sizeof(ack), to);
+}
+
+// fetch `name` acknowledging every window, the bytes received
+static uint64_t
+fetch(const std::string& port, const std::string& name)
+{
+  auto hint = udpHint();
+  BS::BSocket sock(hint, port, "127.0.0.1");
+  sockaddr_storage storage = {};
+  std::memcpy(&storage, sock.validAddr.ai_addr, sock.validAddr.ai_addrlen);
+  BS::SockaddrWrapper tid(storage, sock.validAddr.ai_addrlen);
+
+  TransferOptions proposed;
+  proposed.present = TransferOptions::BLKSIZE | TransferOptions::WINDOWSIZE;
+  proposed.blksize = BLKSIZE;
+  proposed.windowsize = WINDOW;
+  std::byte options[64];
+  auto optionsSize = buildOptions(options, proposed);
+  std::byte rrq[512];
+  auto size = buildRequest(
+    rrq, Opcodes::rrq, name, "octet", std::span(options, optionsSize));
+  sock.sendTo(rrq, size, tid);
+
+  std::vector<std::byte> buffers(WINDOW * packetSize(BLKSIZE));
+  std::vector<BS::DatagramSlot> slots(WINDOW);
+  for (std::size_t i = 0; i < slots.size(); i++)
+    slots[i] = { buffers.data() + i * packetSize(BLKSIZE),
+                 packetSize(BLKSIZE),
+                 0,
+                 {} };
+
+  uint32_t expect = 0; // 0 until the OACK came
+  uint16_t sinceAck = 0;
+  uint64_t bytes = 0;
+  for (int timeouts = 0;;) {
+    BS::GPollfd pfd = { sock.underlyingSocket(), POLLIN, 0 };
+    if (BS::gPoll(&pfd, 1, 200) <= 0) {
+      if (++timeouts > 10 || expect == 0)
+        return 0;
+      sendAck(sock, tid, expect - 1);
+      sinceAck = 0;
+      continue;
+    }
+    timeouts = 0;
+    auto got = sock.receiveMany(slots, MSG_DONTWAIT);
+    for (std::size_t i = 0; i < got; i++) {
+      auto* packet = SCAST(std::byte*, slots[i].buf);
+      auto len = slots[i].len;
+      if (len < 4)
+        continue;
+      auto op = SCAST(Opcodes, getU16(packet));
+      uint16_t block = getU16(packet + 2);
+      if (op == Opcodes::oack && expect == 0) {
+        tid = slots[i].addr;
+        expect = 1;
+        sendAck(sock, tid, 0);
+        continue;
+      }
+      if (op != Opcodes::data || expect == 0)
+        continue;
+      if (block != (expect & 0xffff)) {
+        sendAck(sock, tid, expect - 1);
+        sinceAck = 0;
+        continue;
+      }
+      bytes += len - 4;
+      expect++;
+      bool done = len - 4 < BLKSIZE;
+      if (done || ++sinceAck >= WINDOW) {
+        sendAck(sock, tid, block);
+        sinceAck = 0;
+      }
+      if (done)
+        return bytes;
+    }
+  }
+}
+
+static void
+serve(const ServerOptions* options, bool batch)
+{
+  auto hint = udpHint();
+  BS::BSocket listener(hint, options->port);
+  listener.bind();
+  PortPool pool;
+  if (options->demux == Demux::socket)
+    pool.fill(hint, options->maxTransfers);
+  Reactor reactor(*options, hint, std::move(listener), std::move(pool));
+  reactor.multiplexer.batch_io = batch;
+  reactor.run();
+}
+
+static double
+cpuSeconds(clockid_t clock)
+{
+  timespec ts;
+  clock_gettime(clock, &ts);
+  return SCAST(double, ts.tv_sec) + SCAST(double, ts.tv_nsec) / 1e9;
+}
+
+int
+main(int argc, char** argv)
+{
+  unsigned clients =
+    argc > 1 ? SCAST(unsigned, std::strtoul(argv[1], nullptr, 10)) : 8;
+  std::size_t mib = argc > 2 ? std::strtoul(argv[2], nullptr, 10) : 32;
+  BS::init();
+
+  char dir[] = "/tmp/bench-batch-XXXXXX";
+  if (mkdtemp(dir) == nullptr) {
+    std::perror("mkdtemp");
+    return 1;
+  }
+  std::string path = std::string(dir) + "/image";
+  {
+    std::vector<unsigned char> bytes(mib << 20);
+    std::mt19937 rng(5);
+    for (auto& b : bytes)
+      b = SCAST(unsigned char, rng());
+    std::FILE* f = std::fopen(path.c_str(), "wb");
+    std::fwrite(bytes.data(), 1, bytes.size(), f);
+    std::fclose(f);
+  }
+
+  struct Mode
+  {
+    const char* name;
+    bool batch;
+    Demux demux;
+  };
+  const Mode modes[] = { { "single, TID sockets", false, Demux::socket },
+                         { "batched, TID sockets", true, Demux::socket },
+                         { "single, listener", false, Demux::peer },
+                         { "batched, listener", true, Demux::peer } };
+  constexpr std::size_t MODES = sizeof(modes) / sizeof(modes[0]);
+  ServerOptions options[MODES];
+  clockid_t clocks[MODES];
+  std::vector<std::thread> reactors;
+  for (std::size_t m = 0; m < MODES; m++) {
+    options[m].port = std::to_string(16985 + m);
+    options[m].root = dir;
+    options[m].backend = Multiplexer::Backend::epoll;
+    options[m].demux = modes[m].demux;
+    options[m].maxTransfers = clients + 4;
+    options[m].maxWindow = WINDOW;
+    reactors.emplace_back(serve, &options[m], modes[m].batch);
+    pthread_getcpuclockid(reactors.back().native_handle(), &clocks[m]);
+  }
+  std::this_thread::sleep_for(std::chrono::milliseconds(100));
+
+  std::printf("%u clients fetching %zu MiB (window %u, blksize %u), epoll\n",
+              clients,
+              mib,
+              WINDOW,
+              BLKSIZE);
+  std::printf("%-22s %9s %11s %11s %14s\n",
+              "",
+              "MiB/s",
+              "datagrams",
+              "calls/dgram",
+              "reactor us/dgram");
+  for (std::size_t m = 0; m < MODES; m++) {
+    auto& io = Multiplexer::stats;
+    uint64_t calls = io.calls.load();
+    uint64_t moved = io.received.load() + io.sent.load();
+    double cpu = cpuSeconds(clocks[m]);
+    auto start = Clock::now();
+
+    std::vector<std::thread> threads;
+    std::atomic<uint64_t> bytes{ 0 };
+    for (unsigned i = 0; i < clients; i++)
+      threads.emplace_back(
+        [&, port = options[m].port]() { bytes += fetch(port, "image"); });
+    for (auto& t : threads)
+      t.join();
+
+    double secs = std::chrono::duration<double>(Clock::now() - start).count();
+    cpu = cpuSeconds(clocks[m]) - cpu;
+    calls = io.calls.load() - calls;
+    moved = io.received.load() + io.sent.load() - moved;
+    std::printf("%-22s %9.1f %11llu %11.3f %14.3f%s\n",
+                modes[m].name,
+                SCAST(double, bytes.load()) / (1 << 20) / secs,
+                SCAST(unsigned long long, moved),
+                SCAST(double, calls) / SCAST(double, moved),
+                cpu * 1e6 / SCAST(double, moved),
+                bytes.load() == clients * (mib << 20) ? "" : "  (stalled)");
+  }
+
+  unlink(path.c_str());
+  rmdir(dir);
+  std::fflush(stdout);
+  std::_Exit(0); // the reactors never return
+}
@@ -0,0 +1,192 @@
+/* Transfer time against the negotiated block size (RFC 2348).
+ *
+ * A reactor runs on its own thread, one lock-step client on the main
+ * thread fetches the same file over loopback with every block size. The
+ * file is fetched once first so it comes from the page cache.
+ *
+ * usage: ./bench-blksize [file-MiB] [backend]
+ */
+
+#include "reactor.hpp"
+
+#include <arpa/inet.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <random>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+#define SCAST(Type, e) static_cast<Type>(e)
+#define TU(e) std::to_underlying(e)
+
+namespace BS = BetterSocket;
+using Clock = std::chrono::steady_clock;
+
+static void
+sendAck(int fd, const sockaddr_in& to, uint16_t block)
+{
+  std::byte ack[4];
+  putU16(ack, TU(Opcodes::ack));
+  putU16(ack + 2, block);
+  sendto(fd,
+         ack,
+         sizeof(ack),
+         0,
+         reinterpret_cast<const sockaddr*>(&to),
+         sizeof(to));
+}
+
+// fetch `name` asking for `blksize`, returns the bytes received
+static uint64_t
+fetch(uint16_t port, const std::string& name, uint16_t blksize)
+{
+  int fd = socket(AF_INET, SOCK_DGRAM, 0);
+  sockaddr_in server = {};
+  server.sin_family = AF_INET;
+  server.sin_port = htons(port);
+  server.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+  TransferOptions proposed;
+  proposed.present = TransferOptions::BLKSIZE;
+  proposed.blksize = blksize;
+  std::byte options[32];
+  auto optionsSize = buildOptions(options, proposed);
+  std::byte rrq[512];
+  auto size = buildRequest(
+    rrq, Opcodes::rrq, name, "octet", std::span(options, optionsSize));
+  sendto(
+    fd, rrq, size, 0, reinterpret_cast<sockaddr*>(&server), sizeof(server));
+
+  // sized to the negotiated block, not to the largest one possible
+  std::vector<std::byte> buf(packetSize(TU(Constants::maxDataLen)));
+  uint16_t negotiated = TU(Constants::maxDataLen);
+  uint32_t expect = 1;
+  uint64_t bytes = 0;
+  for (;;) {
+    pollfd pfd = { fd, POLLIN, 0 };
+    if (poll(&pfd, 1, 5000) <= 0) {
+      std::fprintf(stderr, "bench-blksize: transfer stalled\n");
+      std::exit(1);
+    }
+    socklen_t len = sizeof(server);
+    auto r = recvfrom(fd,
+                      buf.data(),
+                      buf.size(),
+                      0,
+                      reinterpret_cast<sockaddr*>(&server),
+                      &len);
+    if (r < 4) {
+      std::fprintf(stderr, "bench-blksize: short packet\n");
+      std::exit(1);
+    }
+    auto op = SCAST(Opcodes, getU16(buf.data()));
+    if (op == Opcodes::oack) {
+      TransferOptions acked;
+      parseOptions(std::span(buf).subspan(2, SCAST(std::size_t, r) - 2),
+                   acked);
+      negotiated = acked.blksize;
+      buf.resize(packetSize(negotiated));
+      sendAck(fd, server, 0);
+      continue;
+    }
+    if (op != Opcodes::data) {
+      std::fprintf(stderr, "bench-blksize: unexpected packet\n");
+      std::exit(1);
+    }
+    uint16_t block = getU16(buf.data() + 2);
+    if (block == (expect & 0xffff)) {
+      bytes += SCAST(uint64_t, r - 4);
+      expect++;
+    }
+    sendAck(fd, server, block);
+    if (block == ((expect - 1) & 0xffff) && r - 4 < negotiated)
+      break;
+  }
+  close(fd);
+  return bytes;
+}
+
+static void
+serve(const ServerOptions* options)
+{
+  BS::SocketHint hint(BS::IpVersion::vAny,
+                      BS::SockKind::Datagram,
+                      BS::SockFlags::UseHostIP,
+                      BS::IpProtocol::UDP);
+  BS::BSocket listener(hint, options->port);
+  listener.bind();
+  PortPool pool;
+  pool.fill(hint, options->maxTransfers);
+  Reactor reactor(*options, hint, std::move(listener), std::move(pool));
+  reactor.run();
+}
+
+int
+main(int argc, char** argv)
+{
+  std::size_t mib = argc > 1 ? std::strtoul(argv[1], nullptr, 10) : 64;
+  std::string_view backend = argc > 2 ? argv[2] : "epoll";
+  BS::init();
+
+  char dir[] = "/tmp/bench-blksize-XXXXXX";
+  if (mkdtemp(dir) == nullptr) {
+    std::perror("mkdtemp");
+    return 1;
+  }
+  std::string path = std::string(dir) + "/image";
+  {
+    std::FILE* f = std::fopen(path.c_str(), "wb");
+    std::mt19937_64 rng(1);
+    std::vector<uint64_t> chunk(1 << 17);
+    for (std::size_t i = 0; i < mib; i++) {
+      for (auto& w : chunk)
+        w = rng();
+      std::fwrite(chunk.data(), 1, 1 << 20, f);
+    }
+    std::fclose(f);
+  }
+
+  ServerOptions options;
+  options.backend = backend == "uring"  ? Multiplexer::Backend::uring
+                    : backend == "poll" ? Multiplexer::Backend::poll
+                                        : Multiplexer::Backend::epoll;
+  options.port = "16972";
+  options.root = dir;
+  options.maxTransfers = 4;
+  std::thread(serve, &options).detach();
+  std::this_thread::sleep_for(std::chrono::milliseconds(100));
+
+  std::printf("%zu MiB file, %.*s\n",
+              mib,
+              SCAST(int, backend.size()),
+              backend.data());
+  std::printf(
+    "%8s %10s %12s %12s\n", "blksize", "seconds", "MiB/s", "packets");
+  fetch(16972, "image", 65464); // into the page cache
+  const uint16_t sizes[] = {
+    512, 1024, 1428, 4096, 8192, 16384, 32768, 65464,
+  };
+  for (auto blksize : sizes) {
+    auto start = Clock::now();
+    uint64_t bytes = fetch(16972, "image", blksize);
+    double secs = std::chrono::duration<double>(Clock::now() - start).count();
+    std::printf("%8u %10.3f %12.1f %12llu\n",
+                blksize,
+                secs,
+                SCAST(double, bytes) / (1 << 20) / secs,
+                SCAST(unsigned long long, bytes / blksize + 1));
+  }
+
+  unlink(path.c_str());
+  rmdir(dir);
+  std::fflush(stdout);
+  std::_Exit(0); // the reactor never returns
+}
@@ -0,0 +1,414 @@
+/* Aggregate goodput and fairness of concurrent windowed transfers through
+ * a shared bottleneck, with and without congestion control.
+ *
+ * A proxy thread stands for the uplink of a boot server: every DATA packet
+ * goes through one queue drained at a fixed rate, dropped when the queue is
+ * full, and delayed by half the round trip time in each direction. Several
+ * clients fetch the same file at once through it, each from its own thread
+ * and socket, first from a reactor that sends whole windows and then from
+ * one pacing them with AIMD. Fairness is Jain's index over the clients'
+ * goodput: 1 when they all get the same share.
+ *
+ * usage: ./bench-congestion [clients] [file-MiB] [window] [link-MiB/s]
+ *                           [rtt-ms] [queue-KiB]
+ */
+
+#include "reactor.hpp"
+
+#include <arpa/inet.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+#define SCAST(Type, e) static_cast<Type>(e)
+#define TU(e) std::to_underlying(e)
+
+namespace BS = BetterSocket;
+using Clock = std::chrono::steady_clock;
+
+constexpr uint16_t PROXY_PORT = 16977;
+constexpr uint16_t BLKSIZE = 1428;
+
+static std::atomic<uint16_t> serverPort{ 0 }; // the reactor measured now
+static std::atomic<unsigned> run{ 0 };        // the clients are new ones
+static std::atomic<uint64_t> drops{ 0 };
+static double linkBytesPerSec;
+static std::chrono::microseconds oneWay;
+static double queueBytes;
+
+static sockaddr_in
+loopback(uint16_t port)
+{
+  sockaddr_in a = {};
+  a.sin_family = AF_INET;
+  a.sin_port = htons(port);
+  a.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  return a;
+}
+
+// forwards between the clients and the server, each client through a
+// socket of its own so the server sees them as different peers
+static void
+proxy(std::size_t clients)
+{
+  struct Held
+  {
+    Clock::time_point due;
+    std::size_t client;
+    bool toServer;
+    std::vector<std::byte> bytes;
+  };
+  struct Peer
+  {
+    int back;
+    sockaddr_in client;
+    sockaddr_in tid;
+    bool haveTid;
+  };
+
+  int front = socket(AF_INET, SOCK_DGRAM, 0);
+  auto frontAddr = loopback(PROXY_PORT);
+  bind(front, reinterpret_cast<sockaddr*>(&frontAddr), sizeof(frontAddr));
+  std::vector<Peer> peers;
+  std::vector<pollfd> pfds = { { front, POLLIN, 0 } };
+  for (std::size_t i = 0; i < clients; i++) {
+    peers.push_back({ socket(AF_INET, SOCK_DGRAM, 0), {}, {}, false });
+    pfds.push_back({ peers.back().back, POLLIN, 0 });
+  }
+
+  // the delay is the same for all packets of a direction, so each is FIFO
+  std::deque<Held> up, down;
+  auto linkFree = Clock::now(); // when the downlink has sent its backlog
+  std::byte buf[65536];
+  for (unsigned seen = 0;;) {
+    auto next = Clock::time_point::max();
+    if (!up.empty())
+      next = up.front().due;
+    if (!down.empty())
+      next = std::min(next, down.front().due);
+    timespec wait = {};
+    if (next != Clock::time_point::max()) {
+      auto ns =
+        std::chrono::duration_cast<std::chrono::nanoseconds>(next - Clock::now())
+          .count();
+      ns = std::max<decltype(ns)>(ns, 0);
+      wait = { SCAST(time_t, ns / 1000000000), SCAST(long, ns % 1000000000) };
+    }
+    for (auto& p : pfds)
+      p.revents = 0;
+    ppoll(pfds.data(),
+          pfds.size(),
+          next == Clock::time_point::max() ? nullptr : &wait,
+          nullptr);
+    if (seen != run) {
+      seen = run;
+      for (auto& peer : peers)
+        peer.client = {};
+    }
+
+    for (std::size_t i = 0; i < pfds.size(); i++) {
+      if (!(pfds[i].revents & POLLIN))
+        continue;
+      sockaddr_in from = {};
+      socklen_t len = sizeof(from);
+      auto r = recvfrom(pfds[i].fd,
+                        buf,
+                        sizeof(buf),
+                        0,
+                        reinterpret_cast<sockaddr*>(&from),
+                        &len);
+      if (r < 2)
+        continue;
+      auto now = Clock::now();
+      if (i == 0) {
+        // a client: known by its port, or the next free slot
+        std::size_t c = 0;
+        while (c < peers.size() && peers[c].client.sin_port != from.sin_port &&
+               peers[c].client.sin_port != 0)
+          c++;
+        if (c == peers.size())
+          continue;
+        peers[c].client = from;
+        if (getU16(buf) == TU(Opcodes::rrq))
+          peers[c].haveTid = false;
+        up.push_back({ now + oneWay, c, true, { buf, buf + r } });
+        continue;
+      }
+
+      // the server: only the first transfer a request started gets through
+      auto& peer = peers[i - 1];
+      if (!peer.haveTid) {
+        peer.tid = from;
+        peer.haveTid = true;
+      } else if (from.sin_port != peer.tid.sin_port) {
+        continue;
+      }
+      // drop tail once the queue holds more than it can
+      auto backlog = std::max(linkFree, now);
+      double queued =
+        std::chrono::duration<double>(backlog - now).count() * linkBytesPerSec;
+      if (queued + SCAST(double, r) > queueBytes) {
+        drops++;
+        continue;
+      }
+      linkFree = backlog + std::chrono::duration_cast<Clock::duration>(
+                             std::chrono::duration<double>(
+                               SCAST(double, r) / linkBytesPerSec));
+      down.push_back({ linkFree + oneWay, i - 1, false, { buf, buf + r } });
+    }
+
+    auto now = Clock::now();
+    for (auto* q : { &up, &down }) {
+      while (!q->empty() && q->front().due <= now) {
+        auto& h = q->front();
+        auto& peer = peers[h.client];
+        auto listener = loopback(serverPort);
+        bool request = getU16(h.bytes.data()) == TU(Opcodes::rrq);
+        auto& to = h.toServer ? (request ? listener : peer.tid) : peer.client;
+        sendto(h.toServer ? peer.back : front,
+               h.bytes.data(),
+               h.bytes.size(),
+               0,
+               reinterpret_cast<sockaddr*>(&to),
+               sizeof(to));
+        q->pop_front();
+      }
+    }
+  }
+}
+
+static void
+sendAck(int fd, const sockaddr_in& to, uint32_t block)
+{
+  std::byte ack[4];
+  putU16(ack, TU(Opcodes::ack));
+  putU16(ack + 2, SCAST(uint16_t, block & 0xffff));
+  sendto(fd,
+         ack,
+         sizeof(ack),
+         0,
+         reinterpret_cast<const sockaddr*>(&to),
+         sizeof(to));
+}
+
+// fetch `name` through the proxy, returns the bytes received
+static uint64_t
+fetch(const std::string& name, uint16_t window)
+{
+  int fd = socket(AF_INET, SOCK_DGRAM, 0);
+  auto server = loopback(PROXY_PORT);
+
+  TransferOptions proposed;
+  proposed.present = TransferOptions::BLKSIZE | TransferOptions::WINDOWSIZE;
+  proposed.blksize = BLKSIZE;
+  proposed.windowsize = window;
+  std::byte options[64];
+  auto optionsSize = buildOptions(options, proposed);
+  std::byte rrq[512];
+  auto size = buildRequest(
+    rrq, Opcodes::rrq, name, "octet", std::span(options, optionsSize));
+
+  std::vector<std::byte> buf(packetSize(BLKSIZE));
+  TransferOptions acked;
+  uint32_t expect = 0; // 0 until the OACK came
+  uint16_t sinceAck = 0;
+  bool gapAcked = false;
+  uint64_t bytes = 0;
+  for (int timeouts = 0;;) {
+    if (expect == 0 && timeouts == 0)
+      sendto(
+        fd, rrq, size, 0, reinterpret_cast<sockaddr*>(&server), sizeof(server));
+    pollfd pfd = { fd, POLLIN, 0 };
+    if (poll(&pfd, 1, TU(Constants::retransmitTimeout)) <= 0) {
+      if (++timeouts > 30) {
+        std::fprintf(stderr, "bench-congestion: transfer stalled\n");
+        std::exit(1);
+      }
+      if (expect > 0)
+        sendAck(fd, server, expect - 1);
+      else
+        timeouts = 0; // the request is sent again
+      continue;
+    }
+    auto r = recv(fd, buf.data(), buf.size(), 0);
+    if (r < 4)
+      continue;
+    timeouts = 0;
+    auto op = SCAST(Opcodes, getU16(buf.data()));
+    uint16_t block = getU16(buf.data() + 2);
+    if (op == Opcodes::oack && expect == 0) {
+      parseOptions(std::span(buf).subspan(2, SCAST(std::size_t, r) - 2),
+                   acked);
+      expect = 1;
+      sendAck(fd, server, 0);
+      continue;
+    }
+    if (op != Opcodes::data || expect == 0)
+      continue;
+    if (block != (expect & 0xffff)) {
+      if (!gapAcked) {
+        sendAck(fd, server, expect - 1);
+        gapAcked = true;
+        sinceAck = 0;
+      }
+      continue;
+    }
+    bytes += SCAST(uint64_t, r - 4);
+    expect++;
+    gapAcked = false;
+    bool done = SCAST(std::size_t, r - 4) < acked.blksize;
+    if (done || ++sinceAck >= acked.windowsize) {
+      sendAck(fd, server, block);
+      sinceAck = 0;
+    }
+    if (done)
+      break;
+  }
+  close(fd);
+  return bytes;
+}
+
+static void
+serve(const ServerOptions* options)
+{
+  BS::SocketHint hint(BS::IpVersion::vAny,
+                      BS::SockKind::Datagram,
+                      BS::SockFlags::UseHostIP,
+                      BS::IpProtocol::UDP);
+  BS::BSocket listener(hint, options->port);
+  listener.bind();
+  PortPool pool;
+  pool.fill(hint, options->maxTransfers);
+  Reactor reactor(*options, hint, std::move(listener), std::move(pool));
+  reactor.run();
+}
+
+static unsigned long
+arg(int argc, char** argv, int i, unsigned long fallback)
+{
+  return argc > i ? std::strtoul(argv[i], nullptr, 10) : fallback;
+}
+
+int
+main(int argc, char** argv)
+{
+  std::size_t clients = arg(argc, argv, 1, 8);
+  std::size_t mib = arg(argc, argv, 2, 2);
+  auto window = SCAST(uint16_t, arg(argc, argv, 3, 64));
+  auto linkMiB = arg(argc, argv, 4, 16);
+  auto rtt = arg(argc, argv, 5, 10);
+  auto queueKiB = arg(argc, argv, 6, 128);
+  linkBytesPerSec = SCAST(double, linkMiB << 20);
+  oneWay = std::chrono::microseconds(rtt * 500);
+  queueBytes = SCAST(double, queueKiB << 10);
+  BS::init();
+
+  char dir[] = "/tmp/bench-congestion-XXXXXX";
+  if (mkdtemp(dir) == nullptr) {
+    std::perror("mkdtemp");
+    return 1;
+  }
+  std::string path = std::string(dir) + "/image";
+  {
+    std::FILE* f = std::fopen(path.c_str(), "wb");
+    std::mt19937_64 rng(1);
+    std::vector<uint64_t> chunk(1 << 17);
+    for (std::size_t i = 0; i < mib; i++) {
+      for (auto& w : chunk)
+        w = rng();
+      std::fwrite(chunk.data(), 1, 1 << 20, f);
+    }
+    std::fclose(f);
+  }
+
+  const Congestion modes[] = { Congestion::none, Congestion::aimd };
+  std::vector<ServerOptions> servers(std::size(modes));
+  for (std::size_t m = 0; m < std::size(modes); m++) {
+    servers[m].port = std::to_string(16975 + m);
+    servers[m].root = dir;
+    servers[m].maxTransfers = SCAST(unsigned, clients);
+    servers[m].maxWindow = window;
+    servers[m].congestion = modes[m];
+    std::thread(serve, &servers[m]).detach();
+  }
+  std::thread(proxy, clients).detach();
+  std::this_thread::sleep_for(std::chrono::milliseconds(100));
+
+  std::printf("%zu clients, %zu MiB each, window %u of %u bytes, link %lu "
+              "MiB/s, rtt %lu ms, queue %lu KiB\n",
+              clients,
+              mib,
+              window,
+              BLKSIZE,
+              linkMiB,
+              rtt,
+              queueKiB);
+  std::printf("%6s %12s %12s %12s %9s %8s %12s\n",
+              "mode",
+              "total MiB/s",
+              "min MiB/s",
+              "max MiB/s",
+              "fairness",
+              "drops",
+              "retransmits");
+  for (std::size_t m = 0; m < std::size(modes); m++) {
+    serverPort = SCAST(uint16_t, 16975 + m);
+    run++;
+    drops = 0;
+    auto retransmits = Reactor::stats.retransmits.load();
+
+    std::vector<double> rates(clients);
+    std::vector<std::thread> threads;
+    auto start = Clock::now();
+    for (std::size_t c = 0; c < clients; c++)
+      threads.emplace_back([&, c]() {
+        auto began = Clock::now();
+        auto bytes = fetch("image", window);
+        double secs = std::chrono::duration<double>(Clock::now() - began).count();
+        if (bytes != mib << 20) {
+          std::fprintf(stderr,
+                       "bench-congestion: got %llu bytes\n",
+                       SCAST(unsigned long long, bytes));
+          std::exit(1);
+        }
+        rates[c] = SCAST(double, bytes) / (1 << 20) / secs;
+      });
+    for (auto& t : threads)
+      t.join();
+    double secs = std::chrono::duration<double>(Clock::now() - start).count();
+
+    double sum = 0, squares = 0;
+    for (auto r : rates) {
+      sum += r;
+      squares += r * r;
+    }
+    auto [lo, hi] = std::minmax_element(rates.begin(), rates.end());
+    std::printf("%6s %12.2f %12.2f %12.2f %9.3f %8llu %12llu\n",
+                modes[m] == Congestion::aimd ? "aimd" : "none",
+                SCAST(double, clients * mib) / secs,
+                *lo,
+                *hi,
+                sum * sum / (SCAST(double, clients) * squares),
+                SCAST(unsigned long long, drops.load()),
+                SCAST(unsigned long long,
+                      Reactor::stats.retransmits.load() - retransmits));
+    std::fflush(stdout);
+  }
+
+  unlink(path.c_str());
+  rmdir(dir);
+  std::fflush(stdout);
+  std::_Exit(0); // the reactors and the proxy never return
+}
@@ -0,0 +1,330 @@
+/* CPU per datagram with and without the UDP segmentation offloads.
+ *
+ * Sending: two reactors run on their own threads, both batching their
+ * sends, one handing each window of DATA to the kernel as one buffer it
+ * splits (`--gso on`). `clients` threads fetch a file from each at once with
+ * a big window; throughput and the reactor's CPU time per datagram are
+ * printed.
+ *
+ * Receiving: the uploads of the server are lock-step and give the kernel
+ * little to coalesce, so receiving is measured on a socket pair instead.
+ * Bursts of datagrams, as many as one send takes, are sent with
+ * BSocket::sendSegments() and read with BSocket::receiveSegments(), once one
+ * by one and once coalesced (BSocket::coalesceReceives()); the receiving
+ * system calls and the CPU time per datagram are printed.
+ *
+ * usage: ./bench-gso [clients] [file-MiB] [bursts]
+ */
+
+#include "reactor.hpp"
+#include "socket/error_utils.hpp"
+
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+#define SCAST(Type, e) static_cast<Type>(e)
+#define TU(e) std::to_underlying(e)
+
+namespace BS = BetterSocket;
+using Clock = std::chrono::steady_clock;
+
+constexpr uint16_t BLKSIZE = 1428;
+constexpr uint16_t WINDOW = 64;
+
+static BS::SocketHint
+udpHint()
+{
+  return BS::SocketHint(BS::IpVersion::v4,
+                        BS::SockKind::Datagram,
+                        BS::SockFlags::UseHostIP,
+                        BS::IpProtocol::UDP);
+}
+
+static BS::SockaddrWrapper
+addressOf(const BS::BSocket& sock)
+{
+  sockaddr_storage storage = {};
+  std::memcpy(&storage, sock.validAddr.ai_addr, sock.validAddr.ai_addrlen);
+  return BS::SockaddrWrapper(storage, sock.validAddr.ai_addrlen);
+}
+
+static void
+sendAck(BS::BSocket& sock, BS::SockaddrWrapper& to, uint32_t block)
+{
+  std::byte ack[4];
+  putU16(ack, TU(Opcodes::ack));
+  putU16(ack + 2, SCAST(uint16_t, block & 0xffff));
+  sock.sendTo(ack, sizeof(ack), to);
+}
+
+// fetch `name` acknowledging every window, the bytes received
+static uint64_t
+fetch(const std::string& port, const std::string& name)
+{
+  auto hint = udpHint();
+  BS::BSocket sock(hint, port, "127.0.0.1");
+  auto tid = addressOf(sock);
+
+  TransferOptions proposed;
+  proposed.present = TransferOptions::BLKSIZE | TransferOptions::WINDOWSIZE;
+  proposed.blksize = BLKSIZE;
+  proposed.windowsize = WINDOW;
+  std::byte options[64];
+  auto optionsSize = buildOptions(options, proposed);
+  std::byte rrq[512];
+  auto size = buildRequest(
+    rrq, Opcodes::rrq, name, "octet", std::span(options, optionsSize));
+  sock.sendTo(rrq, size, tid);
+
+  std::vector<std::byte> buffers(WINDOW * packetSize(BLKSIZE));
+  std::vector<BS::DatagramSlot> slots(WINDOW);
+  for (std::size_t i = 0; i < slots.size(); i++)
+    slots[i] = { buffers.data() + i * packetSize(BLKSIZE),
+                 packetSize(BLKSIZE),
+                 0,
+                 {} };
+
+  uint32_t expect = 0; // 0 until the OACK came
+  uint16_t sinceAck = 0;
+  uint64_t bytes = 0;
+  for (int timeouts = 0;;) {
+    BS::GPollfd pfd = { sock.underlyingSocket(), POLLIN, 0 };
+    if (BS::gPoll(&pfd, 1, 200) <= 0) {
+      if (++timeouts > 10 || expect == 0)
+        return 0;
+      sendAck(sock, tid, expect - 1);
+      sinceAck = 0;
+      continue;
+    }
+    timeouts = 0;
+    auto got = sock.receiveMany(slots, MSG_DONTWAIT);
+    for (std::size_t i = 0; i < got; i++) {
+      auto* packet = SCAST(std::byte*, slots[i].buf);
+      auto len = slots[i].len;
+      if (len < 4)
+        continue;
+      auto op = SCAST(Opcodes, getU16(packet));
+      uint16_t block = getU16(packet + 2);
+      if (op == Opcodes::oack && expect == 0) {
+        tid = slots[i].addr;
+        expect = 1;
+        sendAck(sock, tid, 0);
+        continue;
+      }
+      if (op != Opcodes::data || expect == 0)
+        continue;
+      if (block != (expect & 0xffff)) {
+        sendAck(sock, tid, expect - 1);
+        sinceAck = 0;
+        continue;
+      }
+      bytes += len - 4;
+      expect++;
+      bool done = len - 4 < BLKSIZE;
+      if (done || ++sinceAck >= WINDOW) {
+        sendAck(sock, tid, block);
+        sinceAck = 0;
+      }
+      if (done)
+        return bytes;
+    }
+  }
+}
+
+static void
+serve(const ServerOptions* options)
+{
+  auto hint = udpHint();
+  BS::BSocket listener(hint, options->port);
+  listener.bind();
+  PortPool pool;
+  pool.fill(hint, options->maxTransfers);
+  Reactor reactor(*options, hint, std::move(listener), std::move(pool));
+  reactor.run();
+}
+
+static double
+cpuSeconds(clockid_t clock)
+{
+  timespec ts;
+  clock_gettime(clock, &ts);
+  return SCAST(double, ts.tv_sec) + SCAST(double, ts.tv_nsec) / 1e9;
+}
+
+static void
+sending(unsigned clients, std::size_t mib, const std::string& dir)
+{
+  struct Mode
+  {
+    const char* name;
+    bool gso;
+  };
+  const Mode modes[] = { { "gso off", false }, { "gso on", true } };
+  constexpr std::size_t MODES = sizeof(modes) / sizeof(modes[0]);
+  ServerOptions options[MODES];
+  clockid_t clocks[MODES];
+  std::vector<std::thread> reactors;
+  for (std::size_t m = 0; m < MODES; m++) {
+    options[m].port = std::to_string(16987 + m);
+    options[m].root = dir;
+    options[m].backend = Multiplexer::Backend::epoll;
+    options[m].maxTransfers = clients + 4;
+    options[m].maxWindow = WINDOW;
+    options[m].gso = modes[m].gso;
+    reactors.emplace_back(serve, &options[m]);
+    pthread_getcpuclockid(reactors.back().native_handle(), &clocks[m]);
+  }
+  for (auto& r : reactors)
+    r.detach();
+  std::this_thread::sleep_for(std::chrono::milliseconds(100));
+
+  std::printf("sending: %u clients fetching %zu MiB (window %u, blksize %u), "
+              "epoll\n",
+              clients,
+              mib,
+              WINDOW,
+              BLKSIZE);
+  std::printf("%-10s %9s %11s %11s %16s\n",
+              "",
+              "MiB/s",
+              "datagrams",
+              "split share",
+              "reactor us/dgram");
+  for (std::size_t m = 0; m < MODES; m++) {
+    auto& io = Multiplexer::stats;
+    uint64_t sent = io.sent.load();
+    uint64_t split = io.segmented.load();
+    double cpu = cpuSeconds(clocks[m]);
+    auto start = Clock::now();
+
+    std::vector<std::thread> threads;
+    std::atomic<uint64_t> bytes{ 0 };
+    for (unsigned i = 0; i < clients; i++)
+      threads.emplace_back(
+        [&, port = options[m].port]() { bytes += fetch(port, "image"); });
+    for (auto& t : threads)
+      t.join();
+
+    double secs = std::chrono::duration<double>(Clock::now() - start).count();
+    cpu = cpuSeconds(clocks[m]) - cpu;
+    sent = io.sent.load() - sent;
+    split = io.segmented.load() - split;
+    std::printf("%-10s %9.1f %11llu %11.3f %16.3f%s\n",
+                modes[m].name,
+                SCAST(double, bytes.load()) / (1 << 20) / secs,
+                SCAST(unsigned long long, sent),
+                SCAST(double, split) / SCAST(double, sent),
+                cpu * 1e6 / SCAST(double, sent),
+                bytes.load() == clients * (mib << 20) ? "" : "  (stalled)");
+  }
+}
+
+static void
+receiving(unsigned bursts)
+{
+  // what the kernel splits one send into is at most a datagram's worth
+  const std::size_t segment = packetSize(BLKSIZE);
+  const std::size_t count = TU(Multiplexer::constants::GSO_BYTES) / segment;
+  std::printf("\nreceiving: %u bursts of %zu datagrams of %zu bytes, "
+              "loopback\n",
+              bursts,
+              count,
+              segment);
+  std::printf("%-10s %11s %11s %17s\n",
+              "",
+              "datagrams",
+              "calls/dgram",
+              "receiver us/dgram");
+
+  std::vector<std::byte> burst(count * segment, std::byte{ 7 });
+  std::vector<std::byte> buf(1 << 16);
+  for (bool coalesce : { false, true }) {
+    auto hint = udpHint();
+    BS::BSocket receiver(hint, "0", "127.0.0.1");
+    receiver.bind();
+    if (coalesce && !receiver.coalesceReceives(true)) {
+      std::printf("%-10s not supported by this kernel\n", "gro on");
+      continue;
+    }
+    BS::BSocket sender(hint, std::to_string(receiver.localPort()), "127.0.0.1");
+    auto to = addressOf(sender);
+
+    uint64_t datagrams = 0;
+    uint64_t calls = 0;
+    double cpu = 0;
+    for (unsigned b = 0; b < bursts; b++) {
+      sender.sendSegments(burst.data(), burst.size(), segment, to);
+      // loopback delivers before the send returns, time the receiver only
+      timespec t0, t1;
+      clock_gettime(CLOCK_THREAD_CPUTIME_ID, &t0);
+      for (std::size_t got = 0; got < burst.size();) {
+        BS::SockaddrWrapper from;
+        BS::Size size;
+        BS::SSize r;
+        try {
+          r = receiver.receiveSegments(
+            buf.data(), buf.size(), from, size, MSG_DONTWAIT);
+        } catch (const SockErrors::APIError&) {
+          break; // dropped, the receive buffer was full
+        }
+        calls++;
+        got += SCAST(std::size_t, r);
+        datagrams += (SCAST(std::size_t, r) + size - 1) / size;
+      }
+      clock_gettime(CLOCK_THREAD_CPUTIME_ID, &t1);
+      cpu += SCAST(double, t1.tv_sec - t0.tv_sec) +
+             SCAST(double, t1.tv_nsec - t0.tv_nsec) / 1e9;
+    }
+    std::printf("%-10s %11llu %11.3f %17.3f\n",
+                coalesce ? "gro on" : "gro off",
+                SCAST(unsigned long long, datagrams),
+                SCAST(double, calls) / SCAST(double, datagrams),
+                cpu * 1e6 / SCAST(double, datagrams));
+  }
+}
+
+int
+main(int argc, char** argv)
+{
+  unsigned clients =
+    argc > 1 ? SCAST(unsigned, std::strtoul(argv[1], nullptr, 10)) : 8;
+  std::size_t mib = argc > 2 ? std::strtoul(argv[2], nullptr, 10) : 32;
+  unsigned bursts =
+    argc > 3 ? SCAST(unsigned, std::strtoul(argv[3], nullptr, 10)) : 20000;
+  BS::init();
+
+  char dir[] = "/tmp/bench-gso-XXXXXX";
+  if (mkdtemp(dir) == nullptr) {
+    std::perror("mkdtemp");
+    return 1;
+  }
+  std::string path = std::string(dir) + "/image";
+  {
+    std::vector<unsigned char> bytes(mib << 20);
+    std::mt19937 rng(7);
+    for (auto& b : bytes)
+      b = SCAST(unsigned char, rng());
+    std::FILE* f = std::fopen(path.c_str(), "wb");
+    std::fwrite(bytes.data(), 1, bytes.size(), f);
+    std::fclose(f);
+  }
+
+  sending(clients, mib, dir);
+  receiving(bursts);
+
+  unlink(path.c_str());
+  rmdir(dir);
+  std::fflush(stdout);
+  std::_Exit(0); // the reactors never return
+}
@@ -0,0 +1,189 @@
+/* Netascii translation speed, SIMD scanning against byte by byte.
+ *
+ * The baseline looks at every byte on its own, the way a transcoder
+ * without run scanning would. The others are `Netascii::Encoder` and
+ * `Decoder` with each instruction set the CPU has. The text is lines of
+ * random length with LF line ends and a few lone CRs. Output goes into
+ * blksize sized pieces, as it does when the server fills DATA packets, so
+ * line ends are cut in two all the time. Every variant has to produce the
+ * same bytes as the baseline.
+ *
+ * usage: ./bench-netascii [text-MiB] [mean-line-length] [blksize]
+ */
+
+#include "netascii.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <span>
+#include <vector>
+
+#define SCAST(Type, e) static_cast<Type>(e)
+
+using Clock = std::chrono::steady_clock;
+using Bytes = std::vector<std::byte>;
+
+static Bytes
+makeText(std::size_t size, unsigned meanLine)
+{
+  std::mt19937 rng(5);
+  std::uniform_int_distribution<unsigned> line(0, 2 * meanLine);
+  std::uniform_int_distribution<int> printable(' ', '~');
+  Bytes text;
+  text.reserve(size);
+  while (text.size() < size) {
+    for (unsigned n = line(rng); n > 0; n--)
+      text.push_back(SCAST(std::byte, printable(rng)));
+    text.push_back(rng() % 100 == 0 ? std::byte{ '\r' } : std::byte{ '\n' });
+  }
+  text.resize(size);
+  return text;
+}
+
+// byte by byte into `out`, which is large enough. Returns the length
+static std::size_t
+encodeBytewise(const Bytes& in, Bytes& out)
+{
+  std::byte* w = out.data();
+  for (auto b : in) {
+    if (b == std::byte{ '\n' }) {
+      *w++ = std::byte{ '\r' };
+      *w++ = std::byte{ '\n' };
+    } else if (b == std::byte{ '\r' }) {
+      *w++ = std::byte{ '\r' };
+      *w++ = std::byte{ 0 };
+    } else {
+      *w++ = b;
+    }
+  }
+  return SCAST(std::size_t, w - out.data());
+}
+
+static std::size_t
+decodeBytewise(const Bytes& in, Bytes& out)
+{
+  std::byte* w = out.data();
+  bool cr = false;
+  for (auto b : in) {
+    if (cr) {
+      cr = false;
+      if (b == std::byte{ '\n' }) {
+        *w++ = b;
+        continue;
+      }
+      *w++ = std::byte{ '\r' };
+      if (b == std::byte{ 0 })
+        continue;
+    }
+    if (b == std::byte{ '\r' })
+      cr = true;
+    else
+      *w++ = b;
+  }
+  return SCAST(std::size_t, w - out.data());
+}
+
+// the whole input through `step` into `out`, `piece` bytes of output at a
+// time. Returns the length
+template<typename Step>
+static std::size_t
+stream(const Bytes& in, Bytes& out, std::size_t piece, Step step)
+{
+  std::span<const std::byte> rest(in);
+  std::size_t len = 0;
+  do {
+    auto room = std::min(piece, out.size() - len);
+    auto done = step(rest, std::span(out).subspan(len, room));
+    rest = rest.subspan(done.read);
+    len += done.written;
+  } while (!rest.empty());
+  // a byte the encoder held back at the very end
+  auto room = std::min(piece, out.size() - len);
+  len += step(std::span<const std::byte>{}, std::span(out).subspan(len, room))
+           .written;
+  return len;
+}
+
+// best of a few runs, in GB/s of input
+template<typename Run>
+static double
+measure(std::size_t bytes, Run run)
+{
+  double best = 0;
+  for (int i = 0; i < 5; i++) {
+    auto start = Clock::now();
+    run();
+    double secs = std::chrono::duration<double>(Clock::now() - start).count();
+    best = std::max(best, SCAST(double, bytes) / secs / 1e9);
+  }
+  return best;
+}
+
+int
+main(int argc, char** argv)
+{
+  std::size_t mib = argc > 1 ? std::strtoul(argv[1], nullptr, 10) : 64;
+  unsigned meanLine =
+    argc > 2 ? SCAST(unsigned, std::strtoul(argv[2], nullptr, 10)) : 60;
+  std::size_t blksize = argc > 3 ? std::strtoul(argv[3], nullptr, 10) : 1428;
+
+  auto text = makeText(mib << 20, meanLine);
+  // every output is written into buffers allocated once, with room to spare
+  Bytes encoded(2 * text.size() + 1);
+  Bytes out(2 * text.size() + 1);
+  encoded.resize(encodeBytewise(text, encoded));
+  if (out.resize(decodeBytewise(encoded, out)); out != text) {
+    std::fprintf(stderr, "bench-netascii: the baseline does not round trip\n");
+    return 1;
+  }
+  std::printf("%zu MiB of text, lines of %u bytes on average, %zu byte "
+              "blocks\n",
+              mib,
+              meanLine,
+              blksize);
+  std::printf("%-10s %12s %12s   (GB/s)\n", "", "encode", "decode");
+
+  out.resize(2 * text.size() + 1);
+  std::printf("%-10s %12.2f %12.2f\n",
+              "bytewise",
+              measure(text.size(), [&] { encodeBytewise(text, out); }),
+              measure(encoded.size(), [&] { decodeBytewise(encoded, out); }));
+
+  const char* names[] = { "scalar", "sse2", "avx2" };
+  for (auto simd : { Netascii::Simd::scalar,
+                     Netascii::Simd::sse2,
+                     Netascii::Simd::avx2 }) {
+    if (simd > Netascii::best())
+      break;
+    auto encode = [&] {
+      Netascii::Encoder e(simd);
+      return stream(text, out, blksize, [&](auto in, auto to) {
+        return e.encode(in, to);
+      });
+    };
+    // a decoder may need one byte more than it is given
+    auto decode = [&] {
+      Netascii::Decoder d(simd);
+      return stream(encoded, out, blksize + 1, [&](auto in, auto to) {
+        return d.decode(in.first(std::min(in.size(), blksize)), to);
+      });
+    };
+    auto same = [&](std::size_t len, const Bytes& want) {
+      return len == want.size() &&
+             std::equal(want.begin(), want.end(), out.begin());
+    };
+    if (!same(encode(), encoded) || !same(decode(), text)) {
+      std::fprintf(
+        stderr, "bench-netascii: %s differs\n", names[SCAST(int, simd)]);
+      return 1;
+    }
+    std::printf("%-10s %12.2f %12.2f\n",
+                names[SCAST(int, simd)],
+                measure(text.size(), encode),
+                measure(encoded.size(), decode));
+  }
+  return 0;
+}
@@ -0,0 +1,261 @@
+/* Transfers per second against the number of reactors sharing the port.
+ *
+ * For N = 1, 2, 4... up to the number of cores (at least 4), N reactors are
+ * started the way the server starts them: N listeners bound to one port with
+ * SO_REUSEPORT, each served by a reactor on its own thread. Once with the
+ * kernel's flow hash spreading the requests (`--steering hash`), once with
+ * the BPF program sending a request to the reactor of the CPU it came in on
+ * and every reactor pinned to its CPU (`--steering cpu`).
+ *
+ * `clients` threads then fetch a small file over and over for `seconds`,
+ * lock-step from a new port every time, so every transfer is a new flow.
+ * Completed transfers per second, the speedup over one reactor and the
+ * busiest reactor's share of the reactors' CPU time are printed.
+ *
+ * usage: ./bench-reactors [clients] [seconds] [max-reactors]
+ */
+
+#include "reactor.hpp"
+
+#include <arpa/inet.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <string>
+#include <thread>
+#include <vector>
+
+#define SCAST(Type, e) static_cast<Type>(e)
+#define TU(e) std::to_underlying(e)
+
+namespace BS = BetterSocket;
+using Clock = std::chrono::steady_clock;
+
+constexpr std::size_t FILE_SIZE = 4000; // 8 blocks of 512
+
+static void
+pinToCPU(unsigned cpu)
+{
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  CPU_SET(cpu % std::max(1u, std::thread::hardware_concurrency()), &set);
+  pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+}
+
+static double
+cpuSeconds(clockid_t clock)
+{
+  timespec ts;
+  clock_gettime(clock, &ts);
+  return SCAST(double, ts.tv_sec) + SCAST(double, ts.tv_nsec) / 1e9;
+}
+
+static void
+sendAck(int fd, const sockaddr_in& to, uint16_t block)
+{
+  std::byte ack[4];
+  putU16(ack, TU(Opcodes::ack));
+  putU16(ack + 2, block);
+  sendto(fd,
+         ack,
+         sizeof(ack),
+         0,
+         reinterpret_cast<const sockaddr*>(&to),
+         sizeof(to));
+}
+
+// one lock-step transfer of `rrq`'s file from a fresh port, false if it
+// stalled
+static bool
+fetch(uint16_t port, const std::vector<std::byte>& rrq)
+{
+  int fd = socket(AF_INET, SOCK_DGRAM, 0);
+  sockaddr_in server = {};
+  server.sin_family = AF_INET;
+  server.sin_port = htons(port);
+  server.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  sendto(fd,
+         rrq.data(),
+         rrq.size(),
+         0,
+         reinterpret_cast<sockaddr*>(&server),
+         sizeof(server));
+
+  std::byte buf[1024];
+  uint16_t expect = 1;
+  bool done = false;
+  while (!done) {
+    pollfd pfd = { fd, POLLIN, 0 };
+    if (poll(&pfd, 1, 1000) <= 0)
+      break;
+    socklen_t len = sizeof(server);
+    auto r = recvfrom(
+      fd, buf, sizeof(buf), 0, reinterpret_cast<sockaddr*>(&server), &len);
+    if (r < 4 || getU16(buf) != TU(Opcodes::data))
+      break; // an ERROR
+    uint16_t block = getU16(buf + 2);
+    if (block == expect) {
+      expect++;
+      done = SCAST(std::size_t, r - 4) < TU(Constants::maxDataLen);
+    }
+    sendAck(fd, server, block);
+  }
+  close(fd);
+  return done;
+}
+
+// N reactors on `options->port`, the way the server starts them. The
+// CPU clocks of their threads go to `clocks`
+static void
+start(const ServerOptions* options,
+      unsigned reactors,
+      std::vector<clockid_t>& clocks)
+{
+  auto hint = BS::SocketHint(BS::IpVersion::v4,
+                             BS::SockKind::Datagram,
+                             BS::SockFlags::UseHostIP,
+                             BS::IpProtocol::UDP);
+  // bound in order: the steering program returns the index in the group
+  std::vector<BS::BSocket> listeners;
+  for (unsigned i = 0; i < reactors; i++) {
+    BS::BSocket listener(hint, options->port);
+    if (reactors > 1)
+      listener.reusePort();
+    listener.bind();
+    listeners.push_back(std::move(listener));
+  }
+  if (reactors > 1 && options->steering == Steering::cpu)
+    listeners.front().steerByCPU(reactors);
+
+  for (unsigned i = 0; i < reactors; i++) {
+    PortPool pool;
+    pool.fill(hint, options->maxTransfers);
+    std::thread t(
+      [options, hint, i](BS::BSocket listener, PortPool tids) {
+        if (options->steering == Steering::cpu)
+          pinToCPU(i);
+        Reactor reactor(*options, hint, std::move(listener), std::move(tids));
+        reactor.run();
+      },
+      std::move(listeners[i]),
+      std::move(pool));
+    clockid_t clock;
+    pthread_getcpuclockid(t.native_handle(), &clock);
+    clocks.push_back(clock);
+    t.detach();
+  }
+}
+
+int
+main(int argc, char** argv)
+{
+  unsigned clients =
+    argc > 1 ? SCAST(unsigned, std::strtoul(argv[1], nullptr, 10)) : 16;
+  double seconds = argc > 2 ? std::strtod(argv[2], nullptr) : 2;
+  unsigned cores = std::max(1u, std::thread::hardware_concurrency());
+  unsigned most =
+    argc > 3 ? SCAST(unsigned, std::strtoul(argv[3], nullptr, 10))
+             : std::max(4u, cores);
+  BS::init();
+
+  char dir[] = "/tmp/bench-reactors-XXXXXX";
+  if (mkdtemp(dir) == nullptr) {
+    std::perror("mkdtemp");
+    return 1;
+  }
+  std::string path = std::string(dir) + "/small";
+  {
+    std::vector<char> bytes(FILE_SIZE, 'x');
+    std::FILE* f = std::fopen(path.c_str(), "wb");
+    std::fwrite(bytes.data(), 1, bytes.size(), f);
+    std::fclose(f);
+  }
+  std::vector<std::byte> rrq(2 + sizeof("small") + sizeof("octet"));
+  putU16(rrq.data(), TU(Opcodes::rrq));
+  std::memcpy(rrq.data() + 2, "small", sizeof("small"));
+  std::memcpy(rrq.data() + 2 + sizeof("small"), "octet", sizeof("octet"));
+
+  std::printf("%u clients fetching %zu bytes lock-step for %.1f s, %u "
+              "cores, epoll\n",
+              clients,
+              FILE_SIZE,
+              seconds,
+              cores);
+  std::printf("%-8s %8s %13s %8s %8s %14s\n",
+              "steering",
+              "reactors",
+              "transfers/s",
+              "speedup",
+              "stalled",
+              "busiest share");
+
+  std::deque<ServerOptions> configs; // the reactors keep referring to them
+  uint16_t port = 17069;
+  for (auto steering : { Steering::hash, Steering::cpu }) {
+    double single = 0;
+    for (unsigned n = 1; n <= most; n *= 2) {
+      auto& options = configs.emplace_back();
+      options.port = std::to_string(port++);
+      options.root = dir;
+      options.backend = Multiplexer::Backend::epoll;
+      options.steering = steering;
+      // any reactor may get them all, twice: a client starts its next
+      // transfer before its last ACK reached the server
+      options.maxTransfers = clients * 2;
+      std::vector<clockid_t> clocks;
+      start(&options, n, clocks);
+      std::this_thread::sleep_for(std::chrono::milliseconds(100));
+
+      std::vector<double> cpu;
+      for (auto clock : clocks)
+        cpu.push_back(cpuSeconds(clock));
+      std::atomic<uint64_t> done{ 0 };
+      std::atomic<uint64_t> stalled{ 0 };
+      auto begin = Clock::now();
+      auto until = begin + std::chrono::duration<double>(seconds);
+      std::vector<std::thread> threads;
+      for (unsigned c = 0; c < clients; c++)
+        threads.emplace_back([&, p = SCAST(uint16_t, port - 1)]() {
+          while (Clock::now() < until)
+            (fetch(p, rrq) ? done : stalled)++;
+        });
+      for (auto& t : threads)
+        t.join();
+      double secs = std::chrono::duration<double>(Clock::now() - begin).count();
+
+      double total = 0;
+      double busiest = 0;
+      for (std::size_t i = 0; i < clocks.size(); i++) {
+        cpu[i] = cpuSeconds(clocks[i]) - cpu[i];
+        total += cpu[i];
+        busiest = std::max(busiest, cpu[i]);
+      }
+      double rate = SCAST(double, done.load()) / secs;
+      if (n == 1)
+        single = rate;
+      std::printf("%-8s %8u %13.0f %8.2f %8llu %14.2f\n",
+                  steering == Steering::cpu ? "cpu" : "hash",
+                  n,
+                  rate,
+                  rate / single,
+                  SCAST(unsigned long long, stalled.load()),
+                  total > 0 ? busiest / total : 0.0);
+    }
+  }
+
+  unlink(path.c_str());
+  rmdir(dir);
+  std::fflush(stdout);
+  std::_Exit(0); // the reactors never return
+}
@@ -0,0 +1,272 @@
+/* Cold cache throughput of a large image, and what the disk costs the
+ * other transfers of the reactor meanwhile.
+ *
+ * Two reactors run on their own threads, one without read-ahead, one with
+ * the default. For each of them the image is dropped from the page cache,
+ * then fetched with a big window while a second client keeps fetching a
+ * small file that is in memory, one fetch after the other. A reactor that
+ * waits for the disk in a page fault holds those up too. Dropping the
+ * image with POSIX_FADV_DONTNEED works without privileges, but only on a
+ * file system backed by a disk: point DIR at one, not at a tmpfs. A fast
+ * SSD outruns the loopback client, run the benchmark in a blkio cgroup
+ * with a read throttle to see a disk bound server.
+ *
+ * usage: ./bench-readahead [image-MiB] [DIR]
+ */
+
+#include "reactor.hpp"
+
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+#define SCAST(Type, e) static_cast<Type>(e)
+#define TU(e) std::to_underlying(e)
+
+namespace BS = BetterSocket;
+using Clock = std::chrono::steady_clock;
+
+constexpr uint16_t BLKSIZE = 1428;
+constexpr uint16_t WINDOW = 64;
+
+static std::atomic<bool> stopping{ false };
+
+static sockaddr_in
+loopback(uint16_t port)
+{
+  sockaddr_in a = {};
+  a.sin_family = AF_INET;
+  a.sin_port = htons(port);
+  a.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  return a;
+}
+
+static void
+sendAck(int fd, const sockaddr_in& to, uint32_t block)
+{
+  std::byte ack[4];
+  putU16(ack, TU(Opcodes::ack));
+  putU16(ack + 2, SCAST(uint16_t, block & 0xffff));
+  sendto(fd,
+         ack,
+         sizeof(ack),
+         0,
+         reinterpret_cast<const sockaddr*>(&to),
+         sizeof(to));
+}
+
+// fetch `name` from the reactor on `port`, acknowledging every window.
+// Returns the bytes received, 0 if the transfer stalled
+static uint64_t
+fetch(uint16_t port, const std::string& name, uint16_t window)
+{
+  int fd = socket(AF_INET, SOCK_DGRAM, 0);
+  auto server = loopback(port);
+  sockaddr_in tid = server;
+
+  TransferOptions proposed;
+  proposed.present = TransferOptions::BLKSIZE | TransferOptions::WINDOWSIZE;
+  proposed.blksize = BLKSIZE;
+  proposed.windowsize = window;
+  std::byte options[64];
+  auto optionsSize = buildOptions(options, proposed);
+  std::byte rrq[512];
+  auto size = buildRequest(
+    rrq, Opcodes::rrq, name, "octet", std::span(options, optionsSize));
+  sendto(
+    fd, rrq, size, 0, reinterpret_cast<sockaddr*>(&server), sizeof(server));
+
+  std::byte buf[packetSize(BLKSIZE)];
+  uint32_t expect = 0; // 0 until the OACK came
+  uint16_t sinceAck = 0;
+  uint64_t bytes = 0;
+  for (int timeouts = 0;;) {
+    pollfd pfd = { fd, POLLIN, 0 };
+    if (poll(&pfd, 1, 200) <= 0) {
+      if (++timeouts > 10 || expect == 0) {
+        bytes = 0;
+        break;
+      }
+      sendAck(fd, tid, expect - 1);
+      sinceAck = 0;
+      continue;
+    }
+    sockaddr_in from = {};
+    socklen_t len = sizeof(from);
+    auto r = recvfrom(
+      fd, buf, sizeof(buf), 0, reinterpret_cast<sockaddr*>(&from), &len);
+    if (r < 4)
+      continue;
+    timeouts = 0;
+    auto op = SCAST(Opcodes, getU16(buf));
+    uint16_t block = getU16(buf + 2);
+    if (op == Opcodes::oack && expect == 0) {
+      tid = from;
+      expect = 1;
+      sendAck(fd, tid, 0);
+      continue;
+    }
+    if (op != Opcodes::data || expect == 0)
+      continue;
+    if (block != (expect & 0xffff)) {
+      sendAck(fd, tid, expect - 1);
+      sinceAck = 0;
+      continue;
+    }
+    bytes += SCAST(uint64_t, r - 4);
+    expect++;
+    bool done = r - 4 < BLKSIZE;
+    if (done || ++sinceAck >= window) {
+      sendAck(fd, tid, block);
+      sinceAck = 0;
+    }
+    if (done)
+      break;
+  }
+  close(fd);
+  return bytes;
+}
+
+static void
+serve(const ServerOptions* options)
+{
+  BS::SocketHint hint(BS::IpVersion::vAny,
+                      BS::SockKind::Datagram,
+                      BS::SockFlags::UseHostIP,
+                      BS::IpProtocol::UDP);
+  BS::BSocket listener(hint, options->port);
+  listener.bind();
+  PortPool pool;
+  pool.fill(hint, options->maxTransfers);
+  Reactor reactor(*options, hint, std::move(listener), std::move(pool));
+  reactor.run();
+}
+
+static void
+writeFile(const std::string& path, std::size_t size)
+{
+  std::vector<unsigned char> bytes(size);
+  std::mt19937 rng(3);
+  for (auto& b : bytes)
+    b = SCAST(unsigned char, rng());
+  std::FILE* f = std::fopen(path.c_str(), "wb");
+  std::fwrite(bytes.data(), 1, bytes.size(), f);
+  std::fclose(f);
+}
+
+// write it out and drop it from the page cache: the next reads go to disk
+static void
+evict(const std::string& path)
+{
+  int fd = open(path.c_str(), O_RDONLY);
+  fdatasync(fd);
+  posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+  close(fd);
+}
+
+static double
+percentile(const std::vector<double>& sorted, double p)
+{
+  if (sorted.empty())
+    return 0;
+  auto i = SCAST(std::size_t, p / 100 * SCAST(double, sorted.size() - 1));
+  return sorted[i];
+}
+
+int
+main(int argc, char** argv)
+{
+  std::size_t imageMiB = argc > 1 ? std::strtoul(argv[1], nullptr, 10) : 256;
+  std::string base = argc > 2 ? argv[2] : "/var/tmp";
+  BS::init();
+
+  std::string dir = base + "/bench-readahead-XXXXXX";
+  if (mkdtemp(dir.data()) == nullptr) {
+    std::perror("mkdtemp");
+    return 1;
+  }
+  writeFile(dir + "/image", imageMiB << 20);
+  writeFile(dir + "/small", 16 << 10);
+
+  ServerOptions without;
+  without.port = "16983";
+  without.root = dir;
+  without.readAhead = 0;
+  ServerOptions with = without;
+  with.port = "16984";
+  with.readAhead = ServerOptions{}.readAhead;
+  std::thread(serve, &without).detach();
+  std::thread(serve, &with).detach();
+  std::this_thread::sleep_for(std::chrono::milliseconds(100));
+
+  std::printf("cold %zu MiB image (window %u, blksize %u) beside fetches of "
+              "a cached 16 KiB file\n",
+              imageMiB,
+              WINDOW,
+              BLKSIZE);
+  std::printf("%-12s %9s %9s   %9s %9s %9s   (ms)\n",
+              "read-ahead",
+              "MiB/s",
+              "image",
+              "small p50",
+              "p99",
+              "max");
+  const std::pair<const ServerOptions*, uint16_t> runs[] = {
+    { &without, 16983 }, { &with, 16984 }
+  };
+  for (auto [opts, port] : runs) {
+    evict(dir + "/image");
+    fetch(port, "small", 1); // in memory from now on
+
+    stopping = false;
+    std::vector<double> times;
+    std::thread small([&times, port = port]() {
+      while (!stopping) {
+        auto start = Clock::now();
+        if (fetch(port, "small", 1) == 16 << 10)
+          times.push_back(std::chrono::duration<double, std::milli>(
+                            Clock::now() - start)
+                            .count());
+      }
+    });
+    auto start = Clock::now();
+    auto bytes = fetch(port, "image", WINDOW);
+    double secs =
+      std::chrono::duration<double>(Clock::now() - start).count();
+    stopping = true;
+    small.join();
+    std::sort(times.begin(), times.end());
+
+    char depth[32];
+    std::snprintf(depth,
+                  sizeof(depth),
+                  "%llu KiB",
+                  SCAST(unsigned long long, opts->readAhead >> 10));
+    std::printf("%-12s %9.1f %9.0f   %9.2f %9.2f %9.2f%s\n",
+                opts->readAhead == 0 ? "none" : depth,
+                SCAST(double, bytes) / (1 << 20) / secs,
+                secs * 1000,
+                percentile(times, 50),
+                percentile(times, 99),
+                times.empty() ? 0 : times.back(),
+                bytes == imageMiB << 20 ? "" : "   (stalled)");
+  }
+
+  unlink((dir + "/image").c_str());
+  unlink((dir + "/small").c_str());
+  rmdir(dir.c_str());
+  std::fflush(stdout);
+  std::_Exit(0); // the reactors never return
+}
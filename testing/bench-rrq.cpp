@@ -0,0 +1,210 @@
+/* Throughput of the RRQ data path: the same file served from a mapping
+ * with sendmsg() (`--file-io mmap`), through read() (`--file-io read`) and
+ * as ready made packets from the block cache (`--cache-mb`).
+ *
+ * A reactor runs on its own thread for each mode, `clients` lock-step TFTP
+ * clients on the main thread fetch the file over loopback at once.
+ *
+ * usage: ./bench-rrq [file-MiB] [clients] [backend]
+ */
+
+#include "reactor.hpp"
+
+#include <arpa/inet.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <random>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+#define SCAST(Type, e) static_cast<Type>(e)
+#define TU(e) std::to_underlying(e)
+
+namespace BS = BetterSocket;
+using Clock = std::chrono::steady_clock;
+
+struct Client
+{
+  int fd;
+  sockaddr_in server; // the TID once the first DATA arrived
+  uint32_t expect;    // next block
+  uint64_t bytes;
+  bool done;
+};
+
+static void
+sendU16s(Client& c, uint16_t op, uint16_t block)
+{
+  std::byte ack[4];
+  putU16(ack, op);
+  putU16(ack + 2, block);
+  sendto(c.fd,
+         ack,
+         sizeof(ack),
+         0,
+         reinterpret_cast<sockaddr*>(&c.server),
+         sizeof(c.server));
+}
+
+// fetch `name` with `n` clients at once, returns the bytes received
+static uint64_t
+fetch(uint16_t port, const std::string& name, std::size_t n)
+{
+  std::vector<Client> clients(n);
+  std::vector<pollfd> pfds(n);
+  std::vector<std::byte> rrq(2 + name.size() + 1 + sizeof("octet"));
+  putU16(rrq.data(), TU(Opcodes::rrq));
+  std::memcpy(rrq.data() + 2, name.c_str(), name.size() + 1);
+  std::memcpy(rrq.data() + 2 + name.size() + 1, "octet", sizeof("octet"));
+
+  for (std::size_t i = 0; i < n; i++) {
+    auto& c = clients[i];
+    c = { socket(AF_INET, SOCK_DGRAM, 0), {}, 1, 0, false };
+    c.server.sin_family = AF_INET;
+    c.server.sin_port = htons(port);
+    c.server.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    sendto(c.fd,
+           rrq.data(),
+           rrq.size(),
+           0,
+           reinterpret_cast<sockaddr*>(&c.server),
+           sizeof(c.server));
+    pfds[i] = { c.fd, POLLIN, 0 };
+  }
+
+  std::byte buf[2048];
+  std::size_t left = n;
+  uint64_t total = 0;
+  while (left > 0) {
+    if (poll(pfds.data(), pfds.size(), 5000) <= 0) {
+      std::fprintf(stderr, "bench-rrq: transfer stalled\n");
+      std::exit(1);
+    }
+    for (std::size_t i = 0; i < n; i++) {
+      auto& c = clients[i];
+      if (!(pfds[i].revents & POLLIN) || c.done)
+        continue;
+      socklen_t len = sizeof(c.server);
+      auto r = recvfrom(
+        c.fd, buf, sizeof(buf), 0, reinterpret_cast<sockaddr*>(&c.server), &len);
+      if (r < 4 || getU16(buf) != TU(Opcodes::data)) {
+        std::fprintf(stderr, "bench-rrq: unexpected packet\n");
+        std::exit(1);
+      }
+      uint16_t block = getU16(buf + 2);
+      if (block == (c.expect & 0xffff)) {
+        c.bytes += SCAST(uint64_t, r - 4);
+        c.expect++;
+        if (SCAST(std::size_t, r - 4) < TU(Constants::maxDataLen)) {
+          c.done = true;
+          left--;
+          total += c.bytes;
+        }
+      }
+      sendU16s(c, TU(Opcodes::ack), block);
+    }
+  }
+
+  for (auto& c : clients)
+    close(c.fd);
+  return total;
+}
+
+static BlockCache cache(std::size_t{ 1 } << 30);
+
+static void
+serve(const ServerOptions* options)
+{
+  BS::SocketHint hint(BS::IpVersion::vAny,
+                      BS::SockKind::Datagram,
+                      BS::SockFlags::UseHostIP,
+                      BS::IpProtocol::UDP);
+  BS::BSocket listener(hint, options->port);
+  listener.bind();
+  PortPool pool;
+  pool.fill(hint, options->maxTransfers);
+  Reactor reactor(*options,
+                  hint,
+                  std::move(listener),
+                  std::move(pool),
+                  options->cacheMiB > 0 ? &cache : nullptr);
+  reactor.run();
+}
+
+int
+main(int argc, char** argv)
+{
+  std::size_t mib = argc > 1 ? std::strtoul(argv[1], nullptr, 10) : 64;
+  std::size_t n = argc > 2 ? std::strtoul(argv[2], nullptr, 10) : 4;
+  std::string_view backend = argc > 3 ? argv[3] : "epoll";
+  BS::init();
+
+  char dir[] = "/tmp/bench-rrq-XXXXXX";
+  if (mkdtemp(dir) == nullptr) {
+    std::perror("mkdtemp");
+    return 1;
+  }
+  std::string path = std::string(dir) + "/image";
+  {
+    std::FILE* f = std::fopen(path.c_str(), "wb");
+    std::mt19937_64 rng(1);
+    std::vector<uint64_t> chunk(1 << 17);
+    for (std::size_t i = 0; i < mib; i++) {
+      for (auto& w : chunk)
+        w = rng();
+      std::fwrite(chunk.data(), 1, 1 << 20, f);
+    }
+    std::fclose(f);
+  }
+
+  constexpr int MODES = 3;
+  ServerOptions modes[MODES];
+  const char* names[MODES] = { "mmap", "read", "cache" };
+  for (int m = 0; m < MODES; m++) {
+    modes[m].backend = backend == "uring"  ? Multiplexer::Backend::uring
+                       : backend == "poll" ? Multiplexer::Backend::poll
+                                           : Multiplexer::Backend::epoll;
+    modes[m].port = std::to_string(16969 + m);
+    modes[m].fileIO = m == 1 ? FileIO::read : FileIO::mmap;
+    modes[m].cacheMiB = m == 2 ? 1024 : 0;
+    modes[m].root = dir;
+    modes[m].maxTransfers = SCAST(unsigned, n);
+    std::thread(serve, &modes[m]).detach();
+  }
+  std::this_thread::sleep_for(std::chrono::milliseconds(100));
+
+  std::printf("%zu MiB file, %zu clients, %.*s\n",
+              mib,
+              n,
+              SCAST(int, backend.size()),
+              backend.data());
+  // cpu time of the whole process: clients and server
+  std::printf("%-6s %12s %12s\n", "mode", "MiB/s", "cpu s");
+  for (int round = 0; round < 2; round++) {
+    for (int m = 0; m < MODES; m++) {
+      auto cpu0 = std::clock();
+      auto start = Clock::now();
+      uint64_t bytes = fetch(SCAST(uint16_t, 16969 + m), "image", n);
+      double secs = std::chrono::duration<double>(Clock::now() - start).count();
+      double cpu = SCAST(double, std::clock() - cpu0) / CLOCKS_PER_SEC;
+      if (round == 1) // the first round warms the page cache
+        std::printf("%-6s %12.1f %12.2f\n",
+                    names[m],
+                    SCAST(double, bytes) / (1 << 20) / secs,
+                    cpu);
+    }
+  }
+
+  unlink(path.c_str());
+  rmdir(dir);
+  std::fflush(stdout);
+  std::_Exit(0); // the reactors never return
+}
@@ -0,0 +1,267 @@
+/* Completion time of small files while large ones are being sent.
+ *
+ * Two reactors run on their own threads, one sending in the order ACKs
+ * are handled, one with deficit round robin. Against each of them a few
+ * bulk clients fetch a large image over and over with a big window, which
+ * keeps the reactor busy sending, while the main thread fetches a small
+ * file block by block, one fetch after the other. The percentiles of the
+ * small fetches' completion times are printed for both.
+ *
+ * usage: ./bench-scheduler [bulk-clients] [image-MiB] [small-KiB] [fetches]
+ */
+
+#include "reactor.hpp"
+
+#include <arpa/inet.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+#define SCAST(Type, e) static_cast<Type>(e)
+#define TU(e) std::to_underlying(e)
+
+namespace BS = BetterSocket;
+using Clock = std::chrono::steady_clock;
+
+constexpr uint16_t BLKSIZE = 1428;
+constexpr uint16_t BULK_WINDOW = 64;
+
+static std::atomic<bool> stopping{ false };
+
+static sockaddr_in
+loopback(uint16_t port)
+{
+  sockaddr_in a = {};
+  a.sin_family = AF_INET;
+  a.sin_port = htons(port);
+  a.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  return a;
+}
+
+static void
+sendAck(int fd, const sockaddr_in& to, uint32_t block)
+{
+  std::byte ack[4];
+  putU16(ack, TU(Opcodes::ack));
+  putU16(ack + 2, SCAST(uint16_t, block & 0xffff));
+  sendto(fd,
+         ack,
+         sizeof(ack),
+         0,
+         reinterpret_cast<const sockaddr*>(&to),
+         sizeof(to));
+}
+
+// fetch `name` from the reactor on `port`, acknowledging every window.
+// Returns the bytes received, 0 if the transfer stalled
+static uint64_t
+fetch(uint16_t port, const std::string& name, uint16_t window)
+{
+  int fd = socket(AF_INET, SOCK_DGRAM, 0);
+  auto server = loopback(port);
+  sockaddr_in tid = server;
+
+  TransferOptions proposed;
+  proposed.present = TransferOptions::BLKSIZE | TransferOptions::WINDOWSIZE;
+  proposed.blksize = BLKSIZE;
+  proposed.windowsize = window;
+  std::byte options[64];
+  auto optionsSize = buildOptions(options, proposed);
+  std::byte rrq[512];
+  auto size = buildRequest(
+    rrq, Opcodes::rrq, name, "octet", std::span(options, optionsSize));
+  sendto(
+    fd, rrq, size, 0, reinterpret_cast<sockaddr*>(&server), sizeof(server));
+
+  std::byte buf[packetSize(BLKSIZE)];
+  uint32_t expect = 0; // 0 until the OACK came
+  uint16_t sinceAck = 0;
+  uint64_t bytes = 0;
+  for (int timeouts = 0;;) {
+    pollfd pfd = { fd, POLLIN, 0 };
+    if (poll(&pfd, 1, 200) <= 0) {
+      if (++timeouts > 10 || expect == 0) {
+        bytes = 0;
+        break;
+      }
+      sendAck(fd, tid, expect - 1);
+      sinceAck = 0;
+      continue;
+    }
+    sockaddr_in from = {};
+    socklen_t len = sizeof(from);
+    auto r = recvfrom(
+      fd, buf, sizeof(buf), 0, reinterpret_cast<sockaddr*>(&from), &len);
+    if (r < 4)
+      continue;
+    timeouts = 0;
+    auto op = SCAST(Opcodes, getU16(buf));
+    uint16_t block = getU16(buf + 2);
+    if (op == Opcodes::oack && expect == 0) {
+      tid = from;
+      expect = 1;
+      sendAck(fd, tid, 0);
+      continue;
+    }
+    if (op != Opcodes::data || expect == 0)
+      continue;
+    if (block != (expect & 0xffff)) {
+      sendAck(fd, tid, expect - 1);
+      sinceAck = 0;
+      continue;
+    }
+    bytes += SCAST(uint64_t, r - 4);
+    expect++;
+    bool done = r - 4 < BLKSIZE;
+    if (done || ++sinceAck >= window) {
+      sendAck(fd, tid, block);
+      sinceAck = 0;
+    }
+    if (done)
+      break;
+  }
+  close(fd);
+  return bytes;
+}
+
+static void
+serve(const ServerOptions* options)
+{
+  BS::SocketHint hint(BS::IpVersion::vAny,
+                      BS::SockKind::Datagram,
+                      BS::SockFlags::UseHostIP,
+                      BS::IpProtocol::UDP);
+  BS::BSocket listener(hint, options->port);
+  listener.bind();
+  PortPool pool;
+  pool.fill(hint, options->maxTransfers);
+  Reactor reactor(*options, hint, std::move(listener), std::move(pool));
+  reactor.run();
+}
+
+static void
+writeFile(const std::string& path, std::size_t size)
+{
+  std::vector<unsigned char> bytes(size);
+  std::mt19937 rng(3);
+  for (auto& b : bytes)
+    b = SCAST(unsigned char, rng());
+  std::FILE* f = std::fopen(path.c_str(), "wb");
+  std::fwrite(bytes.data(), 1, bytes.size(), f);
+  std::fclose(f);
+}
+
+// small fetches against the reactor on `port` while `bulk` clients keep it
+// busy, in milliseconds, sorted
+static std::vector<double>
+measure(uint16_t port, unsigned bulk, unsigned fetches, uint64_t smallSize)
+{
+  stopping = false;
+  std::vector<std::thread> clients;
+  for (unsigned i = 0; i < bulk; i++)
+    clients.emplace_back([port]() {
+      while (!stopping)
+        fetch(port, "image", BULK_WINDOW);
+    });
+  std::this_thread::sleep_for(std::chrono::milliseconds(200));
+
+  std::vector<double> times;
+  for (unsigned i = 0; i < fetches; i++) {
+    auto start = Clock::now();
+    auto bytes = fetch(port, "small", 1);
+    if (bytes != smallSize)
+      continue; // stalled, not a completion time
+    times.push_back(
+      std::chrono::duration<double, std::milli>(Clock::now() - start).count());
+  }
+  stopping = true;
+  for (auto& c : clients)
+    c.join();
+  std::sort(times.begin(), times.end());
+  return times;
+}
+
+static double
+percentile(const std::vector<double>& sorted, double p)
+{
+  if (sorted.empty())
+    return 0;
+  auto i = SCAST(std::size_t, p / 100 * SCAST(double, sorted.size() - 1));
+  return sorted[i];
+}
+
+int
+main(int argc, char** argv)
+{
+  unsigned bulk =
+    argc > 1 ? SCAST(unsigned, std::strtoul(argv[1], nullptr, 10)) : 8;
+  std::size_t imageMiB = argc > 2 ? std::strtoul(argv[2], nullptr, 10) : 64;
+  std::size_t smallKiB = argc > 3 ? std::strtoul(argv[3], nullptr, 10) : 64;
+  unsigned fetches =
+    argc > 4 ? SCAST(unsigned, std::strtoul(argv[4], nullptr, 10)) : 200;
+  BS::init();
+
+  char dir[] = "/tmp/bench-scheduler-XXXXXX";
+  if (mkdtemp(dir) == nullptr) {
+    std::perror("mkdtemp");
+    return 1;
+  }
+  std::string root = dir;
+  writeFile(root + "/image", imageMiB << 20);
+  writeFile(root + "/small", smallKiB << 10);
+
+  ServerOptions arrival;
+  arrival.port = "16981";
+  arrival.root = root;
+  arrival.maxTransfers = bulk + 4;
+  arrival.maxWindow = BULK_WINDOW;
+  ServerOptions drr = arrival;
+  drr.port = "16982";
+  drr.scheduling = Scheduling::drr;
+  std::thread(serve, &arrival).detach();
+  std::thread(serve, &drr).detach();
+  std::this_thread::sleep_for(std::chrono::milliseconds(100));
+
+  std::printf("%u bulk clients on a %zu MiB image (window %u), %u fetches "
+              "of a %zu KiB file\n",
+              bulk,
+              imageMiB,
+              BULK_WINDOW,
+              fetches,
+              smallKiB);
+  std::printf("%-10s %9s %9s %9s %9s %9s   (ms)\n",
+              "",
+              "p50",
+              "p90",
+              "p99",
+              "max",
+              "done");
+  const std::pair<const char*, uint16_t> runs[] = { { "arrival", 16981 },
+                                                    { "drr", 16982 } };
+  for (auto [name, port] : runs) {
+    auto times = measure(port, bulk, fetches, smallKiB << 10);
+    std::printf("%-10s %9.2f %9.2f %9.2f %9.2f %9zu\n",
+                name,
+                percentile(times, 50),
+                percentile(times, 90),
+                percentile(times, 99),
+                times.empty() ? 0 : times.back(),
+                times.size());
+  }
+
+  unlink((root + "/image").c_str());
+  unlink((root + "/small").c_str());
+  rmdir(dir);
+  std::fflush(stdout);
+  std::_Exit(0); // the reactors never return
+}
@@ -0,0 +1,146 @@
+/* Cost of setting up and tearing down a transfer in both demultiplexing
+ * modes of the server:
+ *  - fresh:  a new BSocket on a random port (getaddrinfo, socket) that is
+ *            then registered with the multiplexer, what `--demux socket`
+ *            did before the TID port pool
+ *  - pool:   a socket taken from the pre-bound PortPool and a connection
+ *            from the ConnectionTable, `--demux socket`
+ *  - peer:   a connection from the ConnectionTable, `--demux peer`
+ * `transfers` of them are open at the same time before they are closed.
+ *
+ * usage: ./bench-setup [transfers]
+ */
+
+#include "reactor.hpp"
+
+#include <sys/resource.h>
+
+#include <arpa/inet.h>
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <vector>
+
+namespace BS = BetterSocket;
+using Clock = std::chrono::steady_clock;
+
+static double
+usPer(Clock::time_point start, Clock::time_point end, std::size_t n)
+{
+  return std::chrono::duration<double, std::micro>(end - start).count() / n;
+}
+
+static void
+perSocket(Multiplexer::Backend backend, std::size_t n)
+{
+  BS::SocketHint hint(BS::IpVersion::vAny,
+                      BS::SockKind::Datagram,
+                      BS::SockFlags::UseHostIP,
+                      BS::IpProtocol::UDP);
+  Multiplexer m(backend);
+  std::vector<BS::BSocket> socks(n);
+
+  auto start = Clock::now();
+  for (auto& s : socks) {
+    s = BS::BSocket(hint, std::to_string(randomPort()));
+    m.receive_datagrams(s.underlyingSocket());
+  }
+  auto mid = Clock::now();
+  for (auto& s : socks) {
+    m.unwatch(s.underlyingSocket());
+    s.close();
+  }
+  auto end = Clock::now();
+
+  std::printf("%-8s %-6s %12.2f %12.2f\n",
+              "fresh",
+              backend == Multiplexer::Backend::poll    ? "poll"
+              : backend == Multiplexer::Backend::epoll ? "epoll"
+                                                       : "uring",
+              usPer(start, mid, n),
+              usPer(mid, end, n));
+}
+
+// distinct client addresses, built up front like the multiplexer does
+static std::vector<BS::SockaddrWrapper>
+makePeers(std::size_t n)
+{
+  std::vector<BS::SockaddrWrapper> peers;
+  peers.reserve(n);
+  for (std::size_t i = 0; i < n; i++) {
+    sockaddr_storage ss = {};
+    auto* v4 = reinterpret_cast<sockaddr_in*>(&ss);
+    v4->sin_family = AF_INET;
+    v4->sin_addr.s_addr = htonl(0x7f000001 + static_cast<uint32_t>(i >> 16));
+    v4->sin_port = htons(static_cast<uint16_t>(i));
+    peers.emplace_back(ss, sizeof(sockaddr_in));
+  }
+  return peers;
+}
+
+// open and close `n` transfers in the connection table twice and time the
+// second round, when the table has already grown
+static void
+perTable(const char* name, std::size_t n, PortPool* pool)
+{
+  auto peers = makePeers(n);
+  ConnectionTable table(n);
+  std::vector<ConnectionTable::Handle> handles(n);
+  std::vector<PortPool::Tid> taken(n, PortPool::NO_TID);
+  Clock::time_point start, mid, end;
+
+  for (int round = 0; round < 2; round++) {
+    start = Clock::now();
+    for (std::size_t i = 0; i < n; i++) {
+      TransferKey key{ PeerKey::of(peers[i]), 0 };
+      if (pool != nullptr) {
+        taken[i] = pool->acquire();
+        key.local = pool->port(taken[i]);
+      }
+      handles[i] = table.allocate(key);
+    }
+    mid = Clock::now();
+    for (std::size_t i = 0; i < n; i++) {
+      table.release(handles[i]);
+      if (pool != nullptr)
+        pool->release(taken[i]);
+    }
+    end = Clock::now();
+  }
+
+  std::printf("%-8s %-6s %12.2f %12.2f\n",
+              name,
+              "-",
+              usPer(start, mid, n),
+              usPer(mid, end, n));
+}
+
+int
+main(int argc, char** argv)
+{
+  std::size_t n = argc > 1 ? std::strtoul(argv[1], nullptr, 10) : 4096;
+
+  struct rlimit lim;
+  getrlimit(RLIMIT_NOFILE, &lim);
+  lim.rlim_cur = lim.rlim_max;
+  setrlimit(RLIMIT_NOFILE, &lim);
+  if (n + 64 > lim.rlim_cur)
+    n = lim.rlim_cur - 64;
+
+  BS::init();
+  std::printf("%zu transfers\n", n);
+  std::printf("%-8s %-6s %12s %12s\n", "demux", "mux", "setup us", "close us");
+  perSocket(Multiplexer::Backend::poll, n);
+  perSocket(Multiplexer::Backend::epoll, n);
+  perSocket(Multiplexer::Backend::uring, n);
+  BS::SocketHint hint(BS::IpVersion::vAny,
+                      BS::SockKind::Datagram,
+                      BS::SockFlags::UseHostIP,
+                      BS::IpProtocol::UDP);
+  PortPool pool;
+  pool.fill(hint, n);
+  perTable("pool", n, &pool);
+  perTable("peer", n, nullptr);
+}
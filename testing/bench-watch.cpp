@@ -0,0 +1,69 @@
+/* Cost of Multiplexer::watch()/unwatch() as the number of watched sockets
+ * grows. Each round unwatches a random socket and watches it again, so the
+ * table stays at the same size while being churned.
+ *
+ * usage: ./bench-watch [max-sockets]
+ */
+
+#include "multiplexer.hpp"
+
+#include <sys/resource.h>
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <vector>
+
+namespace BS = BetterSocket;
+
+static double
+churn(Multiplexer::Backend backend, const std::vector<BS::GSocket>& socks)
+{
+  Multiplexer m(backend);
+  for (auto s : socks)
+    m.watch(s, Multiplexer::Events::input);
+
+  std::mt19937 rng(42);
+  std::uniform_int_distribution<std::size_t> pick(0, socks.size() - 1);
+  constexpr int rounds = 200000;
+
+  auto start = std::chrono::steady_clock::now();
+  for (int i = 0; i < rounds; i++) {
+    auto s = socks[pick(rng)];
+    m.unwatch(s);
+    m.watch(s, Multiplexer::Events::input);
+  }
+  auto end = std::chrono::steady_clock::now();
+
+  return std::chrono::duration<double, std::nano>(end - start).count() /
+         rounds;
+}
+
+int
+main(int argc, char** argv)
+{
+  std::size_t max = argc > 1 ? std::strtoul(argv[1], nullptr, 10) : 16384;
+
+  struct rlimit lim;
+  getrlimit(RLIMIT_NOFILE, &lim);
+  lim.rlim_cur = lim.rlim_max;
+  setrlimit(RLIMIT_NOFILE, &lim);
+  if (max + 16 > lim.rlim_cur)
+    max = lim.rlim_cur - 16;
+
+  std::printf("%10s %18s %18s\n", "sockets", "poll ns/op", "epoll ns/op");
+  for (std::size_t n = 64; n <= max; n *= 4) {
+    std::vector<BS::GSocket> socks;
+    for (std::size_t i = 0; i < n; i++)
+      socks.push_back(socket(AF_INET, SOCK_DGRAM, 0));
+
+    std::printf("%10zu %18.1f %18.1f\n",
+                n,
+                churn(Multiplexer::Backend::poll, socks),
+                churn(Multiplexer::Backend::epoll, socks));
+
+    for (auto s : socks)
+      BS::closeSocket(s);
+  }
+}
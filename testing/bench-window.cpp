@@ -0,0 +1,316 @@
+/* Throughput against the RFC 7440 window size on a link with latency.
+ *
+ * A reactor runs on its own thread. Between it and the client sits a
+ * proxy thread that holds every datagram for half the round trip time in
+ * each direction, and drops a share of them if asked to. The client on the
+ * main thread acknowledges the last block of every window, and the last
+ * block it has in order when it sees a gap or times out. The server's
+ * retransmission counters are printed at the end.
+ *
+ * usage: ./bench-window [file-MiB] [blksize] [loss-percent]
+ */
+
+#include "reactor.hpp"
+
+#include <arpa/inet.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+#define SCAST(Type, e) static_cast<Type>(e)
+#define TU(e) std::to_underlying(e)
+
+namespace BS = BetterSocket;
+using Clock = std::chrono::steady_clock;
+
+constexpr uint16_t SERVER_PORT = 16973;
+constexpr uint16_t PROXY_PORT = 16974;
+
+static std::atomic<int> oneWayUs{ 0 };
+static std::atomic<unsigned> lossPercent{ 0 };
+
+static sockaddr_in
+loopback(uint16_t port)
+{
+  sockaddr_in a = {};
+  a.sin_family = AF_INET;
+  a.sin_port = htons(port);
+  a.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  return a;
+}
+
+// forwards between the client and the server, late and maybe not at all
+static void
+proxy()
+{
+  struct Held
+  {
+    Clock::time_point due;
+    bool toServer;
+    std::vector<std::byte> bytes;
+  };
+
+  int front = socket(AF_INET, SOCK_DGRAM, 0);
+  int back = socket(AF_INET, SOCK_DGRAM, 0);
+  auto frontAddr = loopback(PROXY_PORT);
+  bind(front, reinterpret_cast<sockaddr*>(&frontAddr), sizeof(frontAddr));
+  sockaddr_in client = {};
+  auto listener = loopback(SERVER_PORT);
+  sockaddr_in tid = listener; // where the transfer's packets go
+  bool haveTid = false;
+
+  std::deque<Held> held; // the delay is the same for all, so it is FIFO
+  std::mt19937 rng(7);
+  std::byte buf[65536];
+  for (;;) {
+    // ppoll(): poll() only sleeps to the millisecond
+    timespec wait = {};
+    if (!held.empty()) {
+      auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                  held.front().due - Clock::now())
+                  .count();
+      ns = std::max<decltype(ns)>(ns, 0);
+      wait = { SCAST(time_t, ns / 1000000000), SCAST(long, ns % 1000000000) };
+    }
+    pollfd pfds[2] = { { front, POLLIN, 0 }, { back, POLLIN, 0 } };
+    ppoll(pfds, 2, held.empty() ? nullptr : &wait, nullptr);
+
+    for (int i = 0; i < 2; i++) {
+      if (!(pfds[i].revents & POLLIN))
+        continue;
+      sockaddr_in from = {};
+      socklen_t len = sizeof(from);
+      auto r = recvfrom(pfds[i].fd,
+                        buf,
+                        sizeof(buf),
+                        0,
+                        reinterpret_cast<sockaddr*>(&from),
+                        &len);
+      if (r < 2)
+        continue;
+      // a request sent again may start a second transfer on the server,
+      // only the first one to answer is let through
+      if (i == 0) {
+        client = from;
+        if (getU16(buf) == TU(Opcodes::rrq))
+          haveTid = false;
+      } else if (!haveTid) {
+        tid = from;
+        haveTid = true;
+      } else if (from.sin_port != tid.sin_port) {
+        continue;
+      }
+      if (rng() % 100 < lossPercent)
+        continue;
+      held.push_back({ Clock::now() + std::chrono::microseconds(oneWayUs),
+                       i == 0,
+                       { buf, buf + r } });
+    }
+
+    while (!held.empty() && held.front().due <= Clock::now()) {
+      auto& h = held.front();
+      bool request = getU16(h.bytes.data()) == TU(Opcodes::rrq);
+      auto& to = h.toServer ? (request ? listener : tid) : client;
+      sendto(h.toServer ? back : front,
+             h.bytes.data(),
+             h.bytes.size(),
+             0,
+             reinterpret_cast<sockaddr*>(&to),
+             sizeof(to));
+      held.pop_front();
+    }
+  }
+}
+
+static void
+sendAck(int fd, const sockaddr_in& to, uint32_t block)
+{
+  std::byte ack[4];
+  putU16(ack, TU(Opcodes::ack));
+  putU16(ack + 2, SCAST(uint16_t, block & 0xffff));
+  sendto(fd,
+         ack,
+         sizeof(ack),
+         0,
+         reinterpret_cast<const sockaddr*>(&to),
+         sizeof(to));
+}
+
+// fetch `name` through the proxy, returns the bytes received
+static uint64_t
+fetch(const std::string& name, uint16_t blksize, uint16_t window)
+{
+  int fd = socket(AF_INET, SOCK_DGRAM, 0);
+  auto server = loopback(PROXY_PORT);
+
+  TransferOptions proposed;
+  proposed.present = TransferOptions::BLKSIZE | TransferOptions::WINDOWSIZE;
+  proposed.blksize = blksize;
+  proposed.windowsize = window;
+  std::byte options[64];
+  auto optionsSize = buildOptions(options, proposed);
+  std::byte rrq[512];
+  auto size = buildRequest(
+    rrq, Opcodes::rrq, name, "octet", std::span(options, optionsSize));
+
+  std::vector<std::byte> buf(packetSize(blksize));
+  TransferOptions acked;
+  uint32_t expect = 0; // 0 until the OACK came
+  uint16_t sinceAck = 0;
+  bool gapAcked = false;
+  uint64_t bytes = 0;
+  for (int timeouts = 0;;) {
+    if (expect == 0 && timeouts == 0)
+      sendto(
+        fd, rrq, size, 0, reinterpret_cast<sockaddr*>(&server), sizeof(server));
+    pollfd pfd = { fd, POLLIN, 0 };
+    if (poll(&pfd, 1, TU(Constants::retransmitTimeout)) <= 0) {
+      if (++timeouts > 10) {
+        std::fprintf(stderr, "bench-window: transfer stalled\n");
+        std::exit(1);
+      }
+      if (expect > 0)
+        sendAck(fd, server, expect - 1);
+      else
+        timeouts = 0; // the request is sent again
+      continue;
+    }
+    auto r = recv(fd, buf.data(), buf.size(), 0);
+    if (r < 4)
+      continue;
+    timeouts = 0;
+    auto op = SCAST(Opcodes, getU16(buf.data()));
+    uint16_t block = getU16(buf.data() + 2);
+    if (op == Opcodes::oack && expect == 0) {
+      parseOptions(std::span(buf).subspan(2, SCAST(std::size_t, r) - 2),
+                   acked);
+      expect = 1;
+      sendAck(fd, server, 0);
+      continue;
+    }
+    if (op != Opcodes::data || expect == 0)
+      continue;
+    if (block != (expect & 0xffff)) {
+      if (!gapAcked) {
+        sendAck(fd, server, expect - 1);
+        gapAcked = true;
+        sinceAck = 0;
+      }
+      continue;
+    }
+    bytes += SCAST(uint64_t, r - 4);
+    expect++;
+    gapAcked = false;
+    bool done = SCAST(std::size_t, r - 4) < acked.blksize;
+    if (done || ++sinceAck >= acked.windowsize) {
+      sendAck(fd, server, block);
+      sinceAck = 0;
+    }
+    if (done)
+      break;
+  }
+  close(fd);
+  return bytes;
+}
+
+static void
+serve(const ServerOptions* options)
+{
+  BS::SocketHint hint(BS::IpVersion::vAny,
+                      BS::SockKind::Datagram,
+                      BS::SockFlags::UseHostIP,
+                      BS::IpProtocol::UDP);
+  BS::BSocket listener(hint, options->port);
+  listener.bind();
+  PortPool pool;
+  pool.fill(hint, options->maxTransfers);
+  Reactor reactor(*options, hint, std::move(listener), std::move(pool));
+  reactor.run();
+}
+
+int
+main(int argc, char** argv)
+{
+  std::size_t mib = argc > 1 ? std::strtoul(argv[1], nullptr, 10) : 1;
+  auto blksize =
+    SCAST(uint16_t, argc > 2 ? std::strtoul(argv[2], nullptr, 10) : 1428);
+  lossPercent = argc > 3 ? SCAST(unsigned, std::strtoul(argv[3], nullptr, 10))
+                         : 0;
+  BS::init();
+
+  char dir[] = "/tmp/bench-window-XXXXXX";
+  if (mkdtemp(dir) == nullptr) {
+    std::perror("mkdtemp");
+    return 1;
+  }
+  std::string path = std::string(dir) + "/image";
+  std::vector<std::byte> image(mib << 20);
+  {
+    std::mt19937_64 rng(1);
+    for (auto& b : image)
+      b = SCAST(std::byte, rng());
+    std::FILE* f = std::fopen(path.c_str(), "wb");
+    std::fwrite(image.data(), 1, image.size(), f);
+    std::fclose(f);
+  }
+
+  ServerOptions options;
+  options.port = std::to_string(SERVER_PORT);
+  options.root = dir;
+  options.maxTransfers = 4;
+  options.maxWindow = 65535;
+  std::thread(serve, &options).detach();
+  std::thread(proxy).detach();
+  std::this_thread::sleep_for(std::chrono::milliseconds(100));
+
+  std::printf("%zu MiB file, blksize %u, %u%% loss\n",
+              mib,
+              blksize,
+              lossPercent.load());
+  const int rtts[] = { 1, 5, 10 };
+  const uint16_t windows[] = { 1, 4, 16, 64 };
+  std::printf("%8s", "rtt ms");
+  for (auto w : windows)
+    std::printf("   window %-4u", w);
+  std::printf("   (MiB/s)\n");
+  for (auto rtt : rtts) {
+    oneWayUs = rtt * 500;
+    std::printf("%8d", rtt);
+    for (auto window : windows) {
+      auto start = Clock::now();
+      uint64_t bytes = fetch("image", blksize, window);
+      double secs = std::chrono::duration<double>(Clock::now() - start).count();
+      if (bytes != image.size()) {
+        std::fprintf(stderr,
+                     "bench-window: got %llu bytes\n",
+                     SCAST(unsigned long long, bytes));
+        return 1;
+      }
+      std::printf(" %14.2f", SCAST(double, bytes) / (1 << 20) / secs);
+      std::fflush(stdout);
+    }
+    std::printf("\n");
+  }
+
+  auto& stats = Reactor::stats;
+  std::printf("timeouts %llu, retransmits %llu, spurious %llu\n",
+              SCAST(unsigned long long, stats.timeouts.load()),
+              SCAST(unsigned long long, stats.retransmits.load()),
+              SCAST(unsigned long long, stats.spurious.load()));
+
+  unlink(path.c_str());
+  rmdir(dir);
+  std::fflush(stdout);
+  std::_Exit(0); // the reactor and the proxy never return
+}